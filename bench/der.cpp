@@ -0,0 +1,279 @@
+// DER entitlements: the previous recursive encoder, which returned and
+// concatenated a string per nesting level, versus the two-pass ZDER
+// writer. Random plists are fuzzed against the previous output first,
+// integers and the CDHashes attribute against OpenSSL's encoding.
+//
+//	bench_der [iterations] [seed]
+
+#include "common.h"
+#include "json.h"
+#include "mach-o.h"
+#include "openssl.h"
+#include "signing.h"
+#include <openssl/asn1.h>
+#include <openssl/conf.h>
+#include <openssl/x509.h>
+
+static void ReferenceDERLength(string& strBlob, uint64_t uLength)
+{
+	if (uLength < 128) {
+		strBlob.append(1, (char)uLength);
+	} else {
+		uint32_t sLength = (64 - ZUtil::builtin_clzll(uLength) + 7) / 8;
+		strBlob.append(1, (char)(0x80 | sLength));
+		sLength *= 8;
+		do {
+			strBlob.append(1, (char)(uLength >> (sLength -= 8)));
+		} while (sLength != 0);
+	}
+}
+
+// integers are left out: the previous encoder wrote their value as the
+// length, which was only right for 1
+static string ReferenceDER(const jvalue& data)
+{
+	string strOutput;
+	if (data.is_bool()) {
+		strOutput.append(1, 0x01);
+		strOutput.append(1, 1);
+		strOutput.append(1, data.as_bool() ? (char)0xff : (char)0x00);
+	} else if (data.is_string()) {
+		string strVal = data.as_cstr();
+		strOutput.append(1, 0x0c);
+		ReferenceDERLength(strOutput, strVal.size());
+		strOutput += strVal;
+	} else if (data.is_array()) {
+		string strArray;
+		size_t size = data.size();
+		for (size_t i = 0; i < size; i++) {
+			strArray += ReferenceDER(data[i]);
+		}
+		strOutput.append(1, 0x30);
+		ReferenceDERLength(strOutput, strArray.size());
+		strOutput += strArray;
+	} else if (data.is_object()) {
+		vector<string> arrKeys;
+		data.get_keys(arrKeys);
+		std::sort(arrKeys.begin(), arrKeys.end());
+
+		string strDict;
+		for (size_t i = 0; i < arrKeys.size(); i++) {
+			string& strKey = arrKeys[i];
+			string strVal = ReferenceDER(data[strKey]);
+
+			string strEntry;
+			strEntry.append(1, 0x0c);
+			ReferenceDERLength(strEntry, strKey.size());
+			strEntry += strKey;
+			strEntry += strVal;
+
+			strDict.append(1, 0x30);
+			ReferenceDERLength(strDict, strEntry.size());
+			strDict += strEntry;
+		}
+
+		strOutput.append(1, (char)0xb0);
+		ReferenceDERLength(strOutput, strDict.size());
+		strOutput += strDict;
+	}
+	return strOutput;
+}
+
+// the CDHashes attribute as GenerateCMS used to build it, through an
+// OpenSSL ASN1_generate_nconf() config string
+static bool ReferenceCDHashDER(const string& strCDHash256, string& strOutput)
+{
+	static const char hex_upper[] = "0123456789ABCDEF";
+	string strHex;
+	for (size_t i = 0; i < strCDHash256.size(); i++) {
+		uint8_t c = (uint8_t)strCDHash256[i];
+		strHex += hex_upper[c >> 4];
+		strHex += hex_upper[c & 0x0F];
+	}
+
+	string strConf = "asn1=SEQUENCE:A\n[A]\nC=OBJECT:sha256\nB=FORMAT:HEX,OCT:" + strHex + "\n";
+	BIO* bio = BIO_new_mem_buf(strConf.data(), (int)strConf.size());
+	CONF* cnf = NCONF_new(NULL);
+	long errline = -1;
+	ASN1_TYPE* type = NULL;
+	if (NULL != bio && NULL != cnf && NCONF_load_bio(cnf, bio, &errline) > 0) {
+		char* genstr = NCONF_get_string(cnf, "default", "asn1");
+		if (NULL != genstr) {
+			type = ASN1_generate_nconf(genstr, cnf);
+		}
+	}
+	if (NULL != type) {
+		strOutput.assign((const char*)ASN1_STRING_get0_data(type->value.asn1_string), ASN1_STRING_length(type->value.asn1_string));
+		ASN1_TYPE_free(type);
+	}
+	BIO_free(bio);
+	NCONF_free(cnf);
+	return (NULL != type);
+}
+
+static uint32_t Random(uint32_t& uSeed)
+{
+	uSeed = uSeed * 1103515245 + 12345;
+	return (uSeed >> 8) & 0xffffff;
+}
+
+static string RandomString(uint32_t& uSeed)
+{
+	// mostly short, sometimes over the 127 and 255 byte length forms
+	static const uint32_t arrMaxLengths[] = { 16, 64, 200, 400, 70000 };
+	uint32_t uMax = arrMaxLengths[Random(uSeed) % 100 < 97 ? Random(uSeed) % 3 : 3 + Random(uSeed) % 2];
+	string strValue(Random(uSeed) % (uMax + 1), 0);
+	for (size_t i = 0; i < strValue.size(); i++) {
+		strValue[i] = (char)(0x20 + Random(uSeed) % 0x5f);
+	}
+	return strValue;
+}
+
+static void RandomValue(jvalue& jvValue, uint32_t& uSeed, int nDepth)
+{
+	uint32_t uType = Random(uSeed) % ((nDepth > 0) ? 5 : 3);
+	if (0 == uType) {
+		jvValue = (0 == Random(uSeed) % 2);
+	} else if (1 == uType || 2 == uType) {
+		jvValue = RandomString(uSeed);
+	} else if (3 == uType) {
+		jvValue = jvalue(jvalue::E_ARRAY);
+		for (uint32_t i = 0, n = Random(uSeed) % 12; i < n; i++) {
+			jvalue jvItem;
+			RandomValue(jvItem, uSeed, nDepth - 1);
+			jvValue.push_back(jvItem);
+		}
+	} else {
+		jvValue = jvalue(jvalue::E_OBJECT);
+		for (uint32_t i = 0, n = Random(uSeed) % 12; i < n; i++) {
+			RandomValue(jvValue[RandomString(uSeed)], uSeed, nDepth - 1);
+		}
+	}
+}
+
+static string EncodeDER(const jvalue& jvValue)
+{
+	ZDER der;
+	string strOutput((size_t)der.Measure(jvValue), 0);
+	uint8_t* pEnd = der.Write(jvValue, (uint8_t*)&strOutput[0]);
+	if ((size_t)(pEnd - (uint8_t*)strOutput.data()) != strOutput.size()) {
+		strOutput += "<length mismatch>";
+	}
+	return strOutput;
+}
+
+static bool FuzzPlists(uint32_t uIterations, uint32_t uSeed)
+{
+	for (uint32_t i = 0; i < uIterations; i++) {
+		jvalue jvRoot(jvalue::E_OBJECT);
+		uint32_t uCaseSeed = uSeed + i;
+		uint32_t uRandom = uCaseSeed;
+		for (uint32_t j = 0, n = 1 + Random(uRandom) % 8; j < n; j++) {
+			RandomValue(jvRoot[RandomString(uRandom)], uRandom, 1 + (int)(Random(uRandom) % 6));
+		}
+		if (ReferenceDER(jvRoot) != EncodeDER(jvRoot)) {
+			ZLog::ErrorV(">>> DER mismatch for plist seed %u!\n", uCaseSeed);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool FuzzIntegers(uint32_t uIterations, uint32_t uSeed)
+{
+	for (uint32_t i = 0; i < uIterations; i++) {
+		// every magnitude, both signs, and the values around each byte boundary
+		uint32_t uShift = Random(uSeed) % 64;
+		int64_t nValue = (int64_t)(((uint64_t)Random(uSeed) << 40) ^ ((uint64_t)Random(uSeed) << 16) ^ Random(uSeed)) >> uShift;
+		nValue += (int64_t)(Random(uSeed) % 3) - 1;
+
+		uint8_t arrOutput[16];
+		string strOutput((const char*)arrOutput, ZDER::WriteInteger(arrOutput, nValue) - arrOutput);
+
+		ASN1_INTEGER* pInteger = ASN1_INTEGER_new();
+		ASN1_INTEGER_set_int64(pInteger, nValue);
+		unsigned char* pDER = NULL;
+		int nDER = i2d_ASN1_INTEGER(pInteger, &pDER);
+		string strExpected((const char*)pDER, (nDER > 0) ? nDER : 0);
+		OPENSSL_free(pDER);
+		ASN1_INTEGER_free(pInteger);
+
+		if (strOutput != strExpected || ZDER::IntegerSize(nValue) != strOutput.size()) {
+			ZLog::ErrorV(">>> DER mismatch for integer %lld!\n", (long long)nValue);
+			return false;
+		}
+	}
+	return true;
+}
+
+static bool FuzzCDHashes(uint32_t uIterations, uint32_t uSeed)
+{
+	for (uint32_t i = 0; i < uIterations; i++) {
+		string strCDHash(32, 0);
+		for (size_t j = 0; j < strCDHash.size(); j++) {
+			strCDHash[j] = (char)Random(uSeed);
+		}
+		string strOutput;
+		string strExpected;
+		ZSignAsset::BuildCDHashDER(strCDHash, strOutput);
+		if (!ReferenceCDHashDER(strCDHash, strExpected) || strOutput != strExpected) {
+			ZLog::Error(">>> DER mismatch for the CDHashes attribute!\n");
+			return false;
+		}
+	}
+	return true;
+}
+
+static void Run(const char* szName, const jvalue& jvRoot, function<string(const jvalue&)> encoder, string& strOutput)
+{
+	uint32_t uRounds = 0;
+	uint64_t uBegin = ZUtil::GetMicroSecond();
+	uint64_t uElapse = 0;
+	while (uElapse < 500 * 1000) {
+		strOutput = encoder(jvRoot);
+		uRounds++;
+		uElapse = ZUtil::GetMicroSecond() - uBegin;
+	}
+	ZLog::PrintV("%-10s %10.1f us  (%u runs, %llu bytes)\n", szName, (double)uElapse / uRounds, uRounds, (unsigned long long)strOutput.size());
+}
+
+int main(int argc, char* argv[])
+{
+	uint32_t uIterations = (argc > 1) ? (uint32_t)atoi(argv[1]) : 2000;
+	uint32_t uSeed = (argc > 2) ? (uint32_t)atoi(argv[2]) : 1;
+	uIterations = (uIterations > 0) ? uIterations : 2000;
+
+	if (!FuzzPlists(uIterations, uSeed) || !FuzzIntegers(uIterations * 10, uSeed) || !FuzzCDHashes(uIterations, uSeed)) {
+		return -1;
+	}
+	ZLog::PrintV(">>> Fuzz:\t%u plists, %u integers, %u CDHashes match\n", uIterations, uIterations * 10, uIterations);
+
+	// keychain groups and associated domains of a large app, nested deep
+	jvalue jvEntitlements;
+	jvEntitlements["application-identifier"] = "ZSIGNBENCH.com.zsign.bench";
+	jvEntitlements["get-task-allow"] = false;
+	jvalue* pNested = &jvEntitlements["com.zsign.nested"];
+	for (int i = 0; i < 16; i++) {
+		jvalue& jvLevel = *pNested;
+		for (int j = 0; j < 200; j++) {
+			string strDomain;
+			ZUtil::StringFormatV(strDomain, "applinks:www%d-%d.example.com", i, j);
+			jvLevel["com.apple.developer.associated-domains"].push_back(strDomain);
+			ZUtil::StringFormatV(strDomain, "ZSIGNBENCH.com.zsign.bench.group%d-%d", i, j);
+			jvLevel["keychain-access-groups"].push_back(strDomain);
+		}
+		if (i < 15) {
+			pNested = &jvLevel["nested"][0];
+		}
+	}
+
+	string strReference;
+	string strOutput;
+	Run("recursive", jvEntitlements, ReferenceDER, strReference);
+	Run("two-pass", jvEntitlements, EncodeDER, strOutput);
+	if (strReference != strOutput) {
+		ZLog::Error(">>> DER mismatch between the recursive and two-pass encoders!\n");
+		return -1;
+	}
+	return 0;
+}
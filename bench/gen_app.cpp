@@ -0,0 +1,550 @@
+// Synthetic .app/.ipa generator for load and scale tests.
+//
+// Writes thin or fat Mach-O executables and dylibs (from the mach-o.h
+// definitions) and assembles them into an app bundle with frameworks,
+// appex plugins, localizations and a tree of resource files. The result
+// is signable by zsign, optionally already carrying an ad-hoc signature.
+//
+//	gen_app [options] -o <output.ipa|output_folder>
+//
+//	-n name		app name (default: Synth)
+//	-a archs	comma separated: arm64, arm64e, armv7, x86_64 (default: arm64)
+//	-c size		code size of the main executable, e.g. 512K, 8M (default: 1M)
+//	-C size		code size of frameworks and plugins (default: 256K)
+//	-H bytes	free space after the load commands (default: 1024)
+//	-F count	frameworks (default: 2)
+//	-P count	appex plugins (default: 1)
+//	-L count	localizations (default: 3)
+//	-f count	resource files (default: 1000)
+//	-d depth	resource folder depth (default: 3)
+//	-S size		resource file size (default: 4K)
+//	-s			sign the generated app ad-hoc, so it carries an existing signature
+//	-z level	zip level of the ipa (default: 0)
+//	-r seed		random seed (default: 1)
+
+#include "common.h"
+#include "json.h"
+#include "mach-o.h"
+#include "macho.h"
+#include "bundle.h"
+#include "openssl.h"
+#include "timer.h"
+#include "archive.h"
+
+struct ZSynthArch
+{
+	const char*	szName;
+	int			nCPUType;
+	int			nCPUSubType;
+	bool		b64Bit;
+};
+
+static const ZSynthArch s_arrArches[] = {
+	{ "arm64", CPU_TYPE_ARM64, CPU_SUBTYPE_ARM64_ALL, true },
+	{ "arm64e", CPU_TYPE_ARM64, CPU_SUBTYPE_ARM64E, true },
+	{ "armv7", CPU_TYPE_ARM, CPU_SUBTYPE_ARM_V7, false },
+	{ "x86_64", CPU_TYPE_X86_64, CPU_SUBTYPE_X86_64_ALL, true },
+};
+
+#define SYNTH_PAGE_SIZE		0x4000
+#define SYNTH_LINKEDIT_SIZE	64
+
+static uint32_t s_uSeed = 1;
+
+static void RandomData(string& strData, size_t uSize)
+{
+	strData.resize(uSize);
+	for (size_t i = 0; i < uSize; i++) {
+		s_uSeed = s_uSeed * 1103515245 + 12345;
+		strData[i] = (char)(s_uSeed >> 16);
+	}
+}
+
+static uint64_t Align(uint64_t uValue, uint64_t uAlign)
+{
+	return (uValue + uAlign - 1) / uAlign * uAlign;
+}
+
+static bool ParseSize(const char* szSize, uint64_t& uSize)
+{
+	char* pEnd = NULL;
+	double dValue = strtod(szSize, &pEnd);
+	if (pEnd == szSize || dValue < 0) {
+		return false;
+	}
+	switch (toupper(*pEnd)) {
+	case 'K':
+		dValue *= 1024;
+		break;
+	case 'M':
+		dValue *= 1024 * 1024;
+		break;
+	case 'G':
+		dValue *= 1024 * 1024 * 1024;
+		break;
+	case '\0':
+		break;
+	default:
+		return false;
+	}
+	uSize = (uint64_t)dValue;
+	return true;
+}
+
+static void AppendCommand(string& strCommands, uint32_t& uCommands, const void* pCommand, size_t uSize, const char* szString = NULL)
+{
+	size_t uBegin = strCommands.size();
+	strCommands.append((const char*)pCommand, uSize);
+	if (NULL != szString) {
+		strCommands.append(szString, strlen(szString) + 1);
+	}
+	strCommands.append(Align(strCommands.size() - uBegin, 8) - (strCommands.size() - uBegin), 0);
+	((load_command*)&strCommands[uBegin])->cmdsize = (uint32_t)(strCommands.size() - uBegin);
+	uCommands++;
+}
+
+static void AppendDylib(string& strCommands, uint32_t& uCommands, uint32_t uCmd, const string& strPath)
+{
+	dylib_command dc = { 0 };
+	dc.cmd = uCmd;
+	dc.dylib.name.offset = sizeof(dylib_command);
+	dc.dylib.timestamp = 2;
+	dc.dylib.current_version = 0x10000;
+	dc.dylib.compatibility_version = 0x10000;
+	AppendCommand(strCommands, uCommands, &dc, sizeof(dc), strPath.c_str());
+}
+
+// Load commands other than the segments: identity, linking and encryption.
+static void BuildLinkCommands(const ZSynthArch& arch, uint32_t uFileType, const string& strInstallName, const vector<string>& arrDylibs,
+								uint64_t uTextOffset, uint64_t uCodeSize, uint64_t uLinkEditOffset, string& strCommands, uint32_t& uCommands)
+{
+	uint32_t arrSymtab[6] = { LC_SYMTAB, 24, (uint32_t)uLinkEditOffset, 0, (uint32_t)uLinkEditOffset, SYNTH_LINKEDIT_SIZE };
+	AppendCommand(strCommands, uCommands, arrSymtab, sizeof(arrSymtab));
+
+	uuid_command uc = { LC_UUID, sizeof(uuid_command) };
+	string strUUID;
+	RandomData(strUUID, 16);
+	memcpy(uc.uuid, strUUID.data(), 16);
+	AppendCommand(strCommands, uCommands, &uc, sizeof(uc));
+
+	if (MH_EXECUTE == uFileType) {
+		uint32_t arrDylinker[3] = { LC_LOAD_DYLINKER, 0, 12 };
+		AppendCommand(strCommands, uCommands, arrDylinker, sizeof(arrDylinker), "/usr/lib/dyld");
+
+		entry_point_command ep = { LC_MAIN, sizeof(entry_point_command), uTextOffset, 0 };
+		AppendCommand(strCommands, uCommands, &ep, sizeof(ep));
+	} else {
+		AppendDylib(strCommands, uCommands, LC_ID_DYLIB, strInstallName);
+	}
+
+	AppendDylib(strCommands, uCommands, LC_LOAD_DYLIB, "/usr/lib/libSystem.B.dylib");
+	for (const string& strDylib : arrDylibs) {
+		AppendDylib(strCommands, uCommands, LC_LOAD_DYLIB, strDylib);
+	}
+
+	if (MH_EXECUTE == uFileType) {
+		uint32_t arrRPath[3] = { LC_RPATH, 0, 12 };
+		AppendCommand(strCommands, uCommands, arrRPath, sizeof(arrRPath), "@executable_path/Frameworks");
+	}
+
+	if (arch.b64Bit) {
+		encryption_info_command_64 eic = { LC_ENCRYPTION_INFO_64, sizeof(encryption_info_command_64), (uint32_t)uTextOffset, (uint32_t)uCodeSize, 0, 0 };
+		AppendCommand(strCommands, uCommands, &eic, sizeof(eic));
+	} else {
+		encryption_info_command eic = { LC_ENCRYPTION_INFO, sizeof(encryption_info_command), (uint32_t)uTextOffset, (uint32_t)uCodeSize, 0 };
+		AppendCommand(strCommands, uCommands, &eic, sizeof(eic));
+	}
+}
+
+// One thin Mach-O: header, load commands, uHeadroom bytes of free space,
+// __TEXT,__text with uCodeSize bytes of code and a small __LINKEDIT.
+static void BuildArchO(const ZSynthArch& arch, uint32_t uFileType, const string& strInstallName, const vector<string>& arrDylibs,
+						uint64_t uCodeSize, uint32_t uHeadroom, string& strOutput)
+{
+	uint32_t uHeaderSize = arch.b64Bit ? sizeof(mach_header_64) : sizeof(mach_header);
+	uint32_t uSegmentSize = arch.b64Bit ? sizeof(segment_command_64) : sizeof(segment_command);
+	uint32_t uSectionSize = arch.b64Bit ? sizeof(section_64) : sizeof(section);
+	uint32_t uSegments = (MH_EXECUTE == uFileType) ? 3 : 2;
+	uint64_t uVMBase = (MH_EXECUTE == uFileType) ? (arch.b64Bit ? 0x100000000ULL : SYNTH_PAGE_SIZE) : 0;
+
+	// the link commands don't depend on the offsets for their size, so a
+	// dry run gives the final size of all load commands
+	string strLinkCommands;
+	uint32_t uLinkCommands = 0;
+	BuildLinkCommands(arch, uFileType, strInstallName, arrDylibs, 0, 0, 0, strLinkCommands, uLinkCommands);
+	uint32_t uSizeOfCmds = uSegments * uSegmentSize + uSectionSize + (uint32_t)strLinkCommands.size();
+
+	uint64_t uTextOffset = Align(uHeaderSize + uSizeOfCmds + uHeadroom, 16);
+	uint64_t uTextSegmentSize = Align(uTextOffset + uCodeSize, SYNTH_PAGE_SIZE);
+	uint64_t uLinkEditOffset = uTextSegmentSize;
+
+	strLinkCommands.clear();
+	uLinkCommands = 0;
+	BuildLinkCommands(arch, uFileType, strInstallName, arrDylibs, uTextOffset, uCodeSize, uLinkEditOffset, strLinkCommands, uLinkCommands);
+
+	string strCommands;
+	uint32_t uCommands = 0;
+	struct Segment { const char* szName; uint64_t uVMAddr; uint64_t uVMSize; uint64_t uFileOff; uint64_t uFileSize; int nProt; bool bText; };
+	vector<Segment> arrSegments;
+	if (MH_EXECUTE == uFileType) {
+		arrSegments.push_back({ "__PAGEZERO", 0, uVMBase, 0, 0, 0, false });
+	}
+	arrSegments.push_back({ "__TEXT", uVMBase, uTextSegmentSize, 0, uTextSegmentSize, 5, true });
+	arrSegments.push_back({ "__LINKEDIT", uVMBase + uTextSegmentSize, SYNTH_PAGE_SIZE, uLinkEditOffset, SYNTH_LINKEDIT_SIZE, 1, false });
+
+	for (const Segment& seg : arrSegments) {
+		if (arch.b64Bit) {
+			segment_command_64 sc;
+			memset(&sc, 0, sizeof(sc));
+			sc.cmd = LC_SEGMENT_64;
+			strncpy(sc.segname, seg.szName, sizeof(sc.segname));
+			sc.vmaddr = seg.uVMAddr;
+			sc.vmsize = seg.uVMSize;
+			sc.fileoff = seg.uFileOff;
+			sc.filesize = seg.uFileSize;
+			sc.maxprot = seg.nProt;
+			sc.initprot = seg.nProt;
+			sc.nsects = seg.bText ? 1 : 0;
+			string strCommand((const char*)&sc, sizeof(sc));
+			if (seg.bText) {
+				section_64 sect;
+				memset(&sect, 0, sizeof(sect));
+				strncpy(sect.sectname, "__text", sizeof(sect.sectname));
+				strncpy(sect.segname, "__TEXT", sizeof(sect.segname));
+				sect.addr = uVMBase + uTextOffset;
+				sect.size = uCodeSize;
+				sect.offset = (uint32_t)uTextOffset;
+				sect.align = 2;
+				sect.flags = S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS;
+				strCommand.append((const char*)&sect, sizeof(sect));
+			}
+			AppendCommand(strCommands, uCommands, strCommand.data(), strCommand.size());
+		} else {
+			segment_command sc;
+			memset(&sc, 0, sizeof(sc));
+			sc.cmd = LC_SEGMENT;
+			strncpy(sc.segname, seg.szName, sizeof(sc.segname));
+			sc.vmaddr = (uint32_t)seg.uVMAddr;
+			sc.vmsize = (uint32_t)seg.uVMSize;
+			sc.fileoff = (uint32_t)seg.uFileOff;
+			sc.filesize = (uint32_t)seg.uFileSize;
+			sc.maxprot = seg.nProt;
+			sc.initprot = seg.nProt;
+			sc.nsects = seg.bText ? 1 : 0;
+			string strCommand((const char*)&sc, sizeof(sc));
+			if (seg.bText) {
+				section sect;
+				memset(&sect, 0, sizeof(sect));
+				strncpy(sect.sectname, "__text", sizeof(sect.sectname));
+				strncpy(sect.segname, "__TEXT", sizeof(sect.segname));
+				sect.addr = (uint32_t)(uVMBase + uTextOffset);
+				sect.size = (uint32_t)uCodeSize;
+				sect.offset = (uint32_t)uTextOffset;
+				sect.align = 2;
+				sect.flags = S_ATTR_PURE_INSTRUCTIONS | S_ATTR_SOME_INSTRUCTIONS;
+				strCommand.append((const char*)&sect, sizeof(sect));
+			}
+			AppendCommand(strCommands, uCommands, strCommand.data(), strCommand.size());
+		}
+	}
+	strCommands += strLinkCommands;
+	uCommands += uLinkCommands;
+
+	mach_header_64 header;
+	memset(&header, 0, sizeof(header));
+	header.magic = arch.b64Bit ? MH_MAGIC_64 : MH_MAGIC;
+	header.cputype = arch.nCPUType;
+	header.cpusubtype = arch.nCPUSubType;
+	header.filetype = uFileType;
+	header.ncmds = uCommands;
+	header.sizeofcmds = (uint32_t)strCommands.size();
+	header.flags = MH_NOUNDEFS | MH_DYLDLINK | MH_TWOLEVEL | ((MH_EXECUTE == uFileType) ? MH_PIE : MH_NO_REEXPORTED_DYLIBS);
+
+	strOutput.clear();
+	strOutput.append((const char*)&header, uHeaderSize);
+	strOutput += strCommands;
+	strOutput.append(uTextOffset - strOutput.size(), 0);
+	string strCode;
+	RandomData(strCode, (size_t)uCodeSize);
+	strOutput += strCode;
+	strOutput.append(uLinkEditOffset - strOutput.size(), 0);
+	strOutput.append(SYNTH_LINKEDIT_SIZE, 0);
+}
+
+// A thin Mach-O for one arch, a fat one for several.
+static bool WriteMachO(const string& strFile, const vector<const ZSynthArch*>& arrArches, uint32_t uFileType, const string& strInstallName,
+						const vector<string>& arrDylibs, uint64_t uCodeSize, uint32_t uHeadroom)
+{
+	if (1 == arrArches.size()) {
+		string strArchO;
+		BuildArchO(*arrArches[0], uFileType, strInstallName, arrDylibs, uCodeSize, uHeadroom, strArchO);
+		return ZFile::WriteFile(strFile.c_str(), strArchO);
+	}
+
+	string strHeader;
+	fat_header fh = { BE((uint32_t)FAT_MAGIC), BE((uint32_t)arrArches.size()) };
+	strHeader.append((const char*)&fh, sizeof(fh));
+
+	string strBody;
+	uint64_t uFirstOffset = Align(sizeof(fat_header) + sizeof(fat_arch) * arrArches.size(), SYNTH_PAGE_SIZE);
+	uint64_t uOffset = uFirstOffset;
+	for (const ZSynthArch* pArch : arrArches) {
+		string strArchO;
+		BuildArchO(*pArch, uFileType, strInstallName, arrDylibs, uCodeSize, uHeadroom, strArchO);
+		fat_arch fa = { (cpu_type_t)BE((uint32_t)pArch->nCPUType), (cpu_subtype_t)BE((uint32_t)pArch->nCPUSubType),
+						BE((uint32_t)uOffset), BE((uint32_t)strArchO.size()), BE((uint32_t)14) };
+		strHeader.append((const char*)&fa, sizeof(fa));
+		strBody.append(uOffset - uFirstOffset - strBody.size(), 0);
+		strBody += strArchO;
+		uOffset = Align(uOffset + strArchO.size(), SYNTH_PAGE_SIZE);
+	}
+	strHeader.append(uFirstOffset - strHeader.size(), 0);
+
+	return ZFile::WriteFile(strFile.c_str(), strHeader) && ZFile::AppendFile(strFile.c_str(), strBody);
+}
+
+static bool WriteInfoPlist(const string& strFolder, const string& strName, const string& strBundleId, const char* szPackageType, bool bExtension)
+{
+	jvalue jvInfo;
+	jvInfo["CFBundleDevelopmentRegion"] = "en";
+	jvInfo["CFBundleExecutable"] = strName;
+	jvInfo["CFBundleIdentifier"] = strBundleId;
+	jvInfo["CFBundleInfoDictionaryVersion"] = "6.0";
+	jvInfo["CFBundleName"] = strName;
+	jvInfo["CFBundleDisplayName"] = strName;
+	jvInfo["CFBundlePackageType"] = szPackageType;
+	jvInfo["CFBundleShortVersionString"] = "1.0";
+	jvInfo["CFBundleVersion"] = "1";
+	jvInfo["CFBundleSupportedPlatforms"][0] = "iPhoneOS";
+	jvInfo["MinimumOSVersion"] = "12.0";
+	jvInfo["UIDeviceFamily"][0] = 1;
+	jvInfo["UIDeviceFamily"][1] = 2;
+	if (bExtension) {
+		jvInfo["NSExtension"]["NSExtensionPointIdentifier"] = "com.apple.widgetkit-extension";
+	}
+	return jvInfo.style_write_plist_to_file("%s/Info.plist", strFolder.c_str());
+}
+
+static bool WriteResources(const string& strAppFolder, uint32_t uFiles, uint32_t uDepth, uint64_t uFileSize, uint32_t uLocalizations)
+{
+	static const char* arrLanguages[] = { "en", "zh-Hans", "ja", "de", "fr", "es", "ko", "it", "pt-BR", "ru", "zh-Hant", "nl" };
+	uint32_t uLanguages = sizeof(arrLanguages) / sizeof(arrLanguages[0]);
+	for (uint32_t i = 0; i < uLocalizations; i++) {
+		string strLanguage = arrLanguages[i % uLanguages];
+		if (i >= uLanguages) {
+			strLanguage += "-" + to_string(i / uLanguages);
+		}
+		string strFolder = strAppFolder + "/" + strLanguage + ".lproj";
+		ZFile::CreateFolder(strFolder.c_str());
+		jvalue jvStrings;
+		jvStrings["CFBundleDisplayName"] = "Synth " + strLanguage;
+		jvStrings.style_write_plist_to_file("%s/InfoPlist.strings", strFolder.c_str());
+		string strData;
+		RandomData(strData, 2048);
+		ZFile::WriteFileV(strData, "%s/Localizable.strings", strFolder.c_str());
+	}
+
+	// uFiles spread over a fan-out of 8 folders per level, uDepth levels deep
+	string strData;
+	for (uint32_t i = 0; i < uFiles; i++) {
+		string strFolder = strAppFolder + "/Assets";
+		uint32_t uBucket = i;
+		for (uint32_t d = 0; d < uDepth; d++) {
+			strFolder += "/dir" + to_string(uBucket % 8);
+			uBucket /= 8;
+		}
+		if (!ZFile::CreateFolder(strFolder.c_str())) {
+			return false;
+		}
+		RandomData(strData, (size_t)uFileSize);
+		string strFile;
+		ZUtil::StringFormatV(strFile, "%s/res%06u.%s", strFolder.c_str(), i, (0 == i % 5) ? "png" : "dat");
+		if (!ZFile::WriteFile(strFile.c_str(), strData)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static int usage()
+{
+	ZLog::Print("Usage: gen_app [-n name] [-a arm64,armv7,...] [-c code_size] [-C fw_code_size] [-H headroom]\n");
+	ZLog::Print("               [-F frameworks] [-P plugins] [-L localizations] [-f files] [-d depth] [-S file_size]\n");
+	ZLog::Print("               [-s] [-z zip_level] [-r seed] -o <output.ipa|output_folder>\n");
+	return -1;
+}
+
+int main(int argc, char* argv[])
+{
+	string strName = "Synth";
+	string strOutput;
+	string strArches = "arm64";
+	uint64_t uCodeSize = 1024 * 1024;
+	uint64_t uFrameworkCodeSize = 256 * 1024;
+	uint64_t uHeadroom = 1024;
+	uint64_t uFileSize = 4 * 1024;
+	uint32_t uFrameworks = 2;
+	uint32_t uPlugins = 1;
+	uint32_t uLocalizations = 3;
+	uint32_t uFiles = 1000;
+	uint32_t uDepth = 3;
+	uint32_t uZipLevel = 0;
+	bool bSign = false;
+
+	int opt = 0;
+	while (-1 != (opt = getopt(argc, argv, "n:o:a:c:C:H:F:P:L:f:d:S:sz:r:h"))) {
+		bool bOK = true;
+		switch (opt) {
+		case 'n':
+			strName = optarg;
+			break;
+		case 'o':
+			strOutput = ZFile::GetFullPath(optarg);
+			break;
+		case 'a':
+			strArches = optarg;
+			break;
+		case 'c':
+			bOK = ParseSize(optarg, uCodeSize);
+			break;
+		case 'C':
+			bOK = ParseSize(optarg, uFrameworkCodeSize);
+			break;
+		case 'H':
+			bOK = ParseSize(optarg, uHeadroom);
+			break;
+		case 'S':
+			bOK = ParseSize(optarg, uFileSize);
+			break;
+		case 'F':
+			uFrameworks = (uint32_t)atoi(optarg);
+			break;
+		case 'P':
+			uPlugins = (uint32_t)atoi(optarg);
+			break;
+		case 'L':
+			uLocalizations = (uint32_t)atoi(optarg);
+			break;
+		case 'f':
+			uFiles = (uint32_t)atoi(optarg);
+			break;
+		case 'd':
+			uDepth = (uint32_t)atoi(optarg);
+			break;
+		case 's':
+			bSign = true;
+			break;
+		case 'z':
+			uZipLevel = (uint32_t)atoi(optarg);
+			break;
+		case 'r':
+			s_uSeed = (uint32_t)strtoul(optarg, NULL, 10);
+			break;
+		default:
+			return usage();
+		}
+		if (!bOK) {
+			ZLog::ErrorV(">>> Invalid size: -%c %s\n", opt, optarg);
+			return -1;
+		}
+	}
+
+	if (strOutput.empty() || uCodeSize < 16 || uFrameworkCodeSize < 16 || uZipLevel > 9) {
+		return usage();
+	}
+
+	vector<const ZSynthArch*> arrArches;
+	vector<string> arrArchNames;
+	ZUtil::StringSplit(strArches, ",", arrArchNames);
+	for (const string& strArch : arrArchNames) {
+		const ZSynthArch* pArch = NULL;
+		for (const ZSynthArch& arch : s_arrArches) {
+			if (strArch == arch.szName) {
+				pArch = &arch;
+			}
+		}
+		if (NULL == pArch) {
+			ZLog::ErrorV(">>> Unknown arch: %s\n", strArch.c_str());
+			return -1;
+		}
+		arrArches.push_back(pArch);
+	}
+	if (arrArches.empty()) {
+		return usage();
+	}
+
+	bool bIpa = ZFile::IsPathSuffix(strOutput, ".ipa");
+	string strBaseFolder = strOutput;
+	if (bIpa) {
+		ZUtil::StringFormatV(strBaseFolder, "%s/zsign_gen_app_%d", ZFile::GetTempFolder(), (int)getpid());
+	}
+	string strAppFolder = strBaseFolder + "/Payload/" + strName + ".app";
+	string strBundleId = "com.zsign.synth." + strName;
+	ZFile::RemoveFolder(strAppFolder.c_str());
+	if (!ZFile::CreateFolder(strAppFolder.c_str())) {
+		ZLog::ErrorV(">>> Can't create app folder! %s\n", strAppFolder.c_str());
+		return -1;
+	}
+
+	ZTimer timer;
+	vector<string> arrMainDylibs;
+	for (uint32_t i = 0; i < uFrameworks; i++) {
+		string strFramework = "Synth" + to_string(i);
+		string strFolder = strAppFolder + "/Frameworks/" + strFramework + ".framework";
+		string strInstallName = "@rpath/" + strFramework + ".framework/" + strFramework;
+		ZFile::CreateFolder(strFolder.c_str());
+		if (!WriteMachO(strFolder + "/" + strFramework, arrArches, MH_DYLIB, strInstallName, vector<string>(), uFrameworkCodeSize, (uint32_t)uHeadroom) ||
+			!WriteInfoPlist(strFolder, strFramework, strBundleId + ".fw" + to_string(i), "FMWK", false)) {
+			ZLog::ErrorV(">>> Can't write framework! %s\n", strFolder.c_str());
+			return -1;
+		}
+		arrMainDylibs.push_back(strInstallName);
+	}
+
+	for (uint32_t i = 0; i < uPlugins; i++) {
+		string strPlugin = "SynthExt" + to_string(i);
+		string strFolder = strAppFolder + "/PlugIns/" + strPlugin + ".appex";
+		ZFile::CreateFolder(strFolder.c_str());
+		if (!WriteMachO(strFolder + "/" + strPlugin, arrArches, MH_EXECUTE, "", vector<string>(), uFrameworkCodeSize, (uint32_t)uHeadroom) ||
+			!WriteInfoPlist(strFolder, strPlugin, strBundleId + ".ext" + to_string(i), "XPC!", true)) {
+			ZLog::ErrorV(">>> Can't write plugin! %s\n", strFolder.c_str());
+			return -1;
+		}
+	}
+
+	if (!WriteMachO(strAppFolder + "/" + strName, arrArches, MH_EXECUTE, "", arrMainDylibs, uCodeSize, (uint32_t)uHeadroom) ||
+		!WriteInfoPlist(strAppFolder, strName, strBundleId, "APPL", false) ||
+		!ZFile::WriteFileV("APPL????", 8, "%s/PkgInfo", strAppFolder.c_str()) ||
+		!WriteResources(strAppFolder, uFiles, uDepth, uFileSize, uLocalizations)) {
+		ZLog::ErrorV(">>> Can't write app! %s\n", strAppFolder.c_str());
+		return -1;
+	}
+	timer.PrintResult(true, ">>> Generated: \t%s", strAppFolder.c_str());
+
+	if (bSign) {
+		ZSignAsset zsa;
+		ZBundle bundle;
+		int nLogLevel = ZLog::E_INFO;
+		ZLog::SetLogLever(ZLog::E_NONE);
+		bool bRet = zsa.Init("", "", "", "", "", true, true, false) &&
+			bundle.SignFolder(&zsa, strAppFolder, "", "", "", vector<string>(), vector<string>(), true, false, false);
+		ZLog::SetLogLever(nLogLevel);
+		if (!bRet) {
+			ZLog::ErrorV(">>> Ad-hoc sign failed! %s\n", strAppFolder.c_str());
+			return -1;
+		}
+		timer.PrintResult(true, ">>> Signed (Ad-hoc)");
+	}
+
+	if (bIpa) {
+		ZFile::RemoveFile(strOutput.c_str());
+		bool bRet = Zip::Archive(strBaseFolder, strOutput, (int)uZipLevel);
+		ZFile::RemoveFolder(strBaseFolder.c_str());
+		if (!bRet) {
+			ZLog::ErrorV(">>> Archive failed! %s\n", strOutput.c_str());
+			return -1;
+		}
+		timer.PrintResult(true, ">>> Archived: \t%s (%s)", strOutput.c_str(), ZFile::GetFileSizeString(strOutput.c_str()).c_str());
+	}
+	return 0;
+}
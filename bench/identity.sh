@@ -0,0 +1,63 @@
+#!/bin/sh
+
+# Generates a throwaway signing identity for the benchmarks:
+#   bench.p12              leaf key + certificate + CA chain (password: bench)
+#   bench.mobileprovision  CMS-signed profile carrying the TeamIdentifier
+#
+#	identity.sh <output_folder>
+
+set -e
+
+OUT="${1:-.}"
+TEAM="ZSIGNBENCH"
+PASS="bench"
+
+mkdir -p "$OUT"
+cd "$OUT"
+
+openssl req -x509 -newkey rsa:2048 -nodes -days 3650 -sha256 \
+	-subj "/CN=zsign bench CA/O=zsign bench" \
+	-keyout ca.key -out ca.pem >/dev/null 2>&1
+
+openssl req -newkey rsa:2048 -nodes -sha256 \
+	-subj "/CN=iPhone Distribution: zsign bench ($TEAM)/OU=$TEAM/O=zsign bench" \
+	-keyout leaf.key -out leaf.csr >/dev/null 2>&1
+
+openssl x509 -req -days 3650 -sha256 -in leaf.csr -CA ca.pem -CAkey ca.key \
+	-set_serial 1 -out leaf.pem >/dev/null 2>&1
+
+openssl pkcs12 -export -inkey leaf.key -in leaf.pem -certfile ca.pem \
+	-passout "pass:$PASS" -out bench.p12
+
+cat > bench.plist <<EOF
+<?xml version="1.0" encoding="UTF-8"?>
+<!DOCTYPE plist PUBLIC "-//Apple//DTD PLIST 1.0//EN" "http://www.apple.com/DTDs/PropertyList-1.0.dtd">
+<plist version="1.0">
+<dict>
+	<key>AppIDName</key>
+	<string>zsign bench</string>
+	<key>Entitlements</key>
+	<dict>
+		<key>application-identifier</key>
+		<string>$TEAM.*</string>
+		<key>com.apple.developer.team-identifier</key>
+		<string>$TEAM</string>
+		<key>get-task-allow</key>
+		<false/>
+	</dict>
+	<key>Name</key>
+	<string>zsign bench</string>
+	<key>TeamIdentifier</key>
+	<array>
+		<string>$TEAM</string>
+	</array>
+	<key>Version</key>
+	<integer>1</integer>
+</dict>
+</plist>
+EOF
+
+openssl smime -sign -binary -nodetach -outform DER -in bench.plist \
+	-signer leaf.pem -inkey leaf.key -out bench.mobileprovision
+
+rm -f ca.key leaf.csr bench.plist
@@ -0,0 +1,418 @@
+// Microbenchmarks for the hot paths of a signing job, with a JSON report
+// that can be diffed across commits.
+//
+//	microbench [-o report.json] [-f filter] [-t min_ms] [-I identity_folder]
+//
+// Every case runs until it has at least 3 samples and min_ms of total time;
+// short cases are run in batches of at least 1 ms per sample.
+// The CMS case needs the identity that `make bench` generates next to this
+// binary (bench/identity.sh); it is skipped when the identity is missing.
+
+#include "common.h"
+#include "json.h"
+#include "base64.h"
+#include "bundle.h"
+#include "mach-o.h"
+#include "openssl.h"
+#include "signing.h"
+#include "archive.h"
+
+#ifndef ZSIGN_VERSION
+#define ZSIGN_VERSION 0.0.0-dev
+#endif
+#define ZSIGN_STR_(x) #x
+#define ZSIGN_STR(x) ZSIGN_STR_(x)
+
+static uint64_t s_uMinTime = 200 * 1000;
+static string s_strFilter;
+static jvalue s_jvResults;
+
+static void RandomData(string& strData, size_t uSize, uint32_t uSeed)
+{
+	strData.resize(uSize);
+	for (size_t i = 0; i < uSize; i++) {
+		uSeed = uSeed * 1103515245 + 12345;
+		strData[i] = (char)(uSeed >> 16);
+	}
+}
+
+static string SizeName(uint64_t uSize)
+{
+	string strName;
+	if (uSize >= 1024 * 1024 && 0 == uSize % (1024 * 1024)) {
+		ZUtil::StringFormatV(strName, "%lluMB", (unsigned long long)(uSize / (1024 * 1024)));
+	} else if (uSize >= 1024 && 0 == uSize % 1024) {
+		ZUtil::StringFormatV(strName, "%lluKB", (unsigned long long)(uSize / 1024));
+	} else {
+		ZUtil::StringFormatV(strName, "%lluB", (unsigned long long)uSize);
+	}
+	return strName;
+}
+
+// Times run() and records one result. uBytes is the amount of payload one
+// run processes; cases without a payload (0) report runs per second instead,
+// e.g. signatures per second for the CMS case.
+static void Bench(const string& strName, const string& strCase, uint64_t uBytes, function<bool()> run)
+{
+	string strFullName = strName + "/" + strCase;
+	if (!s_strFilter.empty() && string::npos == strFullName.find(s_strFilter)) {
+		return;
+	}
+
+	if (!run()) { // warm up, and make sure the case works at all
+		ZLog::ErrorV(">>> %-40s failed!\n", strFullName.c_str());
+		return;
+	}
+
+	// batch short runs so one sample is well above the timer resolution
+	uint64_t uBatch = 1;
+	for (;;) {
+		uint64_t uBegin = ZUtil::GetMicroSecond();
+		for (uint64_t i = 0; i < uBatch; i++) {
+			run();
+		}
+		if (ZUtil::GetMicroSecond() - uBegin >= 1000 || uBatch >= (1 << 20)) {
+			break;
+		}
+		uBatch *= 2;
+	}
+
+	vector<double> arrSamples;
+	uint64_t uTotal = 0;
+	while (arrSamples.size() < 3 || uTotal < s_uMinTime) {
+		uint64_t uBegin = ZUtil::GetMicroSecond();
+		for (uint64_t i = 0; i < uBatch; i++) {
+			run();
+		}
+		uint64_t uElapse = ZUtil::GetMicroSecond() - uBegin;
+		arrSamples.push_back((double)uElapse / uBatch);
+		uTotal += uElapse;
+	}
+	sort(arrSamples.begin(), arrSamples.end());
+
+	double dMin = arrSamples.front();
+	double dMedian = arrSamples[arrSamples.size() / 2];
+	double dMean = (double)uTotal / (arrSamples.size() * uBatch);
+	double dMBs = (uBytes > 0 && dMedian > 0) ? ((double)uBytes / (1024.0 * 1024.0)) / (dMedian / 1000000.0) : 0;
+	double dPerSecond = (dMedian > 0) ? 1000000.0 / dMedian : 0;
+
+	jvalue jvResult;
+	jvResult["name"] = strName;
+	jvResult["case"] = strCase;
+	jvResult["iterations"] = (int64_t)(arrSamples.size() * uBatch);
+	jvResult["min_us"] = dMin;
+	jvResult["median_us"] = dMedian;
+	jvResult["mean_us"] = dMean;
+	if (uBytes > 0) {
+		jvResult["bytes"] = (int64_t)uBytes;
+		jvResult["mb_per_s"] = dMBs;
+	} else {
+		jvResult["per_s"] = dPerSecond;
+	}
+	s_jvResults.push_back(jvResult);
+
+	if (uBytes > 0) {
+		ZLog::PrintV("%-40s %12.2f us  %9.1f MB/s  (%llu runs)\n", strFullName.c_str(), dMedian, dMBs, (unsigned long long)(arrSamples.size() * uBatch));
+	} else {
+		ZLog::PrintV("%-40s %12.2f us  %11.1f /s  (%llu runs)\n", strFullName.c_str(), dMedian, dPerSecond, (unsigned long long)(arrSamples.size() * uBatch));
+	}
+}
+
+static void BenchCodeDirectory()
+{
+	static const uint64_t arrSizes[] = { 64 * 1024, 1024 * 1024, 16 * 1024 * 1024 };
+	for (uint64_t uSize : arrSizes) {
+		string strCode;
+		RandomData(strCode, (size_t)uSize, (uint32_t)uSize);
+		string strEmpty1(20, 0);
+		string strEmpty256(32, 0);
+		for (int nAlternate = 0; nAlternate < 2; nAlternate++) {
+			bool bAlternate = (1 == nAlternate);
+			const string& strEmpty = bAlternate ? strEmpty256 : strEmpty1;
+			string strCase = SizeName(uSize) + (bAlternate ? "/sha256" : "/sha1") + "/4KB-pages";
+			Bench("code_directory", strCase, uSize, [&]() {
+				string strOutput;
+				return ZSign::SlotBuildCodeDirectory(bAlternate, (uint8_t*)strCode.data(), (uint32_t)strCode.size(), NULL, 0,
+					0, 0, "com.zsign.bench", "ZSIGNBENCH", strEmpty, strEmpty, strEmpty, strEmpty, strEmpty, true, false, strOutput);
+			});
+		}
+	}
+}
+
+static void BenchSHAFile(const string& strTempFolder)
+{
+	// below and above the mmap/stream switch in SHAFile
+	static const uint64_t arrSizes[] = { 16 * 1024, 1024 * 1024, 32 * 1024 * 1024 };
+	for (uint64_t uSize : arrSizes) {
+		string strData;
+		RandomData(strData, (size_t)uSize, (uint32_t)uSize);
+		string strFile = strTempFolder + "/sha_" + SizeName(uSize);
+		ZFile::WriteFile(strFile.c_str(), strData);
+		Bench("sha_file", SizeName(uSize), uSize, [&]() {
+			string strSHA1;
+			string strSHA256;
+			return ZSHA::SHAFile(strFile.c_str(), strSHA1, strSHA256);
+		});
+	}
+}
+
+// A bundle with uFiles resources of uFileSize bytes spread over 16 folders,
+// plus the Info.plist and executable GenerateCodeResources looks for.
+static bool MakeBundle(const string& strFolder, uint32_t uFiles, uint32_t uFileSize)
+{
+	ZFile::RemoveFolder(strFolder.c_str());
+	if (!ZFile::CreateFolder(strFolder.c_str())) {
+		return false;
+	}
+
+	jvalue jvInfo;
+	jvInfo["CFBundleExecutable"] = "Bench";
+	jvInfo["CFBundleIdentifier"] = "com.zsign.bench";
+	jvInfo["CFBundleName"] = "Bench";
+	jvInfo["CFBundleVersion"] = "1.0";
+	jvInfo.style_write_plist_to_file("%s/Info.plist", strFolder.c_str());
+
+	string strData;
+	RandomData(strData, 64 * 1024, uFiles);
+	ZFile::WriteFileV(strData, "%s/Bench", strFolder.c_str());
+	for (uint32_t i = 0; i < uFiles; i++) {
+		string strFile;
+		ZUtil::StringFormatV(strFile, "%s/res%02u/file%05u.dat", strFolder.c_str(), i % 16, i);
+		if (0 == i % 97) {
+			ZUtil::StringFormatV(strFile, "%s/en.lproj/file%05u.strings", strFolder.c_str(), i);
+		}
+		string strParent = strFile;
+		ZFile::PathRemoveFileSpec(strParent);
+		ZFile::CreateFolder(strParent.c_str());
+		strData[0] = (char)i;
+		strData[1] = (char)(i >> 8);
+		if (!ZFile::WriteFile(strFile.c_str(), strData.data(), uFileSize)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static void BenchCodeResources(const string& strTempFolder)
+{
+	struct Tree { uint32_t uFiles; uint32_t uFileSize; };
+	static const Tree arrTrees[] = { { 100, 16 * 1024 }, { 2000, 4 * 1024 }, { 10000, 512 } };
+	for (const Tree& tree : arrTrees) {
+		string strFolder = strTempFolder + "/Bench.app";
+		if (!MakeBundle(strFolder, tree.uFiles, tree.uFileSize)) {
+			ZLog::ErrorV(">>> Can't create bench bundle! %s\n", strFolder.c_str());
+			return;
+		}
+
+		string strCase;
+		ZUtil::StringFormatV(strCase, "%ux%s", tree.uFiles, SizeName(tree.uFileSize).c_str());
+		Bench("code_resources", strCase, (uint64_t)tree.uFiles * tree.uFileSize, [&]() {
+			ZBundle bundle;
+			bundle.m_strAppFolder = strFolder;
+			jvalue jvCodeRes;
+			return bundle.GenerateCodeResources(strFolder, jvCodeRes);
+		});
+		ZFile::RemoveFolder(strFolder.c_str());
+	}
+}
+
+// A CodeResources-shaped document with uFiles entries.
+static void MakeCodeResources(uint32_t uFiles, jvalue& jvCodeRes)
+{
+	string strHash1;
+	string strHash256;
+	for (uint32_t i = 0; i < uFiles; i++) {
+		string strKey;
+		ZUtil::StringFormatV(strKey, "Assets/res%02u/file%05u.dat", i % 16, i);
+		RandomData(strHash1, 20, i);
+		RandomData(strHash256, 32, ~i);
+		jvCodeRes["files"][strKey].assign_data(strHash1);
+		jvCodeRes["files2"][strKey]["hash"].assign_data(strHash1);
+		jvCodeRes["files2"][strKey]["hash2"].assign_data(strHash256);
+	}
+	jvCodeRes["rules"]["^.*"] = true;
+	jvCodeRes["rules"]["^.*\\.lproj/"]["optional"] = true;
+	jvCodeRes["rules"]["^.*\\.lproj/"]["weight"] = 1000.0;
+	jvCodeRes["rules2"]["^.*"] = true;
+	jvCodeRes["rules2"]["^Info\\.plist$"]["omit"] = true;
+	jvCodeRes["rules2"]["^Info\\.plist$"]["weight"] = 20.0;
+}
+
+static void BenchPlist()
+{
+	static const uint32_t arrFiles[] = { 100, 5000 };
+	for (uint32_t uFiles : arrFiles) {
+		jvalue jvCodeRes;
+		MakeCodeResources(uFiles, jvCodeRes);
+
+		string strXml;
+		string strBinary;
+		jvCodeRes.style_write_plist(strXml);
+		jvCodeRes.write_bplist(strBinary);
+
+		string strCase;
+		ZUtil::StringFormatV(strCase, "%u-files", uFiles);
+		Bench("plist_parse", strCase + "/xml", strXml.size(), [&]() {
+			jvalue jvRoot;
+			return jvRoot.read_plist(strXml);
+		});
+		Bench("plist_parse", strCase + "/binary", strBinary.size(), [&]() {
+			jvalue jvRoot;
+			jpreader reader;
+			bool bBinary = false;
+			return reader.parse(strBinary.data(), strBinary.size(), jvRoot, &bBinary) && bBinary;
+		});
+		Bench("plist_write", strCase, strXml.size(), [&]() {
+			string strOutput;
+			jvCodeRes.style_write_plist(strOutput);
+			return !strOutput.empty();
+		});
+	}
+}
+
+static void BenchBase64()
+{
+	static const uint64_t arrSizes[] = { 32, 64 * 1024, 4 * 1024 * 1024 };
+	for (uint64_t uSize : arrSizes) {
+		string strData;
+		RandomData(strData, (size_t)uSize, (uint32_t)uSize);
+		string strEncoded = jbase64().encode(strData);
+		Bench("base64_encode", SizeName(uSize), uSize, [&]() {
+			jbase64 b64;
+			return (NULL != b64.encode(strData));
+		});
+		Bench("base64_decode", SizeName(uSize), uSize, [&]() {
+			jbase64 b64;
+			string strOutput;
+			b64.decode(strEncoded.c_str(), strOutput);
+			return (strOutput.size() == strData.size());
+		});
+	}
+}
+
+static void BenchZip(const string& strTempFolder)
+{
+	string strFolder = strTempFolder + "/zip/Payload/Bench.app";
+	if (!MakeBundle(strFolder, 1000, 16 * 1024)) {
+		ZLog::ErrorV(">>> Can't create bench bundle! %s\n", strFolder.c_str());
+		return;
+	}
+	uint64_t uBytes = 1000 * 16 * 1024;
+
+	string strBaseFolder = strTempFolder + "/zip";
+	string strOutputFolder = strTempFolder + "/unzip";
+	static const int arrLevels[] = { 0, 6 };
+	for (int nLevel : arrLevels) {
+		string strZipFile;
+		ZUtil::StringFormatV(strZipFile, "%s/bench_%d.ipa", strTempFolder.c_str(), nLevel);
+		string strCase;
+		ZUtil::StringFormatV(strCase, "1000x16KB/level-%d", nLevel);
+		Bench("zip_archive", strCase, uBytes, [&]() {
+			ZFile::RemoveFile(strZipFile.c_str());
+			return Zip::Archive(strBaseFolder, strZipFile, nLevel);
+		});
+		Bench("zip_extract", strCase, uBytes, [&]() {
+			return Zip::Extract(strZipFile.c_str(), strOutputFolder.c_str());
+		});
+	}
+}
+
+static void BenchCMS(const string& strIdentityFolder)
+{
+	string strP12 = strIdentityFolder + "/bench.p12";
+	string strProv = strIdentityFolder + "/bench.mobileprovision";
+	if (!ZFile::IsFileExists(strP12.c_str()) || !ZFile::IsFileExists(strProv.c_str())) {
+		ZLog::WarnV(">>> %-40s skipped (no identity in %s)\n", "cms", strIdentityFolder.c_str());
+		return;
+	}
+
+	ZLog::SetLogLever(ZLog::E_NONE);
+	ZSignAsset zsa;
+	bool bInit = zsa.Init("", strP12, strProv, "", "bench", false, true, false);
+	ZLog::SetLogLever(ZLog::E_INFO);
+	if (!bInit) {
+		ZLog::ErrorV(">>> Can't load bench identity! %s\n", strIdentityFolder.c_str());
+		return;
+	}
+
+	// a CodeDirectory of a 16 MB binary; GenerateCMS signs a digest of it
+	string strCode;
+	RandomData(strCode, 16 * 1024 * 1024, 1);
+	string strEmpty(32, 0);
+	string strCodeDirectory;
+	ZSign::SlotBuildCodeDirectory(true, (uint8_t*)strCode.data(), (uint32_t)strCode.size(), NULL, 0, 0, 0,
+		"com.zsign.bench", zsa.m_strTeamId, strEmpty, strEmpty, strEmpty, strEmpty, strEmpty, true, false, strCodeDirectory);
+
+	string strSHA1;
+	string strSHA256;
+	ZSHA::SHA(strCodeDirectory, strSHA1, strSHA256);
+	jvalue jvHashes;
+	jvHashes["cdhashes"][0].assign_data(strSHA256.data(), 20);
+	string strCDHashesPlist;
+	jvHashes.style_write_plist(strCDHashesPlist);
+
+	Bench("cms", "rsa2048/sha256-only", 0, [&]() {
+		string strCMS;
+		return zsa.GenerateCMS(strCodeDirectory, strCDHashesPlist, strSHA1, strSHA256, strCMS);
+	});
+}
+
+int main(int argc, char* argv[])
+{
+	string strOutputFile = "microbench.json";
+	string strIdentityFolder = ZFile::GetFullPath(argv[0]);
+	ZFile::PathRemoveFileSpec(strIdentityFolder);
+	strIdentityFolder += "/identity";
+
+	int opt = 0;
+	while (-1 != (opt = getopt(argc, argv, "o:f:t:I:h"))) {
+		switch (opt) {
+		case 'o':
+			strOutputFile = optarg;
+			break;
+		case 'f':
+			s_strFilter = optarg;
+			break;
+		case 't':
+			s_uMinTime = (uint64_t)atoi(optarg) * 1000;
+			break;
+		case 'I':
+			strIdentityFolder = optarg;
+			break;
+		default:
+			ZLog::Print("Usage: microbench [-o report.json] [-f filter] [-t min_ms] [-I identity_folder]\n");
+			return -1;
+		}
+	}
+
+	string strTempFolder;
+	ZUtil::StringFormatV(strTempFolder, "%s/zsign_microbench_%d", ZFile::GetTempFolder(), (int)getpid());
+	ZFile::RemoveFolder(strTempFolder.c_str());
+	ZFile::CreateFolder(strTempFolder.c_str());
+
+	s_jvResults = jvalue(jvalue::E_ARRAY);
+	BenchCodeDirectory();
+	BenchSHAFile(strTempFolder);
+	BenchCodeResources(strTempFolder);
+	BenchPlist();
+	BenchBase64();
+	BenchZip(strTempFolder);
+	BenchCMS(strIdentityFolder);
+	ZFile::RemoveFolder(strTempFolder.c_str());
+
+	jvalue jvReport;
+	jvReport["version"] = ZSIGN_STR(ZSIGN_VERSION);
+	jvReport["timestamp"] = (int64_t)time(NULL);
+	jvReport["cpus"] = (int)thread::hardware_concurrency();
+	jvReport["min_ms"] = (int64_t)(s_uMinTime / 1000);
+	jvReport["results"] = s_jvResults;
+
+	string strReport;
+	jvReport.style_write(strReport);
+	if (!ZFile::WriteFile(strOutputFile.c_str(), strReport)) {
+		ZLog::ErrorV(">>> Can't write report! %s\n", strOutputFile.c_str());
+		return -1;
+	}
+	ZLog::PrintV(">>> Report:\t%s\n", strOutputFile.c_str());
+	return 0;
+}
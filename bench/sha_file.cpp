@@ -0,0 +1,87 @@
+// SHAFile throughput: whole-file mmap (the previous implementation) versus
+// the streaming reader, on warm and cold page cache.
+//
+//	bench_sha_file [size_mb] [rounds]
+
+#include "common.h"
+
+static bool MapAndHash(const char* szFile, string& strSHA1, string& strSHA256)
+{
+	size_t sSize = 0;
+	uint8_t* pBase = (uint8_t*)ZFile::MapFile(szFile, 0, 0, &sSize, true);
+	ZSHA::SHA1(pBase, sSize, strSHA1);
+	ZSHA::SHA256(pBase, sSize, strSHA256);
+	if (NULL != pBase && sSize > 0) {
+		ZFile::UnmapFile(pBase, sSize);
+	}
+	return true;
+}
+
+static bool DropCache(const char* szFile)
+{
+#if defined(POSIX_FADV_DONTNEED)
+	int fd = open(szFile, O_RDONLY);
+	if (fd >= 0) {
+		fdatasync(fd);
+		int ret = posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+		close(fd);
+		return (0 == ret);
+	}
+#endif
+	return false;
+}
+
+static void Run(const char* szName, const char* szFile, int64_t nSize, int nRounds, bool bCold,
+				function<bool(const char*, string&, string&)> hasher, string& strSHA256)
+{
+	uint64_t uTotal = 0;
+	for (int i = 0; i < nRounds; i++) {
+		if (bCold && !DropCache(szFile)) {
+			ZLog::PrintV("%-10s %-5s  n/a (can't drop page cache here)\n", szName, "cold");
+			return;
+		}
+		string strSHA1;
+		uint64_t uBegin = ZUtil::GetMicroSecond();
+		hasher(szFile, strSHA1, strSHA256);
+		uTotal += ZUtil::GetMicroSecond() - uBegin;
+	}
+	double dMBs = ((double)nSize * nRounds / (1024.0 * 1024.0)) / ((double)uTotal / 1000000.0);
+	ZLog::PrintV("%-10s %-5s %8.1f MB/s  (%llu us avg)\n", szName, bCold ? "cold" : "warm", dMBs, (unsigned long long)(uTotal / nRounds));
+}
+
+int main(int argc, char* argv[])
+{
+	int64_t nSizeMB = (argc > 1) ? atoi(argv[1]) : 256;
+	int nRounds = (argc > 2) ? atoi(argv[2]) : 3;
+	nSizeMB = (nSizeMB > 0) ? nSizeMB : 256;
+	nRounds = (nRounds > 0) ? nRounds : 3;
+
+	string strFile;
+	ZUtil::StringFormatV(strFile, "%s/zsign_bench_sha_%d.bin", ZFile::GetTempFolder(), (int)getpid());
+	string strBlock(1024 * 1024, 0);
+	uint32_t uSeed = 0x12345678;
+	for (size_t i = 0; i < strBlock.size(); i++) {
+		uSeed = uSeed * 1103515245 + 12345;
+		strBlock[i] = (char)(uSeed >> 16);
+	}
+	ZFile::WriteFile(strFile.c_str(), "", 0);
+	for (int64_t i = 0; i < nSizeMB; i++) {
+		ZFile::AppendFile(strFile.c_str(), strBlock);
+	}
+
+	ZLog::PrintV(">>> File:\t%s (%lld MB, %d rounds)\n", strFile.c_str(), (long long)nSizeMB, nRounds);
+
+	string strMapped;
+	string strStreamed;
+	for (int c = 0; c < 2; c++) {
+		Run("mmap", strFile.c_str(), nSizeMB * 1024 * 1024, nRounds, (0 == c), MapAndHash, strMapped);
+		Run("SHAFile", strFile.c_str(), nSizeMB * 1024 * 1024, nRounds, (0 == c), ZSHA::SHAFile, strStreamed);
+	}
+
+	ZFile::RemoveFile(strFile.c_str());
+	if (strMapped != strStreamed) {
+		ZLog::Error(">>> Digest mismatch between mmap and SHAFile!\n");
+		return -1;
+	}
+	return 0;
+}
@@ -0,0 +1,112 @@
+// Code page hashing: the previous one-shot ::SHA1/::SHA256 per 4 KiB page
+// versus ZSHA::HashPages() on every backend this CPU can run. Each backend
+// is first checked against OpenSSL's EVP_Digest on random lengths around
+// the 64-byte block and padding boundaries.
+//
+//	bench_sha_pages [size_mb] [iterations]
+
+#include "common.h"
+#include <openssl/evp.h>
+#include <openssl/sha.h>
+
+static void OneShotPages(bool bSHA256, const uint8_t* data, size_t size, uint32_t uPageSize, uint8_t* pHashes)
+{
+	for (size_t uOffset = 0; uOffset < size; uOffset += uPageSize) {
+		size_t uSize = min((size_t)uPageSize, size - uOffset);
+		if (bSHA256) {
+			::SHA256(data + uOffset, uSize, pHashes);
+			pHashes += 32;
+		} else {
+			::SHA1(data + uOffset, uSize, pHashes);
+			pHashes += 20;
+		}
+	}
+}
+
+static bool Fuzz(int nBackend, const string& strData, uint32_t uIterations)
+{
+	uint32_t uSeed = 1;
+	for (uint32_t i = 0; i < uIterations; i++) {
+		uSeed = uSeed * 1103515245 + 12345;
+		// every length up to 4 blocks first, then random ones up to 64 KiB
+		size_t uSize = (i < 256) ? i : (uSeed >> 8) % (64 * 1024);
+		size_t uOffset = (uSeed >> 4) % 61; // unaligned input too
+		const uint8_t* pData = (const uint8_t*)strData.data() + uOffset;
+		for (int j = 0; j < 2; j++) {
+			bool bSHA256 = (1 == j);
+			uint8_t arrHash[32];
+			uint8_t arrExpected[32];
+			unsigned int uExpected = 0;
+			ZSHA::Hash(bSHA256, pData, uSize, arrHash);
+			EVP_Digest(pData, uSize, arrExpected, &uExpected, bSHA256 ? EVP_sha256() : EVP_sha1(), NULL);
+			if (0 != memcmp(arrHash, arrExpected, uExpected)) {
+				ZLog::ErrorV(">>> %s mismatch on %s for %llu bytes!\n", bSHA256 ? "SHA-256" : "SHA-1", ZSHA::GetBackendName(nBackend), (unsigned long long)uSize);
+				return false;
+			}
+		}
+	}
+	return true;
+}
+
+static void Run(const char* szName, bool bSHA256, const string& strData, uint32_t uIterations,
+				function<void(bool, const uint8_t*, size_t, uint32_t, uint8_t*)> hasher, string& strHashes)
+{
+	strHashes.assign((strData.size() + 4095) / 4096 * (bSHA256 ? 32 : 20), 0);
+	uint64_t uBegin = ZUtil::GetMicroSecond();
+	for (uint32_t i = 0; i < uIterations; i++) {
+		hasher(bSHA256, (const uint8_t*)strData.data(), strData.size(), 4096, (uint8_t*)&strHashes[0]);
+	}
+	uint64_t uElapse = ZUtil::GetMicroSecond() - uBegin;
+	double dMBs = ((double)strData.size() * uIterations / (1024.0 * 1024.0)) / ((double)uElapse / 1000000.0);
+	double dPages = (double)(strData.size() / 4096) * uIterations / ((double)uElapse / 1000000.0);
+	ZLog::PrintV("%-10s %-8s %8.1f MB/s  %10.0f pages/s\n", szName, bSHA256 ? "sha256" : "sha1", dMBs, dPages);
+}
+
+int main(int argc, char* argv[])
+{
+	int64_t nSizeMB = (argc > 1) ? atoi(argv[1]) : 64;
+	uint32_t uIterations = (argc > 2) ? (uint32_t)atoi(argv[2]) : 4;
+	nSizeMB = (nSizeMB > 0) ? nSizeMB : 64;
+	uIterations = (uIterations > 0) ? uIterations : 4;
+
+	string strData((size_t)nSizeMB * 1024 * 1024, 0);
+	uint32_t uSeed = 0x12345678;
+	for (size_t i = 0; i < strData.size(); i++) {
+		uSeed = uSeed * 1103515245 + 12345;
+		strData[i] = (char)(uSeed >> 16);
+	}
+
+	int nDefault = ZSHA::GetBackend();
+	ZLog::PrintV(">>> Data:\t%lld MB in 4 KiB pages, %u iterations, default backend %s\n", (long long)nSizeMB, uIterations, ZSHA::GetBackendName(nDefault));
+
+	vector<int> arrBackends;
+	int arrAll[] = { ZSHA::E_BACKEND_OPENSSL, ZSHA::E_BACKEND_SHANI, ZSHA::E_BACKEND_ARMV8 };
+	for (int nBackend : arrAll) {
+		if (!ZSHA::SetBackend(nBackend)) {
+			ZLog::PrintV("%-10s n/a on this CPU\n", ZSHA::GetBackendName(nBackend));
+			continue;
+		}
+		if (!Fuzz(nBackend, strData, 4096)) {
+			return -1;
+		}
+		arrBackends.push_back(nBackend);
+	}
+	ZLog::PrintV(">>> Fuzz:\t%u lengths per backend match EVP_Digest\n", 4096);
+
+	for (int j = 0; j < 2; j++) {
+		bool bSHA256 = (1 == j);
+		string strReference;
+		Run("one-shot", bSHA256, strData, uIterations, OneShotPages, strReference);
+		for (int nBackend : arrBackends) {
+			string strHashes;
+			ZSHA::SetBackend(nBackend);
+			Run(ZSHA::GetBackendName(nBackend), bSHA256, strData, uIterations, ZSHA::HashPages, strHashes);
+			if (strHashes != strReference) {
+				ZLog::ErrorV(">>> Page hashes of %s differ from the one-shot ones!\n", ZSHA::GetBackendName(nBackend));
+				return -1;
+			}
+		}
+	}
+	ZSHA::SetBackend(nDefault);
+	return 0;
+}
@@ -2,8 +2,7 @@
 #include "json.h"
 #include "archo.h"
 #include "signing.h"
-
-uint64_t ZArchO::s_uExecSegLimit = 0;
+#include "stats.h"
 
 ZArchO::ZArchO()
 {
@@ -15,6 +14,7 @@ ZArchO::ZArchO()
 	m_pHeader = NULL;
 	m_uHeaderSize = 0;
 	m_uFileType = 0;
+	m_uExecSegLimit = 0;
 	m_bEncrypted = false;
 	m_b64Bit = false;
 	m_bBigEndian = false;
@@ -32,6 +32,7 @@ bool ZArchO::Init(uint8_t* pBase, uint32_t uLength)
 
 	m_pBase = pBase;
 	m_uLength = uLength;
+	m_setChangedPages.clear();
 	m_uCodeLength = (uLength % 16 == 0) ? uLength : uLength + 16 - (uLength % 16);
 	m_pHeader = (mach_header*)m_pBase;
 	if (MH_MAGIC != m_pHeader->magic && MH_CIGAM != m_pHeader->magic && MH_MAGIC_64 != m_pHeader->magic && MH_CIGAM_64 != m_pHeader->magic) {
@@ -51,7 +52,7 @@ bool ZArchO::Init(uint8_t* pBase, uint32_t uLength)
 		{
 			segment_command* seglc = (segment_command*)pLoadCommand;
 			if (0 == strcmp("__TEXT", seglc->segname)) {
-				s_uExecSegLimit = seglc->vmsize;
+				m_uExecSegLimit = seglc->vmsize;
 				for (uint32_t j = 0; j < BO(seglc->nsects); j++) {
 					section* sect = (section*)((pLoadCommand + sizeof(segment_command)) + sizeof(section) * j);
 					if (0 == strcmp("__text", sect->sectname)) {
@@ -71,7 +72,7 @@ bool ZArchO::Init(uint8_t* pBase, uint32_t uLength)
 		{
 			segment_command_64* seglc = (segment_command_64*)pLoadCommand;
 			if (0 == strcmp("__TEXT", seglc->segname)) {
-				s_uExecSegLimit = seglc->vmsize;
+				m_uExecSegLimit = seglc->vmsize;
 				for (uint32_t j = 0; j < BO(seglc->nsects); j++) {
 					section_64* sect = (section_64*)((pLoadCommand + sizeof(segment_command_64)) + sizeof(section_64) * j);
 					if (0 == strcmp("__text", sect->sectname)) {
@@ -113,6 +114,11 @@ bool ZArchO::Init(uint8_t* pBase, uint32_t uLength)
 	return true;
 }
 
+const char* ZArchO::GetArchName()
+{
+	return GetArch(BO(m_pHeader->cputype), BO(m_pHeader->cpusubtype));
+}
+
 const char* ZArchO::GetArch(int cpuType, int cpuSubType)
 {
 	switch (cpuType) {
@@ -242,6 +248,29 @@ bool ZArchO::IsSigned() const
 	return true;
 }
 
+// Without strInfoPlist the Info.plist slot must hash the embedded
+// __info_plist section, as in Sign().
+bool ZArchO::Verify(const string& strInfoPlist, const string& strCodeResources, string& strReason)
+{
+	if (NULL == m_pSignBase || m_uSignLength <= 0) {
+		strReason = "not signed";
+		return false;
+	}
+
+	if ((uint64_t)m_uCodeLength + m_uSignLength > m_uLength) {
+		strReason = "code signature is out of bounds";
+		return false;
+	}
+
+	return ZSign::VerifyCodeSignature(m_pSignBase,
+										m_uSignLength,
+										m_pBase,
+										m_uCodeLength,
+										strInfoPlist.empty() ? m_strInfoPlist : strInfoPlist,
+										strCodeResources,
+										strReason);
+}
+
 void ZArchO::PrintInfo()
 {
 	if (NULL == m_pHeader) {
@@ -253,7 +282,7 @@ void ZArchO::PrintInfo()
 	ZLog::PrintV("\tFileType: \t%s\n", GetFileType(BO(m_pHeader->filetype)));
 	ZLog::PrintV("\tTotalSize: \t%u (%s)\n", m_uLength, ZUtil::FormatSize(m_uLength).c_str());
 	ZLog::PrintV("\tPlatform: \t%u\n", m_b64Bit ? 64 : 32);
-	ZLog::PrintV("\tCPUArch: \t%s\n", GetArch(BO(m_pHeader->cputype), BO(m_pHeader->cpusubtype)));
+	ZLog::PrintV("\tCPUArch: \t%s\n", GetArchName());
 	ZLog::PrintV("\tCPUType: \t0x%x\n", BO(m_pHeader->cputype));
 	ZLog::PrintV("\tCPUSubType: \t0x%x\n", BO(m_pHeader->cpusubtype));
 	ZLog::PrintV("\tBigEndian: \t%d\n", m_bBigEndian);
@@ -333,48 +362,34 @@ bool ZArchO::BuildCodeSignature(ZSignAsset* pSignAsset,
 	const string& strCodeResourcesSHA256, 
 	string& strOutput)
 {
-	string strRequirementsSlot;
-	string strEntitlementsSlot;
-	string strDerEntitlementsSlot;
-
-	string strEmptyEntitlements = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n<plist version=\"1.0\">\n<dict/>\n</plist>\n";
-	ZSign::SlotBuildRequirements(strBundleId, pSignAsset->m_strSubjectCN, strRequirementsSlot);
-	ZSign::SlotBuildEntitlements(IsExecute() ? pSignAsset->m_strEntitleData : strEmptyEntitlements, strEntitlementsSlot);
-	ZSign::SlotBuildDerEntitlements(IsExecute() ? pSignAsset->m_strEntitleData : "", strDerEntitlementsSlot);
-
-	string strRequirementsSlotSHA1;
-	string strRequirementsSlotSHA256;
-	if (strRequirementsSlot.empty()) { //empty
-		strRequirementsSlotSHA1.append(20, 0);
-		strRequirementsSlotSHA256.append(32, 0);
-	} else {
-		ZSHA::SHA(strRequirementsSlot, strRequirementsSlotSHA1, strRequirementsSlotSHA256);
-	}
-
-	string strEntitlementsSlotSHA1;
-	string strEntitlementsSlotSHA256;
-	if (strEntitlementsSlot.empty()) { //empty
-		strEntitlementsSlotSHA1.append(20, 0);
-		strEntitlementsSlotSHA256.append(32, 0);
-	} else {
-		ZSHA::SHA(strEntitlementsSlot, strEntitlementsSlotSHA1, strEntitlementsSlotSHA256);
-	}
-
-	string strDerEntitlementsSlotSHA1;
-	string strDerEntitlementsSlotSHA256;
-	if (strDerEntitlementsSlot.empty()) { //empty
-		strDerEntitlementsSlotSHA1.append(20, 0);
-		strDerEntitlementsSlotSHA256.append(32, 0);
-	} else {
-		ZSHA::SHA(strDerEntitlementsSlot, strDerEntitlementsSlotSHA1, strDerEntitlementsSlotSHA256);
-	}
+	ZSignAsset::SpecialSlot requirementsSlot;
+	ZSignAsset::SpecialSlot entitlementsSlot;
+	ZSignAsset::SpecialSlot derEntitlementsSlot;
+	pSignAsset->GetSpecialSlots(strBundleId, IsExecute(), requirementsSlot, entitlementsSlot, derEntitlementsSlot);
+
+	const string& strRequirementsSlot = requirementsSlot.strData;
+	const string& strRequirementsSlotSHA1 = requirementsSlot.strSHA1;
+	const string& strRequirementsSlotSHA256 = requirementsSlot.strSHA256;
+	const string& strEntitlementsSlot = entitlementsSlot.strData;
+	const string& strEntitlementsSlotSHA1 = entitlementsSlot.strSHA1;
+	const string& strEntitlementsSlotSHA256 = entitlementsSlot.strSHA256;
+	const string& strDerEntitlementsSlot = derEntitlementsSlot.strData;
+	const string& strDerEntitlementsSlotSHA1 = derEntitlementsSlot.strSHA1;
+	const string& strDerEntitlementsSlotSHA256 = derEntitlementsSlot.strSHA256;
 
 	uint8_t* pCodeSlots1Data = NULL;
 	uint8_t* pCodeSlots256Data = NULL;
 	uint32_t uCodeSlots1DataLength = 0;
 	uint32_t uCodeSlots256DataLength = 0;
+	uint32_t uCodeSlots1PageSize = 0;
+	uint32_t uCodeSlots256PageSize = 0;
+	string strPatchedSlots1;
+	string strPatchedSlots256;
 	if (!bForce) {
-		ZSign::GetCodeSignatureExistsCodeSlotsData(m_pSignBase, pCodeSlots1Data, uCodeSlots1DataLength, pCodeSlots256Data, uCodeSlots256DataLength);
+		ZSign::GetCodeSignatureExistsCodeSlotsData(m_pSignBase, pCodeSlots1Data, uCodeSlots1DataLength, uCodeSlots1PageSize,
+													pCodeSlots256Data, uCodeSlots256DataLength, uCodeSlots256PageSize);
+		PatchCodeSlots(pCodeSlots1Data, uCodeSlots1DataLength, uCodeSlots1PageSize, false, strPatchedSlots1);
+		PatchCodeSlots(pCodeSlots256Data, uCodeSlots256DataLength, uCodeSlots256PageSize, true, strPatchedSlots256);
 	}
 
 	uint64_t uExecSegFlags = 0;
@@ -404,13 +419,14 @@ bool ZArchO::BuildCodeSignature(ZSignAsset* pSignAsset,
 
 	string strCodeDirectorySlot;
 	string strAltnateCodeDirectorySlot;
+	ZStatsScope cdScope("code_directory");
 	if (!pSignAsset->m_bSHA256Only) {
 		if (!ZSign::SlotBuildCodeDirectory(false,
 			m_pBase,
 			m_uCodeLength,
 			pCodeSlots1Data,
 			uCodeSlots1DataLength,
-			s_uExecSegLimit,
+			m_uExecSegLimit,
 			uExecSegFlags,
 			strBundleId,
 			pSignAsset->m_strTeamId,
@@ -432,7 +448,7 @@ bool ZArchO::BuildCodeSignature(ZSignAsset* pSignAsset,
 		m_uCodeLength,
 		pCodeSlots256Data,
 		uCodeSlots256DataLength,
-		s_uExecSegLimit,
+		m_uExecSegLimit,
 		uExecSegFlags,
 		strBundleId,
 		pSignAsset->m_strTeamId,
@@ -452,9 +468,11 @@ bool ZArchO::BuildCodeSignature(ZSignAsset* pSignAsset,
 		// code directory if `m_bUseSHA256Only == true`.
 		strAltnateCodeDirectorySlot.swap(strCodeDirectorySlot);
 	}
+	cdScope.Stop();
 
 	string strCMSSignatureSlot;
 	if (!pSignAsset->m_bAdhoc) { //adhoc remove cms signature slot
+		ZStatsScope cmsScope("cms");
 		if (!ZSign::SlotBuildCMSSignature(pSignAsset, strCodeDirectorySlot, strAltnateCodeDirectorySlot, strCMSSignatureSlot)) {
 			ZLog::Error(">>> Build CMS signature failed!\n");
 			return false;
@@ -602,16 +620,17 @@ bool ZArchO::Sign(ZSignAsset* pSignAsset,
 	return true;
 }
 
-uint32_t ZArchO::ReallocCodeSignSpace(const string& strNewFile)
+// Writes a copy of this arch with room for the signature to strOutput:
+// LC_CODE_SIGNATURE and __LINKEDIT grown to the new length, zero padded.
+uint32_t ZArchO::ReallocCodeSignSpace(string& strOutput)
 {
-	ZFile::RemoveFile(strNewFile.c_str());
-
 	uint32_t uNewLength = m_uCodeLength + ZUtil::ByteAlign(((m_uCodeLength / 4096) + 1) * (20 + 32), 4096) + 32768; //32K Should Be Enough
 	if (NULL == m_pLinkEditSegment || uNewLength <= m_uLength) {
 		return 0;
 	}
 
 	load_command* pseglc = (load_command*)m_pLinkEditSegment;
+	MarkChangedPage(m_pLinkEditSegment);
 	switch (BO(pseglc->cmd)) {
 	case LC_SEGMENT:
 	{
@@ -646,118 +665,181 @@ uint32_t ZArchO::ReallocCodeSignSpace(const string& strNewFile)
 		pcslc->dataoff = BO(m_uCodeLength);
 		m_pHeader->ncmds = BO(BO(m_pHeader->ncmds) + 1);
 		m_pHeader->sizeofcmds = BO(BO(m_pHeader->sizeofcmds) + sizeof(codesignature_command));
+		MarkChangedPage(m_pBase);
 	}
+	MarkChangedPage((uint8_t*)pcslc);
 	pcslc->datasize = BO(uNewLength - m_uCodeLength);
 
-	if (!ZFile::AppendFile(strNewFile.c_str(), (const char*)m_pBase, m_uLength)) {
-		return 0;
+	strOutput.reserve(uNewLength);
+	strOutput.assign((const char*)m_pBase, m_uLength);
+	strOutput.append(uNewLength - m_uLength, 0);
+	return uNewLength;
+}
+
+void ZLoadCommandEdits::InjectDylib(const string& strDylib, bool bWeak)
+{
+	for (pair<string, bool>& inject : m_arrInjectDylibs) {
+		if (inject.first == strDylib) {
+			inject.second = bWeak;
+			return;
+		}
 	}
+	m_arrInjectDylibs.push_back(make_pair(strDylib, bWeak));
+}
 
-	string strPadding;
-	strPadding.append(uNewLength - m_uLength, 0);
-	if (!ZFile::AppendFile(strNewFile.c_str(), strPadding)) {
-		ZFile::RemoveFile(strNewFile.c_str());
-		return 0;
+void ZLoadCommandEdits::RemoveDylib(const string& strDylib)
+{
+	m_setRemoveDylibs.insert(strDylib);
+}
+
+bool ZLoadCommandEdits::IsEmpty() const
+{
+	return m_arrInjectDylibs.empty() && m_setRemoveDylibs.empty();
+}
+
+void ZArchO::MarkChangedPage(const uint8_t* pData)
+{
+	m_setChangedPages.insert((uint32_t)((pData - m_pBase) / 4096));
+}
+
+// Existing code slots are only reused when the code is unchanged, so the
+// pages edited since then are hashed again into a copy of them. Edits are
+// recorded in 4 KiB pages, the existing code directory may use another
+// page size (uPageSize, 0 for one slot over the whole code).
+void ZArchO::PatchCodeSlots(uint8_t*& pCodeSlots, uint32_t uCodeSlotsLength, uint32_t uPageSize, bool bSHA256, string& strPatched)
+{
+	uint32_t uHashSize = bSHA256 ? 32 : 20;
+	uint64_t uSlotSize = (uPageSize > 0) ? uPageSize : max(m_uCodeLength, (uint32_t)1);
+	uint64_t uCodeSlots = (m_uCodeLength + uSlotSize - 1) / uSlotSize;
+	if (NULL == pCodeSlots || m_setChangedPages.empty() || uCodeSlotsLength != uCodeSlots * uHashSize) {
+		return;
 	}
 
-	return uNewLength;
+	set<uint64_t> setSlots;
+	for (uint32_t uPage : m_setChangedPages) {
+		uint64_t uBegin = (uint64_t)uPage * 4096;
+		uint64_t uEnd = min(uBegin + 4096, (uint64_t)m_uCodeLength);
+		for (uint64_t uSlot = uBegin / uSlotSize; uBegin < uEnd && uSlot <= (uEnd - 1) / uSlotSize; uSlot++) {
+			setSlots.insert(uSlot);
+		}
+	}
+
+	strPatched.assign((const char*)pCodeSlots, uCodeSlotsLength);
+	for (uint64_t uSlot : setSlots) {
+		uint64_t uOffset = uSlot * uSlotSize;
+		size_t uSize = (size_t)min(uSlotSize, m_uCodeLength - uOffset);
+		ZSHA::Hash(bSHA256, m_pBase + uOffset, uSize, (uint8_t*)&strPatched[uSlot * uHashSize]);
+	}
+	pCodeSlots = (uint8_t*)&strPatched[0];
 }
 
-bool ZArchO::InjectDylib(bool bWeakInject, const char* szDylibFile)
+// Builds the whole new load command area first, so the free space after
+// the load commands is checked once for the batch, then writes it over the
+// old one and records the pages whose bytes actually changed.
+bool ZArchO::ApplyLoadCommandEdits(const ZLoadCommandEdits& edits)
 {
 	if (NULL == m_pHeader) {
 		return false;
 	}
 
+	uint32_t uOldCommandsSize = BO(m_pHeader->sizeofcmds);
+	uint32_t uCommands = 0;
+	string strCommands;
+	strCommands.reserve(uOldCommandsSize + 256 * edits.m_arrInjectDylibs.size());
+
+	vector<bool> arrFound(edits.m_arrInjectDylibs.size(), false);
 	uint8_t* pLoadCommand = m_pBase + m_uHeaderSize;
 	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++) {
 		load_command* plc = (load_command*)pLoadCommand;
 		uint32_t uLoadType = BO(plc->cmd);
+		uint32_t uLoadSize = BO(plc->cmdsize);
 		if (LC_LOAD_DYLIB == uLoadType || LC_LOAD_WEAK_DYLIB == uLoadType) {
 			dylib_command* dlc = (dylib_command*)pLoadCommand;
 			const char* szDylib = (const char*)(pLoadCommand + BO(dlc->dylib.name.offset));
-			if (0 == strcmp(szDylib, szDylibFile)) {
+			if (edits.m_setRemoveDylibs.count(szDylib) > 0) {
+				ZLog::PrintV("\t\t\t%s\tclear\n", szDylib);
+				pLoadCommand += uLoadSize;
+				continue;
+			}
+			if (!edits.m_setRemoveDylibs.empty()) {
+				ZLog::PrintV("\t\t\t%s\n", szDylib);
+			}
+
+			size_t sOffset = strCommands.size();
+			strCommands.append((const char*)pLoadCommand, uLoadSize);
+			for (size_t j = 0; j < edits.m_arrInjectDylibs.size(); j++) {
+				if (arrFound[j] || edits.m_arrInjectDylibs[j].first != szDylib) {
+					continue;
+				}
+				arrFound[j] = true;
+				bool bWeakInject = edits.m_arrInjectDylibs[j].second;
 				if ((bWeakInject && (LC_LOAD_WEAK_DYLIB != uLoadType)) || (!bWeakInject && (LC_LOAD_DYLIB != uLoadType))) {
-					dlc->cmd = BO((uint32_t)(bWeakInject ? LC_LOAD_WEAK_DYLIB : LC_LOAD_DYLIB));
+					uint32_t uNewLoadType = BO((uint32_t)(bWeakInject ? LC_LOAD_WEAK_DYLIB : LC_LOAD_DYLIB));
+					memcpy(&strCommands[sOffset], &uNewLoadType, sizeof(uNewLoadType));
 					const char* oldLoadType = bWeakInject ? "LC_LOAD_DYLIB" : "LC_LOAD_WEAK_DYLIB";
 					const char* newLoadType = bWeakInject ? "LC_LOAD_WEAK_DYLIB" : "LC_LOAD_DYLIB";
 					ZLog::WarnV(">>>\t\t %s -> %s\n", oldLoadType, newLoadType);
 				}
-				return true;
 			}
+		} else {
+			strCommands.append((const char*)pLoadCommand, uLoadSize);
 		}
-		pLoadCommand += BO(plc->cmdsize);
+		uCommands++;
+		pLoadCommand += uLoadSize;
 	}
 
-	uint32_t uDylibFileLength = (uint32_t)strlen(szDylibFile);
-	uint32_t uDylibFilePadding = (8 - uDylibFileLength % 8);
-	uint32_t uDylibCommandSize = sizeof(dylib_command) + uDylibFileLength + uDylibFilePadding;
-	if (m_uLoadCommandsFreeSpace > 0 && m_uLoadCommandsFreeSpace < uDylibCommandSize) { // some bin doesn't have '__text'
+	for (size_t j = 0; j < edits.m_arrInjectDylibs.size(); j++) {
+		const string& strDylibFile = edits.m_arrInjectDylibs[j].first;
+		if (arrFound[j] || edits.m_setRemoveDylibs.count(strDylibFile) > 0) {
+			continue;
+		}
+
+		uint32_t uDylibFileLength = (uint32_t)strDylibFile.size();
+		uint32_t uDylibFilePadding = (8 - uDylibFileLength % 8);
+		uint32_t uDylibCommandSize = sizeof(dylib_command) + uDylibFileLength + uDylibFilePadding;
+
+		dylib_command dlc;
+		dlc.cmd = BO((uint32_t)(edits.m_arrInjectDylibs[j].second ? LC_LOAD_WEAK_DYLIB : LC_LOAD_DYLIB));
+		dlc.cmdsize = BO(uDylibCommandSize);
+		dlc.dylib.name.offset = BO((uint32_t)sizeof(dylib_command));
+		dlc.dylib.timestamp = BO((uint32_t)2);
+		dlc.dylib.current_version = 0;
+		dlc.dylib.compatibility_version = 0;
+		strCommands.append((const char*)&dlc, sizeof(dylib_command));
+		strCommands.append(strDylibFile);
+		strCommands.append(uDylibFilePadding, 0);
+		uCommands++;
+	}
+
+	uint32_t uNewCommandsSize = (uint32_t)strCommands.size();
+	if (uNewCommandsSize > uOldCommandsSize && m_uLoadCommandsFreeSpace > 0 &&
+		m_uLoadCommandsFreeSpace < uNewCommandsSize - uOldCommandsSize) { // some bin doesn't have '__text'
 		ZLog::Error(">>> Can't find free space of LoadCommands for LC_LOAD_DYLIB or LC_LOAD_WEAK_DYLIB!\n");
 		return false;
 	}
 
-	//add
-	dylib_command* dlc = (dylib_command*)(m_pBase + m_uHeaderSize + BO(m_pHeader->sizeofcmds));
-	dlc->cmd = BO((uint32_t)(bWeakInject ? LC_LOAD_WEAK_DYLIB : LC_LOAD_DYLIB));
-	dlc->cmdsize = BO(uDylibCommandSize);
-	dlc->dylib.name.offset = BO((uint32_t)sizeof(dylib_command));
-	dlc->dylib.timestamp = BO((uint32_t)2);
-	dlc->dylib.current_version = 0;
-	dlc->dylib.compatibility_version = 0;
-
-	string strDylibFile = szDylibFile;
-	strDylibFile.append(uDylibFilePadding, 0);
-
-	uint8_t* pDylibFile = (uint8_t*)dlc + sizeof(dylib_command);
-	memcpy(pDylibFile, strDylibFile.data(), strDylibFile.size());
+	// removed commands leave zeros behind, in the padding after the last one
+	uint32_t uAreaSize = max(uOldCommandsSize, uNewCommandsSize);
+	strCommands.append(uAreaSize - uNewCommandsSize, 0);
 
-	m_pHeader->ncmds = BO(BO(m_pHeader->ncmds) + 1);
-	m_pHeader->sizeofcmds = BO(BO(m_pHeader->sizeofcmds) + uDylibCommandSize);
-
-	return true;
-}
-
-void ZArchO::RemoveDylibs(const set<string>& setDylibs)
-{
-	uint8_t* pLoadCommand = m_pBase + m_uHeaderSize;
-	uint32_t old_load_command_size = m_pHeader->sizeofcmds;
-	uint8_t* new_load_command_data = (uint8_t*)malloc(old_load_command_size);
-	if (NULL == new_load_command_data) {
-		return;
+	uint8_t* pArea = m_pBase + m_uHeaderSize;
+	for (uint32_t uOffset = 0; uOffset < uAreaSize;) {
+		uint32_t uPageEnd = ((m_uHeaderSize + uOffset) / 4096 + 1) * 4096 - m_uHeaderSize;
+		uint32_t uSize = min(uPageEnd, uAreaSize) - uOffset;
+		if (0 != memcmp(pArea + uOffset, strCommands.data() + uOffset, uSize)) {
+			MarkChangedPage(pArea + uOffset);
+			memcpy(pArea + uOffset, strCommands.data() + uOffset, uSize);
+		}
+		uOffset += uSize;
 	}
 
-	memset(new_load_command_data, 0, old_load_command_size);
-	uint32_t new_load_command_size = 0;
-	uint32_t clear_num = 0;
-	uint32_t clear_data_size = 0;
-	for (uint32_t i = 0; i < BO(m_pHeader->ncmds); i++) {
-		load_command* plc = (load_command*)pLoadCommand;
-		uint32_t load_command_size = BO(plc->cmdsize);
-		if (LC_LOAD_DYLIB == BO(plc->cmd) || LC_LOAD_WEAK_DYLIB == BO(plc->cmd)) {
-			dylib_command* dlc = (dylib_command*)pLoadCommand;
-			const char* szDylib = (const char*)(pLoadCommand + BO(dlc->dylib.name.offset));
-			string dylibName = szDylib;
-			if (setDylibs.count(dylibName) > 0) {
-				ZLog::PrintV("\t\t\t%s\tclear\n", szDylib);
-				clear_num++;
-				clear_data_size += load_command_size;
-				pLoadCommand += BO(plc->cmdsize);
-				continue;
-			}
-			ZLog::PrintV("\t\t\t%s\n", szDylib);
+	if (BO(m_pHeader->ncmds) != uCommands || uOldCommandsSize != uNewCommandsSize) {
+		MarkChangedPage(m_pBase);
+		m_pHeader->ncmds = BO(uCommands);
+		m_pHeader->sizeofcmds = BO(uNewCommandsSize);
+		if (m_uLoadCommandsFreeSpace > 0) {
+			m_uLoadCommandsFreeSpace = m_uLoadCommandsFreeSpace + uOldCommandsSize - uNewCommandsSize;
 		}
-		new_load_command_size += load_command_size;
-		memcpy(new_load_command_data, pLoadCommand, load_command_size);
-		new_load_command_data += load_command_size;
-		pLoadCommand += BO(plc->cmdsize);
 	}
-	pLoadCommand -= m_pHeader->sizeofcmds;
-
-	m_pHeader->ncmds = BO(BO(m_pHeader->ncmds) - clear_num);
-	m_pHeader->sizeofcmds = BO(BO(m_pHeader->sizeofcmds) - clear_data_size);
-	new_load_command_data -= new_load_command_size;
-	memset(pLoadCommand, 0, old_load_command_size);
-	memcpy(pLoadCommand, new_load_command_data, new_load_command_size);
-	free(new_load_command_data);
+	return true;
 }
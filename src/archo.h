@@ -2,6 +2,22 @@
 #include "mach-o.h"
 #include "openssl.h"
 
+// A batch of dylib load command edits, applied to each slice in one pass:
+// injected dylibs are appended, or switched between LC_LOAD_DYLIB and
+// LC_LOAD_WEAK_DYLIB when already present, and removed dylibs dropped.
+// A dylib both injected and removed ends up removed.
+class ZLoadCommandEdits
+{
+public:
+	void InjectDylib(const string& strDylib, bool bWeak);
+	void RemoveDylib(const string& strDylib);
+	bool IsEmpty() const;
+
+public:
+	vector<pair<string, bool>>	m_arrInjectDylibs;
+	set<string>					m_setRemoveDylibs;
+};
+
 class ZArchO
 {
 public:
@@ -19,14 +35,17 @@ public:
 				const string& strCodeResourcesData);
 
 	void PrintInfo();
+	const char* GetArchName();
 	bool IsExecute();
 	bool IsSigned() const;
-	bool InjectDylib(bool bWeakInject, const char* szDylibFile);
-	void RemoveDylibs(const set<string>& setDylibs);
-	uint32_t ReallocCodeSignSpace(const string& strNewFile);
+	bool Verify(const string& strInfoPlist, const string& strCodeResources, string& strReason);
+	bool ApplyLoadCommandEdits(const ZLoadCommandEdits& edits);
+	uint32_t ReallocCodeSignSpace(string& strOutput);
 
 private:
 	uint32_t	BO(uint32_t uVal);
+	void		MarkChangedPage(const uint8_t* pData);
+	void		PatchCodeSlots(uint8_t*& pCodeSlots, uint32_t uCodeSlotsLength, uint32_t uPageSize, bool bSHA256, string& strPatched);
 	const char* GetFileType(uint32_t uFileType);
 	const char* GetArch(int cpuType, int cpuSubType);
 	bool		BuildCodeSignature(ZSignAsset* pSignAsset, 
@@ -55,7 +74,6 @@ public:
 	uint32_t		m_uFileType;
 	mach_header*	m_pHeader;
 	uint32_t		m_uHeaderSize;
-
-private:
-	static uint64_t s_uExecSegLimit;
+	uint64_t		m_uExecSegLimit;
+	set<uint32_t>	m_setChangedPages;	// 4 KiB pages edited since the existing signature was made
 };
@@ -2,6 +2,7 @@
 #include "base64.h"
 #include "common.h"
 #include "macho.h"
+#include "stats.h"
 #include "sys/stat.h"
 #include "sys/types.h"
 
@@ -17,6 +18,7 @@ ZBundle::ZBundle()
 	m_bRemoveWatchApp = false;
 	m_bRemoveUISupportedDevices = false;
 	m_bInjectExtensions = false;
+	m_strCacheFolder = "./.zsign_cache";
 }
 
 bool ZBundle::FindAppFolder(const string& strFolder, string& strAppFolder)
@@ -50,7 +52,11 @@ bool ZBundle::GetSignFolderInfo(const string& strFolder, jvalue& jvNode, bool bG
 	string strInfoPlistData;
 	string strInfoPlistPath = strFolder + "/Info.plist";
 	ZFile::ReadFile(strInfoPlistPath.c_str(), strInfoPlistData);
+	return GetSignFolderInfo(strFolder, strInfoPlistData, jvNode, bGetName);
+}
 
+bool ZBundle::GetSignFolderInfo(const string& strFolder, const string& strInfoPlistData, jvalue& jvNode, bool bGetName)
+{
 	jvalue jvInfo;
 	jvInfo.read_plist(strInfoPlistData);
 	string strBundleId = jvInfo["CFBundleIdentifier"];
@@ -114,42 +120,46 @@ bool ZBundle::GetObjectsToSign(const string& strFolder, jvalue& jvInfo)
 		return depthA > depthB;
 	});
 	
+	vector<string> arrInfoPlists;
 	for (const string& bundlePath : allBundles) {
+		arrInfoPlists.push_back(bundlePath + "/Info.plist");
+	}
+
+	vector<string> arrInfoPlistDatas;
+	ZFile::ReadFiles(arrInfoPlists, 0, arrInfoPlistDatas);
+	for (size_t i = 0; i < allBundles.size(); i++) {
 		jvalue jvNode;
-		if (GetSignFolderInfo(bundlePath, jvNode)) {
+		if (GetSignFolderInfo(allBundles[i], arrInfoPlistDatas[i], jvNode)) {
 			jvInfo["folders"].push_back(jvNode);
 		}
 	}
 	
+	vector<string> arrFiles;
 	ZFile::EnumFolder(strFolder.c_str(), true, NULL, [&](bool bFolder, const string& strPath) {
 		if (bFolder || string::npos != strPath.find(".dSYM") ||
 			string::npos != strPath.find("_WatchKitStub")) {
 			return false;
 		}
-		bool bMachO = false;
-		{
-			FILE* fp = NULL;
-#ifdef _WIN32
-			fopen_s(&fp, strPath.c_str(), "rb");
-#else
-			fp = fopen(strPath.c_str(), "rb");
-#endif
-			if (fp) {
-				uint32_t magic = 0;
-				if (1 == fread(&magic, sizeof(magic), 1, fp)) {
-					bMachO = (magic == MH_MAGIC || magic == MH_CIGAM ||
-							  magic == MH_MAGIC_64 || magic == MH_CIGAM_64 ||
-							  magic == FAT_MAGIC || magic == FAT_CIGAM);
-				}
-				fclose(fp);
-			}
-		}
-		if (bMachO) {
-			jvInfo["files"].push_back(strPath.substr(m_strAppFolder.size() + 1));
-		}
+		arrFiles.push_back(strPath);
 		return false;
 	});
 
+	// sniff the Mach-O magic of every file in one batch
+	vector<string> arrHeads;
+	ZFile::ReadFiles(arrFiles, sizeof(uint32_t), arrHeads);
+	for (size_t i = 0; i < arrFiles.size(); i++) {
+		if (arrHeads[i].size() < sizeof(uint32_t)) {
+			continue;
+		}
+		uint32_t magic = 0;
+		memcpy(&magic, arrHeads[i].data(), sizeof(magic));
+		if (magic == MH_MAGIC || magic == MH_CIGAM ||
+			magic == MH_MAGIC_64 || magic == MH_CIGAM_64 ||
+			magic == FAT_MAGIC || magic == FAT_CIGAM) {
+			jvInfo["files"].push_back(arrFiles[i].substr(m_strAppFolder.size() + 1));
+		}
+	}
+
 	return true;
 }
 
@@ -192,7 +202,9 @@ bool ZBundle::GenerateCodeResources(const string& strFolder, jvalue& jvCodeRes)
 		string strFile = strFolder + "/" + strKey;
 		string strSHA1Base64;
 		string strSHA256Base64;
-		ZSHA::SHABase64File(strFile.c_str(), strSHA1Base64, strSHA256Base64);
+		ZFileStamp stamp;
+		m_hashes.HashFile(strFile, strSHA1Base64, strSHA256Base64, &stamp);
+		m_cache.SetFileHash(strFile.substr(m_strAppFolder.size() + 1), stamp, strSHA1Base64, strSHA256Base64);
 
 #ifdef _WIN32
 		strKey = ic.A2U8(strKey);
@@ -309,6 +321,9 @@ static bool IsAppExtensionPath(const string& strPath)
 
 bool ZBundle::SignNode(jvalue& jvNode)
 {
+	string strFolder = jvNode["path"];
+	ZStatsScope scope("bundle", ("/" == strFolder) ? m_strAppFolder : (m_strAppFolder + "/" + strFolder));
+
 	if (jvNode.has("files")) {
 		for (size_t i = 0; i < jvNode["files"].size(); i++) {
 			string strFile = jvNode["files"][i];
@@ -335,7 +350,6 @@ bool ZBundle::SignNode(jvalue& jvNode)
 	jbase64 b64;
 	string strInfoSHA1;
 	string strInfoSHA256;
-	string strFolder = jvNode["path"];
 	string strBundleId = jvNode["bundle_id"];
 	string strBundleExe = jvNode["bundle_executable"];
 	b64.decode(jvNode["sha1"].as_cstr(), strInfoSHA1);
@@ -368,13 +382,17 @@ bool ZBundle::SignNode(jvalue& jvNode)
 
 	bool bForceSign = m_bForceSign;
 	if ("/" == strFolder) { // inject/remove dylib before CodeResources generation
+		ZLoadCommandEdits edits;
 		for (const string& strDylibFile : m_arrInjectDylibs) {
-			if (macho.InjectDylib(m_bWeakInject, strDylibFile.c_str())) {
-				bForceSign = true;
-			}
+			edits.InjectDylib(strDylibFile, m_bWeakInject);
+		}
+		for (const string& name : m_setRemoveDylibs) {
+			edits.RemoveDylib(name);
+		}
+		if (!edits.IsEmpty() && macho.ApplyLoadCommandEdits(edits)) {
+			bForceSign = true;
 		}
 		if (!m_setRemoveDylibs.empty()) {
-			macho.RemoveDylibs(m_setRemoveDylibs);
 			for (const string& name : m_setRemoveDylibs) {
 				string baseName = name;
 				if (baseName.find("@executable_path/") == 0) {
@@ -393,14 +411,16 @@ bool ZBundle::SignNode(jvalue& jvNode)
 		for (size_t i = 0, n = 1 + (size_t)count(strFolder.begin(), strFolder.end(), '/'); i < n; i++) {
 			strPrefix += "../";
 		}
+		ZLoadCommandEdits edits;
 		for (const string& strName : m_arrInjectDylibNames) {
-			string strLoadPath = "@executable_path/" + strPrefix + strName;
-			if (macho.InjectDylib(m_bWeakInject, strLoadPath.c_str())) {
-				bForceSign = true;
-			}
+			edits.InjectDylib("@executable_path/" + strPrefix + strName, m_bWeakInject);
+		}
+		if (macho.ApplyLoadCommandEdits(edits)) {
+			bForceSign = true;
 		}
 	}
 
+	ZStatsScope crScope("code_resources", strBaseFolder);
 	ZFile::CreateFolderV("%s/_CodeSignature", strBaseFolder.c_str());
 	string strCodeResFile = strBaseFolder + "/_CodeSignature/CodeResources";
 
@@ -421,9 +441,13 @@ bool ZBundle::SignNode(jvalue& jvNode)
 
 			string strFileSHA1;
 			string strFileSHA256;
-			if (!ZSHA::SHABase64File(strRealFile.c_str(), strFileSHA1, strFileSHA256)) {
-				ZLog::ErrorV(">>> Can't get changed file SHASum! %s", strFile.c_str());
-				return false;
+			if (!m_cache.GetFileHash(strFile, strRealFile, strFileSHA1, strFileSHA256)) {
+				ZFileStamp stamp;
+				if (!m_hashes.HashFile(strRealFile, strFileSHA1, strFileSHA256, &stamp)) {
+					ZLog::ErrorV(">>> Can't get changed file SHASum! %s", strFile.c_str());
+					return false;
+				}
+				m_cache.SetFileHash(strFile, stamp, strFileSHA1, strFileSHA256);
 			}
 
 			string strKey = strFile;
@@ -445,6 +469,7 @@ bool ZBundle::SignNode(jvalue& jvNode)
 		ZLog::ErrorV("\tWriting CodeResources failed! %s\n", strCodeResFile.c_str());
 		return false;
 	}
+	crScope.Stop();
 
 	if (m_pSignAssets) {
 		auto endsWith = [](const string& str, const string& suffix) {
@@ -480,10 +505,13 @@ bool ZBundle::SignNode(jvalue& jvNode)
 		}
 	}
 
-	if (!macho.Sign(m_pSignAsset, bForceSign, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResData)) {
+	// -f and -l sign everything; otherwise only the pages edited for -D are
+	// rehashed and the other code slots are still valid
+	if (!macho.Sign(m_pSignAsset, m_bForceSign, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResData)) {
 		return false;
 	}
 
+	ZStats::Add(ZStats::E_BUNDLES_SIGNED);
 	return true;
 }
 
@@ -532,7 +560,7 @@ bool ZBundle::ModifyPluginsBundleId(const string& strOldBundleId, const string&
 			}
 		}
 
-		jvInfo.style_write_plist_to_file("%s/Info.plist", strFolder.c_str());
+		ZFile::WriteFileV(jvInfo.style_write_plist(), "%s/Info.plist", strFolder.c_str());
 	}
 
 	return true;
@@ -641,10 +669,16 @@ bool ZBundle::ChangeAppIcon()
 		arrIconFiles.push_back(m_strAppFolder + "/" + arrIconNames[0] + "@2x.png");
 	}
 
+	// every copy has the same content, hash it once for CodeResources
+	string strIconSHA1;
+	string strIconSHA256;
+	ZSHA::SHABase64(strIconData, strIconSHA1, strIconSHA256);
+
 	int nReplaced = 0;
 	for (const string& strPath : arrIconFiles) {
 		if (ZFile::WriteFile(strPath.c_str(), strIconData)) {
 			nReplaced++;
+			m_hashes.AddFile(strPath, strIconSHA1, strIconSHA256);
 			ZLog::DebugV("\t\tIcon: %s\n", strPath.substr(m_strAppFolder.size() + 1).c_str());
 		} else {
 			ZLog::WarnV(">>> Warning: Can't write icon file! %s\n", strPath.c_str());
@@ -655,7 +689,7 @@ bool ZBundle::ChangeAppIcon()
 		return false;
 	}
 
-	if (!jvInfo.style_write_plist_to_file("%s/Info.plist", m_strAppFolder.c_str())) {
+	if (!ZFile::WriteFileV(jvInfo.style_write_plist(), "%s/Info.plist", m_strAppFolder.c_str())) {
 		ZLog::ErrorV(">>> Can't write app's Info.plist! %s\n", m_strAppFolder.c_str());
 		return false;
 	}
@@ -700,14 +734,14 @@ bool ZBundle::ModifyBundleInfo(const string& strBundleId, const string& strBundl
 		if (jvInfoStrings.read_plist_from_file("%s/zh_CN.lproj/InfoPlist.strings", m_strAppFolder.c_str())) {
 			jvInfoStrings["CFBundleName"] = strNewDisplayName;
 			jvInfoStrings["CFBundleDisplayName"] = strNewDisplayName;
-			jvInfoStrings.style_write_plist_to_file("%s/zh_CN.lproj/InfoPlist.strings", m_strAppFolder.c_str());
+			ZFile::WriteFileV(jvInfoStrings.style_write_plist(), "%s/zh_CN.lproj/InfoPlist.strings", m_strAppFolder.c_str());
 		}
 
 		jvInfoStrings.clear();
 		if (jvInfoStrings.read_plist_from_file("%s/zh-Hans.lproj/InfoPlist.strings", m_strAppFolder.c_str())) {
 			jvInfoStrings["CFBundleName"] = strNewDisplayName;
 			jvInfoStrings["CFBundleDisplayName"] = strNewDisplayName;
-			jvInfoStrings.style_write_plist_to_file("%s/zh-Hans.lproj/InfoPlist.strings", m_strAppFolder.c_str());
+			ZFile::WriteFileV(jvInfoStrings.style_write_plist(), "%s/zh-Hans.lproj/InfoPlist.strings", m_strAppFolder.c_str());
 		}
 
 #ifdef _WIN32
@@ -725,7 +759,7 @@ bool ZBundle::ModifyBundleInfo(const string& strBundleId, const string& strBundl
 		ZLog::PrintV(">>> BundleVersion: %s -> %s\n", strOldBundleVersion.c_str(), strBundleVersion.c_str());
 	}
 
-	jvInfo.style_write_plist_to_file("%s/Info.plist", m_strAppFolder.c_str());
+	ZFile::WriteFileV(jvInfo.style_write_plist(), "%s/Info.plist", m_strAppFolder.c_str());
 	return true;
 }
 
@@ -737,7 +771,7 @@ void ZBundle::ApplyAppModifications()
 		jvInfo.read_plist_from_file("%s/Info.plist", m_strAppFolder.c_str());
 		jvInfo["UISupportsDocumentBrowser"] = true;
 		jvInfo["UIFileSharingEnabled"] = true;
-		jvInfo.style_write_plist_to_file("%s/Info.plist", m_strAppFolder.c_str());
+		ZFile::WriteFileV(jvInfo.style_write_plist(), "%s/Info.plist", m_strAppFolder.c_str());
 		m_bForceSign = true;
 		ZLog::Print(">>> Enabled documents support\n");
 	}
@@ -747,7 +781,7 @@ void ZBundle::ApplyAppModifications()
 		jvInfo.read_plist_from_file("%s/Info.plist", m_strAppFolder.c_str());
 		string strOldVersion = jvInfo["MinimumOSVersion"];
 		jvInfo["MinimumOSVersion"] = m_strMinVersion;
-		jvInfo.style_write_plist_to_file("%s/Info.plist", m_strAppFolder.c_str());
+		ZFile::WriteFileV(jvInfo.style_write_plist(), "%s/Info.plist", m_strAppFolder.c_str());
 		m_bForceSign = true;
 		ZLog::PrintV(">>> MinimumOSVersion: %s -> %s\n", strOldVersion.c_str(), m_strMinVersion.c_str());
 	}
@@ -781,7 +815,7 @@ void ZBundle::ApplyAppModifications()
 		jvInfo.read_plist_from_file("%s/Info.plist", m_strAppFolder.c_str());
 		if (jvInfo.has("UISupportedDevices")) {
 			jvInfo.erase("UISupportedDevices");
-			jvInfo.style_write_plist_to_file("%s/Info.plist", m_strAppFolder.c_str());
+			ZFile::WriteFileV(jvInfo.style_write_plist(), "%s/Info.plist", m_strAppFolder.c_str());
 			m_bForceSign = true;
 			ZLog::Print(">>> Removed UISupportedDevices\n");
 		}
@@ -805,6 +839,7 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 	m_bWeakInject = bWeakInject;
 	m_bRemoveProvision = bRemoveProvision;
 	m_setRemoveDylibs.clear();
+	m_hashes.Clear();
 	for (const string& name : arrRemoveDylibNames) {
 		if (name.find('/') != string::npos) {
 			m_setRemoveDylibs.insert(name);
@@ -820,7 +855,9 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 		ZLog::ErrorV(">>> Can't find app folder! %s\n", strFolder.c_str());
 		return false;
 	}
+	ZStats::SetBaseFolder(m_strAppFolder);
 
+	ZStatsScope infoScope("info_plist");
 	ApplyAppModifications();
 
 	if (!m_strIconFile.empty()) {
@@ -836,6 +873,7 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 			return false;
 		}
 	}
+	infoScope.Stop();
 
 	ZFile::RemoveFileV("%s/embedded.mobileprovision", m_strAppFolder.c_str());
 	if (!pSignAsset->m_strProvData.empty()) {
@@ -846,6 +884,7 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 	}
 
 	if (!arrInjectDylibs.empty()) {
+		// the cached tree neither signs nor seals the new dylibs
 		m_bForceSign = true;
 		for (const string& strDylibFile : arrInjectDylibs) {
 			string strFileName = ZUtil::GetBaseName(strDylibFile.c_str());
@@ -856,9 +895,9 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 		}
 	}
 
-	string strCacheName;
-	ZSHA::SHA1Text(m_strAppFolder, strCacheName);
-	if (!ZFile::IsFileExistsV("./.zsign_cache/%s.json", strCacheName.c_str())) {
+	ZStatsScope scanScope("scan");
+	m_cache.Init(m_strCacheFolder, m_strAppFolder);
+	if (!m_bForceSign && !m_cache.Load()) {
 		m_bForceSign = true;
 	}
 
@@ -874,9 +913,11 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 			return false;
 		}
 		GetNodeChangedFiles(jvRoot);
-	} else {
-		jvRoot.read_from_file("./.zsign_cache/%s.json", strCacheName.c_str());
+	} else if (!m_cache.GetRoot(jvRoot)) {
+		ZLog::ErrorV(">>> Can't read signing cache! %s\n", m_strAppFolder.c_str());
+		return false;
 	}
+	scanScope.Stop();
 
 	string strAppName = jvRoot["name"];
 
@@ -893,11 +934,15 @@ bool ZBundle::SignFolder(ZSignAsset* pSignAsset,
 	ZLog::PrintV(">>> SubjectCN: \t%s\n", m_pSignAsset->m_strSubjectCN.c_str());
 	ZLog::PrintV(">>> ReadCache: \t%s\n", m_bForceSign ? "NO" : "YES");
 
-	if (SignNode(jvRoot)) {
+	bool bRet = SignNode(jvRoot);
+	ZStats::Add(ZStats::E_CACHE_HITS, m_cache.m_uHashHits);
+	ZStats::Add(ZStats::E_CACHE_MISSES, m_cache.m_uHashMisses);
+	ZStats::Add(ZStats::E_HASH_BYTES_SAVED, m_hashes.m_uBytesSaved);
+	if (bRet) {
 		if (bEnableCache) {
-			ZFile::CreateFolder("./.zsign_cache");
-			jvRoot.style_write_to_file("./.zsign_cache/%s.json", strCacheName.c_str());
+			m_cache.Save(jvRoot);
 		}
+		m_cache.Close();
 		return true;
 	}
 
@@ -2,6 +2,7 @@
 #include "common.h"
 #include "json.h"
 #include "openssl.h"
+#include "cache.h"
 #include <vector>
 #include <list>
 #include <set>
@@ -36,6 +37,8 @@ public:
 					bool bEnableCache,
 					bool bRemoveProvision = false);
 
+	bool GenerateCodeResources(const string& strFolder, jvalue& jvCodeRes);
+
 private:
 	bool SignNode(jvalue& jvNode);
 	void GetNodeChangedFiles(jvalue& jvNode);
@@ -48,9 +51,7 @@ private:
 	bool FindAppFolder(const string& strFolder, string& strAppFolder);
 	bool GetObjectsToSign(const string& strFolder, jvalue& jvInfo);
 	bool GetSignFolderInfo(const string& strFolder, jvalue& jvNode, bool bGetName = false);
-
-private:
-	bool GenerateCodeResources(const string& strFolder, jvalue& jvCodeRes);
+	bool GetSignFolderInfo(const string& strFolder, const string& strInfoPlistData, jvalue& jvNode, bool bGetName = false);
 
 private:
 	bool			m_bForceSign;
@@ -61,6 +62,8 @@ private:
 	vector<string>	m_arrInjectDylibs;
 	vector<string>	m_arrInjectDylibNames;
 	set<string>		m_setRemoveDylibs;
+	ZSignCache		m_cache;
+	ZHashMemo		m_hashes;
 
 private:
 	void ApplyAppModifications();
@@ -73,5 +76,6 @@ public:
 	bool		m_bRemoveWatchApp;
 	bool		m_bRemoveUISupportedDevices;
 	bool		m_bInjectExtensions;
+	string		m_strCacheFolder;
 	string			m_strAppFolder;
 };
@@ -0,0 +1,592 @@
+#include "cache.h"
+#include "base64.h"
+
+#define ZCACHE_MAGIC		0x48435a5a	// "ZZCH"
+#define ZCACHE_VERSION		2
+#define ZCACHE_SUFFIX		".zcache"
+#define ZCACHE_FILE_HASHED	0x1
+
+// On-disk layout, little endian, packed. All offsets are from the start of
+// the file, strings live in one table and are referenced by offset/length.
+//
+//	header | nodes | files | file index | children | strings
+//
+// Node 0 is the app root. Nodes are stored in pre-order, so every child
+// index is greater than its parent's. The file index is sorted by path.
+#pragma pack(push, 1)
+struct zcache_str
+{
+	uint32_t	off;
+	uint32_t	len;
+};
+
+struct zcache_header
+{
+	uint32_t	magic;
+	uint32_t	version;
+	uint64_t	file_size;
+	uint64_t	update_time;
+	zcache_str	app_folder;
+	uint32_t	node_count;
+	uint32_t	node_offset;
+	uint32_t	file_count;
+	uint32_t	file_offset;
+	uint32_t	file_index_count;
+	uint32_t	file_index_offset;
+	uint32_t	child_count;
+	uint32_t	child_offset;
+	uint32_t	string_offset;
+	uint32_t	string_size;
+	uint32_t	hash_hits;
+	uint32_t	hash_misses;
+};
+
+struct zcache_index
+{
+	zcache_str	path;
+	uint32_t	item;
+};
+
+struct zcache_node
+{
+	zcache_str	path;
+	zcache_str	bundle_id;
+	zcache_str	bundle_version;
+	zcache_str	bundle_executable;
+	zcache_str	sha1;
+	zcache_str	sha256;
+	zcache_str	name;
+	uint32_t	child_first;
+	uint32_t	child_count;
+	uint32_t	macho_first;
+	uint32_t	macho_count;
+	uint32_t	changed_first;
+	uint32_t	changed_count;
+};
+
+struct zcache_file
+{
+	zcache_str	path;
+	uint32_t	flags;
+	uint64_t	size;
+	uint64_t	mtime;
+	uint64_t	device;
+	uint64_t	inode;
+	uint8_t		sha1[20];
+	uint8_t		sha256[32];
+};
+#pragma pack(pop)
+
+ZSignCache::ZSignCache()
+{
+	m_pBase = NULL;
+	m_sSize = 0;
+	m_uHashHits = 0;
+	m_uHashMisses = 0;
+}
+
+ZSignCache::~ZSignCache()
+{
+	Close();
+}
+
+void ZSignCache::Init(const string& strCacheFolder, const string& strAppFolder)
+{
+	Close();
+	m_strCacheFolder = strCacheFolder;
+	m_strAppFolder = strAppFolder;
+
+	string strCacheName;
+	ZSHA::SHA1Text(m_strAppFolder, strCacheName);
+	m_strCacheFile = m_strCacheFolder + "/" + strCacheName + ZCACHE_SUFFIX;
+	m_mapHashes.clear();
+	m_uHashHits = 0;
+	m_uHashMisses = 0;
+}
+
+bool ZSignCache::Validate(const uint8_t* pBase, size_t sSize)
+{
+	if (NULL == pBase || sSize < sizeof(zcache_header)) {
+		return false;
+	}
+
+	const zcache_header* pHeader = (const zcache_header*)pBase;
+	if (ZCACHE_MAGIC != pHeader->magic || ZCACHE_VERSION != pHeader->version || sSize != pHeader->file_size) {
+		return false;
+	}
+
+	auto inside = [&](uint64_t off, uint64_t count, uint64_t size) {
+		return (off <= sSize && count * size <= sSize - off);
+	};
+	if (!inside(pHeader->node_offset, pHeader->node_count, sizeof(zcache_node)) ||
+		!inside(pHeader->file_offset, pHeader->file_count, sizeof(zcache_file)) ||
+		!inside(pHeader->file_index_offset, pHeader->file_index_count, sizeof(zcache_index)) ||
+		!inside(pHeader->child_offset, pHeader->child_count, sizeof(uint32_t)) ||
+		!inside(pHeader->string_offset, pHeader->string_size, 1) ||
+		0 == pHeader->node_count) {
+		return false;
+	}
+
+	// string refs are checked on access, table refs are checked here once
+	const zcache_node* pNodes = (const zcache_node*)(pBase + pHeader->node_offset);
+	const uint32_t* pChildren = (const uint32_t*)(pBase + pHeader->child_offset);
+	for (uint32_t i = 0; i < pHeader->node_count; i++) {
+		const zcache_node& node = pNodes[i];
+		if ((uint64_t)node.child_first + node.child_count > pHeader->child_count ||
+			(uint64_t)node.macho_first + node.macho_count > pHeader->file_count ||
+			(uint64_t)node.changed_first + node.changed_count > pHeader->file_count) {
+			return false;
+		}
+		for (uint32_t j = 0; j < node.child_count; j++) {
+			uint32_t uChild = pChildren[node.child_first + j];
+			if (uChild <= i || uChild >= pHeader->node_count) {
+				return false;
+			}
+		}
+	}
+
+	const zcache_index* pFileIndex = (const zcache_index*)(pBase + pHeader->file_index_offset);
+	for (uint32_t i = 0; i < pHeader->file_index_count; i++) {
+		if (pFileIndex[i].item >= pHeader->file_count) {
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ZSignCache::Load()
+{
+	Close();
+	if (!ZFile::IsFileExists(m_strCacheFile.c_str())) {
+		return false;
+	}
+
+	m_pBase = (uint8_t*)ZFile::MapFile(m_strCacheFile.c_str(), 0, 0, &m_sSize, true);
+	if (!Validate(m_pBase, m_sSize)) {
+		ZLog::WarnV(">>> Ignoring invalid or outdated cache file! %s\n", m_strCacheFile.c_str());
+		Close();
+		return false;
+	}
+
+	const zcache_header* pHeader = (const zcache_header*)m_pBase;
+	if (GetString(&pHeader->app_folder) != m_strAppFolder) {
+		Close();
+		return false;
+	}
+	return true;
+}
+
+void ZSignCache::Close()
+{
+	if (NULL != m_pBase) {
+		ZFile::UnmapFile(m_pBase, m_sSize);
+	}
+	m_pBase = NULL;
+	m_sSize = 0;
+}
+
+string ZSignCache::GetString(const void* pStr)
+{
+	const zcache_header* pHeader = (const zcache_header*)m_pBase;
+	const zcache_str* str = (const zcache_str*)pStr;
+	if (NULL == m_pBase || str->off > pHeader->string_size || str->len > pHeader->string_size - str->off) {
+		return string();
+	}
+	return string((const char*)m_pBase + pHeader->string_offset + str->off, str->len);
+}
+
+bool ZSignCache::GetNode(uint32_t uIndex, jvalue& jvNode)
+{
+	const zcache_header* pHeader = (const zcache_header*)m_pBase;
+	const zcache_node& node = ((const zcache_node*)(m_pBase + pHeader->node_offset))[uIndex];
+	const zcache_file* pFiles = (const zcache_file*)(m_pBase + pHeader->file_offset);
+	const uint32_t* pChildren = (const uint32_t*)(m_pBase + pHeader->child_offset);
+
+	jvNode["path"] = GetString(&node.path);
+	jvNode["bundle_id"] = GetString(&node.bundle_id);
+	jvNode["bundle_version"] = GetString(&node.bundle_version);
+	jvNode["bundle_executable"] = GetString(&node.bundle_executable);
+	jvNode["sha1"] = GetString(&node.sha1);
+	jvNode["sha256"] = GetString(&node.sha256);
+	if (node.name.len > 0) {
+		jvNode["name"] = GetString(&node.name);
+	}
+
+	for (uint32_t i = 0; i < node.macho_count; i++) {
+		jvNode["files"].push_back(GetString(&pFiles[node.macho_first + i].path));
+	}
+
+	for (uint32_t i = 0; i < node.child_count; i++) {
+		jvalue jvSubNode;
+		if (!GetNode(pChildren[node.child_first + i], jvSubNode)) {
+			return false;
+		}
+		jvNode["folders"].push_back(jvSubNode);
+	}
+
+	for (uint32_t i = 0; i < node.changed_count; i++) {
+		jvNode["changed"].push_back(GetString(&pFiles[node.changed_first + i].path));
+	}
+	return true;
+}
+
+bool ZSignCache::GetRoot(jvalue& jvRoot)
+{
+	jvRoot.clear();
+	if (NULL == m_pBase) {
+		return false;
+	}
+
+	if (!GetNode(0, jvRoot)) {
+		return false;
+	}
+	jvRoot["root"] = m_strAppFolder;
+	return true;
+}
+
+bool ZSignCache::GetFileHash(const string& strFile, const string& strRealFile, string& strSHA1Base64, string& strSHA256Base64)
+{
+	if (NULL == m_pBase) {
+		return false;
+	}
+
+	const zcache_header* pHeader = (const zcache_header*)m_pBase;
+	const zcache_index* pIndex = (const zcache_index*)(m_pBase + pHeader->file_index_offset);
+	const zcache_file* pFiles = (const zcache_file*)(m_pBase + pHeader->file_offset);
+
+	const zcache_file* pFile = NULL;
+	uint32_t uLow = 0;
+	uint32_t uHigh = pHeader->file_index_count;
+	while (uLow < uHigh && NULL == pFile) {
+		uint32_t uMid = uLow + (uHigh - uLow) / 2;
+		int nCmp = GetString(&pIndex[uMid].path).compare(strFile);
+		if (nCmp < 0) {
+			uLow = uMid + 1;
+		} else if (nCmp > 0) {
+			uHigh = uMid;
+		} else {
+			pFile = &pFiles[pIndex[uMid].item];
+		}
+	}
+
+	FileHash hash;
+	if (NULL == pFile || !(pFile->flags & ZCACHE_FILE_HASHED) ||
+		!ZFile::GetFileStamp(strRealFile.c_str(), hash.uSize, hash.uMTime, hash.uDevice, hash.uInode) ||
+		pFile->size != hash.uSize || pFile->mtime != hash.uMTime ||
+		pFile->device != hash.uDevice || pFile->inode != hash.uInode) {
+		m_uHashMisses++;
+		return false;
+	}
+
+	jbase64 b64;
+	hash.strSHA1.assign((const char*)pFile->sha1, sizeof(pFile->sha1));
+	hash.strSHA256.assign((const char*)pFile->sha256, sizeof(pFile->sha256));
+	strSHA1Base64 = b64.encode(hash.strSHA1);
+	strSHA256Base64 = b64.encode(hash.strSHA256);
+	m_mapHashes[strFile] = hash;
+	m_uHashHits++;
+	return true;
+}
+
+void ZSignCache::SetFileHash(const string& strFile, const ZFileStamp& stamp, const string& strSHA1Base64, const string& strSHA256Base64)
+{
+	// without an inode (Windows) the stamp is just size and a whole-second
+	// mtime, which misses a same-size rewrite within that second
+	if (0 == stamp.uDevice && 0 == stamp.uInode) {
+		return;
+	}
+
+	jbase64 b64;
+	FileHash hash;
+	hash.uSize = stamp.uSize;
+	hash.uMTime = stamp.uMTime;
+	hash.uDevice = stamp.uDevice;
+	hash.uInode = stamp.uInode;
+	b64.decode(strSHA1Base64.c_str(), hash.strSHA1);
+	b64.decode(strSHA256Base64.c_str(), hash.strSHA256);
+	if (20 == hash.strSHA1.size() && 32 == hash.strSHA256.size()) {
+		m_mapHashes[strFile] = hash;
+	}
+}
+
+bool ZSignCache::Save(const jvalue& jvRoot)
+{
+	vector<zcache_node> arrNodes;
+	vector<zcache_file> arrFiles;
+	vector<uint32_t> arrChildren;
+	string strStrings;
+	map<string, uint32_t> mapStrings;
+
+	auto addString = [&](const string& str) {
+		zcache_str ref = { 0, (uint32_t)str.size() };
+		auto it = mapStrings.find(str);
+		if (it != mapStrings.end()) {
+			ref.off = it->second;
+		} else {
+			ref.off = (uint32_t)strStrings.size();
+			mapStrings[str] = ref.off;
+			strStrings += str;
+		}
+		return ref;
+	};
+
+	auto addFile = [&](const string& strPath) {
+		zcache_file file;
+		memset(&file, 0, sizeof(file));
+		file.path = addString(strPath);
+		auto it = m_mapHashes.find(strPath);
+		if (it != m_mapHashes.end()) {
+			file.flags = ZCACHE_FILE_HASHED;
+			file.size = it->second.uSize;
+			file.mtime = it->second.uMTime;
+			file.device = it->second.uDevice;
+			file.inode = it->second.uInode;
+			memcpy(file.sha1, it->second.strSHA1.data(), sizeof(file.sha1));
+			memcpy(file.sha256, it->second.strSHA256.data(), sizeof(file.sha256));
+		}
+		arrFiles.push_back(file);
+	};
+
+	// pre-order, so children always get a larger index than their parent
+	function<uint32_t(const jvalue&)> addNode = [&](const jvalue& jvNode) {
+		uint32_t uIndex = (uint32_t)arrNodes.size();
+		arrNodes.push_back(zcache_node());
+		zcache_node node;
+		memset(&node, 0, sizeof(node));
+		node.path = addString(jvNode["path"].as_string());
+		node.bundle_id = addString(jvNode["bundle_id"].as_string());
+		node.bundle_version = addString(jvNode["bundle_version"].as_string());
+		node.bundle_executable = addString(jvNode["bundle_executable"].as_string());
+		node.sha1 = addString(jvNode["sha1"].as_string());
+		node.sha256 = addString(jvNode["sha256"].as_string());
+		node.name = addString(jvNode["name"].as_string());
+
+		node.macho_first = (uint32_t)arrFiles.size();
+		node.macho_count = (uint32_t)jvNode["files"].size();
+		for (size_t i = 0; i < jvNode["files"].size(); i++) {
+			addFile(jvNode["files"][i].as_string());
+		}
+
+		node.changed_first = (uint32_t)arrFiles.size();
+		node.changed_count = (uint32_t)jvNode["changed"].size();
+		for (size_t i = 0; i < jvNode["changed"].size(); i++) {
+			addFile(jvNode["changed"][i].as_string());
+		}
+
+		vector<uint32_t> arrSubNodes;
+		for (size_t i = 0; i < jvNode["folders"].size(); i++) {
+			arrSubNodes.push_back(addNode(jvNode["folders"][i]));
+		}
+		node.child_first = (uint32_t)arrChildren.size();
+		node.child_count = (uint32_t)arrSubNodes.size();
+		arrChildren.insert(arrChildren.end(), arrSubNodes.begin(), arrSubNodes.end());
+
+		arrNodes[uIndex] = node;
+		return uIndex;
+	};
+
+	zcache_header header;
+	memset(&header, 0, sizeof(header));
+	header.app_folder = addString(m_strAppFolder);
+	addNode(jvRoot);
+
+	auto sortIndex = [&](vector<zcache_index>& arrIndex) {
+		sort(arrIndex.begin(), arrIndex.end(), [&](const zcache_index& a, const zcache_index& b) {
+			return strStrings.compare(a.path.off, a.path.len, strStrings, b.path.off, b.path.len) < 0;
+		});
+	};
+
+	// the same path can be listed by several bundles, index each hashed one once
+	vector<zcache_index> arrFileIndex;
+	set<uint32_t> setIndexed;
+	for (uint32_t i = 0; i < arrFiles.size(); i++) {
+		if ((arrFiles[i].flags & ZCACHE_FILE_HASHED) && setIndexed.insert(arrFiles[i].path.off).second) {
+			zcache_index index = { arrFiles[i].path, i };
+			arrFileIndex.push_back(index);
+		}
+	}
+	sortIndex(arrFileIndex);
+
+	string strData;
+	auto append = [&](const void* pData, size_t sLen) {
+		uint32_t uOffset = (uint32_t)strData.size();
+		strData.append((const char*)pData, sLen);
+		return uOffset;
+	};
+
+	strData.resize(sizeof(zcache_header));
+	header.magic = ZCACHE_MAGIC;
+	header.version = ZCACHE_VERSION;
+	header.update_time = (uint64_t)ZUtil::GetUnixStamp();
+	header.node_count = (uint32_t)arrNodes.size();
+	header.node_offset = append(arrNodes.data(), arrNodes.size() * sizeof(zcache_node));
+	header.file_count = (uint32_t)arrFiles.size();
+	header.file_offset = append(arrFiles.data(), arrFiles.size() * sizeof(zcache_file));
+	header.file_index_count = (uint32_t)arrFileIndex.size();
+	header.file_index_offset = append(arrFileIndex.data(), arrFileIndex.size() * sizeof(zcache_index));
+	header.child_count = (uint32_t)arrChildren.size();
+	header.child_offset = append(arrChildren.data(), arrChildren.size() * sizeof(uint32_t));
+	header.string_size = (uint32_t)strStrings.size();
+	header.string_offset = append(strStrings.data(), strStrings.size());
+	header.hash_hits = m_uHashHits;
+	header.hash_misses = m_uHashMisses;
+	header.file_size = strData.size();
+	memcpy(&strData[0], &header, sizeof(header));
+
+	Close();
+	if (!ZFile::CreateFolder(m_strCacheFolder.c_str())) {
+		return ZLog::ErrorV(">>> Can't create cache folder! %s\n", m_strCacheFolder.c_str());
+	}
+
+	string strTempFile;
+	ZUtil::StringFormatV(strTempFile, "%s.%llu.tmp", m_strCacheFile.c_str(), ZUtil::GetMicroSecond());
+	if (!ZFile::WriteFile(strTempFile.c_str(), strData) || !ZFile::RenameFile(strTempFile.c_str(), m_strCacheFile.c_str())) {
+		ZFile::RemoveFile(strTempFile.c_str());
+		return ZLog::ErrorV(">>> Can't write cache file! %s\n", m_strCacheFile.c_str());
+	}
+
+	// drop the json cache written by older versions
+	string strLegacyFile = m_strCacheFile.substr(0, m_strCacheFile.size() - strlen(ZCACHE_SUFFIX)) + ".json";
+	ZFile::RemoveFile(strLegacyFile.c_str());
+	return true;
+}
+
+bool ZSignCache::PrintStats(const string& strCacheFolder)
+{
+	if (!ZFile::IsFolder(strCacheFolder.c_str())) {
+		ZLog::PrintV(">>> Cache:\t%s (empty)\n", strCacheFolder.c_str());
+		return true;
+	}
+
+	vector<string> arrCacheFiles;
+	ZFile::EnumFolder(strCacheFolder.c_str(), false, NULL, [&](bool bFolder, const string& strPath) {
+		if (!bFolder && ZFile::IsPathSuffix(strPath, ZCACHE_SUFFIX)) {
+			arrCacheFiles.push_back(strPath);
+		}
+		return false;
+	});
+
+	uint64_t uTotalSize = 0;
+	uint32_t uTotalFiles = 0;
+	uint32_t uInvalid = 0;
+	ZLog::PrintV(">>> Cache:\t%s\n", strCacheFolder.c_str());
+	for (const string& strCacheFile : arrCacheFiles) {
+		ZSignCache cache;
+		cache.m_pBase = (uint8_t*)ZFile::MapFile(strCacheFile.c_str(), 0, 0, &cache.m_sSize, true);
+		uTotalSize += cache.m_sSize;
+		if (!Validate(cache.m_pBase, cache.m_sSize)) {
+			uInvalid++;
+			ZLog::WarnV(">>> Invalid:\t%s\n", ZUtil::GetBaseName(strCacheFile.c_str()));
+			continue;
+		}
+
+		const zcache_header* pHeader = (const zcache_header*)cache.m_pBase;
+		time_t tUpdate = (time_t)pHeader->update_time;
+		char szUpdate[64] = { 0 };
+		strftime(szUpdate, sizeof(szUpdate), "%Y-%m-%d %H:%M:%S", localtime(&tUpdate));
+		uTotalFiles++;
+
+		ZLog::PrintV(">>> App:\t%s\n", cache.GetString(&pHeader->app_folder).c_str());
+		ZLog::PrintV("\tFile:\t\t%s (%s)\n", ZUtil::GetBaseName(strCacheFile.c_str()), ZUtil::FormatSize(cache.m_sSize).c_str());
+		ZLog::PrintV("\tUpdated:\t%s\n", szUpdate);
+		ZLog::PrintV("\tBundles:\t%u\n", pHeader->node_count);
+		ZLog::PrintV("\tFiles:\t\t%u (%u hashed)\n", pHeader->file_count, pHeader->file_index_count);
+		ZLog::PrintV("\tLast run:\t%u hash hits, %u misses\n", pHeader->hash_hits, pHeader->hash_misses);
+	}
+	ZLog::PrintV(">>> Total:\t%u caches, %u invalid, %s\n", uTotalFiles, uInvalid, ZUtil::FormatSize(uTotalSize).c_str());
+	return true;
+}
+
+// cloned extents are only worth an extra ioctl for files of some size
+#define HASH_MEMO_EXTENT_MIN	(64 * 1024)
+
+ZHashMemo::ZHashMemo()
+{
+	m_uBytesSaved = 0;
+}
+
+void ZHashMemo::Clear()
+{
+	m_uBytesSaved = 0;
+	m_mapInodes.clear();
+	m_mapExtents.clear();
+}
+
+bool ZHashMemo::HashFile(const string& strFile, string& strSHA1Base64, string& strSHA256Base64, ZFileStamp* pStamp)
+{
+	ZFileStamp stamp = { 0, 0, 0, 0 };
+	if (NULL != pStamp) {
+		*pStamp = stamp;
+	}
+
+	Digest digest;
+	uint64_t uDevice = 0;
+	uint64_t uInode = 0;
+	if (!ZFile::GetFileStamp(strFile.c_str(), digest.uSize, digest.uMTime, uDevice, uInode)) {
+		return ZSHA::SHABase64File(strFile.c_str(), strSHA1Base64, strSHA256Base64);
+	}
+	if (NULL != pStamp) {
+		stamp.uSize = digest.uSize;
+		stamp.uMTime = digest.uMTime;
+		stamp.uDevice = uDevice;
+		stamp.uInode = uInode;
+		*pStamp = stamp;
+	}
+
+	pair<uint64_t, uint64_t> inode(uDevice, uInode);
+	bool bInode = (0 != uDevice || 0 != uInode);
+	if (bInode) {
+		auto it = m_mapInodes.find(inode);
+		if (it != m_mapInodes.end() && it->second.uSize == digest.uSize && it->second.uMTime == digest.uMTime) {
+			strSHA1Base64 = it->second.strSHA1;
+			strSHA256Base64 = it->second.strSHA256;
+			m_uBytesSaved += digest.uSize;
+			return true;
+		}
+	}
+
+	string strExtents;
+	if (digest.uSize >= HASH_MEMO_EXTENT_MIN && ZFile::GetSharedExtents(strFile.c_str(), digest.uSize, uDevice, strExtents)) {
+		auto it = m_mapExtents.find(strExtents);
+		if (it != m_mapExtents.end()) {
+			strSHA1Base64 = it->second.strSHA1;
+			strSHA256Base64 = it->second.strSHA256;
+			m_uBytesSaved += digest.uSize;
+			if (bInode) {
+				digest.strSHA1 = strSHA1Base64;
+				digest.strSHA256 = strSHA256Base64;
+				m_mapInodes[inode] = digest;
+			}
+			return true;
+		}
+	}
+
+	if (!ZSHA::SHABase64File(strFile.c_str(), strSHA1Base64, strSHA256Base64)) {
+		return false;
+	}
+
+	digest.strSHA1 = strSHA1Base64;
+	digest.strSHA256 = strSHA256Base64;
+	if (bInode) {
+		m_mapInodes[inode] = digest;
+	}
+	if (!strExtents.empty()) {
+		m_mapExtents[strExtents] = digest;
+	}
+	return true;
+}
+
+// Records the digest of a file just written from a buffer that was hashed
+// once for all of its copies.
+void ZHashMemo::AddFile(const string& strFile, const string& strSHA1Base64, const string& strSHA256Base64)
+{
+	Digest digest;
+	uint64_t uDevice = 0;
+	uint64_t uInode = 0;
+	if (!ZFile::GetFileStamp(strFile.c_str(), digest.uSize, digest.uMTime, uDevice, uInode) || (0 == uDevice && 0 == uInode)) {
+		return;
+	}
+	digest.strSHA1 = strSHA1Base64;
+	digest.strSHA256 = strSHA256Base64;
+	m_mapInodes[make_pair(uDevice, uInode)] = digest;
+}
@@ -0,0 +1,102 @@
+#pragma once
+#include "common.h"
+#include "json.h"
+
+// What ZFile::GetFileStamp() reports about a file; device and inode are 0
+// where there are none (Windows).
+struct ZFileStamp
+{
+	uint64_t	uSize;
+	uint64_t	uMTime;
+	uint64_t	uDevice;
+	uint64_t	uInode;
+};
+
+// Binary signing cache, one file per app folder: <folder>/<sha1(app path)>.zcache
+//
+// The file is mapped read-only and used in place. It holds the signing
+// tree (bundles, Mach-O files and changed files per bundle) plus a
+// fingerprint (size, mtime, device, inode) and SHA-1/SHA-256 of every
+// hashed file, so unchanged files are not hashed again on the next run.
+// File hashes are not kept where files have no inode number (Windows).
+// Updates are written to a temporary file and renamed over the old one.
+class ZSignCache
+{
+public:
+	ZSignCache();
+	~ZSignCache();
+
+public:
+	void Init(const string& strCacheFolder, const string& strAppFolder);
+	bool Load();
+	void Close();
+	bool GetRoot(jvalue& jvRoot);
+	bool GetFileHash(const string& strFile, const string& strRealFile, string& strSHA1Base64, string& strSHA256Base64);
+	// stamp must be taken before the file was hashed, so a rewrite while
+	// it was read leaves a stamp that no longer matches
+	void SetFileHash(const string& strFile, const ZFileStamp& stamp, const string& strSHA1Base64, const string& strSHA256Base64);
+	bool Save(const jvalue& jvRoot);
+
+	static bool PrintStats(const string& strCacheFolder);
+
+public:
+	uint32_t	m_uHashHits;
+	uint32_t	m_uHashMisses;
+
+private:
+	struct FileHash
+	{
+		uint64_t	uSize;
+		uint64_t	uMTime;
+		uint64_t	uDevice;
+		uint64_t	uInode;
+		string		strSHA1;
+		string		strSHA256;
+	};
+
+	static bool Validate(const uint8_t* pBase, size_t sSize);
+	string GetString(const void* pStr);
+	bool GetNode(uint32_t uIndex, jvalue& jvNode);
+
+private:
+	string			m_strCacheFolder;
+	string			m_strAppFolder;
+	string			m_strCacheFile;
+	uint8_t*		m_pBase;
+	size_t			m_sSize;
+	map<string, FileHash> m_mapHashes;
+};
+
+// Per-run digests of file content, so content reachable through several
+// paths is hashed once: the same (device, inode), which every file of a
+// nested bundle is again when its parent's CodeResources is built, files
+// zsign wrote itself from a buffer it already hashed, and on Linux files
+// cloned from one another whose shared extents are identical. A digest is
+// reused only while the file's size and mtime are unchanged.
+class ZHashMemo
+{
+public:
+	ZHashMemo();
+
+public:
+	void Clear();
+	// pStamp receives the stamp the digest belongs to, all 0 if unknown
+	bool HashFile(const string& strFile, string& strSHA1Base64, string& strSHA256Base64, ZFileStamp* pStamp = NULL);
+	void AddFile(const string& strFile, const string& strSHA1Base64, const string& strSHA256Base64);
+
+public:
+	uint64_t	m_uBytesSaved;
+
+private:
+	struct Digest
+	{
+		uint64_t	uSize;
+		uint64_t	uMTime;
+		string		strSHA1;
+		string		strSHA256;
+	};
+
+private:
+	map<pair<uint64_t, uint64_t>, Digest> m_mapInodes;
+	map<string, Digest> m_mapExtents;
+};
@@ -4,17 +4,7 @@
 #include "mach-o.h"
 #include "signing.h"
 #include "macho.h"
-
-#if defined(ZSIGN_SYSTEM_MINIZIP_NG)
-#include <zip.h>
-#include <unzip.h>
-#elif defined(ZSIGN_SYSTEM_MINIZIP)
-#include <minizip/zip.h>
-#include <minizip/unzip.h>
-#else
-#include "third-party/minizip/zip.h"
-#include "third-party/minizip/unzip.h"
-#endif
+#include "archive.h"
 
 #include <openssl/pem.h>
 #include <openssl/pkcs12.h>
@@ -33,6 +23,7 @@ typedef int ssize_t;
 #define OCSP_CLOSE_SOCKET(s) closesocket(s)
 #else
 #include <sys/socket.h>
+#include <poll.h>
 #include <netdb.h>
 #include <unistd.h>
 #define OCSP_CLOSE_SOCKET(s) close(s)
@@ -351,65 +342,23 @@ static MachOSignInfo ExtractFromMachOData(uint8_t* pBase, uint32_t uLength)
 
 // --- Read from zip (no extraction) ----------------------------------
 
-static bool ReadFileFromZipToMemory(unzFile uf, string& outData)
-{
-	if (UNZ_OK != unzOpenCurrentFile(uf)) return false;
-	outData.clear();
-	char buf[65536];
-	int nRead;
-	while ((nRead = unzReadCurrentFile(uf, buf, sizeof(buf))) > 0)
-		outData.append(buf, nRead);
-	unzCloseCurrentFile(uf);
-	return (nRead >= 0);
-}
-
 static MachOSignInfo LoadFromIPA(const string& ipaPath)
 {
 	MachOSignInfo info = { false, NULL };
-	unzFile uf = unzOpen64(ipaPath.c_str());
-	if (!uf) return info;
-
-	unz_global_info64 gi;
-	if (UNZ_OK != unzGetGlobalInfo64(uf, &gi)) { unzClose(uf); return info; }
+	ZipIndex zip;
+	if (!zip.Open(ipaPath)) return info;
 
 	string strAppFolder, strInfoPlistData, strExecName;
-	char szPath[PATH_MAX];
-
-	for (uint64_t i = 0; i < gi.number_entry; i++) {
-		unz_file_info64 fi;
-		if (UNZ_OK != unzGetCurrentFileInfo64(uf, &fi, szPath, PATH_MAX, NULL, 0, NULL, 0)) break;
-		string path = szPath;
-		if (path.find("Payload/") == 0 && path.find(".app/Info.plist") != string::npos) {
-			size_t s1 = path.find('/'), s2 = path.find('/', s1 + 1), s3 = path.find('/', s2 + 1);
-			if (s3 == string::npos) {
-				strAppFolder = path.substr(0, s2 + 1);
-				ReadFileFromZipToMemory(uf, strInfoPlistData);
-				break;
-			}
-		}
-		if (i < gi.number_entry - 1 && UNZ_OK != unzGoToNextFile(uf)) break;
-	}
-
-	if (strInfoPlistData.empty()) { unzClose(uf); return info; }
+	if (!zip.FindAppFolder(strAppFolder)) return info;
+	if (!zip.ReadFile(strAppFolder + "Info.plist", strInfoPlistData)) return info;
 
 	jvalue jvInfo;
 	if (jvInfo.read_plist(strInfoPlistData))
 		strExecName = jvInfo["CFBundleExecutable"].as_cstr();
-	if (strExecName.empty()) { unzClose(uf); return info; }
-
-	string strExecPath = strAppFolder + strExecName;
+	if (strExecName.empty()) return info;
 
 	string strBinaryData;
-	if (UNZ_OK != unzGoToFirstFile(uf)) { unzClose(uf); return info; }
-	for (uint64_t i = 0; i < gi.number_entry; i++) {
-		unz_file_info64 fi;
-		if (UNZ_OK != unzGetCurrentFileInfo64(uf, &fi, szPath, PATH_MAX, NULL, 0, NULL, 0)) break;
-		if (string(szPath) == strExecPath) { ReadFileFromZipToMemory(uf, strBinaryData); break; }
-		if (i < gi.number_entry - 1 && UNZ_OK != unzGoToNextFile(uf)) break;
-	}
-	unzClose(uf);
-
-	if (strBinaryData.empty()) return info;
+	if (!zip.ReadFile(strAppFolder + strExecName, strBinaryData) || strBinaryData.empty()) return info;
 	return ExtractFromMachOData((uint8_t*)strBinaryData.data(), (uint32_t)strBinaryData.size());
 }
 
@@ -419,8 +368,21 @@ struct OCSPResult {
 	string status;
 	string revokedTime;
 	string errorDetail;
+	string host;
+	bool cached;
 };
 
+static string s_strOCSPCacheFolder;
+static uint32_t s_uOCSPMaxAge = 86400;
+static uint32_t s_uOCSPTimeout = 10;
+
+void SetOCSPOptions(const string& strCacheFolder, uint32_t uMaxAge, uint32_t uTimeout)
+{
+	s_strOCSPCacheFolder = strCacheFolder.empty() ? "" : strCacheFolder + "/ocsp";
+	s_uOCSPMaxAge = uMaxAge;
+	s_uOCSPTimeout = uTimeout;
+}
+
 static bool ExtractOCSPUrl(X509* cert, string& host, string& port, string& path)
 {
 	AUTHORITY_INFO_ACCESS* aia = (AUTHORITY_INFO_ACCESS*)X509_get_ext_d2i(cert, NID_info_access, NULL, NULL);
@@ -455,139 +417,380 @@ static bool ExtractOCSPUrl(X509* cert, string& host, string& port, string& path)
 	return false;
 }
 
-static OCSPResult PerformOCSP(X509* cert, X509* issuer)
+// The response must be signed by the issuer itself or by a responder
+// certificate the issuer delegated OCSP signing to.
+static bool VerifyOCSPSignature(OCSP_BASICRESP* basic, X509* issuer)
 {
-	OCSPResult result;
-	result.status = "Error";
-	if (!cert || !issuer) { result.errorDetail = "Missing certificate or issuer"; return result; }
+	X509_STORE* store = X509_STORE_new();
+	STACK_OF(X509)* certs = sk_X509_new_null();
+	bool ok = false;
+	if (store && certs && X509_STORE_add_cert(store, issuer) == 1 && sk_X509_push(certs, issuer) > 0) {
+		// the issuer is an intermediate, trust it without its own chain
+		X509_STORE_set_flags(store, X509_V_FLAG_PARTIAL_CHAIN);
+		ok = (OCSP_basic_verify(basic, certs, store, 0) == 1);
+	}
+	sk_X509_free(certs);
+	X509_STORE_free(store);
+	ERR_clear_error();
+	return ok;
+}
 
-	string ocspHost, ocspPort, ocspPath;
-	if (!ExtractOCSPUrl(cert, ocspHost, ocspPort, ocspPath)) {
-		ocspHost = "ocsp.apple.com";
-		ocspPort = "80";
-		ocspPath = "/ocsp03-wwdr01";
-		string issuerCN = GetNameField(X509_get_subject_name(issuer), NID_commonName);
-		if (issuerCN.find("G6") != string::npos) ocspPath = "/ocsp03-wwdrg6";
-		else if (issuerCN.find("G3") != string::npos) ocspPath = "/ocsp03-wwdrg3";
-		else if (issuerCN.find("G2") != string::npos) ocspPath = "/ocsp03-wwdrg2";
+// Fills result from a DER OCSP response; false if it says nothing about the
+// cert or isn't signed for its issuer. With maxAge >= 0 the response must
+// also be current: not past its nextUpdate and issued at most maxAge
+// seconds ago.
+static bool ParseOCSPResponse(const string& data, X509* cert, X509* issuer, long maxAge, OCSPResult& result)
+{
+	const unsigned char* p = (const unsigned char*)data.data();
+	OCSP_RESPONSE* oresp = d2i_OCSP_RESPONSE(NULL, &p, (long)data.size());
+	if (!oresp) { result.errorDetail = "Parse failed"; return false; }
+	if (OCSP_response_status(oresp) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
+		OCSP_RESPONSE_free(oresp); result.errorDetail = "OCSP error"; return false;
 	}
 
-	OCSP_CERTID* certId = OCSP_cert_to_id(EVP_sha1(), cert, issuer);
-	if (!certId) { result.errorDetail = "Failed to create cert ID"; return result; }
-	OCSP_REQUEST* req = OCSP_REQUEST_new();
-	if (!req) { OCSP_CERTID_free(certId); result.errorDetail = "Request failed"; return result; }
-	if (!OCSP_request_add0_id(req, certId)) { OCSP_REQUEST_free(req); result.errorDetail = "Add ID failed"; return result; }
+	OCSP_BASICRESP* basic = OCSP_response_get1_basic(oresp);
+	if (!basic) { OCSP_RESPONSE_free(oresp); result.errorDetail = "Parse error"; return false; }
+	if (!VerifyOCSPSignature(basic, issuer)) {
+		OCSP_BASICRESP_free(basic); OCSP_RESPONSE_free(oresp); result.errorDetail = "Bad signature"; return false;
+	}
 
-	unsigned char* derReq = NULL;
-	int derReqLen = i2d_OCSP_REQUEST(req, &derReq);
-	if (derReqLen <= 0 || !derReq) { OCSP_REQUEST_free(req); result.errorDetail = "Serialize failed"; return result; }
+	int cs = -1, reason = 0;
+	ASN1_GENERALIZEDTIME *rt = NULL, *tu = NULL, *nu = NULL;
+	OCSP_CERTID* lid = OCSP_cert_to_id(EVP_sha1(), cert, issuer);
+	if (!lid) { OCSP_BASICRESP_free(basic); OCSP_RESPONSE_free(oresp); result.errorDetail = "Lookup failed"; return false; }
 
-	struct addrinfo hints, *res = NULL;
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = AF_INET;
-	hints.ai_socktype = SOCK_STREAM;
-	if (getaddrinfo(ocspHost.c_str(), ocspPort.c_str(), &hints, &res) != 0 || !res) {
-		OPENSSL_free(derReq); OCSP_REQUEST_free(req);
-		result.errorDetail = "DNS failed"; return result;
+	if (OCSP_resp_find_status(basic, lid, &cs, &reason, &rt, &tu, &nu) != 1) {
+		OCSP_CERTID_free(lid); OCSP_BASICRESP_free(basic); OCSP_RESPONSE_free(oresp);
+		result.status = "Unknown"; result.errorDetail = "Not in response"; return false;
 	}
+	OCSP_CERTID_free(lid);
+
+	bool current = (maxAge < 0 || OCSP_check_validity(tu, nu, 0, maxAge) == 1);
+	ERR_clear_error();
+	if (current) {
+		switch (cs) {
+		case V_OCSP_CERTSTATUS_GOOD: result.status = "Valid"; result.errorDetail = ""; break;
+		case V_OCSP_CERTSTATUS_REVOKED:
+			result.status = "Revoked"; result.errorDetail = "";
+			if (rt) { BIO* tb = BIO_new(BIO_s_mem()); if (tb) { ASN1_GENERALIZEDTIME_print(tb, rt); BUF_MEM* bp = NULL; BIO_get_mem_ptr(tb, &bp); if (bp) result.revokedTime.assign(bp->data, bp->length); BIO_free(tb); } }
+			break;
+		default: result.status = "Unknown"; break;
+		}
+	}
+
+	OCSP_BASICRESP_free(basic);
+	OCSP_RESPONSE_free(oresp);
+	return current;
+}
+
+// Cached responses are named by the sha1 of their DER CertID, which covers
+// the issuer name and key hashes and the serial number.
+static string OCSPCacheFile(X509* cert, X509* issuer)
+{
+	if (s_strOCSPCacheFolder.empty() || 0 == s_uOCSPMaxAge) return "";
+	OCSP_CERTID* certId = OCSP_cert_to_id(EVP_sha1(), cert, issuer);
+	if (!certId) return "";
+	unsigned char* der = NULL;
+	int derLen = i2d_OCSP_CERTID(certId, &der);
+	OCSP_CERTID_free(certId);
+	if (derLen <= 0 || !der) return "";
+	string strHash;
+	ZSHA::SHA1Text(string((const char*)der, derLen), strHash);
+	OPENSSL_free(der);
+	return s_strOCSPCacheFolder + "/" + strHash + ".der";
+}
+
 #ifdef _WIN32
-	SOCKET sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (sock == INVALID_SOCKET) {
+typedef SOCKET ocsp_socket;
+#define OCSP_INVALID_SOCKET INVALID_SOCKET
 #else
-	int sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-	if (sock < 0) {
+typedef int ocsp_socket;
+#define OCSP_INVALID_SOCKET (-1)
 #endif
-		freeaddrinfo(res); OPENSSL_free(derReq); OCSP_REQUEST_free(req);
-		result.errorDetail = "Socket failed"; return result;
+
+// Waits until sock is readable (or writable) or the deadline, in microseconds, passes.
+// poll on POSIX, where select can't take fds past FD_SETSIZE, which a
+// long-running libzsign host reaches; a Windows fd_set is a list of sockets.
+static bool WaitSocket(ocsp_socket sock, bool write, uint64_t deadline)
+{
+#ifdef _WIN32
+	uint64_t now = ZUtil::GetMicroSecond();
+	if (now >= deadline) return false;
+	uint64_t remain = deadline - now;
+	struct timeval tv;
+	tv.tv_sec = (long)(remain / 1000000);
+	tv.tv_usec = (long)(remain % 1000000);
+	fd_set fds;
+	FD_ZERO(&fds);
+	FD_SET(sock, &fds);
+	int n = select((int)sock + 1, write ? NULL : &fds, write ? &fds : NULL, NULL, &tv);
+	return (n > 0);
+#else
+	while (true) {
+		uint64_t now = ZUtil::GetMicroSecond();
+		if (now >= deadline) return false;
+		struct pollfd pfd;
+		pfd.fd = sock;
+		pfd.events = write ? POLLOUT : POLLIN;
+		pfd.revents = 0;
+		int n = poll(&pfd, 1, (int)min((deadline - now + 999) / 1000, (uint64_t)INT_MAX));
+		if (n >= 0 || EINTR != errno) return (n > 0);
 	}
-	if (connect(sock, res->ai_addr, (int)res->ai_addrlen) < 0) {
-		freeaddrinfo(res); OCSP_CLOSE_SOCKET(sock); OPENSSL_free(derReq); OCSP_REQUEST_free(req);
-		result.errorDetail = "Connect failed"; return result;
+#endif
+}
+
+// getaddrinfo takes no timeout, so it runs on a thread of its own. When the
+// deadline passes first the thread is left to finish and free its result.
+struct OCSPLookup {
+	mutex mtx;
+	condition_variable cv;
+	bool done;
+	bool abandoned;
+	struct addrinfo* res;
+};
+
+static struct addrinfo* ResolveHost(const string& host, const string& port, uint64_t deadline, string& errorDetail)
+{
+	shared_ptr<OCSPLookup> lookup = make_shared<OCSPLookup>();
+	lookup->done = false;
+	lookup->abandoned = false;
+	lookup->res = NULL;
+	auto resolve = [lookup, host, port]() {
+		struct addrinfo hints, *res = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0) res = NULL;
+		lock_guard<mutex> lock(lookup->mtx);
+		if (lookup->abandoned) {
+			if (res) freeaddrinfo(res);
+			return;
+		}
+		lookup->res = res;
+		lookup->done = true;
+		lookup->cv.notify_all();
+	};
+	try {
+		thread(resolve).detach();
+	} catch (...) {
+		resolve(); // no thread to spare, resolve without a bound
 	}
+
+	unique_lock<mutex> lock(lookup->mtx);
+	while (!lookup->done) {
+		uint64_t now = ZUtil::GetMicroSecond();
+		if (now >= deadline) {
+			lookup->abandoned = true;
+			errorDetail = "Timed out";
+			return NULL;
+		}
+		lookup->cv.wait_for(lock, chrono::microseconds(deadline - now));
+	}
+	if (!lookup->res) errorDetail = "DNS failed";
+	return lookup->res;
+}
+
+static ocsp_socket ConnectSocket(const string& host, const string& port, uint64_t deadline, string& errorDetail)
+{
+	struct addrinfo* res = ResolveHost(host, port, deadline, errorDetail);
+	if (!res) return OCSP_INVALID_SOCKET;
+
+	ocsp_socket sock = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+	if (sock == OCSP_INVALID_SOCKET) {
+		freeaddrinfo(res); errorDetail = "Socket failed"; return OCSP_INVALID_SOCKET;
+	}
+
+	// non-blocking, so that connect, send and recv all honor the deadline
+#ifdef _WIN32
+	u_long nonBlocking = 1;
+	ioctlsocket(sock, FIONBIO, &nonBlocking);
+	bool connected = (0 == connect(sock, res->ai_addr, (int)res->ai_addrlen));
+	bool pending = (!connected && WSAGetLastError() == WSAEWOULDBLOCK);
+#else
+	fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+	bool connected = (0 == connect(sock, res->ai_addr, (int)res->ai_addrlen));
+	bool pending = (!connected && (errno == EINPROGRESS || errno == EWOULDBLOCK));
+#endif
 	freeaddrinfo(res);
+	if (!connected && !pending) {
+		OCSP_CLOSE_SOCKET(sock); errorDetail = "Connect failed"; return OCSP_INVALID_SOCKET;
+	}
+	if (pending) {
+		int err = 0;
+		socklen_t errLen = sizeof(err);
+		if (!WaitSocket(sock, true, deadline)) {
+			OCSP_CLOSE_SOCKET(sock); errorDetail = "Timed out"; return OCSP_INVALID_SOCKET;
+		}
+		if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char*)&err, &errLen) < 0 || err != 0) {
+			OCSP_CLOSE_SOCKET(sock); errorDetail = "Connect failed"; return OCSP_INVALID_SOCKET;
+		}
+	}
+	return sock;
+}
+
+// POSTs the request and returns the response body, all before the deadline.
+static bool PostOCSPRequest(const string& host, const string& port, const string& path, const unsigned char* derReq, int derReqLen, uint64_t deadline, string& body, string& errorDetail)
+{
+	ocsp_socket sock = ConnectSocket(host, port, deadline, errorDetail);
+	if (sock == OCSP_INVALID_SOCKET) return false;
 
 	char hdr[512];
 	snprintf(hdr, sizeof(hdr),
-		"POST %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: zsign\r\nContent-Type: application/ocsp-request\r\nContent-Length: %d\r\n\r\n",
-		ocspPath.c_str(), ocspHost.c_str(), derReqLen);
+		"POST %s HTTP/1.1\r\nHost: %s\r\nUser-Agent: zsign\r\nContent-Type: application/ocsp-request\r\nContent-Length: %d\r\nConnection: close\r\n\r\n",
+		path.c_str(), host.c_str(), derReqLen);
 	string request(hdr);
 	request.append((const char*)derReq, derReqLen);
-	OPENSSL_free(derReq);
-	OCSP_REQUEST_free(req);
 
 	const char* sendPtr = request.data();
 	size_t sendRemain = request.size();
 	while (sendRemain > 0) {
+		if (!WaitSocket(sock, true, deadline)) { OCSP_CLOSE_SOCKET(sock); errorDetail = "Timed out"; return false; }
 		ssize_t sent = send(sock, sendPtr, (int)sendRemain, 0);
-		if (sent <= 0) { OCSP_CLOSE_SOCKET(sock); result.errorDetail = "Send failed"; return result; }
+		if (sent <= 0) { OCSP_CLOSE_SOCKET(sock); errorDetail = "Send failed"; return false; }
 		sendPtr += sent;
 		sendRemain -= sent;
 	}
 
-	// read response: first read until headers are complete
+	// read until the body is complete, or the server closes without a Content-Length
 	string resp;
 	char rb[4096];
-	while (resp.find("\r\n\r\n") == string::npos) {
+	size_t he = string::npos;
+	long contentLength = -1;
+	while (true) {
+		if (he == string::npos) {
+			he = resp.find("\r\n\r\n");
+			if (he != string::npos) {
+				size_t clPos = resp.find("Content-Length:");
+				if (clPos == string::npos) clPos = resp.find("content-length:");
+				if (clPos != string::npos && clPos < he) contentLength = atol(resp.c_str() + clPos + 15);
+			}
+		}
+		if (he != string::npos && contentLength >= 0 && resp.size() - he - 4 >= (size_t)contentLength) break;
+		if (!WaitSocket(sock, false, deadline)) { OCSP_CLOSE_SOCKET(sock); errorDetail = "Timed out"; return false; }
 		ssize_t br = recv(sock, rb, sizeof(rb), 0);
 		if (br <= 0) break;
 		resp.append(rb, br);
 	}
+	OCSP_CLOSE_SOCKET(sock);
 
-	size_t he = resp.find("\r\n\r\n");
-	if (he == string::npos) { OCSP_CLOSE_SOCKET(sock); result.errorDetail = "Invalid response"; return result; }
+	if (he == string::npos) { errorDetail = "Invalid response"; return false; }
+	body = resp.substr(he + 4);
+	if (body.empty()) { errorDetail = "Empty body"; return false; }
+	return true;
+}
 
-	// parse Content-Length and read remaining body
-	long contentLength = 0;
-	{
-		size_t clPos = resp.find("Content-Length:");
-		if (clPos == string::npos) clPos = resp.find("content-length:");
-		if (clPos != string::npos) contentLength = atol(resp.c_str() + clPos + 15);
+static OCSPResult PerformOCSP(X509* cert, X509* issuer, bool appleFallback, uint64_t deadline)
+{
+	OCSPResult result;
+	result.status = "Error";
+	result.cached = false;
+	if (!cert || !issuer) { result.errorDetail = "Missing certificate or issuer"; return result; }
+
+	string ocspHost, ocspPort, ocspPath;
+	if (!ExtractOCSPUrl(cert, ocspHost, ocspPort, ocspPath)) {
+		if (!appleFallback) { result.errorDetail = "No OCSP responder"; return result; }
+		ocspHost = "ocsp.apple.com";
+		ocspPort = "80";
+		ocspPath = "/ocsp03-wwdr01";
+		string issuerCN = GetNameField(X509_get_subject_name(issuer), NID_commonName);
+		if (issuerCN.find("G6") != string::npos) ocspPath = "/ocsp03-wwdrg6";
+		else if (issuerCN.find("G3") != string::npos) ocspPath = "/ocsp03-wwdrg3";
+		else if (issuerCN.find("G2") != string::npos) ocspPath = "/ocsp03-wwdrg2";
 	}
-	size_t bodyHave = resp.size() - he - 4;
-	while (contentLength > 0 && bodyHave < (size_t)contentLength) {
-		ssize_t br = recv(sock, rb, sizeof(rb), 0);
-		if (br <= 0) break;
-		resp.append(rb, br);
-		bodyHave += br;
+	result.host = ocspHost;
+
+	string cacheFile = OCSPCacheFile(cert, issuer);
+	string cached;
+	if (!cacheFile.empty() && ZFile::ReadFile(cacheFile.c_str(), cached)) {
+		OCSPResult cachedResult = result;
+		if (ParseOCSPResponse(cached, cert, issuer, (long)s_uOCSPMaxAge, cachedResult)) {
+			cachedResult.cached = true;
+			return cachedResult;
+		}
 	}
-	OCSP_CLOSE_SOCKET(sock);
 
-	const unsigned char* bodyPtr = (const unsigned char*)resp.data() + he + 4;
-	long bodyLen = (long)(resp.size() - he - 4);
-	if (bodyLen <= 0) { result.errorDetail = "Empty body"; return result; }
+	OCSP_CERTID* certId = OCSP_cert_to_id(EVP_sha1(), cert, issuer);
+	if (!certId) { result.errorDetail = "Failed to create cert ID"; return result; }
+	OCSP_REQUEST* req = OCSP_REQUEST_new();
+	if (!req) { OCSP_CERTID_free(certId); result.errorDetail = "Request failed"; return result; }
+	if (!OCSP_request_add0_id(req, certId)) { OCSP_REQUEST_free(req); result.errorDetail = "Add ID failed"; return result; }
 
-	OCSP_RESPONSE* oresp = d2i_OCSP_RESPONSE(NULL, &bodyPtr, bodyLen);
-	if (!oresp) { result.errorDetail = "Parse failed"; return result; }
-	if (OCSP_response_status(oresp) != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
-		OCSP_RESPONSE_free(oresp); result.errorDetail = "OCSP error"; return result;
-	}
+	unsigned char* derReq = NULL;
+	int derReqLen = i2d_OCSP_REQUEST(req, &derReq);
+	OCSP_REQUEST_free(req);
+	if (derReqLen <= 0 || !derReq) { result.errorDetail = "Serialize failed"; return result; }
 
-	OCSP_BASICRESP* basic = OCSP_response_get1_basic(oresp);
-	if (!basic) { OCSP_RESPONSE_free(oresp); result.errorDetail = "Parse error"; return result; }
+	string body;
+	bool posted = PostOCSPRequest(ocspHost, ocspPort, ocspPath, derReq, derReqLen, deadline, body, result.errorDetail);
+	OPENSSL_free(derReq);
+	if (!posted) return result;
+
+	if (ParseOCSPResponse(body, cert, issuer, -1, result) && !cacheFile.empty() && result.status != "Unknown") {
+		string strTempFile;
+		ZUtil::StringFormatV(strTempFile, "%s.%llu.tmp", cacheFile.c_str(), ZUtil::GetMicroSecond());
+		if (!ZFile::CreateFolder(s_strOCSPCacheFolder.c_str()) ||
+			!ZFile::WriteFile(strTempFile.c_str(), body) || !ZFile::RenameFile(strTempFile.c_str(), cacheFile.c_str())) {
+			ZFile::RemoveFile(strTempFile.c_str());
+		}
+	}
+	return result;
+}
 
-	int cs = -1, reason = 0;
-	ASN1_GENERALIZEDTIME *rt = NULL, *tu = NULL, *nu = NULL;
-	OCSP_CERTID* lid = OCSP_cert_to_id(EVP_sha1(), cert, issuer);
-	if (!lid) { OCSP_BASICRESP_free(basic); OCSP_RESPONSE_free(oresp); result.errorDetail = "Lookup failed"; return result; }
+// One OCSP lookup, shared by every checked file with the same cert and issuer.
+struct OCSPQuery {
+	X509* cert;
+	X509* issuer;
+	bool appleFallback;
+	OCSPResult result;
+};
 
-	if (OCSP_resp_find_status(basic, lid, &cs, &reason, &rt, &tu, &nu) != 1) {
-		OCSP_CERTID_free(lid); OCSP_BASICRESP_free(basic); OCSP_RESPONSE_free(oresp);
-		result.status = "Unknown"; result.errorDetail = "Not in response"; return result;
+// Runs all lookups concurrently; together they take at most s_uOCSPTimeout seconds.
+static void PerformOCSPQueries(vector<OCSPQuery>& queries)
+{
+	if (queries.empty()) return;
+#ifdef _WIN32
+	WSADATA wsaData;
+	WSAStartup(MAKEWORD(2, 2), &wsaData);
+#endif
+	uint64_t deadline = ZUtil::GetMicroSecond() + (uint64_t)s_uOCSPTimeout * 1000000;
+	atomic<size_t> uNext(0);
+	ZLog::ThreadCallback logCallback = ZLog::GetThreadCallback();
+	auto worker = [&]() {
+		ZLog::SetThreadCallback(logCallback);
+		for (size_t i = uNext++; i < queries.size(); i = uNext++) {
+			queries[i].result = PerformOCSP(queries[i].cert, queries[i].issuer, queries[i].appleFallback, deadline);
+		}
+	};
+
+	vector<thread> arrThreads;
+	size_t uThreads = min(queries.size(), (size_t)8);
+	for (size_t i = 1; i < uThreads; i++) {
+		try {
+			arrThreads.push_back(thread(worker));
+		} catch (...) {
+			break; // the rest is queried on this thread
+		}
 	}
-	OCSP_CERTID_free(lid);
-
-	switch (cs) {
-	case V_OCSP_CERTSTATUS_GOOD: result.status = "Valid"; result.errorDetail = ""; break;
-	case V_OCSP_CERTSTATUS_REVOKED:
-		result.status = "Revoked";
-		if (rt) { BIO* tb = BIO_new(BIO_s_mem()); if (tb) { ASN1_GENERALIZEDTIME_print(tb, rt); BUF_MEM* bp = NULL; BIO_get_mem_ptr(tb, &bp); if (bp) result.revokedTime.assign(bp->data, bp->length); BIO_free(tb); } }
-		break;
-	default: result.status = "Unknown"; break;
+	worker();
+	for (thread& t : arrThreads) {
+		t.join();
 	}
+#ifdef _WIN32
+	WSACleanup();
+#endif
+}
 
-	OCSP_BASICRESP_free(basic);
-	OCSP_RESPONSE_free(oresp);
-	return result;
+static size_t AddOCSPQuery(vector<OCSPQuery>& queries, X509* cert, X509* issuer, bool appleFallback)
+{
+	for (size_t i = 0; i < queries.size(); i++) {
+		if (X509_cmp(queries[i].cert, cert) == 0 && X509_cmp(queries[i].issuer, issuer) == 0) return i;
+	}
+	OCSPQuery query;
+	query.cert = cert;
+	query.issuer = issuer;
+	query.appleFallback = appleFallback;
+	queries.push_back(query);
+	return queries.size() - 1;
 }
 
 // --- display (simple text, matches zsign style) ----------------------
@@ -627,18 +830,20 @@ static void PrintCertInfo(X509* cert, const string& fileTypeStr, bool showSigned
 	ZLog::PrintV(">>> Issuer:\t%s\n", issuerCN.c_str());
 }
 
-static int PrintOCSPResult(const OCSPResult& result)
+static int PrintOCSPResult(const OCSPResult& result, const char* label)
 {
+	string source = result.host;
+	if (result.cached) source += ", cached";
 	if (result.status == "Valid") {
-		ZLog::Print(">>> OCSP:\tValid (ocsp.apple.com)\n");
+		ZLog::PrintV(">>> %s:\tValid (%s)\n", label, source.c_str());
 	} else if (result.status == "Revoked") {
-		ZLog::Print(">>> OCSP:\tREVOKED\n");
+		ZLog::PrintV(">>> %s:\tREVOKED (%s)\n", label, source.c_str());
 		if (!result.revokedTime.empty())
 			ZLog::PrintV(">>> Revoked:\t%s\n", result.revokedTime.c_str());
 	} else if (result.status == "Unknown") {
-		ZLog::Print(">>> OCSP:\tUnknown\n");
+		ZLog::PrintV(">>> %s:\tUnknown\n", label);
 	} else {
-		ZLog::Print(">>> OCSP:\tError\n");
+		ZLog::PrintV(">>> %s:\tError\n", label);
 	}
 
 	if (!result.errorDetail.empty())
@@ -651,96 +856,159 @@ static int PrintOCSPResult(const OCSPResult& result)
 
 // --- main entry -----------------------------------------------------
 
-int CheckCertificate(const string& strFilePath, const string& strPassword)
+struct CertCheckTarget {
+	string path;
+	string fileTypeStr;
+	int loadRet;			// 0, or the result when there is no cert to check
+	bool isSigned;
+	bool showSigned;
+	X509* cert;
+	X509* issuer;			// NULL for non-WWDR issuers
+	X509* caIssuer;			// issuer of the intermediate, if known
+	STACK_OF(X509)* ca;
+	size_t leafQuery;
+	size_t caQuery;
+};
+
+static X509* ResolveRootIssuer(STACK_OF(X509)* ca, X509* intermediate)
+{
+	if (X509_check_issued(intermediate, intermediate) == X509_V_OK) return NULL;
+	X509* root = FindIssuerInChain(ca, intermediate);
+	if (root) return root;
+	const char* roots[] = { ZSignAsset::s_szAppleRootCACert, ZSignAsset::s_szAppleRootCACertG3 };
+	for (size_t i = 0; i < sizeof(roots) / sizeof(roots[0]); i++) {
+		root = LoadEmbeddedCert(roots[i]);
+		if (root && X509_check_issued(root, intermediate) == X509_V_OK) return root;
+		if (root) X509_free(root);
+	}
+	return NULL;
+}
+
+static void LoadCheckTarget(const string& strFilePath, const string& strPassword, CertCheckTarget& target)
 {
+	target.path = strFilePath;
+	target.loadRet = 0;
+	target.isSigned = false;
+	target.showSigned = false;
+	target.cert = NULL;
+	target.issuer = NULL;
+	target.caIssuer = NULL;
+	target.ca = NULL;
+	target.leafQuery = (size_t)-1;
+	target.caQuery = (size_t)-1;
+
 	string data;
 	if (!ZFile::ReadFile(strFilePath.c_str(), data) || data.empty()) {
 		ZLog::ErrorV(">>> Cannot read file: %s\n", strFilePath.c_str());
-		return -1;
+		target.loadRet = -1;
+		return;
 	}
 
 	CertFileType fileType = DetectFileType(strFilePath, data);
-	X509* cert = NULL;
-	STACK_OF(X509)* ca = NULL;
-	string fileTypeStr;
-	bool isSigned = false, showSigned = false;
-
 	switch (fileType) {
 	case CERT_FILE_IPA: {
-		fileTypeStr = "IPA";
-		showSigned = true;
+		target.fileTypeStr = "IPA";
+		target.showSigned = true;
 		MachOSignInfo si = LoadFromIPA(strFilePath);
-		isSigned = si.isSigned; cert = si.cert;
+		target.isSigned = si.isSigned; target.cert = si.cert;
 		break;
 	}
 	case CERT_FILE_MACHO: {
-		fileTypeStr = "Mach-O";
-		showSigned = true;
+		target.fileTypeStr = "Mach-O";
+		target.showSigned = true;
 		MachOSignInfo si = ExtractFromMachOData((uint8_t*)data.data(), (uint32_t)data.size());
-		isSigned = si.isSigned; cert = si.cert;
+		target.isSigned = si.isSigned; target.cert = si.cert;
 		break;
 	}
 	case CERT_FILE_PROVISION:
-		fileTypeStr = "Provision"; cert = LoadFromProvision(data); break;
+		target.fileTypeStr = "Provision"; target.cert = LoadFromProvision(data); break;
 	case CERT_FILE_P12:
-		fileTypeStr = "PKCS#12"; cert = LoadFromP12(data, strPassword, &ca); break;
+		target.fileTypeStr = "PKCS#12"; target.cert = LoadFromP12(data, strPassword, &target.ca); break;
 	case CERT_FILE_CER:
 	case CERT_FILE_PEM:
-		fileTypeStr = (fileType == CERT_FILE_PEM) ? "PEM" : "DER";
-		cert = LoadFromCER(data); break;
+		target.fileTypeStr = (fileType == CERT_FILE_PEM) ? "PEM" : "DER";
+		target.cert = LoadFromCER(data); break;
 	default:
 		ZLog::ErrorV(">>> Unknown file type: %s\n", strFilePath.c_str());
-		return -1;
+		target.loadRet = -1;
+		return;
 	}
 
-	ZLog::PrintV("\n>>> Check:\t%s (%s)\n", strFilePath.c_str(), fileTypeStr.c_str());
-
-	if (showSigned && !isSigned) {
-		ZLog::Print(">>> Signed:\tNo\n\n");
-		return -2;
+	if (!target.cert) {
+		target.loadRet = target.showSigned ? -2 : -1;
+		return;
 	}
 
-	if (!cert) {
-		if (showSigned) {
-			ZLog::Print(">>> Signed:\tNo\n\n");
-			return -2;
-		}
-		ZLog::ErrorV(">>> Failed to load certificate from %s\n", strFilePath.c_str());
-		return -1;
-	}
+	if (target.ca && sk_X509_num(target.ca) > 0) target.issuer = FindIssuerInChain(target.ca, target.cert);
+	if (!target.issuer) target.issuer = ResolveIssuer(target.cert);
+	if (target.issuer) target.caIssuer = ResolveRootIssuer(target.ca, target.issuer);
+}
 
-	PrintCertInfo(cert, fileTypeStr, showSigned, isSigned);
+static void FreeCheckTarget(CertCheckTarget& target)
+{
+	if (target.cert) X509_free(target.cert);
+	if (target.issuer) X509_free(target.issuer);
+	if (target.caIssuer) X509_free(target.caIssuer);
+	if (target.ca) sk_X509_pop_free(target.ca, X509_free);
+}
 
-	int daysLeft = DaysRemaining(X509_get0_notAfter(cert));
-	bool expired = (daysLeft < 0);
+int CheckCertificates(const vector<string>& arrFilePaths, const string& strPassword)
+{
+	vector<CertCheckTarget> targets(arrFilePaths.size());
+	vector<OCSPQuery> queries;
+	for (size_t i = 0; i < arrFilePaths.size(); i++) {
+		CertCheckTarget& target = targets[i];
+		LoadCheckTarget(arrFilePaths[i], strPassword, target);
+		if (target.issuer) {
+			target.leafQuery = AddOCSPQuery(queries, target.cert, target.issuer, true);
+			if (target.caIssuer) target.caQuery = AddOCSPQuery(queries, target.issuer, target.caIssuer, false);
+		}
+	}
 
-	X509* issuer = NULL;
-	if (ca && sk_X509_num(ca) > 0) issuer = FindIssuerInChain(ca, cert);
-	if (!issuer) issuer = ResolveIssuer(cert);
+	PerformOCSPQueries(queries);
 
-	int retCode = 0;
-	if (!issuer) {
-		ZLog::Print(">>> OCSP:\tSkipped (non-WWDR issuer)\n");
-		retCode = expired ? 2 : 0;
-	} else {
-#ifdef _WIN32
-		WSADATA wsaData;
-		WSAStartup(MAKEWORD(2, 2), &wsaData);
-#endif
-		OCSPResult ocspResult = PerformOCSP(cert, issuer);
-#ifdef _WIN32
-		WSACleanup();
-#endif
-		retCode = PrintOCSPResult(ocspResult);
-		if (expired && retCode == 0) retCode = 2;
-		X509_free(issuer);
+	int result = 0;
+	for (size_t i = 0; i < targets.size(); i++) {
+		CertCheckTarget& target = targets[i];
+		int retCode = target.loadRet;
+		if (target.fileTypeStr.empty()) {
+			// unreadable or unknown, already reported
+		} else {
+			ZLog::PrintV("\n>>> Check:\t%s (%s)\n", target.path.c_str(), target.fileTypeStr.c_str());
+			if (target.showSigned && (!target.isSigned || !target.cert)) {
+				ZLog::Print(">>> Signed:\tNo\n\n");
+				retCode = -2;
+			} else if (!target.cert) {
+				ZLog::ErrorV(">>> Failed to load certificate from %s\n", target.path.c_str());
+			} else {
+				PrintCertInfo(target.cert, target.fileTypeStr, target.showSigned, target.isSigned);
+				bool expired = (DaysRemaining(X509_get0_notAfter(target.cert)) < 0);
+				if (!target.issuer) {
+					ZLog::Print(">>> OCSP:\tSkipped (non-WWDR issuer)\n");
+					retCode = expired ? 2 : 0;
+				} else {
+					retCode = PrintOCSPResult(queries[target.leafQuery].result, "OCSP");
+					if (target.caQuery != (size_t)-1) {
+						// a revoked intermediate revokes the leaf, anything else is informational
+						if (1 == PrintOCSPResult(queries[target.caQuery].result, "OCSP CA")) retCode = 1;
+					}
+					if (expired && retCode == 0) retCode = 2;
+				}
+				ZLog::Print("\n");
+			}
+		}
+		if (0 == result) result = retCode;
 	}
 
-	ZLog::Print("\n");
+	for (size_t i = 0; i < targets.size(); i++) {
+		FreeCheckTarget(targets[i]);
+	}
+	return result;
+}
 
-	X509_free(cert);
-	if (ca) sk_X509_pop_free(ca, X509_free);
-	return retCode;
+int CheckCertificate(const string& strFilePath, const string& strPassword)
+{
+	return CheckCertificates(vector<string>(1, strFilePath), strPassword);
 }
 
 // --- Post-sign binary check -----------------------------------------
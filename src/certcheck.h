@@ -6,6 +6,15 @@
 // Returns: 0 = valid, 1 = revoked, 2 = expired, -2 = not signed, -1 = error
 int CheckCertificate(const string& strFilePath, const string& strPassword);
 
+// Check several files at once; their OCSP lookups run concurrently.
+// Returns the result of the first file that didn't check out, or 0.
+int CheckCertificates(const vector<string>& arrFilePaths, const string& strPassword);
+
+// OCSP responses are cached in strCacheFolder/ocsp (not at all if empty or
+// uMaxAge is 0) and served from there until their nextUpdate, for at most
+// uMaxAge seconds. All lookups of one check share a timeout of uTimeout seconds.
+void SetOCSPOptions(const string& strCacheFolder, uint32_t uMaxAge, uint32_t uTimeout);
+
 // Check the main binary inside an extracted app folder (used after signing)
 // Returns: 0 = valid, 1 = revoked, 2 = expired, -2 = not signed, -1 = error
 int CheckSignedBinary(const string& strAppFolder);
@@ -1,4 +1,5 @@
 #include "archive.h"
+#include "stats.h"
 
 #if defined(ZSIGN_SYSTEM_MINIZIP_NG)
 #include <zip.h>
@@ -11,6 +12,9 @@
 #include "third-party/minizip/unzip.h"
 #endif
 
+// ZipIndex::ReadFile allocates no more than this before any data arrived
+#define ZIP_READ_PRESIZE	(64 * 1024 * 1024)
+
 void Zip::GetModificationTime(const char* path, void* zfi)
 {
 	zip_fileinfo* zi = (zip_fileinfo*)zfi;
@@ -60,6 +64,7 @@ bool Zip::_WriteFileToZip(void* hZip, const string& strFile, const string& strRe
 	char buffer[4096];
 	size_t bytes_read = fread(buffer, 1, sizeof(buffer), fp);
 	while (bytes_read > 0) {
+		ZStats::Add(ZStats::E_BYTES_READ, bytes_read);
 		if (zipWriteInFileInZip(hZip, buffer, (uint32_t)bytes_read) < 0) {
 			bRet = false;
 			break;
@@ -123,6 +128,7 @@ bool Zip::Archive(const string& strFolder, const string& strZipFile, int nZipLev
 	});
 
     zipClose(zf, NULL);
+	ZStats::Add(ZStats::E_BYTES_WRITTEN, (uint64_t)max(ZFile::GetFileSize(strZipFile.c_str()), (int64_t)0));
 	return bRet;
 }
 
@@ -221,6 +227,7 @@ bool Zip::_ReadFileFromZip(void* hZip, const string& strPath, const string& strR
 				bRet = false;
 				break;
 			}
+			ZStats::Add(ZStats::E_BYTES_WRITTEN, (uint64_t)nReaded);
 			nReaded = unzReadCurrentFile(hZip, pbuff, uBufSize);
 		}
 		if (nReaded < 0) {
@@ -269,7 +276,13 @@ static bool _IsPathSafe(const string& strPath)
 
 bool Zip::_Extract(const char* zip_file, const char* output_folder)
 {
+	// timed in batches of 256 entries, per entry would swamp the trace
+	uint64_t uEntries = 0;
+	ZStatsScope scope("extract_batch", "entries 0+");
 	return _EnumZipItems(zip_file, [&](unzFile uFile, bool bFolder, const string& strPath) {
+		if (0 == (++uEntries % 256)) {
+			scope.Restart("entries " + to_string(uEntries) + "+");
+		}
 		if (!_IsPathSafe(strPath)) {
 			ZLog::ErrorV(">>> Zip: Skipping unsafe path: %s\n", strPath.c_str());
 			return true;
@@ -294,5 +307,210 @@ bool Zip::Extract(const char* zip_file, const char* output_folder)
 		ZFile::RemoveFolder(output_folder);
 		return false;
 	}
+	ZStats::Add(ZStats::E_BYTES_READ, (uint64_t)max(ZFile::GetFileSize(zip_file), (int64_t)0));
 	return true;
 }
+
+ZipIndex::ZipIndex()
+{
+}
+
+ZipIndex::~ZipIndex()
+{
+	Close();
+}
+
+bool ZipIndex::Open(const string& strZipFile)
+{
+	Close();
+	unzFile uf = unzOpen64(strZipFile.c_str());
+	if (NULL == uf) {
+		return false;
+	}
+
+	unz_global_info64 gi;
+	if (UNZ_OK != unzGetGlobalInfo64(uf, &gi)) {
+		unzClose(uf);
+		return false;
+	}
+
+	m_mapEntries.reserve((size_t)gi.number_entry);
+	m_arrFiles.reserve((size_t)gi.number_entry);
+
+	unz_file_info64 fi;
+	char szPath[PATH_MAX] = { 0 };
+	int nRet = unzGoToFirstFile(uf);
+	for (uint64_t i = 0; i < gi.number_entry && UNZ_OK == nRet; i++, nRet = unzGoToNextFile(uf)) {
+		unz64_file_pos pos;
+		if (UNZ_OK != unzGetCurrentFileInfo64(uf, &fi, szPath, PATH_MAX, NULL, 0, NULL, 0) ||
+			UNZ_OK != unzGetFilePos64(uf, &pos)) {
+			unzClose(uf);
+			Close();
+			return false;
+		}
+
+		string strPath = szPath;
+		if (strPath.empty() || '/' == strPath.back()) {
+			continue;
+		}
+
+		ZipEntry entry;
+		entry.uDirOffset = pos.pos_in_zip_directory;
+		entry.uFileIndex = pos.num_of_file;
+		entry.uSize = fi.uncompressed_size;
+		entry.uCompressedSize = fi.compressed_size;
+		if (m_mapEntries.insert(make_pair(strPath, entry)).second) {
+			m_arrFiles.push_back(strPath);
+		}
+	}
+
+	m_strZipFile = strZipFile;
+	m_arrHandles.push_back(uf);
+	return true;
+}
+
+void ZipIndex::Close()
+{
+	for (void* hZip : m_arrHandles) {
+		unzClose(hZip);
+	}
+	m_arrHandles.clear();
+	m_mapEntries.clear();
+	m_arrFiles.clear();
+	m_strZipFile.clear();
+}
+
+const ZipIndex::ZipEntry* ZipIndex::Find(const string& strPath) const
+{
+	unordered_map<string, ZipEntry>::const_iterator it = m_mapEntries.find(strPath);
+	return (m_mapEntries.end() != it) ? &it->second : NULL;
+}
+
+bool ZipIndex::HasFile(const string& strPath) const
+{
+	return (NULL != Find(strPath));
+}
+
+void* ZipIndex::_OpenEntry(const string& strPath, const ZipEntry** ppEntry)
+{
+	const ZipEntry* pEntry = Find(strPath);
+	if (NULL == pEntry) {
+		return NULL;
+	}
+
+	unzFile uf = NULL;
+	{
+		lock_guard<mutex> lock(m_mtxHandles);
+		if (!m_arrHandles.empty()) {
+			uf = m_arrHandles.back();
+			m_arrHandles.pop_back();
+		}
+	}
+	if (NULL == uf) {
+		uf = unzOpen64(m_strZipFile.c_str());
+		if (NULL == uf) {
+			return NULL;
+		}
+	}
+
+	unz64_file_pos pos;
+	pos.pos_in_zip_directory = pEntry->uDirOffset;
+	pos.num_of_file = pEntry->uFileIndex;
+	if (UNZ_OK != unzGoToFilePos64(uf, &pos) || UNZ_OK != unzOpenCurrentFile(uf)) {
+		_ReleaseHandle(uf);
+		return NULL;
+	}
+
+	*ppEntry = pEntry;
+	return uf;
+}
+
+void ZipIndex::_ReleaseHandle(void* hZip)
+{
+	lock_guard<mutex> lock(m_mtxHandles);
+	m_arrHandles.push_back(hZip);
+}
+
+bool ZipIndex::ReadFile(const string& strPath, string& strData)
+{
+	strData.clear();
+	const ZipEntry* pEntry = NULL;
+	unzFile uf = _OpenEntry(strPath, &pEntry);
+	if (NULL == uf) {
+		return false;
+	}
+
+	// the central directory's size can't be trusted with the allocation, so
+	// the buffer starts at most at ZIP_READ_PRESIZE and doubles as it fills
+	uint64_t uSize = pEntry->uSize;
+	if (uSize > (uint64_t)SIZE_MAX / 2) {
+		_ReleaseHandle(uf);
+		return false;
+	}
+	strData.resize((size_t)min(uSize, (uint64_t)ZIP_READ_PRESIZE));
+	int nReaded = 0;
+	size_t sOffset = 0;
+	while (sOffset < uSize) {
+		if (sOffset == strData.size()) {
+			strData.resize((size_t)min(uSize, (uint64_t)strData.size() * 2));
+		}
+		nReaded = unzReadCurrentFile(uf, &strData[sOffset], (unsigned)min(strData.size() - sOffset, (size_t)(1 << 30)));
+		if (nReaded <= 0) {
+			break;
+		}
+		sOffset += nReaded;
+	}
+	strData.resize(sOffset);
+	bool bRet = (sOffset == uSize && UNZ_OK == unzCloseCurrentFile(uf));
+	_ReleaseHandle(uf);
+	ZStats::Add(ZStats::E_BYTES_READ, sOffset);
+	return bRet;
+}
+
+bool ZipIndex::ReadEntry(const string& strPath, read_callback callback)
+{
+	const ZipEntry* pEntry = NULL;
+	unzFile uf = _OpenEntry(strPath, &pEntry);
+	if (NULL == uf) {
+		return false;
+	}
+
+	bool bRet = true;
+	uint64_t uTotal = 0;
+	vector<uint8_t> arrBuffer((size_t)min(pEntry->uSize + 1, (uint64_t)(512 * 1024)));
+	int nReaded = unzReadCurrentFile(uf, arrBuffer.data(), (unsigned)arrBuffer.size());
+	while (nReaded > 0) {
+		uTotal += nReaded;
+		if (!callback(arrBuffer.data(), (size_t)nReaded)) {
+			bRet = false; // stopped early by the callback
+			break;
+		}
+		nReaded = unzReadCurrentFile(uf, arrBuffer.data(), (unsigned)arrBuffer.size());
+	}
+	if (nReaded < 0) {
+		bRet = false;
+	}
+	if (UNZ_OK != unzCloseCurrentFile(uf) && bRet) {
+		bRet = false;
+	}
+	_ReleaseHandle(uf);
+	ZStats::Add(ZStats::E_BYTES_READ, uTotal);
+	return bRet;
+}
+
+bool ZipIndex::FindAppFolder(string& strAppFolder) const
+{
+	// Payload/<name>.app/Info.plist of the first app in the archive
+	for (const string& strPath : m_arrFiles) {
+		if (0 != strPath.compare(0, 8, "Payload/")) {
+			continue;
+		}
+		size_t pos = strPath.find('/', 8);
+		if (string::npos != pos && pos > 12 && 0 == strPath.compare(pos - 4, 4, ".app") &&
+			0 == strPath.compare(pos, string::npos, "/Info.plist")) {
+			strAppFolder = strPath.substr(0, pos + 1);
+			return true;
+		}
+	}
+	return false;
+}
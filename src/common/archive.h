@@ -1,6 +1,7 @@
 #pragma once
 
 #include "common.h"
+#include <unordered_map>
 
 class Zip
 {
@@ -20,3 +21,48 @@ private:
 	static bool _CreateFolderToZip(void* hZip, const string& strFolder, const string& strRootFolder, int zip_level);
 	static void GetModificationTime(const char* path, void* zi);
 };
+
+// The central directory of a zip file, read once and looked up by path.
+// Entries are inflated on demand; any number of threads may read at the same
+// time, each borrowing its own handle to the archive.
+class ZipIndex
+{
+public:
+	struct ZipEntry
+	{
+		uint64_t	uDirOffset;	// unz64_file_pos
+		uint64_t	uFileIndex;
+		uint64_t	uSize;
+		uint64_t	uCompressedSize;
+	};
+
+	typedef function<bool(const uint8_t* pData, size_t sSize)> read_callback;
+
+public:
+	ZipIndex();
+	~ZipIndex();
+
+public:
+	bool Open(const string& strZipFile);
+	void Close();
+	const ZipEntry* Find(const string& strPath) const;
+	bool HasFile(const string& strPath) const;
+	bool ReadFile(const string& strPath, string& strData);
+	bool ReadEntry(const string& strPath, read_callback callback);
+	bool FindAppFolder(string& strAppFolder) const;
+
+public:
+	vector<string>	m_arrFiles; // central directory order, folders excluded
+
+private:
+	ZipIndex(const ZipIndex&);
+	ZipIndex& operator=(const ZipIndex&);
+	void* _OpenEntry(const string& strPath, const ZipEntry** ppEntry);
+	void _ReleaseHandle(void* hZip);
+
+private:
+	string							m_strZipFile;
+	unordered_map<string, ZipEntry>	m_mapEntries;
+	mutex							m_mtxHandles;
+	vector<void*>					m_arrHandles;
+};
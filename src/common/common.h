@@ -36,12 +36,15 @@
 #include <set>
 #include <map>
 #include <mutex>
+#include <atomic>
+#include <thread>
 #include <vector>
 #include <string>
 #include <memory>
 #include <iostream>
 #include <algorithm>
 #include <functional>
+#include <condition_variable>
 using namespace std;
 
 #define FORMAT_V(x, format) char format[1024] = { 0 }; \
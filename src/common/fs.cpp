@@ -1,10 +1,89 @@
 #include "fs.h"
+#include "stats.h"
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <linux/fiemap.h>
+#if defined(__has_include)
+#if __has_include(<linux/io_uring.h>) && defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter) && defined(__NR_io_uring_register)
+#include <linux/io_uring.h>
+#ifdef IO_URING_OP_SUPPORTED // 5.6+ headers, which have IORING_OP_READ and the opcode probe
+#define ZSIGN_HAS_IO_URING
+#endif
+#endif
+#endif
+#endif
+
+#ifdef __APPLE__
+#include <sys/clonefile.h>
+#endif
 
 #if !defined(S_ISREG) && defined(S_IFMT) && defined(S_IFREG)
 #define S_ISREG(m) (((m)&S_IFMT) == S_IFREG)
 #endif
 
 map<void*, void*> ZFile::s_mapFiles;
+static mutex s_mtxMapFiles;
+
+// Upper folders of the overlays created by CreateOverlay. Their unchanged
+// files are symbolic links into the read-only base, which every write
+// through ZFile replaces with a private file first.
+static vector<string> s_arrOverlays;
+static atomic<size_t> s_uOverlays(0);
+static mutex s_mtxOverlays;
+
+static bool DetachOverlayFile(const char* szFile, bool bKeepData)
+{
+#ifndef _WIN32
+	if (0 == s_uOverlays || NULL == szFile) {
+		return true;
+	}
+
+	struct stat st = { 0 };
+	if (0 != lstat(szFile, &st) || !S_ISLNK(st.st_mode)) {
+		return true;
+	}
+
+	// resolve the folder only, the link itself points into the base
+	string strFile = szFile;
+	size_t pos = strFile.rfind('/');
+	string strFolder = (string::npos == pos) ? "." : ((0 == pos) ? "/" : strFile.substr(0, pos));
+	strFile = ZFile::GetFullPath(strFolder.c_str()) + "/" + strFile.substr((string::npos == pos) ? 0 : pos + 1);
+
+	bool bOverlay = false;
+	{
+		lock_guard<mutex> lock(s_mtxOverlays);
+		for (const string& strUpper : s_arrOverlays) {
+			if (0 == strFile.compare(0, strUpper.size() + 1, strUpper + "/")) {
+				bOverlay = true;
+				break;
+			}
+		}
+	}
+	if (!bOverlay) {
+		return true;
+	}
+
+	if (!bKeepData) {
+		return (0 == unlink(szFile));
+	}
+
+	// the private copy is written next, so it can't keep a read-only mode
+	// of the base file, which non-root users couldn't open for writing
+	struct stat stBase = { 0 };
+	string strTempFile;
+	ZUtil::StringFormatV(strTempFile, "%s.%llu.tmp", szFile, ZUtil::GetMicroSecond());
+	if (0 != stat(szFile, &stBase) || !ZFile::CopyFile(szFile, strTempFile.c_str()) ||
+		0 != chmod(strTempFile.c_str(), (stBase.st_mode & 0777) | S_IWUSR) ||
+		!ZFile::RenameFile(strTempFile.c_str(), szFile)) {
+		ZFile::RemoveFile(strTempFile.c_str());
+		return false;
+	}
+#endif
+	return true;
+}
 
 bool ZFile::IsRegularFile(const char* path)
 {
@@ -32,6 +111,7 @@ void* ZFile::MapFile(const char* path, size_t offset, size_t size, size_t* psize
 		if (NULL != hMap) {
 			base = ::MapViewOfFile(hMap, ro ? FILE_MAP_READ : FILE_MAP_ALL_ACCESS, 0, 0, size);
 			if (NULL != base) {
+				lock_guard<mutex> lock(s_mtxMapFiles);
 				s_mapFiles[base] = hMap;
 			} else {
 				::CloseHandle(hMap);
@@ -42,6 +122,10 @@ void* ZFile::MapFile(const char* path, size_t offset, size_t size, size_t* psize
 
 #else
 
+	if (!ro && !DetachOverlayFile(path, true)) {
+		return NULL;
+	}
+
 	int fd = open(path, ro ? O_RDONLY : O_RDWR);
 	if (fd >= 0) {
 		if (size <= 0) {
@@ -69,6 +153,7 @@ void* ZFile::MapFile(const char* path, size_t offset, size_t size, size_t* psize
 bool ZFile::UnmapFile(void* base, size_t size)
 {
 #ifdef _WIN32
+	lock_guard<mutex> lock(s_mtxMapFiles);
 	auto it = s_mapFiles.find(base);
 	if (it != s_mapFiles.end()) {
 		::UnmapViewOfFile(base);
@@ -84,7 +169,7 @@ bool ZFile::UnmapFile(void* base, size_t size)
 
 bool ZFile::WriteFile(const char* szFile, const char* szData, size_t sLen)
 {
-	if (NULL == szFile) {
+	if (NULL == szFile || !DetachOverlayFile(szFile, false)) {
 		return false;
 	}
 
@@ -103,6 +188,7 @@ bool ZFile::WriteFile(const char* szFile, const char* szData, size_t sLen)
 			}
 		}
 		fclose(fp);
+		ZStats::Add(ZStats::E_BYTES_WRITTEN, written);
 		return (written == to_write);
 	} else {
 		ZLog::ErrorV("WriteFile: Failed in fopen! %s, %s\n", szFile, strerror(errno));
@@ -115,7 +201,7 @@ bool ZFile::WriteFile(const char* szFile, const string& strData)
 	return WriteFile(szFile, strData.data(), strData.size());
 }
 
-bool ZFile::WriteFileV(string& strData, const char* szPath, ...)
+bool ZFile::WriteFileV(const string& strData, const char* szPath, ...)
 {
 	FORMAT_V(szPath, szRealPath);
 	return WriteFile(szRealPath, strData);
@@ -147,6 +233,7 @@ bool ZFile::ReadFile(const char* szFile, string& strData)
 				}
 				readed += ret;
 			}
+			ZStats::Add(ZStats::E_BYTES_READ, readed);
 		}
 		fclose(fp);
 		return (strData.size() == to_read);
@@ -162,6 +249,10 @@ bool ZFile::ReadFileV(string& strData, const char* szPath, ...)
 
 bool ZFile::AppendFile(const char* szFile, const char* szData, size_t sLen)
 {
+	if (!DetachOverlayFile(szFile, true)) {
+		return false;
+	}
+
 	FILE* fp = NULL;
 	_fopen64(fp, szFile, "ab+");
 	if (NULL != fp) {
@@ -175,6 +266,7 @@ bool ZFile::AppendFile(const char* szFile, const char* szData, size_t sLen)
 		}
 
 		fclose(fp);
+		ZStats::Add(ZStats::E_BYTES_WRITTEN, sLen - towrite);
 		return (towrite > 0) ? false : true;
 	} else {
 		ZLog::ErrorV("AppendFile: Failed in fopen! %s, %s\n", szFile, strerror(errno));
@@ -325,41 +417,100 @@ bool ZFile::IsZipFile(const char* szFile)
 	return false;
 }
 
+#ifndef _WIN32
+// Copies the rest of src_fd to dest_fd: a copy-on-write clone of the whole
+// file where the file system supports it (btrfs, XFS), then an in-kernel
+// copy_file_range, then plain reads and writes. Each step continues from
+// the file offsets the previous one left, so a partial in-kernel copy is
+// simply finished by the next.
+static bool CopyFileData(int src_fd, int dest_fd, uint64_t uSize)
+{
+#ifdef __linux__
+#ifdef FICLONE
+	if (0 == ioctl(dest_fd, FICLONE, src_fd)) {
+		return true;
+	}
+#endif
+#ifdef __NR_copy_file_range
+	uint64_t uCopied = 0;
+	while (uCopied < uSize) {
+		ssize_t nCopied = (ssize_t)syscall(__NR_copy_file_range, src_fd, NULL, dest_fd, NULL, (size_t)min(uSize - uCopied, (uint64_t)0x40000000), 0);
+		if (nCopied <= 0) {
+			break;
+		}
+		uCopied += nCopied;
+	}
+#endif
+#endif
+
+	vector<char> arrBuffer(1024 * 1024);
+	while (true) {
+		ssize_t bytes_read = read(src_fd, arrBuffer.data(), arrBuffer.size());
+		if (bytes_read < 0) {
+			return false;
+		} else if (0 == bytes_read) {
+			break;
+		}
+		ssize_t bytes_written = write(dest_fd, arrBuffer.data(), bytes_read);
+		if (bytes_written != bytes_read) {
+			return false;
+		}
+	}
+	return true;
+}
+#endif
+
+// The copy is always writable by its owner, since zsign goes on to sign it
+// in place: read-only inputs would otherwise fail for non-root users.
 bool ZFile::CopyFile(const char* szSrcFile, const char* szDestFile)
 {
 #ifdef _WIN32
-	return ::CopyFileA(szSrcFile, szDestFile, FALSE) ? true : false;
+	if (!::CopyFileA(szSrcFile, szDestFile, FALSE)) {
+		return false;
+	}
+	DWORD dwAttrs = ::GetFileAttributesA(szDestFile);
+	if (INVALID_FILE_ATTRIBUTES != dwAttrs && (dwAttrs & FILE_ATTRIBUTE_READONLY)) {
+		::SetFileAttributesA(szDestFile, dwAttrs & ~FILE_ATTRIBUTE_READONLY);
+	}
+	return true;
 #else 
 
-	int src_id = -1;
-	int dest_fd = -1;
-	ssize_t sum_readed = 0;
-	ssize_t sum_written = 0;
-	src_id = open(szSrcFile, O_RDONLY);
-	if (-1 != src_id) {
-		dest_fd = open(szDestFile, O_CREAT | O_WRONLY | O_TRUNC, 0644);
-		if (-1 != dest_fd) {
-			char buffer[65536];
-			ssize_t bytes_read = read(src_id, buffer, sizeof(buffer));
-			while (bytes_read > 0) {
-				sum_readed += bytes_read;
-				ssize_t bytes_written = write(dest_fd, buffer, bytes_read);
-				if (bytes_written != bytes_read) {
-					break;
-				}
-				sum_written += bytes_written;
-				bytes_read = read(src_id, buffer, sizeof(buffer));
-			}
-			close(dest_fd);
+#ifdef __APPLE__
+	if (0 == clonefile(szSrcFile, szDestFile, 0)) { // APFS, only to a new file
+		struct stat st = { 0 };
+		if (0 == stat(szDestFile, &st) && !(st.st_mode & S_IWUSR)) {
+			chmod(szDestFile, (st.st_mode & 0777) | S_IWUSR);
 		}
-		close(src_id);
+		return true;
 	}
+#endif
 
-	if (-1 == src_id || -1 == dest_fd || sum_readed != sum_written) {
+	int src_fd = open(szSrcFile, O_RDONLY | O_CLOEXEC);
+	if (-1 == src_fd) {
 		return false;
 	}
 
-	return true;
+	struct stat st = { 0 };
+	if (0 != fstat(src_fd, &st)) {
+		close(src_fd);
+		return false;
+	}
+
+	if (!DetachOverlayFile(szDestFile, false)) {
+		close(src_fd);
+		return false;
+	}
+
+	int dest_fd = open(szDestFile, O_CREAT | O_WRONLY | O_TRUNC | O_CLOEXEC, (st.st_mode & 0777) | S_IWUSR);
+	if (-1 == dest_fd) {
+		close(src_fd);
+		return false;
+	}
+
+	bool bRet = CopyFileData(src_fd, dest_fd, (uint64_t)st.st_size);
+	close(dest_fd);
+	close(src_fd);
+	return bRet;
 
 #endif
 }
@@ -370,6 +521,150 @@ bool ZFile::CopyFileV(const char* szSrcFile, const char* szDestPath, ...)
 	return CopyFile(szSrcFile, szDestFile);
 }
 
+// Copies a folder tree to szDestFolder, which must not exist yet. Files
+// are cloned copy-on-write where the file system supports it, so the copy
+// costs next to nothing on APFS, btrfs and XFS. Symbolic links are
+// recreated with the same target, not followed.
+bool ZFile::CloneFolder(const char* szSrcFolder, const char* szDestFolder)
+{
+	string strSrcFolder = szSrcFolder;
+	string strDestFolder = szDestFolder;
+	string strParent = strDestFolder;
+	if (PathRemoveFileSpec(strParent) && !strParent.empty()) {
+		CreateFolder(strParent.c_str());
+	}
+
+#ifdef __APPLE__
+	if (0 == clonefile(szSrcFolder, szDestFolder, 0)) {
+		return true;
+	}
+#endif
+
+	if (!CreateFolder(szDestFolder)) {
+		return false;
+	}
+
+	bool bRet = true;
+	vector<string> arrFiles;
+	set<string> setLinks; // a re-listed folder filters its entries again
+	auto filter = [&](bool bFolder, const string& strPath) {
+#ifndef _WIN32
+		struct stat st = { 0 };
+		if (0 == lstat(strPath.c_str(), &st) && S_ISLNK(st.st_mode)) {
+			setLinks.insert(strPath);
+			return true;
+		}
+#endif
+		return false;
+	};
+	EnumFolder(szSrcFolder, true, filter, [&](bool bFolder, const string& strPath) {
+		if (bFolder) {
+			if (!CreateFolder((strDestFolder + strPath.substr(strSrcFolder.size())).c_str())) {
+				bRet = false;
+				return true;
+			}
+		} else {
+			arrFiles.push_back(strPath);
+		}
+		return false;
+	});
+	if (!bRet) {
+		return false;
+	}
+
+#ifndef _WIN32
+	for (const string& strLink : setLinks) {
+		char szTarget[PATH_MAX] = { 0 };
+		string strDestLink = strDestFolder + strLink.substr(strSrcFolder.size());
+		if (readlink(strLink.c_str(), szTarget, sizeof(szTarget) - 1) < 0 || 0 != symlink(szTarget, strDestLink.c_str())) {
+			return ZLog::ErrorV(">>> Can't copy symbolic link! %s\n", strLink.c_str());
+		}
+	}
+#endif
+
+	atomic<size_t> uNext(0);
+	atomic<bool> bFailed(false);
+	ZLog::ThreadCallback logCallback = ZLog::GetThreadCallback();
+	auto worker = [&]() {
+		ZLog::SetThreadCallback(logCallback);
+		size_t i = 0;
+		while (!bFailed && (i = uNext++) < arrFiles.size()) {
+			string strDestFile = strDestFolder + arrFiles[i].substr(strSrcFolder.size());
+			if (!CopyFile(arrFiles[i].c_str(), strDestFile.c_str())) {
+				ZLog::ErrorV(">>> Can't copy file! %s\n", arrFiles[i].c_str());
+				bFailed = true;
+			}
+		}
+	};
+
+	unsigned int nThreads = thread::hardware_concurrency();
+	nThreads = (nThreads > 8) ? 8 : nThreads;
+	nThreads = (nThreads > arrFiles.size()) ? (unsigned int)arrFiles.size() : nThreads;
+
+	vector<thread> arrThreads;
+	for (unsigned int i = 1; i < nThreads; i++) {
+		try {
+			arrThreads.push_back(thread(worker));
+		} catch (...) {
+			break;
+		}
+	}
+	worker();
+	for (thread& t : arrThreads) {
+		t.join();
+	}
+	return !bFailed;
+}
+
+// Lays out szUpperFolder, which must not exist yet, as a writable view of
+// a read-only szBaseFolder: its folders are created and each file is a
+// symbolic link to the base one. Reads fall through to the base, writes
+// through ZFile (WriteFile, AppendFile, CopyFile, a writable MapFile)
+// replace the link with a private copy, and removals only drop the link,
+// so the base is never modified. The upper folder is the merged view that
+// signing and archiving work on. Without symbolic links (Windows) the base
+// is cloned instead.
+bool ZFile::CreateOverlay(const char* szBaseFolder, const char* szUpperFolder)
+{
+#ifdef _WIN32
+	return CloneFolder(szBaseFolder, szUpperFolder);
+#else
+	string strBaseFolder = GetFullPath(szBaseFolder);
+	if (!CreateFolder(szUpperFolder)) {
+		return false;
+	}
+	string strUpperFolder = GetFullPath(szUpperFolder);
+
+	bool bRet = true;
+	EnumFolder(strBaseFolder.c_str(), true, NULL, [&](bool bFolder, const string& strPath) {
+		string strUpperPath = strUpperFolder + strPath.substr(strBaseFolder.size());
+		if (bFolder ? !CreateFolder(strUpperPath.c_str()) : (0 != symlink(strPath.c_str(), strUpperPath.c_str()))) {
+			ZLog::ErrorV(">>> Can't create overlay entry! %s, %s\n", strUpperPath.c_str(), strerror(errno));
+			bRet = false;
+			return true;
+		}
+		return false;
+	});
+
+	if (bRet) {
+		lock_guard<mutex> lock(s_mtxOverlays);
+		s_arrOverlays.push_back(strUpperFolder);
+		s_uOverlays = s_arrOverlays.size();
+	}
+	return bRet;
+#endif
+}
+
+// Ends an overlay: the links left in szUpperFolder still point into the
+// base, but writes no longer replace them.
+void ZFile::CloseOverlay(const char* szUpperFolder)
+{
+	string strUpperFolder = GetFullPath(szUpperFolder);
+	lock_guard<mutex> lock(s_mtxOverlays);
+	s_arrOverlays.erase(remove(s_arrOverlays.begin(), s_arrOverlays.end(), strUpperFolder), s_arrOverlays.end());
+	s_uOverlays = s_arrOverlays.size();
+}
+
 string ZFile::GetFullPath(const char* szPath)
 {
 	string strPath = szPath;
@@ -431,6 +726,102 @@ string ZFile::GetFileSizeString(const char* szFile)
 	return  ZUtil::FormatSize(GetFileSize(szFile), 1024);
 }
 
+// Size, mtime (ns), device and inode, enough to tell whether a file changed
+// since it was last seen. Windows has no inode, device and inode are 0 there.
+bool ZFile::GetFileStamp(const char* szFile, uint64_t& uSize, uint64_t& uMTime, uint64_t& uDevice, uint64_t& uInode)
+{
+#ifdef _WIN32
+	struct _stat64 st = { 0 };
+	if (0 != _stat64(szFile, &st)) {
+		return false;
+	}
+	uMTime = (uint64_t)st.st_mtime * 1000000000ULL;
+	uDevice = 0;
+	uInode = 0;
+#else
+	struct stat st = { 0 };
+	if (0 != stat(szFile, &st)) {
+		return false;
+	}
+#ifdef __APPLE__
+	uMTime = (uint64_t)st.st_mtimespec.tv_sec * 1000000000ULL + (uint64_t)st.st_mtimespec.tv_nsec;
+#else
+	uMTime = (uint64_t)st.st_mtim.tv_sec * 1000000000ULL + (uint64_t)st.st_mtim.tv_nsec;
+#endif
+	uDevice = (uint64_t)st.st_dev;
+	uInode = (uint64_t)st.st_ino;
+#endif
+	uSize = (uint64_t)st.st_size;
+	return true;
+}
+
+// Describes the physical extents of a reflinked (cloned) file, so that two
+// files sharing exactly the same extents are known to have the same content.
+// Only succeeds when every byte lives in a shared, allocated extent; holes,
+// delayed allocation, inline and encoded (compressed) extents all fail.
+// Physical offsets are per filesystem, so the key starts with uDevice, the
+// file's st_dev.
+bool ZFile::GetSharedExtents(const char* szFile, uint64_t uSize, uint64_t uDevice, string& strKey)
+{
+	strKey.clear();
+#ifdef __linux__
+	if (0 == uSize) {
+		return false;
+	}
+
+	int fd = open(szFile, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+
+	const uint32_t uMaxExtents = 32;
+	vector<uint8_t> arrBuffer(sizeof(struct fiemap) + uMaxExtents * sizeof(struct fiemap_extent), 0);
+	struct fiemap* pMap = (struct fiemap*)arrBuffer.data();
+	pMap->fm_start = 0;
+	pMap->fm_length = uSize;
+	pMap->fm_extent_count = uMaxExtents;
+	int nRet = ioctl(fd, FS_IOC_FIEMAP, pMap);
+	close(fd);
+	if (0 != nRet || 0 == pMap->fm_mapped_extents) {
+		return false;
+	}
+
+	const uint32_t uUnstable = FIEMAP_EXTENT_UNKNOWN | FIEMAP_EXTENT_DELALLOC | FIEMAP_EXTENT_ENCODED |
+							FIEMAP_EXTENT_DATA_ENCRYPTED | FIEMAP_EXTENT_NOT_ALIGNED | FIEMAP_EXTENT_DATA_INLINE |
+							FIEMAP_EXTENT_DATA_TAIL | FIEMAP_EXTENT_UNWRITTEN;
+	uint64_t uNext = 0;
+	strKey.append((const char*)&uDevice, sizeof(uDevice));
+	strKey.append((const char*)&uSize, sizeof(uSize));
+	for (uint32_t i = 0; i < pMap->fm_mapped_extents; i++) {
+		const struct fiemap_extent& extent = pMap->fm_extents[i];
+		if (extent.fe_logical != uNext || !(extent.fe_flags & FIEMAP_EXTENT_SHARED) || (extent.fe_flags & uUnstable)) {
+			strKey.clear();
+			return false;
+		}
+		uNext = extent.fe_logical + extent.fe_length;
+		strKey.append((const char*)&extent.fe_physical, sizeof(extent.fe_physical));
+		strKey.append((const char*)&extent.fe_length, sizeof(extent.fe_length));
+	}
+	if (uNext < uSize) { // more extents than asked for, or a trailing hole
+		strKey.clear();
+		return false;
+	}
+	return true;
+#else
+	return false;
+#endif
+}
+
+// Replaces szDestFile atomically where the platform allows it.
+bool ZFile::RenameFile(const char* szSrcFile, const char* szDestFile)
+{
+#ifdef _WIN32
+	return ::MoveFileExA(szSrcFile, szDestFile, MOVEFILE_REPLACE_EXISTING) ? true : false;
+#else
+	return (0 == rename(szSrcFile, szDestFile));
+#endif
+}
+
 bool ZFile::IsPathSuffix(const string& strPath, const char* suffix)
 {
 	size_t nPos = strPath.rfind(suffix);
@@ -446,113 +837,975 @@ const char* ZFile::GetTempFolder()
 {
 	static once_flag s_flag;
 	static string s_strTempFolder;
-	if (s_strTempFolder.empty()) {
-		call_once(s_flag, [&]() {
+	call_once(s_flag, [&]() {
+#ifdef _WIN32
+		char szTempPath[PATH_MAX] = { 0 };
+		if (0 != ::GetTempPathA(PATH_MAX, szTempPath)) {
+			s_strTempFolder = szTempPath;
+		} else {
+			s_strTempFolder = GetFullPath("./");
+		}
+		if (!s_strTempFolder.empty() && s_strTempFolder.back() == '\\') {
+			s_strTempFolder.pop_back();
+		}
+#else
+		s_strTempFolder = "/tmp";
+#endif
+	});
+	return s_strTempFolder.c_str();
+}
+
+static void* AlignedAlloc(size_t size)
+{
+#ifdef _WIN32
+	return _aligned_malloc(size, 4096);
+#else
+	void* p = NULL;
+	return (0 == posix_memalign(&p, 4096, size)) ? p : NULL;
+#endif
+}
+
+static void AlignedFree(void* p)
+{
+#ifdef _WIN32
+	_aligned_free(p);
+#else
+	free(p);
+#endif
+}
+
+// Fills pBuffer as far as possible, returns the byte count or -1 on error.
 #ifdef _WIN32
-			char szTempPath[PATH_MAX] = { 0 };
-			if (0 != ::GetTempPathA(PATH_MAX, szTempPath)) {
-				s_strTempFolder = szTempPath;
+static int64_t ReadBlock(FILE* fp, uint8_t* pBuffer, size_t uSize)
+{
+	size_t readed = fread(pBuffer, 1, uSize, fp);
+	return (readed < uSize && ferror(fp)) ? -1 : (int64_t)readed;
+}
+#else
+static int64_t ReadBlock(int fd, uint8_t* pBuffer, size_t uSize)
+{
+	size_t readed = 0;
+	while (readed < uSize) {
+		ssize_t ret = read(fd, pBuffer + readed, uSize - readed);
+		if (ret < 0) {
+			if (EINTR == errno) {
+				continue;
+			}
+			return -1;
+		}
+		if (0 == ret) {
+			break;
+		}
+		readed += ret;
+	}
+	return (int64_t)readed;
+}
+#endif
+
+bool ZFile::StreamFile(const char* szFile, size_t uBlockSize, stream_file_callback callback, bool bDropCache)
+{
+	if (NULL == szFile || NULL == callback || 0 == uBlockSize) {
+		return false;
+	}
+
+#ifdef _WIN32
+	FILE* fd = NULL;
+	_fopen64(fd, szFile, "rb");
+	if (NULL == fd) {
+		return false;
+	}
+	setvbuf(fd, NULL, _IONBF, 0);
+#else
+	int fd = open(szFile, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return false;
+	}
+#if defined(POSIX_FADV_SEQUENTIAL)
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#elif defined(F_RDAHEAD)
+	fcntl(fd, F_RDAHEAD, 1);
+#endif
+#endif
+
+	// two blocks: the reader thread fills one while the caller consumes the other
+	struct Slot
+	{
+		uint8_t*	pData;
+		int64_t		nSize;	// -1 while empty, -2 on read error
+	};
+	Slot slots[2] = { { (uint8_t*)AlignedAlloc(uBlockSize), -1 }, { (uint8_t*)AlignedAlloc(uBlockSize), -1 } };
+
+	bool bRet = (NULL != slots[0].pData && NULL != slots[1].pData);
+	if (bRet) {
+		mutex mtx;
+		condition_variable cv;
+		bool bStop = false;
+
+		auto reader = [&]() {
+			for (size_t i = 0;; i ^= 1) {
+				Slot& slot = slots[i];
+				{
+					unique_lock<mutex> lock(mtx);
+					while (slot.nSize >= 0 && !bStop) {
+						cv.wait(lock);
+					}
+					if (bStop) {
+						return;
+					}
+				}
+
+				int64_t nReaded = ReadBlock(fd, slot.pData, uBlockSize);
+
+				unique_lock<mutex> lock(mtx);
+				slot.nSize = (nReaded < 0) ? -2 : nReaded;
+				cv.notify_all();
+				if (nReaded < (int64_t)uBlockSize) {
+					return;
+				}
+			}
+		};
+
+		// a reader thread only pays off when it can run beside the consumer
+		thread tReader;
+		bool bThreaded = (thread::hardware_concurrency() > 1);
+		if (bThreaded) {
+			try {
+				tReader = thread(reader);
+			} catch (...) {
+				bThreaded = false;
+			}
+		}
+
+		for (size_t i = 0;; i ^= 1) {
+			Slot& slot = slots[i];
+			int64_t nSize = 0;
+			if (bThreaded) {
+				unique_lock<mutex> lock(mtx);
+				while (-1 == slot.nSize) {
+					cv.wait(lock);
+				}
+				nSize = slot.nSize;
 			} else {
-				s_strTempFolder = GetFullPath("./");
+				int64_t nReaded = ReadBlock(fd, slot.pData, uBlockSize);
+				nSize = (nReaded < 0) ? -2 : nReaded;
+			}
+
+			if (nSize < 0) {
+				bRet = false;
+				break;
+			}
+			if (nSize > 0) {
+				ZStats::Add(ZStats::E_BYTES_READ, nSize);
+				callback(slot.pData, (size_t)nSize);
+			}
+			if (nSize < (int64_t)uBlockSize) {
+				break;
 			}
-			if (!s_strTempFolder.empty() && s_strTempFolder.back() == '\\') {
-				s_strTempFolder.pop_back();
+
+			if (bThreaded) {
+				unique_lock<mutex> lock(mtx);
+				slot.nSize = -1;
+				cv.notify_all();
+			}
+		}
+
+		if (bThreaded) {
+			{
+				unique_lock<mutex> lock(mtx);
+				bStop = true;
+				cv.notify_all();
 			}
+			tReader.join();
+		}
+	}
+
+	AlignedFree(slots[0].pData);
+	AlignedFree(slots[1].pData);
+
+#ifdef _WIN32
+	fclose(fd);
 #else
-			s_strTempFolder = "/tmp";
+#if defined(POSIX_FADV_DONTNEED)
+	// only when the caller knows nobody reads the file again soon: signing
+	// zips or copies the same resources right after hashing them
+	if (bDropCache) {
+		posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+	}
 #endif
-		});
+	close(fd);
+#endif
+
+	return bRet;
+}
+
+// Reads up to uMaxBytes (0 = whole file) from the start of szFile.
+static bool ReadFileHead(const char* szFile, size_t uMaxBytes, string& strData)
+{
+	strData.clear();
+	if (0 == uMaxBytes) {
+		return ZFile::ReadFile(szFile, strData);
 	}
-	return s_strTempFolder.c_str();
+
+	FILE* fp = NULL;
+	_fopen64(fp, szFile, "rb");
+	if (NULL == fp) {
+		return false;
+	}
+	strData.resize(uMaxBytes);
+	size_t readed = fread(&strData[0], 1, uMaxBytes, fp);
+	strData.resize(readed);
+	fclose(fp);
+	return true;
 }
 
-bool ZFile::EnumFolder(const char* szFolder, bool bRecursive, enum_folder_callback filter, enum_folder_callback callback)
+static void ReadFilesThreaded(const vector<string>& arrFiles, size_t uMaxBytes, vector<string>& arrDatas)
 {
-	string strFolder = szFolder;
-	if (strFolder.empty() || NULL == callback) {
+	atomic<size_t> uNext(0);
+	ZLog::ThreadCallback logCallback = ZLog::GetThreadCallback();
+	auto worker = [&]() {
+		ZLog::SetThreadCallback(logCallback);
+		for (size_t i = uNext++; i < arrFiles.size(); i = uNext++) {
+			ReadFileHead(arrFiles[i].c_str(), uMaxBytes, arrDatas[i]);
+		}
+	};
+
+	unsigned int nThreads = thread::hardware_concurrency();
+	nThreads = (nThreads > 8) ? 8 : nThreads;
+	if (arrFiles.size() < 16) {
+		nThreads = 1;
+	}
+
+	vector<thread> arrThreads;
+	for (unsigned int i = 1; i < nThreads; i++) {
+		try {
+			arrThreads.push_back(thread(worker));
+		} catch (...) {
+			break;
+		}
+	}
+	worker();
+	for (thread& t : arrThreads) {
+		t.join();
+	}
+}
+
+#ifdef ZSIGN_HAS_IO_URING
+
+// Minimal io_uring reader on raw syscalls (no liburing dependency). Only
+// IORING_OP_READ is used; one ring is set up per ReadFiles call. Kernels
+// before 5.6 have io_uring but not IORING_OP_READ, nor the probe that
+// tells, so Init fails there and the caller falls back to threads.
+class ZUringReader
+{
+public:
+	ZUringReader()
+		: m_nRingFd(-1), m_pSqRing(NULL), m_pCqRing(NULL), m_pSqes(NULL), m_uSqRingSize(0), m_uCqRingSize(0)
+	{
+		memset(&m_params, 0, sizeof(m_params));
+	}
+
+	~ZUringReader()
+	{
+		if (NULL != m_pSqes) {
+			munmap(m_pSqes, m_params.sq_entries * sizeof(io_uring_sqe));
+		}
+		if (NULL != m_pCqRing && m_pCqRing != m_pSqRing) {
+			munmap(m_pCqRing, m_uCqRingSize);
+		}
+		if (NULL != m_pSqRing) {
+			munmap(m_pSqRing, m_uSqRingSize);
+		}
+		if (m_nRingFd >= 0) {
+			close(m_nRingFd);
+		}
+	}
+
+	bool Init(unsigned int uDepth)
+	{
+		m_nRingFd = (int)syscall(__NR_io_uring_setup, uDepth, &m_params);
+		if (m_nRingFd < 0) {
+			return false;
+		}
+
+		m_uSqRingSize = m_params.sq_off.array + m_params.sq_entries * sizeof(unsigned);
+		m_uCqRingSize = m_params.cq_off.cqes + m_params.cq_entries * sizeof(io_uring_cqe);
+		bool bSingleMap = (0 != (m_params.features & IORING_FEAT_SINGLE_MMAP));
+		if (bSingleMap) {
+			m_uSqRingSize = m_uCqRingSize = max(m_uSqRingSize, m_uCqRingSize);
+		}
+
+		m_pSqRing = (uint8_t*)MapRing(m_uSqRingSize, IORING_OFF_SQ_RING);
+		if (NULL == m_pSqRing) {
+			return false;
+		}
+		m_pCqRing = bSingleMap ? m_pSqRing : (uint8_t*)MapRing(m_uCqRingSize, IORING_OFF_CQ_RING);
+		if (NULL == m_pCqRing) {
+			return false;
+		}
+		m_pSqes = (io_uring_sqe*)MapRing(m_params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES);
+		return (NULL != m_pSqes && IsOpSupported(IORING_OP_READ));
+	}
+
+	unsigned int Depth()
+	{
+		return m_params.sq_entries;
+	}
+
+	void PrepRead(int fd, void* buf, unsigned int len, uint64_t off, uint64_t user)
+	{
+		unsigned* pTail = (unsigned*)(m_pSqRing + m_params.sq_off.tail);
+		unsigned uMask = *(unsigned*)(m_pSqRing + m_params.sq_off.ring_mask);
+		unsigned uTail = *pTail;
+		unsigned uIndex = uTail & uMask;
+
+		io_uring_sqe* sqe = &m_pSqes[uIndex];
+		memset(sqe, 0, sizeof(io_uring_sqe));
+		sqe->opcode = IORING_OP_READ;
+		sqe->fd = fd;
+		sqe->addr = (uint64_t)(uintptr_t)buf;
+		sqe->len = len;
+		sqe->off = off;
+		sqe->user_data = user;
+
+		((unsigned*)(m_pSqRing + m_params.sq_off.array))[uIndex] = uIndex;
+		__atomic_store_n(pTail, uTail + 1, __ATOMIC_RELEASE);
+	}
+
+	// Returns how many of uToSubmit the kernel took, or -1. It only waits
+	// for uMinComplete completions when it took all of them.
+	long Submit(unsigned int uToSubmit, unsigned int uMinComplete)
+	{
+		while (true) {
+			long ret = syscall(__NR_io_uring_enter, m_nRingFd, uToSubmit, uMinComplete, IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret >= 0) {
+				return ret;
+			}
+			if (EINTR != errno) {
+				return -1;
+			}
+		}
+	}
+
+	bool Reap(uint64_t& user, int& res)
+	{
+		unsigned* pHead = (unsigned*)(m_pCqRing + m_params.cq_off.head);
+		unsigned* pTail = (unsigned*)(m_pCqRing + m_params.cq_off.tail);
+		unsigned uMask = *(unsigned*)(m_pCqRing + m_params.cq_off.ring_mask);
+		unsigned uHead = *pHead;
+		if (uHead == __atomic_load_n(pTail, __ATOMIC_ACQUIRE)) {
+			return false;
+		}
+
+		io_uring_cqe* cqe = &((io_uring_cqe*)(m_pCqRing + m_params.cq_off.cqes))[uHead & uMask];
+		user = cqe->user_data;
+		res = cqe->res;
+		__atomic_store_n(pHead, uHead + 1, __ATOMIC_RELEASE);
+		return true;
+	}
+
+private:
+	bool IsOpSupported(unsigned int uOp)
+	{
+		vector<uint8_t> arrProbe(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+		io_uring_probe* pProbe = (io_uring_probe*)arrProbe.data();
+		if (syscall(__NR_io_uring_register, m_nRingFd, IORING_REGISTER_PROBE, pProbe, 256) < 0) {
+			return false;
+		}
+		return (uOp <= pProbe->last_op && 0 != (pProbe->ops[uOp].flags & IO_URING_OP_SUPPORTED));
+	}
+
+	void* MapRing(size_t size, off_t offset)
+	{
+		void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_nRingFd, offset);
+		return (MAP_FAILED == p) ? NULL : p;
+	}
+
+private:
+	int				m_nRingFd;
+	io_uring_params	m_params;
+	uint8_t*		m_pSqRing;
+	uint8_t*		m_pCqRing;
+	io_uring_sqe*	m_pSqes;
+	size_t			m_uSqRingSize;
+	size_t			m_uCqRingSize;
+};
+
+static bool ReadFilesUring(const vector<string>& arrFiles, size_t uMaxBytes, vector<string>& arrDatas)
+{
+	ZUringReader ring;
+	if (!ring.Init(64)) {
 		return false;
 	}
 
+	unsigned int uDepth = ring.Depth();
+	unsigned int uPending = 0;
+	unsigned int uInflight = 0;
+	vector<int> arrFds(arrFiles.size(), -1);
+
+	auto complete = [&](size_t i, int res) {
+		string& strData = arrDatas[i];
+		if (res < 0) {
+			// e.g. a filesystem that refuses this read, try it the slow way
+			close(arrFds[i]);
+			arrFds[i] = -1;
+			ReadFileHead(arrFiles[i].c_str(), uMaxBytes, strData);
+			return;
+		} else if ((size_t)res < strData.size()) {
+			// short read, finish the tail synchronously
+			size_t readed = (size_t)res;
+			while (readed < strData.size()) {
+				ssize_t ret = pread(arrFds[i], &strData[readed], strData.size() - readed, readed);
+				if (ret <= 0) {
+					break;
+				}
+				readed += ret;
+			}
+			strData.resize(readed);
+		}
+		close(arrFds[i]);
+		arrFds[i] = -1;
+	};
+
+	auto drain = [&](unsigned int uMinComplete) {
+		// the kernel may take fewer SQEs than offered; the rest stay in the
+		// ring and are offered again, and only what it took is in flight
+		do {
+			long ret = ring.Submit(uPending, uMinComplete);
+			if (ret < 0 || (0 == ret && uPending > 0)) {
+				return false;
+			}
+			uPending -= (unsigned int)ret;
+			uInflight += (unsigned int)ret;
+		} while (uPending > 0);
+
+		uint64_t user = 0;
+		int res = 0;
+		while (ring.Reap(user, res)) {
+			complete((size_t)user, res);
+			uInflight--;
+		}
+		return true;
+	};
+
+	bool bOK = true;
+	size_t uOpened = 0; // files before this one were queued or skipped
+	for (; uOpened < arrFiles.size() && bOK; uOpened++) {
+		size_t i = uOpened;
+		int fd = open(arrFiles[i].c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			continue;
+		}
+
+		size_t len = uMaxBytes;
+		if (0 == len) {
+			struct stat st = { 0 };
+			if (0 == fstat(fd, &st) && st.st_size > 0) {
+				len = (size_t)st.st_size;
+			}
+		}
+		if (0 == len) {
+			close(fd);
+			continue;
+		}
+
+		arrFds[i] = fd;
+		arrDatas[i].resize(len);
+		ring.PrepRead(fd, &arrDatas[i][0], (unsigned int)min(len, (size_t)0x7ffff000), 0, i);
+		uPending++;
+
+		if (uPending + uInflight >= uDepth) {
+			bOK = drain(1);
+		}
+	}
+
+	while (bOK && (uPending + uInflight) > 0) {
+		bOK = drain(1);
+	}
+
+	if (!bOK) {
+		// The ring became unusable midway. The reads the kernel took may
+		// still write into their buffers and use their fds, so wait for all
+		// of them before redoing anything; the ones it never took are
+		// dropped with the ring.
+		uint64_t user = 0;
+		int res = 0;
+		while (uInflight > 0) {
+			if (ring.Reap(user, res)) {
+				complete((size_t)user, res);
+				uInflight--;
+			} else if (ring.Submit(0, 1) < 0) {
+				break;
+			}
+		}
+
+		if (uInflight > 0) {
+			// can't even wait for them: leave every buffer and fd the kernel
+			// may still use behind, and redo the rest on fresh ones
+			vector<string>* pAbandoned = new vector<string>();
+			pAbandoned->swap(arrDatas);
+			arrDatas.resize(pAbandoned->size());
+			for (size_t i = 0; i < arrFiles.size(); i++) {
+				if (i < uOpened && arrFds[i] < 0) {
+					arrDatas[i] = (*pAbandoned)[i];
+				} else {
+					ReadFileHead(arrFiles[i].c_str(), uMaxBytes, arrDatas[i]);
+				}
+			}
+			return true;
+		}
+
+		for (size_t i = 0; i < arrFiles.size(); i++) {
+			if (arrFds[i] >= 0) {
+				close(arrFds[i]);
+				arrFds[i] = -1;
+				ReadFileHead(arrFiles[i].c_str(), uMaxBytes, arrDatas[i]);
+			} else if (i >= uOpened) {
+				ReadFileHead(arrFiles[i].c_str(), uMaxBytes, arrDatas[i]);
+			}
+		}
+	}
+	return true;
+}
+
+#endif
+
+bool ZFile::ReadFiles(const vector<string>& arrFiles, size_t uMaxBytes, vector<string>& arrDatas)
+{
+	arrDatas.clear();
+	arrDatas.resize(arrFiles.size());
+	if (arrFiles.empty()) {
+		return true;
+	}
+
+	bool bReaded = false;
+#ifdef ZSIGN_HAS_IO_URING
+	bReaded = ReadFilesUring(arrFiles, uMaxBytes, arrDatas);
+#endif
+	if (!bReaded) {
+		ReadFilesThreaded(arrFiles, uMaxBytes, arrDatas);
+	}
+
+	uint64_t uReaded = 0;
+	for (const string& strData : arrDatas) {
+		uReaded += strData.size();
+	}
+	ZStats::Add(ZStats::E_BYTES_READ, uReaded);
+	return true;
+}
+
+// Snapshot of one directory produced by the folder walker. Each node is
+// filled by exactly one worker; child nodes are allocated by the parent
+// before they are queued, so no node is shared while it is being written.
+// While the tree is scanned, a directory stays open until all its queued
+// subfolders have been opened relative to it.
+struct ZFolderNode
+{
+	struct Entry
+	{
+		string	strName;
+		bool	bFolder;
+		bool	bFiltered; // rejected by the filter, neither reported nor walked
+		unique_ptr<ZFolderNode> pChild;
+	};
+
+	ZFolderNode()
+	{
+		bListed = false;
+		bRacy = false;
+		uMTime = 0;
+		pParent = NULL;
+		nFd = -1;
+		uOpenChildren = 0;
+	}
+
+	string			strPath;
+	bool			bListed;
+	bool			bRacy;	// modified in the second it was listed, uMTime can't tell a later change
+	uint64_t		uMTime;	// of the directory, when it was listed
+	vector<Entry>	arrEntries;
+	ZFolderNode*	pParent;
+	int				nFd;			// POSIX only, -1 once closed
+	atomic<size_t>	uOpenChildren;	// queued subfolders not opened yet
+};
+
+// Directories read on the calling thread before the walk goes parallel,
+// so small trees never start a thread.
+#define FOLDER_WALK_SERIAL_LIMIT	64
+
+#if defined(__linux__) && defined(SYS_getdents64)
+struct ZLinuxDirent64
+{
+	uint64_t		d_ino;
+	int64_t			d_off;
+	unsigned short	d_reclen;
+	unsigned char	d_type;
+	char			d_name[1];
+};
+#endif
+
+#if defined(_WIN32) && !defined(FIND_FIRST_EX_LARGE_FETCH)
+#define FIND_FIRST_EX_LARGE_FETCH	0x00000002 // left out of the headers when _WIN32_WINNT targets XP
+#endif
+
+// Lists strFolder on Windows, the open directory fd elsewhere.
+static bool ReadFolderEntries(int fd, const string& strFolder, vector<ZFolderNode::Entry>& arrEntries)
+{
+	arrEntries.clear();
+
 #ifdef _WIN32
+
 	string strFromFolder = strFolder + "\\*";
 	WIN32_FIND_DATAA fd = { 0 };
-	HANDLE hFind = ::FindFirstFileA(strFromFolder.c_str(), &fd);
+	// FindExInfoBasic and FIND_FIRST_EX_LARGE_FETCH need Windows 7; older
+	// systems reject the call, so fall back to a plain FindFirstFile there
+	HANDLE hFind = ::FindFirstFileExA(strFromFolder.c_str(), FindExInfoBasic, &fd, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+	if (INVALID_HANDLE_VALUE == hFind) {
+		hFind = ::FindFirstFileA(strFromFolder.c_str(), &fd);
+	}
 	if (INVALID_HANDLE_VALUE == hFind) {
 		return false;
 	}
 
-	while (::FindNextFileA(hFind, &fd)) {
+	do {
 		if (0 == strcmp(fd.cFileName, ".") || 0 == strcmp(fd.cFileName, "..")) {
 			continue;
 		}
+		ZFolderNode::Entry entry;
+		entry.strName = fd.cFileName;
+		entry.bFolder = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? true : false;
+		arrEntries.push_back(move(entry));
+	} while (::FindNextFileA(hFind, &fd));
+	::FindClose(hFind);
 
-		string strName = fd.cFileName;
-		string strPath = strFolder + "\\" + strName;
-		bool bFolder = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) ? true : false;
+#else
 
-		if (NULL != filter) {
-			if (filter(bFolder, strPath)) {
-				continue;
-			}
-		}
+	// entries whose d_type is DT_UNKNOWN (overlayfs, some network filesystems)
+	// are resolved in one batch relative to the directory fd once listing is done.
+	vector<size_t> arrUnknown;
 
-		if (callback(bFolder, strPath)) {
+#if defined(__linux__) && defined(SYS_getdents64)
+
+	vector<char> buffer(64 * 1024);
+	while (true) {
+		long nread = syscall(SYS_getdents64, fd, buffer.data(), buffer.size());
+		if (nread < 0) {
+			return false;
+		}
+		if (0 == nread) {
 			break;
 		}
+		for (long pos = 0; pos < nread;) {
+			ZLinuxDirent64* d = (ZLinuxDirent64*)(buffer.data() + pos);
+			pos += d->d_reclen;
+			if (0 == strcmp(d->d_name, ".") || 0 == strcmp(d->d_name, "..")) {
+				continue;
+			}
+			ZFolderNode::Entry entry;
+			entry.strName = d->d_name;
+			entry.bFolder = (DT_DIR == d->d_type);
+			if (DT_UNKNOWN == d->d_type) {
+				arrUnknown.push_back(arrEntries.size());
+			}
+			arrEntries.push_back(move(entry));
+		}
+	}
 
-		if (bFolder && bRecursive) {
-			EnumFolder(strPath.c_str(), bRecursive, filter, callback);
+	for (size_t i : arrUnknown) {
+		ZFolderNode::Entry& entry = arrEntries[i];
+#if defined(SYS_statx) && defined(STATX_TYPE) && defined(AT_STATX_DONT_SYNC)
+		struct statx stx;
+		if (0 == syscall(SYS_statx, fd, entry.strName.c_str(), AT_STATX_DONT_SYNC, STATX_TYPE, &stx)) {
+			entry.bFolder = S_ISDIR(stx.stx_mode);
+			continue;
 		}
+#endif
+		struct stat st = { 0 };
+		entry.bFolder = (0 == fstatat(fd, entry.strName.c_str(), &st, 0) && S_ISDIR(st.st_mode));
 	}
-	::FindClose(hFind);
 
 #else
 
-	DIR* dir = opendir(szFolder);
+	// the DIR takes over its fd, so it gets a copy
+	int nDirFd = dup(fd);
+	DIR* dir = (nDirFd >= 0) ? fdopendir(nDirFd) : NULL;
 	if (NULL == dir) {
+		if (nDirFd >= 0) {
+			close(nDirFd);
+		}
 		return false;
 	}
-	
+
+	errno = 0;
 	dirent* ptr = readdir(dir);
 	while (NULL != ptr) {
-		if (0 == strcmp(ptr->d_name, ".") || 0 == strcmp(ptr->d_name, "..")) {
-			ptr = readdir(dir);
-			continue;
+		if (0 != strcmp(ptr->d_name, ".") && 0 != strcmp(ptr->d_name, "..")) {
+			ZFolderNode::Entry entry;
+			entry.strName = ptr->d_name;
+			entry.bFolder = (DT_DIR == ptr->d_type);
+			if (DT_UNKNOWN == ptr->d_type) {
+				arrUnknown.push_back(arrEntries.size());
+			}
+			arrEntries.push_back(move(entry));
 		}
+		ptr = readdir(dir);
+	}
+	if (0 != errno) {
+		closedir(dir);
+		return false;
+	}
 
-		string strPath = strFolder + "/" + ptr->d_name;
+	for (size_t i : arrUnknown) {
+		ZFolderNode::Entry& entry = arrEntries[i];
+		struct stat st = { 0 };
+		entry.bFolder = (0 == fstatat(fd, entry.strName.c_str(), &st, 0) && S_ISDIR(st.st_mode));
+	}
+	closedir(dir);
 
-		bool bFolder = false;
-		if (DT_DIR == ptr->d_type) {
-			bFolder = true;
-		} else if (DT_UNKNOWN == ptr->d_type) {
-			struct stat st = { 0 };
-			if (0 == stat(strPath.c_str(), &st) && S_ISDIR(st.st_mode)) {
-				bFolder = true;
+#endif
+
+#endif
+
+	sort(arrEntries.begin(), arrEntries.end(), [](const ZFolderNode::Entry& a, const ZFolderNode::Entry& b) {
+		return a.strName < b.strName;
+	});
+	return true;
+}
+
+static bool ListFolderNode(ZFolderNode* pNode)
+{
+	// stamp first, so a change made while listing shows up as a newer mtime
+	uint64_t uSize = 0;
+	uint64_t uDevice = 0;
+	uint64_t uInode = 0;
+	time_t tListed = time(NULL);
+	if (!ZFile::GetFileStamp(pNode->strPath.c_str(), uSize, pNode->uMTime, uDevice, uInode)) {
+		return false;
+	}
+	pNode->bRacy = ((int64_t)(pNode->uMTime / 1000000000ULL) >= (int64_t)tListed);
+
+#ifdef _WIN32
+	pNode->bListed = ReadFolderEntries(-1, pNode->strPath, pNode->arrEntries);
+#else
+	// relative to the parent while it is still open, so the walk doesn't
+	// resolve the whole path again for every directory
+	int fd = -1;
+	ZFolderNode* pParent = pNode->pParent;
+	if (NULL != pParent && pParent->nFd >= 0) {
+		string strName = pNode->strPath.substr(pParent->strPath.size() + 1);
+		fd = openat(pParent->nFd, strName.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (1 == pParent->uOpenChildren--) {
+			close(pParent->nFd);
+			pParent->nFd = -1;
+		}
+	}
+	if (fd < 0) {
+		fd = open(pNode->strPath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	}
+	pNode->bListed = (fd >= 0 && ReadFolderEntries(fd, pNode->strPath, pNode->arrEntries));
+	if (pNode->bListed) {
+		pNode->nFd = fd; // ExpandFolderNode decides how long it stays open
+	} else if (fd >= 0) {
+		close(fd);
+	}
+#endif
+	return pNode->bListed;
+}
+
+static bool IsFolderNodeStale(const ZFolderNode* pNode)
+{
+	uint64_t uSize = 0;
+	uint64_t uMTime = 0;
+	uint64_t uDevice = 0;
+	uint64_t uInode = 0;
+	return (!pNode->bListed || pNode->bRacy ||
+			!ZFile::GetFileStamp(pNode->strPath.c_str(), uSize, uMTime, uDevice, uInode) ||
+			uMTime != pNode->uMTime);
+}
+
+// Applies the filter to the entries of a listed node and, when recursive,
+// allocates the nodes of the subfolders it kept. The node's directory is
+// closed here unless subfolders were queued, then the last of them to be
+// opened closes it.
+static void ExpandFolderNode(ZFolderNode* pNode, bool bRecursive, enum_folder_callback& filter, vector<ZFolderNode*>* pQueue)
+{
+#ifdef _WIN32
+	const char* szSep = "\\";
+#else
+	const char* szSep = "/";
+#endif
+	size_t uQueued = 0;
+	for (ZFolderNode::Entry& entry : pNode->arrEntries) {
+		string strPath = pNode->strPath + szSep + entry.strName;
+		entry.bFiltered = (NULL != filter && filter(entry.bFolder, strPath));
+		if (entry.bFolder && bRecursive && !entry.bFiltered) {
+			entry.pChild.reset(new ZFolderNode());
+			entry.pChild->strPath = strPath;
+			entry.pChild->pParent = pNode;
+			if (NULL != pQueue) {
+				pQueue->push_back(entry.pChild.get());
+				uQueued++;
 			}
 		}
+	}
 
-		if (NULL != filter) {
-			if (filter(bFolder, strPath)) {
-				ptr = readdir(dir);
-				continue;
+#ifndef _WIN32
+	if (pNode->nFd >= 0) {
+		if (uQueued > 0) {
+			pNode->uOpenChildren = uQueued;
+		} else {
+			close(pNode->nFd);
+			pNode->nFd = -1;
+		}
+	}
+#endif
+}
+
+// Lists the tree ahead of the replay: serially for the first directories,
+// then on up to 8 threads when there are more. The filter is only ever
+// called by one thread at a time.
+static void ScanFolderTree(ZFolderNode* pRoot, bool bRecursive, enum_folder_callback& filter)
+{
+	vector<ZFolderNode*> arrQueue;
+	ExpandFolderNode(pRoot, bRecursive, filter, &arrQueue);
+
+	for (int i = 0; i < FOLDER_WALK_SERIAL_LIMIT && !arrQueue.empty(); i++) {
+		ZFolderNode* pNode = arrQueue.back();
+		arrQueue.pop_back();
+		if (ListFolderNode(pNode)) {
+			ExpandFolderNode(pNode, bRecursive, filter, &arrQueue);
+		}
+	}
+	if (arrQueue.empty()) {
+		return;
+	}
+
+	mutex mtx;
+	condition_variable cv;
+	size_t nBusy = 0;
+	ZLog::ThreadCallback logCallback = ZLog::GetThreadCallback();
+	auto worker = [&]() {
+		ZLog::SetThreadCallback(logCallback);
+		unique_lock<mutex> lock(mtx);
+		while (true) {
+			while (arrQueue.empty() && nBusy > 0) {
+				cv.wait(lock);
+			}
+			if (arrQueue.empty()) {
+				break;
 			}
+
+			ZFolderNode* pNode = arrQueue.back();
+			arrQueue.pop_back();
+			nBusy++;
+			lock.unlock();
+
+			bool bListed = ListFolderNode(pNode);
+
+			lock.lock();
+			if (bListed) {
+				ExpandFolderNode(pNode, bRecursive, filter, &arrQueue);
+			}
+			nBusy--;
+			cv.notify_all();
 		}
+	};
+
+	unsigned int nThreads = thread::hardware_concurrency();
+	nThreads = (nThreads > 8) ? 8 : nThreads;
 
-		if (callback(bFolder, strPath)) {
+	vector<thread> arrThreads;
+	for (unsigned int i = 1; i < nThreads; i++) {
+		try {
+			arrThreads.push_back(thread(worker));
+		} catch (...) {
 			break;
 		}
+	}
+	worker();
+	for (thread& t : arrThreads) {
+		t.join();
+	}
+}
 
-		if (bFolder && bRecursive) {
-			EnumFolder(strPath.c_str(), bRecursive, filter, callback);
-		}
+// A directory changed since it was listed (e.g. by an earlier callback of
+// this walk) is listed again before it is replayed; the subfolders that
+// are still there keep what was listed for them, which is checked the same
+// way on the way down.
+static bool RefreshFolderNode(ZFolderNode* pNode, bool bRecursive, enum_folder_callback& filter)
+{
+	if (!IsFolderNodeStale(pNode)) {
+		return true;
+	}
 
-		ptr = readdir(dir);
+	vector<ZFolderNode::Entry> arrOldEntries;
+	arrOldEntries.swap(pNode->arrEntries);
+	if (!ListFolderNode(pNode)) {
+		return false;
 	}
-	closedir(dir);
+	ExpandFolderNode(pNode, bRecursive, filter, NULL);
 
+	size_t k = 0;
+	for (ZFolderNode::Entry& entry : pNode->arrEntries) {
+		while (k < arrOldEntries.size() && arrOldEntries[k].strName < entry.strName) {
+			k++;
+		}
+		if (entry.pChild && k < arrOldEntries.size() && arrOldEntries[k].strName == entry.strName && arrOldEntries[k].pChild) {
+			entry.pChild = move(arrOldEntries[k].pChild);
+		}
+	}
+	return true;
+}
+
+static bool ReplayFolderTree(ZFolderNode* pNode, bool bRecursive, enum_folder_callback& filter, enum_folder_callback& callback)
+{
+#ifdef _WIN32
+	const char* szSep = "\\";
+#else
+	const char* szSep = "/";
 #endif
+	if (!RefreshFolderNode(pNode, bRecursive, filter)) {
+		return false; // gone
+	}
+
+	for (ZFolderNode::Entry& entry : pNode->arrEntries) {
+		if (entry.bFiltered) {
+			continue;
+		}
+
+		string strPath = entry.pChild ? entry.pChild->strPath : (pNode->strPath + szSep + entry.strName);
+
+		if (callback(entry.bFolder, strPath)) {
+			return true;
+		}
+
+		if (entry.pChild && ReplayFolderTree(entry.pChild.get(), bRecursive, filter, callback)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// The filter is applied while the tree is listed, so rejected subtrees are
+// never read. Listing goes parallel only for large trees, and the filter
+// then runs on those worker threads, one call at a time; directories that
+// change before they are replayed are filtered again on the calling
+// thread. So a filter must not rely on thread-local state, nor on seeing
+// each path only once. The callback is replayed on the calling thread in
+// sorted, depth-first order. A callback returning true ends the walk.
+bool ZFile::EnumFolder(const char* szFolder, bool bRecursive, enum_folder_callback filter, enum_folder_callback callback)
+{
+	if (NULL == szFolder || 0 == szFolder[0] || NULL == callback) {
+		return false;
+	}
+
+	ZFolderNode root;
+	root.strPath = szFolder;
+	if (!ListFolderNode(&root)) {
+		return false;
+	}
 
+	ScanFolderTree(&root, bRecursive, filter);
+	ReplayFolderTree(&root, bRecursive, filter, callback);
 	return true;
 }
 
@@ -2,15 +2,18 @@
 #include "common.h"
 
 typedef function<bool (bool bFolder, const string& strPath)> enum_folder_callback;
+typedef function<void (const uint8_t* pData, size_t uSize)> stream_file_callback;
 
 class ZFile
 {
 public:
 	static bool		ReadFile(const char* szFile, string& strData);
 	static bool		ReadFileV(string& strData, const char* szPath, ...);
+	static bool		ReadFiles(const vector<string>& arrFiles, size_t uMaxBytes, vector<string>& arrDatas);
+	static bool		StreamFile(const char* szFile, size_t uBlockSize, stream_file_callback callback, bool bDropCache = false);
 	static bool		WriteFile(const char* szFile, const string& strData);
 	static bool		WriteFile(const char* szFile, const char* szData, size_t sLen);
-	static bool		WriteFileV(string& strData, const char* szPath, ...);
+	static bool		WriteFileV(const string& strData, const char* szPath, ...);
 	static bool		WriteFileV(const char* szData, size_t sLen, const char* szPath, ...);
 	static bool		AppendFile(const char* szFile, const string& strData);
 	static bool		AppendFile(const char* szFile, const char* szData, size_t sLen);
@@ -29,9 +32,15 @@ public:
 	static int64_t	GetFileSize(const char* szPath);
 	static int64_t	GetFileSizeV(const char* szPath, ...);
 	static string	GetFileSizeString(const char* szFile);
+	static bool		GetFileStamp(const char* szFile, uint64_t& uSize, uint64_t& uMTime, uint64_t& uDevice, uint64_t& uInode);
+	static bool		GetSharedExtents(const char* szFile, uint64_t uSize, uint64_t uDevice, string& strKey);
+	static bool		RenameFile(const char* szSrcFile, const char* szDestFile);
 	static bool		IsZipFile(const char* szFile);
 	static bool		CopyFile(const char* szSrcFile, const char* szDestFile);
 	static bool		CopyFileV(const char* szSrcFile, const char* szDestPath, ...);
+	static bool		CloneFolder(const char* szSrcFolder, const char* szDestFolder);
+	static bool		CreateOverlay(const char* szBaseFolder, const char* szUpperFolder);
+	static void		CloseOverlay(const char* szUpperFolder);
 	static string	GetFullPath(const char* szPath);
 	static string	GetRealPathV(const char* szPath, ...);
 	static void*	MapFile(const char* path, size_t offset, size_t size, size_t* psize, bool ro);
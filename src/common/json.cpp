@@ -494,7 +494,7 @@ jvalue& jvalue::operator[](size_t index)
 	// (e.g. index == SIZE_MAX would grow to 2^64 elements and never terminate).
 	static const size_t MAX_ARRAY_INDEX = (size_t)1 << 24; // 16M
 	if (index > MAX_ARRAY_INDEX) {
-		static jvalue sink;
+		static thread_local jvalue sink;
 		sink = jvalue();
 		return sink;
 	}
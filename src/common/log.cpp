@@ -3,9 +3,45 @@
 
 int ZLog::g_nLogLevel = ZLog::E_INFO;
 
-void ZLog::_Print(const char* szLog, int nColor)
+static thread_local ZLog::LogCallback s_pfnCallback = NULL;
+static thread_local void* s_pCallbackContext = NULL;
+static thread_local int s_nCallbackLogLevel = ZLog::E_INFO;
+
+// A callback set on this thread also carries its own log level, so jobs on
+// different threads don't share the process-wide one.
+void ZLog::SetThreadCallback(LogCallback pfnCallback, void* pContext, int nLogLevel)
+{
+	s_pfnCallback = pfnCallback;
+	s_pCallbackContext = pContext;
+	s_nCallbackLogLevel = nLogLevel;
+}
+
+void ZLog::SetThreadCallback(const ThreadCallback& callback)
+{
+	SetThreadCallback(callback.pfnCallback, callback.pContext, callback.nLogLevel);
+}
+
+ZLog::ThreadCallback ZLog::GetThreadCallback()
+{
+	ThreadCallback callback = { s_pfnCallback, s_pCallbackContext, s_nCallbackLogLevel };
+	return callback;
+}
+
+int ZLog::GetLogLevel()
+{
+	return (NULL != s_pfnCallback) ? s_nCallbackLogLevel : g_nLogLevel;
+}
+
+void ZLog::_Print(int nLevel, const char* szLog, int nColor)
 {
-	if (g_nLogLevel <= E_NONE) {
+	if (GetLogLevel() <= E_NONE) {
+		return;
+	}
+
+	if (NULL != s_pfnCallback) {
+		if (nLevel <= s_nCallbackLogLevel) {
+			s_pfnCallback(s_pCallbackContext, nLevel, szLog);
+		}
 		return;
 	}
 
@@ -51,42 +87,42 @@ void ZLog::_Print(const char* szLog, int nColor)
 
 void ZLog::Print(int nLevel, const char* szLog)
 {
-	if (g_nLogLevel >= nLevel) {
-		_Print(szLog);
+	if (GetLogLevel() >= nLevel) {
+		_Print(nLevel, szLog);
 	}
 }
 
 void ZLog::PrintV(int nLevel, const char* szFormat, ...)
 {
-	if (g_nLogLevel >= nLevel) {
+	if (GetLogLevel() >= nLevel) {
 		FORMAT_V(szFormat, szLog);
-		_Print(szLog);
+		_Print(nLevel, szLog);
 	}
 }
 
 bool ZLog::Error(const char* szLog)
 {
-	_Print(szLog, 12);
+	_Print(E_ERROR, szLog, 12);
 	return false;
 }
 
 bool ZLog::ErrorV(const char* szFormat, ...)
 {
 	FORMAT_V(szFormat, szLog);
-	_Print(szLog, 12);
+	_Print(E_ERROR, szLog, 12);
 	return false;
 }
 
 bool ZLog::Success(const char* szLog)
 {
-	_Print(szLog, 10);
+	_Print(E_INFO, szLog, 10);
 	return true;
 }
 
 bool ZLog::SuccessV(const char* szFormat, ...)
 {
 	FORMAT_V(szFormat, szLog);
-	_Print(szLog, 10);
+	_Print(E_INFO, szLog, 10);
 	return true;
 }
 
@@ -103,43 +139,43 @@ bool ZLog::PrintResultV(bool bSuccess, const char* szFormat, ...)
 
 bool ZLog::Warn(const char* szLog)
 {
-	_Print(szLog, 6);
+	_Print(E_WARN, szLog, 6);
 	return false;
 }
 
 bool ZLog::WarnV(const char* szFormat, ...)
 {
 	FORMAT_V(szFormat, szLog);
-	_Print(szLog, 6);
+	_Print(E_WARN, szLog, 6);
 	return false;
 }
 
 void ZLog::Print(const char* szLog)
 {
-	if (g_nLogLevel >= E_INFO) {
-		_Print(szLog);
+	if (GetLogLevel() >= E_INFO) {
+		_Print(E_INFO, szLog);
 	}
 }
 
 void ZLog::PrintV(const char* szFormat, ...)
 {
-	if (g_nLogLevel >= E_INFO) {
+	if (GetLogLevel() >= E_INFO) {
 		FORMAT_V(szFormat, szLog);
-		_Print(szLog);
+		_Print(E_INFO, szLog);
 	}
 }
 
 void ZLog::Debug(const char* szLog)
 {
-	if (g_nLogLevel >= E_DEBUG) {
-		_Print(szLog);
+	if (GetLogLevel() >= E_DEBUG) {
+		_Print(E_DEBUG, szLog);
 	}
 }
 
 void ZLog::DebugV(const char* szFormat, ...)
 {
-	if (g_nLogLevel >= E_DEBUG) {
+	if (GetLogLevel() >= E_DEBUG) {
 		FORMAT_V(szFormat, szLog);
-		_Print(szLog);
+		_Print(E_DEBUG, szLog);
 	}
 }
@@ -13,8 +13,20 @@ public:
 		E_DEBUG = 4
 	};
 
+	// Receives every log line of the calling thread instead of stdout.
+	typedef void (*LogCallback)(void* pContext, int nLevel, const char* szLog);
+
+	// A thread's callback as a whole, so the worker threads it starts can
+	// log to the same place.
+	struct ThreadCallback
+	{
+		LogCallback	pfnCallback;
+		void*		pContext;
+		int			nLogLevel;
+	};
+
 public:
-	static bool IsDebug() { return (E_DEBUG == g_nLogLevel); }
+	static bool IsDebug() { return (E_DEBUG == GetLogLevel()); }
 	static void Print(const char* szLog);
 	static void PrintV(const char* szFormat, ...);
 	static void Debug(const char* szLog);
@@ -30,8 +42,12 @@ public:
 	static void Print(int nLevel, const char* szLog);
 	static void PrintV(int nLevel, const char* szFormat, ...);
 	static void SetLogLever(int nLogLevel) { g_nLogLevel = nLogLevel; }
+	static void SetThreadCallback(LogCallback pfnCallback, void* pContext, int nLogLevel);
+	static void SetThreadCallback(const ThreadCallback& callback);
+	static ThreadCallback GetThreadCallback();
+	static int GetLogLevel();
 
 private:
-	static void _Print(const char* szLog, int nColor = 0);
+	static void _Print(int nLevel, const char* szLog, int nColor = 0);
 	static int g_nLogLevel;
 };
@@ -1,12 +1,283 @@
 #include "sha.h"
+#include "sha_hw.h"
 #include "base64.h"
-#include <openssl/sha.h>
+#include "stats.h"
+#include <openssl/evp.h>
+
+// Files up to this size are hashed through mmap, larger ones are streamed.
+#define SHA_FILE_MMAP_LIMIT		(4 * 1024 * 1024)
+#define SHA_FILE_BLOCK_SIZE		(1024 * 1024)
+#define SHA_CHUNK_SIZE			(64 * 1024)
+
+ZDualDigest::ZDualDigest()
+{
+	EVP_MD_CTX* pCtx1 = EVP_MD_CTX_new();
+	EVP_MD_CTX* pCtx256 = EVP_MD_CTX_new();
+	m_pCtx1 = pCtx1;
+	m_pCtx256 = pCtx256;
+	m_bOK = (NULL != pCtx1 && NULL != pCtx256 &&
+			1 == EVP_DigestInit_ex(pCtx1, EVP_sha1(), NULL) &&
+			1 == EVP_DigestInit_ex(pCtx256, EVP_sha256(), NULL));
+}
+
+ZDualDigest::~ZDualDigest()
+{
+	EVP_MD_CTX_free((EVP_MD_CTX*)m_pCtx1);
+	EVP_MD_CTX_free((EVP_MD_CTX*)m_pCtx256);
+}
+
+// feed both digests chunk by chunk, so each chunk is still in cache
+// when the second digest reads it
+void ZDualDigest::Update(const uint8_t* data, size_t size)
+{
+	ZStats::Add(ZStats::E_BYTES_HASHED, size);
+	while (m_bOK && size > 0) {
+		size_t chunk = (size > SHA_CHUNK_SIZE) ? SHA_CHUNK_SIZE : size;
+		m_bOK = (1 == EVP_DigestUpdate((EVP_MD_CTX*)m_pCtx1, data, chunk) &&
+				1 == EVP_DigestUpdate((EVP_MD_CTX*)m_pCtx256, data, chunk));
+		data += chunk;
+		size -= chunk;
+	}
+}
+
+bool ZDualDigest::Final(string& strSHA1, string& strSHA256)
+{
+	strSHA1.clear();
+	strSHA256.clear();
+	uint8_t hash1[20];
+	uint8_t hash256[32];
+	if (m_bOK &&
+		1 == EVP_DigestFinal_ex((EVP_MD_CTX*)m_pCtx1, hash1, NULL) &&
+		1 == EVP_DigestFinal_ex((EVP_MD_CTX*)m_pCtx256, hash256, NULL)) {
+		strSHA1.append((const char*)hash1, 20);
+		strSHA256.append((const char*)hash256, 32);
+		return true;
+	}
+	return false;
+}
+
+typedef void (*SHABlocksFunc)(uint32_t* pState, const uint8_t* pData, size_t uBlocks);
+
+static const uint32_t s_arrSHA1Init[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+static const uint32_t s_arrSHA256Init[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+
+// SHA-1 and SHA-256 pad the same way: 0x80, zeros, and the big-endian bit
+// count at the end of the last 64-byte block
+static void HashBlocks(SHABlocksFunc pfnBlocks, bool bSHA256, const uint8_t* data, size_t size, uint8_t* pHash)
+{
+	uint32_t arrState[8];
+	uint32_t uWords = bSHA256 ? 8 : 5;
+	memcpy(arrState, bSHA256 ? s_arrSHA256Init : s_arrSHA1Init, uWords * sizeof(uint32_t));
+
+	size_t uBlocks = size / 64;
+	size_t uRemain = size % 64;
+	if (uBlocks > 0) {
+		pfnBlocks(arrState, data, uBlocks);
+	}
+
+	uint8_t arrTail[128] = { 0 };
+	if (uRemain > 0) {
+		memcpy(arrTail, data + uBlocks * 64, uRemain);
+	}
+	arrTail[uRemain] = 0x80;
+	size_t uTail = (uRemain < 56) ? 64 : 128;
+	uint64_t uBits = (uint64_t)size * 8;
+	for (size_t i = 0; i < 8; i++) {
+		arrTail[uTail - 1 - i] = (uint8_t)(uBits >> (8 * i));
+	}
+	pfnBlocks(arrState, arrTail, uTail / 64);
+
+	for (uint32_t i = 0; i < uWords; i++) {
+		pHash[4 * i] = (uint8_t)(arrState[i] >> 24);
+		pHash[4 * i + 1] = (uint8_t)(arrState[i] >> 16);
+		pHash[4 * i + 2] = (uint8_t)(arrState[i] >> 8);
+		pHash[4 * i + 3] = (uint8_t)arrState[i];
+	}
+}
+
+// The OpenSSL backend. The digests are fetched once and every thread keeps
+// one context, where the one-shot ::SHA1/::SHA256 set a context up for
+// each call.
+class ZEVPHasher
+{
+public:
+	ZEVPHasher()
+	{
+		m_pCtx = EVP_MD_CTX_new();
+	}
+
+	~ZEVPHasher()
+	{
+		EVP_MD_CTX_free(m_pCtx);
+	}
+
+public:
+	void Hash(bool bSHA256, const uint8_t* data, size_t size, uint8_t* pHash)
+	{
+		static EVP_MD* s_pSHA1 = EVP_MD_fetch(NULL, "SHA1", NULL);
+		static EVP_MD* s_pSHA256 = EVP_MD_fetch(NULL, "SHA256", NULL);
+		const EVP_MD* pMD = bSHA256 ? s_pSHA256 : s_pSHA1;
+		if (NULL == pMD) {
+			pMD = bSHA256 ? EVP_sha256() : EVP_sha1();
+		}
+		if (NULL == m_pCtx ||
+			1 != EVP_DigestInit_ex(m_pCtx, pMD, NULL) ||
+			1 != EVP_DigestUpdate(m_pCtx, data, size) ||
+			1 != EVP_DigestFinal_ex(m_pCtx, pHash, NULL)) {
+			EVP_Digest(data, size, pHash, NULL, pMD, NULL);
+		}
+	}
+
+private:
+	ZEVPHasher(const ZEVPHasher&);
+	ZEVPHasher& operator=(const ZEVPHasher&);
+
+private:
+	EVP_MD_CTX* m_pCtx;
+};
+
+static thread_local ZEVPHasher s_evpHasher;
+static atomic<int> s_nSHABackend(ZSHA::E_BACKEND_AUTO);
+
+static SHABlocksFunc GetBlocksFunc(int nBackend, bool bSHA256)
+{
+	switch (nBackend) {
+	case ZSHA::E_BACKEND_SHANI:
+		return bSHA256 ? ZSHAHW::SHA256BlocksSHANI : ZSHAHW::SHA1BlocksSHANI;
+	case ZSHA::E_BACKEND_ARMV8:
+		return bSHA256 ? ZSHAHW::SHA256BlocksARMv8 : ZSHAHW::SHA1BlocksARMv8;
+	}
+	return NULL;
+}
+
+// Known answer test of a CPU backend against EVP: a few whole blocks and
+// a tail that needs a second padding block, for both digests.
+static bool SelfTest(int nBackend)
+{
+	uint8_t arrData[3 * 64 + 60];
+	for (size_t i = 0; i < sizeof(arrData); i++) {
+		arrData[i] = (uint8_t)(i * 7 + 1);
+	}
+
+	for (int j = 0; j < 2; j++) {
+		bool bSHA256 = (1 == j);
+		uint8_t arrHash[32];
+		uint8_t arrExpected[32];
+		unsigned int uExpected = 0;
+		HashBlocks(GetBlocksFunc(nBackend, bSHA256), bSHA256, arrData, sizeof(arrData), arrHash);
+		if (1 != EVP_Digest(arrData, sizeof(arrData), arrExpected, &uExpected, bSHA256 ? EVP_sha256() : EVP_sha1(), NULL) ||
+			0 != memcmp(arrHash, arrExpected, uExpected)) {
+			ZLog::WarnV(">>> SHA backend %s failed its self-test, using openssl!\n", ZSHA::GetBackendName(nBackend));
+			return false;
+		}
+	}
+	return true;
+}
+
+// whether the CPU has the backend and it hashes correctly, tested once
+static bool CanRun(int nBackend)
+{
+	switch (nBackend) {
+	case ZSHA::E_BACKEND_OPENSSL:
+		return true;
+	case ZSHA::E_BACKEND_SHANI:
+	{
+		static const bool s_bSHANI = ZSHAHW::HasSHANI() && SelfTest(nBackend);
+		return s_bSHANI;
+	}
+	case ZSHA::E_BACKEND_ARMV8:
+	{
+		static const bool s_bARMv8 = ZSHAHW::HasARMv8() && SelfTest(nBackend);
+		return s_bARMv8;
+	}
+	}
+	return false;
+}
+
+int ZSHA::GetBackend()
+{
+	int nBackend = s_nSHABackend.load();
+	if (E_BACKEND_AUTO == nBackend) {
+		if (CanRun(E_BACKEND_SHANI)) {
+			nBackend = E_BACKEND_SHANI;
+		} else if (CanRun(E_BACKEND_ARMV8)) {
+			nBackend = E_BACKEND_ARMV8;
+		} else {
+			nBackend = E_BACKEND_OPENSSL;
+		}
+		s_nSHABackend.store(nBackend);
+	}
+	return nBackend;
+}
+
+bool ZSHA::SetBackend(int nBackend)
+{
+	switch (nBackend) {
+	case E_BACKEND_AUTO:
+	case E_BACKEND_OPENSSL:
+		break;
+	case E_BACKEND_SHANI:
+	case E_BACKEND_ARMV8:
+		if (!CanRun(nBackend)) {
+			return false;
+		}
+		break;
+	default:
+		return false;
+	}
+	s_nSHABackend.store(nBackend);
+	return true;
+}
+
+const char* ZSHA::GetBackendName(int nBackend)
+{
+	switch (nBackend) {
+	case E_BACKEND_AUTO:
+		return "auto";
+	case E_BACKEND_OPENSSL:
+		return "openssl";
+	case E_BACKEND_SHANI:
+		return "sha-ni";
+	case E_BACKEND_ARMV8:
+		return "armv8";
+	}
+	return "unknown";
+}
+
+void ZSHA::Hash(bool bSHA256, const uint8_t* data, size_t size, uint8_t* pHash)
+{
+	ZStats::Add(ZStats::E_BYTES_HASHED, size);
+	SHABlocksFunc pfnBlocks = GetBlocksFunc(GetBackend(), bSHA256);
+	if (NULL != pfnBlocks) {
+		HashBlocks(pfnBlocks, bSHA256, data, size, pHash);
+	} else {
+		s_evpHasher.Hash(bSHA256, data, size, pHash);
+	}
+}
+
+// the backend and the thread's context are looked up once for all pages
+void ZSHA::HashPages(bool bSHA256, const uint8_t* data, size_t size, uint32_t uPageSize, uint8_t* pHashes)
+{
+	ZStats::Add(ZStats::E_BYTES_HASHED, size);
+	uint32_t uHashSize = bSHA256 ? 32 : 20;
+	SHABlocksFunc pfnBlocks = GetBlocksFunc(GetBackend(), bSHA256);
+	ZEVPHasher* pEVPHasher = (NULL == pfnBlocks) ? &s_evpHasher : NULL;
+	for (size_t uOffset = 0; uOffset < size; uOffset += uPageSize) {
+		size_t uSize = min((size_t)uPageSize, size - uOffset);
+		if (NULL != pfnBlocks) {
+			HashBlocks(pfnBlocks, bSHA256, data + uOffset, uSize, pHashes);
+		} else {
+			pEVPHasher->Hash(bSHA256, data + uOffset, uSize, pHashes);
+		}
+		pHashes += uHashSize;
+	}
+}
 
 bool ZSHA::SHA1(uint8_t* data, size_t size, string& strOutput)
 {
 	strOutput.clear();
 	uint8_t hash[20];
-	::SHA1(data, size, hash);
+	Hash(false, data, size, hash);
 	strOutput.append((const char*)hash, 20);
 	return true;
 }
@@ -15,7 +286,7 @@ bool ZSHA::SHA256(uint8_t* data, size_t size, string& strOutput)
 {
 	strOutput.clear();
 	uint8_t hash[32];
-	::SHA256(data, size, hash);
+	Hash(true, data, size, hash);
 	strOutput.append((const char*)hash, 32);
 	return true;
 }
@@ -30,11 +301,16 @@ bool ZSHA::SHA256(const string& strData, string& strOutput)
 	return ZSHA::SHA256((uint8_t*)strData.data(), strData.size(), strOutput);
 }
 
+bool ZSHA::SHA(const uint8_t* data, size_t size, string& strSHA1, string& strSHA256)
+{
+	ZDualDigest digest;
+	digest.Update(data, size);
+	return digest.Final(strSHA1, strSHA256);
+}
+
 bool ZSHA::SHA(const string& strData, string& strSHA1, string& strSHA256)
 {
-	ZSHA::SHA1(strData, strSHA1);
-	ZSHA::SHA256(strData, strSHA256);
-	return (!strSHA1.empty() && !strSHA256.empty());
+	return ZSHA::SHA((const uint8_t*)strData.data(), strData.size(), strSHA1, strSHA256);
 }
 
 bool ZSHA::SHA1Text(const string& strData, string& strOutput)
@@ -57,15 +333,30 @@ bool ZSHA::SHAFile(const char* szFile, string& strSHA1, string& strSHA256)
 {
 	strSHA1.clear();
 	strSHA256.clear();
+	ZStats::Add(ZStats::E_FILES_HASHED);
+
+	struct stat st = { 0 };
+	if (0 == stat(szFile, &st) && st.st_size > SHA_FILE_MMAP_LIMIT) {
+		// large resources: sequential reads on a reader thread instead of
+		// page-fault driven readahead over a mapping
+		ZDualDigest digest;
+		if (!ZFile::StreamFile(szFile, SHA_FILE_BLOCK_SIZE, [&](const uint8_t* pData, size_t uSize) {
+				digest.Update(pData, uSize);
+			})) {
+			return false;
+		}
+		return digest.Final(strSHA1, strSHA256);
+	}
+
 	size_t sSize = 0;
 	uint8_t* pBase = (uint8_t*)ZFile::MapFile(szFile, 0, 0, &sSize, true);
 	// pBase may be NULL, but it's ok, because the file may be empty
-	ZSHA::SHA1(pBase, sSize, strSHA1);
-	ZSHA::SHA256(pBase, sSize, strSHA256);
+	ZStats::Add(ZStats::E_BYTES_READ, (NULL != pBase) ? sSize : 0);
+	bool bRet = ZSHA::SHA(pBase, (NULL != pBase) ? sSize : 0, strSHA1, strSHA256);
 	if (NULL != pBase && sSize > 0) {
 		ZFile::UnmapFile(pBase, sSize);
 	}
-	return (!strSHA1.empty() && !strSHA256.empty());
+	return bRet;
 }
 
 bool ZSHA::SHABase64(const string& strData, string& strSHA1Base64, string& strSHA256Base64)
@@ -5,11 +5,34 @@
 class ZSHA
 {
 public:
+	// The engine behind SHA1(), SHA256(), Hash() and HashPages(): SHA-NI or
+	// ARMv8 crypto kernels when the CPU has them, OpenSSL EVP with a reused
+	// per-thread context otherwise. AUTO picks the fastest on first use.
+	// A CPU backend must first match EVP on a known input, once.
+	// Each call adds its input to E_BYTES_HASHED once, so callers don't.
+	enum Backend
+	{
+		E_BACKEND_AUTO = 0,
+		E_BACKEND_OPENSSL,
+		E_BACKEND_SHANI,
+		E_BACKEND_ARMV8,
+	};
+
+	static int GetBackend();
+	static bool SetBackend(int nBackend); // false if this CPU can't run it correctly
+	static const char* GetBackendName(int nBackend);
+
+	// pHash receives 32 bytes for SHA-256, 20 for SHA-1
+	static void Hash(bool bSHA256, const uint8_t* data, size_t size, uint8_t* pHash);
+	// One hash per uPageSize bytes of data, the last page may be short;
+	// written back to back, so pHashes holds (size + uPageSize - 1) / uPageSize hashes
+	static void HashPages(bool bSHA256, const uint8_t* data, size_t size, uint32_t uPageSize, uint8_t* pHashes);
 
 	static bool SHA1(uint8_t* data, size_t size, string& strOutput);
 	static bool SHA1(const string& strData, string& strOutput);
 	static bool SHA256(uint8_t* data, size_t size, string& strOutput);
 	static bool SHA256(const string& strData, string& strOutput);
+	static bool SHA(const uint8_t* data, size_t size, string& strSHA1, string& strSHA256);
 	static bool SHA(const string& strData, string& strSHA1, string& strSHA256);
 	static bool SHA1Text(const string& strData, string& strOutput);
 	static bool SHAFile(const char* szFile, string& strSHA1, string& strSHA256);
@@ -22,3 +45,24 @@ public:
 	static void PrintData256(const char* prefix, const string& strData, const char* suffix = "\n");
 	static void PrintData256(const char* prefix, uint8_t* data, size_t size, const char* suffix = "\n");
 };
+
+// Incremental SHA-1 + SHA-256 over the same input, one read per byte.
+class ZDualDigest
+{
+public:
+	ZDualDigest();
+	~ZDualDigest();
+
+public:
+	void Update(const uint8_t* data, size_t size);
+	bool Final(string& strSHA1, string& strSHA256);
+
+private:
+	ZDualDigest(const ZDualDigest&);
+	ZDualDigest& operator=(const ZDualDigest&);
+
+private:
+	bool	m_bOK;
+	void*	m_pCtx1; // EVP_MD_CTX*
+	void*	m_pCtx256;
+};
@@ -0,0 +1,357 @@
+#include "sha_hw.h"
+
+#if !defined(ZSIGN_NO_SHA_HW) && (defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86))
+#define ZSHA_HW_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define ZSHA_TARGET_SHANI
+#else
+#include <cpuid.h>
+#define ZSHA_TARGET_SHANI __attribute__((target("sha,sse4.1,ssse3")))
+#endif
+#elif !defined(ZSIGN_NO_SHA_HW) && (defined(__aarch64__) || defined(_M_ARM64))
+#define ZSHA_HW_ARMV8
+#include <arm_neon.h>
+#if defined(__clang__)
+#define ZSHA_TARGET_ARMV8 __attribute__((target("crypto")))
+#elif defined(__GNUC__)
+#define ZSHA_TARGET_ARMV8 __attribute__((target("+crypto")))
+#else
+#define ZSHA_TARGET_ARMV8
+#endif
+#if defined(__linux__) || defined(__ANDROID__)
+#include <sys/auxv.h>
+#ifndef HWCAP_SHA1
+#define HWCAP_SHA1 (1 << 5)
+#endif
+#ifndef HWCAP_SHA2
+#define HWCAP_SHA2 (1 << 6)
+#endif
+#endif
+#endif
+
+#if defined(ZSHA_HW_X86) || defined(ZSHA_HW_ARMV8)
+static const uint32_t s_arrSHA256K[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+#endif
+
+#ifdef ZSHA_HW_X86
+
+bool ZSHAHW::HasSHANI()
+{
+	// SHA (leaf 7 ebx bit 29), plus the SSSE3 and SSE4.1 shuffles and blends
+	// around it (leaf 1 ecx bits 9 and 19)
+	static const bool s_bHas = []() {
+		uint32_t uLeaf1 = 0;
+		uint32_t uLeaf7 = 0;
+#ifdef _MSC_VER
+		int arrInfo[4];
+		__cpuid(arrInfo, 0);
+		if (arrInfo[0] >= 7) {
+			__cpuidex(arrInfo, 7, 0);
+			uLeaf7 = (uint32_t)arrInfo[1];
+			__cpuid(arrInfo, 1);
+			uLeaf1 = (uint32_t)arrInfo[2];
+		}
+#else
+		unsigned int a = 0, b = 0, c = 0, d = 0;
+		if (__get_cpuid_max(0, NULL) >= 7) {
+			__cpuid_count(7, 0, a, b, c, d);
+			uLeaf7 = b;
+			__cpuid(1, a, b, c, d);
+			uLeaf1 = c;
+		}
+#endif
+		return (0 != (uLeaf7 & (1u << 29)) && 0 != (uLeaf1 & (1u << 9)) && 0 != (uLeaf1 & (1u << 19)));
+	}();
+	return s_bHas;
+}
+
+// Four rounds of group i. SHA-1 has 20 of them; Mi holds W[4i..4i+3] and
+// the other three registers the schedule around it. E alternates between
+// E0 and E1, which carry the e input of the next group.
+#define SHA1_GROUP_SHANI(i, Mi, Mnext, Mprev, Mprev2)						\
+	if (0 == (i)) {															\
+		E0 = _mm_add_epi32(E0, Mi);											\
+		E1 = ABCD;															\
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, 0);							\
+	} else if (1 == (i) % 2) {												\
+		E1 = _mm_sha1nexte_epu32(E1, Mi);									\
+		E0 = ABCD;															\
+		if ((i) >= 3 && (i) <= 18) Mnext = _mm_sha1msg2_epu32(Mnext, Mi);	\
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E1, (i) / 5);						\
+	} else {																\
+		E0 = _mm_sha1nexte_epu32(E0, Mi);									\
+		E1 = ABCD;															\
+		if ((i) >= 3 && (i) <= 18) Mnext = _mm_sha1msg2_epu32(Mnext, Mi);	\
+		ABCD = _mm_sha1rnds4_epu32(ABCD, E0, (i) / 5);						\
+	}																		\
+	if ((i) >= 1 && (i) <= 16) Mprev = _mm_sha1msg1_epu32(Mprev, Mi);		\
+	if ((i) >= 2 && (i) <= 17) Mprev2 = _mm_xor_si128(Mprev2, Mi);
+
+ZSHA_TARGET_SHANI
+void ZSHAHW::SHA1BlocksSHANI(uint32_t* pState, const uint8_t* pData, size_t uBlocks)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+	__m128i ABCD = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)pState), 0x1B);
+	__m128i E0 = _mm_set_epi32((int)pState[4], 0, 0, 0);
+	__m128i E1;
+
+	for (; uBlocks > 0; uBlocks--, pData += 64) {
+		__m128i ABCD_SAVE = ABCD;
+		__m128i E0_SAVE = E0;
+		__m128i M0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 0)), MASK);
+		__m128i M1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 16)), MASK);
+		__m128i M2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 32)), MASK);
+		__m128i M3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 48)), MASK);
+
+		SHA1_GROUP_SHANI(0, M0, M1, M3, M2);
+		SHA1_GROUP_SHANI(1, M1, M2, M0, M3);
+		SHA1_GROUP_SHANI(2, M2, M3, M1, M0);
+		SHA1_GROUP_SHANI(3, M3, M0, M2, M1);
+		SHA1_GROUP_SHANI(4, M0, M1, M3, M2);
+		SHA1_GROUP_SHANI(5, M1, M2, M0, M3);
+		SHA1_GROUP_SHANI(6, M2, M3, M1, M0);
+		SHA1_GROUP_SHANI(7, M3, M0, M2, M1);
+		SHA1_GROUP_SHANI(8, M0, M1, M3, M2);
+		SHA1_GROUP_SHANI(9, M1, M2, M0, M3);
+		SHA1_GROUP_SHANI(10, M2, M3, M1, M0);
+		SHA1_GROUP_SHANI(11, M3, M0, M2, M1);
+		SHA1_GROUP_SHANI(12, M0, M1, M3, M2);
+		SHA1_GROUP_SHANI(13, M1, M2, M0, M3);
+		SHA1_GROUP_SHANI(14, M2, M3, M1, M0);
+		SHA1_GROUP_SHANI(15, M3, M0, M2, M1);
+		SHA1_GROUP_SHANI(16, M0, M1, M3, M2);
+		SHA1_GROUP_SHANI(17, M1, M2, M0, M3);
+		SHA1_GROUP_SHANI(18, M2, M3, M1, M0);
+		SHA1_GROUP_SHANI(19, M3, M0, M2, M1);
+
+		E0 = _mm_sha1nexte_epu32(E0, E0_SAVE);
+		ABCD = _mm_add_epi32(ABCD, ABCD_SAVE);
+	}
+
+	_mm_storeu_si128((__m128i*)pState, _mm_shuffle_epi32(ABCD, 0x1B));
+	pState[4] = (uint32_t)_mm_extract_epi32(E0, 3);
+}
+
+// Four rounds of group i out of 16, as two pairs of sha256rnds2; the
+// schedule for group i + 1 is finished and the one for i + 3 started
+#define SHA256_GROUP_SHANI(i, Mi, Mnext, Mprev)								\
+	MSG = _mm_add_epi32(Mi, _mm_loadu_si128((const __m128i*)&s_arrSHA256K[4 * (i)]));	\
+	STATE1 = _mm_sha256rnds2_epu32(STATE1, STATE0, MSG);					\
+	if ((i) >= 3 && (i) <= 14) {											\
+		Mnext = _mm_add_epi32(Mnext, _mm_alignr_epi8(Mi, Mprev, 4));		\
+		Mnext = _mm_sha256msg2_epu32(Mnext, Mi);							\
+	}																		\
+	STATE0 = _mm_sha256rnds2_epu32(STATE0, STATE1, _mm_shuffle_epi32(MSG, 0x0E));	\
+	if ((i) >= 1 && (i) <= 12) Mprev = _mm_sha256msg1_epu32(Mprev, Mi);
+
+ZSHA_TARGET_SHANI
+void ZSHAHW::SHA256BlocksSHANI(uint32_t* pState, const uint8_t* pData, size_t uBlocks)
+{
+	const __m128i MASK = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+	__m128i TMP = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&pState[0]), 0xB1);	// CDAB
+	__m128i STATE1 = _mm_shuffle_epi32(_mm_loadu_si128((const __m128i*)&pState[4]), 0x1B);	// EFGH
+	__m128i STATE0 = _mm_alignr_epi8(TMP, STATE1, 8);	// ABEF
+	STATE1 = _mm_blend_epi16(STATE1, TMP, 0xF0);		// CDGH
+	__m128i MSG;
+
+	for (; uBlocks > 0; uBlocks--, pData += 64) {
+		__m128i ABEF_SAVE = STATE0;
+		__m128i CDGH_SAVE = STATE1;
+		__m128i M0 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 0)), MASK);
+		__m128i M1 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 16)), MASK);
+		__m128i M2 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 32)), MASK);
+		__m128i M3 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(pData + 48)), MASK);
+
+		SHA256_GROUP_SHANI(0, M0, M1, M3);
+		SHA256_GROUP_SHANI(1, M1, M2, M0);
+		SHA256_GROUP_SHANI(2, M2, M3, M1);
+		SHA256_GROUP_SHANI(3, M3, M0, M2);
+		SHA256_GROUP_SHANI(4, M0, M1, M3);
+		SHA256_GROUP_SHANI(5, M1, M2, M0);
+		SHA256_GROUP_SHANI(6, M2, M3, M1);
+		SHA256_GROUP_SHANI(7, M3, M0, M2);
+		SHA256_GROUP_SHANI(8, M0, M1, M3);
+		SHA256_GROUP_SHANI(9, M1, M2, M0);
+		SHA256_GROUP_SHANI(10, M2, M3, M1);
+		SHA256_GROUP_SHANI(11, M3, M0, M2);
+		SHA256_GROUP_SHANI(12, M0, M1, M3);
+		SHA256_GROUP_SHANI(13, M1, M2, M0);
+		SHA256_GROUP_SHANI(14, M2, M3, M1);
+		SHA256_GROUP_SHANI(15, M3, M0, M2);
+
+		STATE0 = _mm_add_epi32(STATE0, ABEF_SAVE);
+		STATE1 = _mm_add_epi32(STATE1, CDGH_SAVE);
+	}
+
+	TMP = _mm_shuffle_epi32(STATE0, 0x1B);			// FEBA
+	STATE1 = _mm_shuffle_epi32(STATE1, 0xB1);		// DCHG
+	_mm_storeu_si128((__m128i*)&pState[0], _mm_blend_epi16(TMP, STATE1, 0xF0));	// DCBA
+	_mm_storeu_si128((__m128i*)&pState[4], _mm_alignr_epi8(STATE1, TMP, 8));		// HGFE
+}
+
+#else
+
+bool ZSHAHW::HasSHANI()
+{
+	return false;
+}
+
+void ZSHAHW::SHA1BlocksSHANI(uint32_t* pState, const uint8_t* pData, size_t uBlocks)
+{
+}
+
+void ZSHAHW::SHA256BlocksSHANI(uint32_t* pState, const uint8_t* pData, size_t uBlocks)
+{
+}
+
+#endif
+
+#ifdef ZSHA_HW_ARMV8
+
+bool ZSHAHW::HasARMv8()
+{
+#if defined(__APPLE__)
+	return true; // every arm64 Apple CPU has SHA-1 and SHA-256
+#elif defined(_WIN32)
+	static const bool s_bHas = (0 != IsProcessorFeaturePresent(PF_ARM_V8_CRYPTO_INSTRUCTIONS_AVAILABLE));
+	return s_bHas;
+#elif defined(__linux__) || defined(__ANDROID__)
+	static const bool s_bHas = ((HWCAP_SHA1 | HWCAP_SHA2) == (getauxval(AT_HWCAP) & (HWCAP_SHA1 | HWCAP_SHA2)));
+	return s_bHas;
+#else
+	return false;
+#endif
+}
+
+// Four rounds of group i out of 20; while i < 16, Mi is then replaced by
+// W[4i+16..4i+19]
+#define SHA1_GROUP_ARMV8(i, Mi, M1, M2, M3, HASH)						\
+	TMP = vaddq_u32(Mi, vdupq_n_u32(arrK[(i) / 5]));					\
+	if ((i) < 16) Mi = vsha1su1q_u32(vsha1su0q_u32(Mi, M1, M2), M3);	\
+	ENEXT = vsha1h_u32(vgetq_lane_u32(ABCD, 0));						\
+	ABCD = HASH(ABCD, E, TMP);											\
+	E = ENEXT;
+
+ZSHA_TARGET_ARMV8
+void ZSHAHW::SHA1BlocksARMv8(uint32_t* pState, const uint8_t* pData, size_t uBlocks)
+{
+	static const uint32_t arrK[4] = { 0x5A827999, 0x6ED9EBA1, 0x8F1BBCDC, 0xCA62C1D6 };
+	uint32x4_t ABCD = vld1q_u32(&pState[0]);
+	uint32_t E = pState[4];
+	uint32_t ENEXT;
+	uint32x4_t TMP;
+
+	for (; uBlocks > 0; uBlocks--, pData += 64) {
+		uint32x4_t ABCD_SAVE = ABCD;
+		uint32_t E_SAVE = E;
+		uint32x4_t M0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(pData + 0)));
+		uint32x4_t M1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(pData + 16)));
+		uint32x4_t M2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(pData + 32)));
+		uint32x4_t M3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(pData + 48)));
+
+		SHA1_GROUP_ARMV8(0, M0, M1, M2, M3, vsha1cq_u32);
+		SHA1_GROUP_ARMV8(1, M1, M2, M3, M0, vsha1cq_u32);
+		SHA1_GROUP_ARMV8(2, M2, M3, M0, M1, vsha1cq_u32);
+		SHA1_GROUP_ARMV8(3, M3, M0, M1, M2, vsha1cq_u32);
+		SHA1_GROUP_ARMV8(4, M0, M1, M2, M3, vsha1cq_u32);
+		SHA1_GROUP_ARMV8(5, M1, M2, M3, M0, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(6, M2, M3, M0, M1, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(7, M3, M0, M1, M2, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(8, M0, M1, M2, M3, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(9, M1, M2, M3, M0, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(10, M2, M3, M0, M1, vsha1mq_u32);
+		SHA1_GROUP_ARMV8(11, M3, M0, M1, M2, vsha1mq_u32);
+		SHA1_GROUP_ARMV8(12, M0, M1, M2, M3, vsha1mq_u32);
+		SHA1_GROUP_ARMV8(13, M1, M2, M3, M0, vsha1mq_u32);
+		SHA1_GROUP_ARMV8(14, M2, M3, M0, M1, vsha1mq_u32);
+		SHA1_GROUP_ARMV8(15, M3, M0, M1, M2, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(16, M0, M1, M2, M3, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(17, M1, M2, M3, M0, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(18, M2, M3, M0, M1, vsha1pq_u32);
+		SHA1_GROUP_ARMV8(19, M3, M0, M1, M2, vsha1pq_u32);
+
+		ABCD = vaddq_u32(ABCD, ABCD_SAVE);
+		E += E_SAVE;
+	}
+
+	vst1q_u32(&pState[0], ABCD);
+	pState[4] = E;
+}
+
+// Four rounds of group i out of 16; while i < 12, Mi is then replaced by
+// W[4i+16..4i+19]
+#define SHA256_GROUP_ARMV8(i, Mi, M1, M2, M3)								\
+	TMP = vaddq_u32(Mi, vld1q_u32(&s_arrSHA256K[4 * (i)]));				\
+	if ((i) < 12) Mi = vsha256su1q_u32(vsha256su0q_u32(Mi, M1), M2, M3);	\
+	ABCD = STATE0;															\
+	STATE0 = vsha256hq_u32(STATE0, STATE1, TMP);							\
+	STATE1 = vsha256h2q_u32(STATE1, ABCD, TMP);
+
+ZSHA_TARGET_ARMV8
+void ZSHAHW::SHA256BlocksARMv8(uint32_t* pState, const uint8_t* pData, size_t uBlocks)
+{
+	uint32x4_t STATE0 = vld1q_u32(&pState[0]);
+	uint32x4_t STATE1 = vld1q_u32(&pState[4]);
+	uint32x4_t ABCD;
+	uint32x4_t TMP;
+
+	for (; uBlocks > 0; uBlocks--, pData += 64) {
+		uint32x4_t ABCD_SAVE = STATE0;
+		uint32x4_t EFGH_SAVE = STATE1;
+		uint32x4_t M0 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(pData + 0)));
+		uint32x4_t M1 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(pData + 16)));
+		uint32x4_t M2 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(pData + 32)));
+		uint32x4_t M3 = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(pData + 48)));
+
+		SHA256_GROUP_ARMV8(0, M0, M1, M2, M3);
+		SHA256_GROUP_ARMV8(1, M1, M2, M3, M0);
+		SHA256_GROUP_ARMV8(2, M2, M3, M0, M1);
+		SHA256_GROUP_ARMV8(3, M3, M0, M1, M2);
+		SHA256_GROUP_ARMV8(4, M0, M1, M2, M3);
+		SHA256_GROUP_ARMV8(5, M1, M2, M3, M0);
+		SHA256_GROUP_ARMV8(6, M2, M3, M0, M1);
+		SHA256_GROUP_ARMV8(7, M3, M0, M1, M2);
+		SHA256_GROUP_ARMV8(8, M0, M1, M2, M3);
+		SHA256_GROUP_ARMV8(9, M1, M2, M3, M0);
+		SHA256_GROUP_ARMV8(10, M2, M3, M0, M1);
+		SHA256_GROUP_ARMV8(11, M3, M0, M1, M2);
+		SHA256_GROUP_ARMV8(12, M0, M1, M2, M3);
+		SHA256_GROUP_ARMV8(13, M1, M2, M3, M0);
+		SHA256_GROUP_ARMV8(14, M2, M3, M0, M1);
+		SHA256_GROUP_ARMV8(15, M3, M0, M1, M2);
+
+		STATE0 = vaddq_u32(STATE0, ABCD_SAVE);
+		STATE1 = vaddq_u32(STATE1, EFGH_SAVE);
+	}
+
+	vst1q_u32(&pState[0], STATE0);
+	vst1q_u32(&pState[4], STATE1);
+}
+
+#else
+
+bool ZSHAHW::HasARMv8()
+{
+	return false;
+}
+
+void ZSHAHW::SHA1BlocksARMv8(uint32_t* pState, const uint8_t* pData, size_t uBlocks)
+{
+}
+
+void ZSHAHW::SHA256BlocksARMv8(uint32_t* pState, const uint8_t* pData, size_t uBlocks)
+{
+}
+
+#endif
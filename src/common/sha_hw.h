@@ -0,0 +1,20 @@
+#pragma once
+
+#include "common.h"
+
+// SHA-1 and SHA-256 block functions on the CPU's SHA instructions: SHA-NI
+// on x86, the crypto extension on ARMv8. Each one updates pState with
+// uBlocks whole 64-byte blocks; padding is left to the caller. Only call a
+// kernel after its Has*() returned true. Build with ZSIGN_NO_SHA_HW to
+// leave them out (Has*() then always returns false).
+class ZSHAHW
+{
+public:
+	static bool HasSHANI();
+	static bool HasARMv8();
+
+	static void SHA1BlocksSHANI(uint32_t* pState, const uint8_t* pData, size_t uBlocks);
+	static void SHA256BlocksSHANI(uint32_t* pState, const uint8_t* pData, size_t uBlocks);
+	static void SHA1BlocksARMv8(uint32_t* pState, const uint8_t* pData, size_t uBlocks);
+	static void SHA256BlocksARMv8(uint32_t* pState, const uint8_t* pData, size_t uBlocks);
+};
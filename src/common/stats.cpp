@@ -0,0 +1,365 @@
+#include "stats.h"
+#include "json.h"
+
+#ifdef _WIN32
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+struct ZStatsItem
+{
+	string		strName;
+	uint64_t	uCount;
+	uint64_t	uWallTime;
+	uint64_t	uCPUTime;
+};
+
+struct ZStatsPhase
+{
+	uint64_t	uCount;
+	uint64_t	uWallTime;
+	uint64_t	uCPUTime;
+	vector<ZStatsItem>	arrItems;
+	map<string, size_t>	mapItems;
+};
+
+struct ZTraceEvent
+{
+	const char*	szPhase;
+	string		strItem;
+	uint64_t	uBeginTime;
+	uint64_t	uWallTime;
+	uint32_t	uThread;
+};
+
+static const char* s_szCounterNames[ZStats::E_COUNTER_MAX] = {
+	"bytes_read",
+	"bytes_hashed",
+	"bytes_written",
+	"files_hashed",
+	"binaries_signed",
+	"bundles_signed",
+	"cache_hits",
+	"cache_misses",
+	"hash_bytes_saved",
+};
+
+static bool s_bEnabled = false;
+static bool s_bTraceEnabled = false;
+static uint64_t s_uStartWallTime = 0;
+static uint64_t s_uStartCPUTime = 0;
+static uint64_t s_uTraceStartTime = 0;
+static atomic<uint64_t> s_arrCounters[ZStats::E_COUNTER_MAX];
+static atomic<uint32_t> s_uThreadCount(0);
+static mutex s_mtxStats;
+static thread_local string s_strBaseFolder;
+static vector<string> s_arrPhaseNames;
+static map<string, ZStatsPhase> s_mapPhases;
+static vector<ZTraceEvent> s_arrTraceEvents;
+static thread_local ZStatsScope* s_pCurrentScope = NULL;
+static thread_local uint32_t s_uThreadId = 0;
+static thread_local ZStats::ScopeCallback s_pfnCallback = NULL;
+static thread_local void* s_pCallbackContext = NULL;
+
+// Small sequential ids in order of first use, the main thread is 1.
+static uint32_t GetThreadId()
+{
+	if (0 == s_uThreadId) {
+		s_uThreadId = ++s_uThreadCount;
+	}
+	return s_uThreadId;
+}
+
+static string GetItemName(const string& strItem)
+{
+	if (!s_strBaseFolder.empty() && 0 == strItem.compare(0, s_strBaseFolder.size(), s_strBaseFolder)) {
+		if (strItem.size() == s_strBaseFolder.size()) {
+			return ZUtil::GetBaseName(s_strBaseFolder.c_str());
+		} else if ('/' == strItem[s_strBaseFolder.size()]) {
+			return strItem.substr(s_strBaseFolder.size() + 1);
+		}
+	}
+	return strItem;
+}
+
+void ZStats::Enable()
+{
+	s_bEnabled = true;
+	s_uStartWallTime = ZUtil::GetMicroSecond();
+	s_uStartCPUTime = GetCPUTime();
+}
+
+bool ZStats::IsEnabled()
+{
+	return s_bEnabled;
+}
+
+void ZStats::EnableTrace()
+{
+	GetThreadId();
+	s_bTraceEnabled = true;
+	s_uTraceStartTime = ZUtil::GetMicroSecond();
+}
+
+bool ZStats::IsTraceEnabled()
+{
+	return s_bTraceEnabled;
+}
+
+// Item names under strFolder are reported relative to it. The base folder
+// belongs to the calling thread, the one running the signing job.
+void ZStats::SetBaseFolder(const string& strFolder)
+{
+	s_strBaseFolder = strFolder;
+}
+
+void ZStats::SetThreadCallback(ScopeCallback pfnCallback, void* pContext)
+{
+	s_pfnCallback = pfnCallback;
+	s_pCallbackContext = pContext;
+}
+
+void ZStats::Add(ECounter eCounter, uint64_t uValue)
+{
+	s_arrCounters[eCounter].fetch_add(uValue, memory_order_relaxed);
+}
+
+uint64_t ZStats::Get(ECounter eCounter)
+{
+	return s_arrCounters[eCounter].load(memory_order_relaxed);
+}
+
+void ZStats::AddPhase(const char* szPhase, const string& strItem, uint64_t uWallTime, uint64_t uCPUTime)
+{
+	lock_guard<mutex> lock(s_mtxStats);
+
+	map<string, ZStatsPhase>::iterator it = s_mapPhases.find(szPhase);
+	if (it == s_mapPhases.end()) {
+		s_arrPhaseNames.push_back(szPhase);
+		ZStatsPhase phase = { 0, 0, 0 };
+		it = s_mapPhases.insert(make_pair(string(szPhase), phase)).first;
+	}
+
+	ZStatsPhase& phase = it->second;
+	phase.uCount++;
+	phase.uWallTime += uWallTime;
+	phase.uCPUTime += uCPUTime;
+
+	if (!strItem.empty()) {
+		string strName = GetItemName(strItem);
+		map<string, size_t>::iterator itItem = phase.mapItems.find(strName);
+		if (itItem == phase.mapItems.end()) {
+			ZStatsItem item = { strName, 0, 0, 0 };
+			phase.arrItems.push_back(item);
+			itItem = phase.mapItems.insert(make_pair(strName, phase.arrItems.size() - 1)).first;
+		}
+		ZStatsItem& item = phase.arrItems[itItem->second];
+		item.uCount++;
+		item.uWallTime += uWallTime;
+		item.uCPUTime += uCPUTime;
+	}
+}
+
+void ZStats::AddTraceEvent(const char* szPhase, const string& strItem, uint64_t uBeginTime, uint64_t uWallTime)
+{
+	uint32_t uThread = GetThreadId();
+	lock_guard<mutex> lock(s_mtxStats);
+	ZTraceEvent event = { szPhase, GetItemName(strItem), uBeginTime, uWallTime, uThread };
+	s_arrTraceEvents.push_back(event);
+}
+
+bool ZStats::WriteFile(const string& strFile, const string& strInput, bool bSuccess)
+{
+	jvalue jvStats;
+	jvStats["version"] = 1;
+	jvStats["input"] = strInput;
+	jvStats["success"] = bSuccess;
+	jvStats["wall_us"] = (int64_t)(ZUtil::GetMicroSecond() - s_uStartWallTime);
+	jvStats["cpu_us"] = (int64_t)(GetCPUTime() - s_uStartCPUTime);
+	jvStats["peak_rss"] = (int64_t)GetPeakRSS();
+
+	jvalue& jvPhases = jvStats["phases"];
+	jvPhases = jvalue(jvalue::E_OBJECT);
+	{
+		lock_guard<mutex> lock(s_mtxStats);
+		for (const string& strPhase : s_arrPhaseNames) {
+			const ZStatsPhase& phase = s_mapPhases[strPhase];
+			jvalue& jvPhase = jvPhases[strPhase];
+			jvPhase["count"] = (int64_t)phase.uCount;
+			jvPhase["wall_us"] = (int64_t)phase.uWallTime;
+			jvPhase["cpu_us"] = (int64_t)phase.uCPUTime;
+			if (!phase.arrItems.empty()) {
+				jvalue& jvItems = jvPhase["items"];
+				for (const ZStatsItem& item : phase.arrItems) {
+					jvalue jvItem;
+					jvItem["name"] = item.strName;
+					jvItem["count"] = (int64_t)item.uCount;
+					jvItem["wall_us"] = (int64_t)item.uWallTime;
+					jvItem["cpu_us"] = (int64_t)item.uCPUTime;
+					jvItems.push_back(jvItem);
+				}
+			}
+		}
+	}
+
+	jvalue& jvCounters = jvStats["counters"];
+	for (int i = 0; i < E_COUNTER_MAX; i++) {
+		jvCounters[s_szCounterNames[i]] = (int64_t)Get((ECounter)i);
+	}
+
+	string strData;
+	jvStats.style_write(strData);
+	if (!ZFile::WriteFile(strFile.c_str(), strData)) {
+		return ZLog::ErrorV(">>> Failed to write stats file! %s\n", strFile.c_str());
+	}
+	return true;
+}
+
+// Chrome trace-event format, loadable in chrome://tracing and Perfetto.
+// Every span is a complete ("X") event named after its phase and item.
+bool ZStats::WriteTraceFile(const string& strFile)
+{
+	jvalue jvTrace;
+	jvalue& jvEvents = jvTrace["traceEvents"];
+	jvEvents = jvalue(jvalue::E_ARRAY);
+	{
+		lock_guard<mutex> lock(s_mtxStats);
+		for (uint32_t i = 1; i <= s_uThreadCount; i++) {
+			jvalue jvEvent;
+			jvEvent["name"] = "thread_name";
+			jvEvent["ph"] = "M";
+			jvEvent["pid"] = 1;
+			jvEvent["tid"] = (int64_t)i;
+			jvEvent["args"]["name"] = (1 == i) ? string("main") : ("worker " + to_string(i - 1));
+			jvEvents.push_back(jvEvent);
+		}
+
+		for (const ZTraceEvent& event : s_arrTraceEvents) {
+			jvalue jvEvent;
+			jvEvent["name"] = event.strItem.empty() ? string(event.szPhase) : (string(event.szPhase) + ": " + event.strItem);
+			jvEvent["cat"] = event.szPhase;
+			jvEvent["ph"] = "X";
+			jvEvent["ts"] = (int64_t)(event.uBeginTime - s_uTraceStartTime);
+			jvEvent["dur"] = (int64_t)event.uWallTime;
+			jvEvent["pid"] = 1;
+			jvEvent["tid"] = (int64_t)event.uThread;
+			if (!event.strItem.empty()) {
+				jvEvent["args"]["item"] = event.strItem;
+			}
+			jvEvents.push_back(jvEvent);
+		}
+	}
+	jvTrace["displayTimeUnit"] = "ms";
+
+	string strData;
+	jvTrace.write(strData);
+	if (!ZFile::WriteFile(strFile.c_str(), strData)) {
+		return ZLog::ErrorV(">>> Failed to write trace file! %s\n", strFile.c_str());
+	}
+	return true;
+}
+
+uint64_t ZStats::GetCPUTime()
+{
+#ifdef _WIN32
+	FILETIME ftCreate, ftExit, ftKernel, ftUser;
+	if (!GetProcessTimes(GetCurrentProcess(), &ftCreate, &ftExit, &ftKernel, &ftUser)) {
+		return 0;
+	}
+	uint64_t uKernel = ((uint64_t)ftKernel.dwHighDateTime << 32) | ftKernel.dwLowDateTime;
+	uint64_t uUser = ((uint64_t)ftUser.dwHighDateTime << 32) | ftUser.dwLowDateTime;
+	return (uKernel + uUser) / 10;
+#else
+	struct rusage ru;
+	if (0 != getrusage(RUSAGE_SELF, &ru)) {
+		return 0;
+	}
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#endif
+}
+
+uint64_t ZStats::GetPeakRSS()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS pmc;
+	if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+		return 0;
+	}
+	return (uint64_t)pmc.PeakWorkingSetSize;
+#else
+	struct rusage ru;
+	if (0 != getrusage(RUSAGE_SELF, &ru)) {
+		return 0;
+	}
+#ifdef __APPLE__
+	return (uint64_t)ru.ru_maxrss; // bytes
+#else
+	return (uint64_t)ru.ru_maxrss * 1024; // kilobytes
+#endif
+#endif
+}
+
+ZStatsScope::ZStatsScope(const char* szPhase, const string& strItem)
+{
+	m_szPhase = szPhase;
+	m_bEnabled = false;
+	m_uWallTime = 0;
+	m_uCPUTime = 0;
+	m_pParent = NULL;
+	Start(strItem);
+}
+
+ZStatsScope::~ZStatsScope()
+{
+	Stop();
+}
+
+void ZStatsScope::Start(const string& strItem)
+{
+	m_bStats = ZStats::IsEnabled();
+	m_bTrace = ZStats::IsTraceEnabled();
+	m_bCallback = (NULL != s_pfnCallback);
+	m_bEnabled = m_bStats || m_bTrace || m_bCallback;
+	if (!m_bEnabled) {
+		return;
+	}
+
+	m_pParent = s_pCurrentScope;
+	m_strItem = (strItem.empty() && NULL != m_pParent) ? m_pParent->m_strItem : strItem;
+	s_pCurrentScope = this;
+
+	if (m_bCallback) {
+		s_pfnCallback(s_pCallbackContext, m_szPhase, GetItemName(m_strItem), false);
+	}
+
+	m_uCPUTime = m_bStats ? ZStats::GetCPUTime() : 0;
+	m_uWallTime = ZUtil::GetMicroSecond();
+}
+
+void ZStatsScope::Stop()
+{
+	if (!m_bEnabled) {
+		return;
+	}
+
+	m_bEnabled = false;
+	uint64_t uWallTime = ZUtil::GetMicroSecond() - m_uWallTime;
+	s_pCurrentScope = m_pParent;
+	if (m_bStats) {
+		ZStats::AddPhase(m_szPhase, m_strItem, uWallTime, ZStats::GetCPUTime() - m_uCPUTime);
+	}
+	if (m_bTrace) {
+		ZStats::AddTraceEvent(m_szPhase, m_strItem, m_uWallTime, uWallTime);
+	}
+	if (m_bCallback && NULL != s_pfnCallback) {
+		s_pfnCallback(s_pCallbackContext, m_szPhase, GetItemName(m_strItem), true);
+	}
+}
+
+void ZStatsScope::Restart(const string& strItem)
+{
+	Stop();
+	Start(strItem);
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "common.h"
+
+// Per-job performance statistics for --stats and --trace.
+//
+// Counters are always collected (one atomic add each). Phase timings are
+// only taken once Enable() has been called, and trace spans once
+// EnableTrace() has, so ZStatsScope costs nothing in a normal run.
+// A thread callback sees every scope begin and end on that thread, which
+// libzsign reports as job progress.
+class ZStats
+{
+public:
+	typedef void (*ScopeCallback)(void* pContext, const char* szPhase, const string& strItem, bool bEnd);
+
+	enum ECounter
+	{
+		E_BYTES_READ = 0,
+		E_BYTES_HASHED,
+		E_BYTES_WRITTEN,
+		E_FILES_HASHED,
+		E_BINARIES_SIGNED,
+		E_BUNDLES_SIGNED,
+		E_CACHE_HITS,
+		E_CACHE_MISSES,
+		E_HASH_BYTES_SAVED,
+		E_COUNTER_MAX,
+	};
+
+public:
+	static void Enable();
+	static bool IsEnabled();
+	static void EnableTrace();
+	static bool IsTraceEnabled();
+	static void SetBaseFolder(const string& strFolder);
+	static void SetThreadCallback(ScopeCallback pfnCallback, void* pContext);
+	static void Add(ECounter eCounter, uint64_t uValue = 1);
+	static uint64_t Get(ECounter eCounter);
+	static void AddPhase(const char* szPhase, const string& strItem, uint64_t uWallTime, uint64_t uCPUTime);
+	static void AddTraceEvent(const char* szPhase, const string& strItem, uint64_t uBeginTime, uint64_t uWallTime);
+	static bool WriteFile(const string& strFile, const string& strInput, bool bSuccess);
+	static bool WriteTraceFile(const string& strFile);
+
+	static uint64_t GetCPUTime();
+	static uint64_t GetPeakRSS();
+};
+
+// Times the enclosing block as one run of szPhase. An empty strItem
+// inherits the item name of the enclosing scope on the same thread, so a
+// per-binary scope names the CodeDirectory and CMS scopes nested in it.
+// Stop() ends the measurement before the end of the block, Restart()
+// ends it and begins the next run of the same phase.
+// With --trace each run is also recorded as a span on the current thread.
+class ZStatsScope
+{
+public:
+	ZStatsScope(const char* szPhase, const string& strItem = "");
+	~ZStatsScope();
+
+public:
+	void Stop();
+	void Restart(const string& strItem = "");
+
+private:
+	void Start(const string& strItem);
+
+private:
+	const char*		m_szPhase;
+	string			m_strItem;
+	bool			m_bEnabled;
+	bool			m_bStats;
+	bool			m_bTrace;
+	bool			m_bCallback;
+	uint64_t		m_uWallTime;
+	uint64_t		m_uCPUTime;
+	ZStatsScope*	m_pParent;
+};
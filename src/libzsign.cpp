@@ -0,0 +1,453 @@
+#include "common.h"
+#include "macho.h"
+#include "bundle.h"
+#include "openssl.h"
+#include "archive.h"
+#include "stats.h"
+#include "libzsign.h"
+
+#ifndef ZSIGN_VERSION
+#define ZSIGN_VERSION 0.0.0-dev
+#endif
+#define ZSIGN_STR_(x) #x
+#define ZSIGN_STR(x) ZSIGN_STR_(x)
+
+struct zsign_identity
+{
+	ZSignAsset	asset;
+};
+
+struct zsign_job
+{
+	const zsign_identity*	pIdentity;
+
+	string			strOutputFile;
+	string			strBundleId;
+	string			strBundleVersion;
+	string			strDisplayName;
+	vector<string>	arrDylibFiles;
+	vector<string>	arrRemoveDylibNames;
+	bool			bWeakInject;
+	bool			bInjectExtensions;
+	bool			bForce;
+	int				nZipLevel;
+	string			strTempFolder;
+	string			strCacheFolder;
+	string			strIconFile;
+	string			strMinVersion;
+	bool			bEnableDocuments;
+	bool			bRemoveProvision;
+	bool			bRemoveExtensions;
+	bool			bRemoveWatchApp;
+	bool			bRemoveUISupportedDevices;
+	int				nLogLevel;
+
+	zsign_log_callback		pfnLog;
+	void*					pLogContext;
+	zsign_progress_callback	pfnProgress;
+	void*					pProgressContext;
+
+	string			strError;
+};
+
+static atomic<uint32_t> s_uJobFolders(0);
+
+// Routes the calling thread's log lines to a job (or identity load) and
+// keeps the last error, restoring stdout logging when it goes out of scope.
+// The worker threads zsign starts for the job log here too, one line at a
+// time.
+class ZJobLog
+{
+public:
+	ZJobLog(zsign_log_callback pfnLog, void* pLogContext, int nLogLevel, string& strError,
+			zsign_progress_callback pfnProgress = NULL, void* pProgressContext = NULL)
+		: m_pfnLog(pfnLog), m_pLogContext(pLogContext), m_nLogLevel(nLogLevel), m_strError(strError),
+		  m_pfnProgress(pfnProgress), m_pProgressContext(pProgressContext)
+	{
+		m_strError.clear();
+		ZLog::SetThreadCallback(OnLog, this, max(nLogLevel, (int)ZLog::E_ERROR));
+		if (NULL != m_pfnProgress) {
+			ZStats::SetThreadCallback(OnScope, this);
+		}
+	}
+
+	~ZJobLog()
+	{
+		ZLog::SetThreadCallback(NULL, NULL, ZLog::E_INFO);
+		ZStats::SetThreadCallback(NULL, NULL);
+		ZStats::SetBaseFolder("");
+	}
+
+private:
+	static void OnLog(void* pContext, int nLevel, const char* szLog)
+	{
+		ZJobLog* pThis = (ZJobLog*)pContext;
+		lock_guard<mutex> lock(pThis->m_mutex);
+		if (ZLog::E_ERROR == nLevel) {
+			pThis->m_strError = szLog;
+			ZUtil::StringTrim(pThis->m_strError);
+		}
+		if (NULL != pThis->m_pfnLog && nLevel <= pThis->m_nLogLevel) {
+			pThis->m_pfnLog(pThis->m_pLogContext, nLevel, szLog);
+		}
+	}
+
+	static void OnScope(void* pContext, const char* szPhase, const string& strItem, bool bEnd)
+	{
+		ZJobLog* pThis = (ZJobLog*)pContext;
+		pThis->m_pfnProgress(pThis->m_pProgressContext, szPhase, strItem.c_str(), bEnd ? 1 : 0);
+	}
+
+private:
+	zsign_log_callback		m_pfnLog;
+	void*					m_pLogContext;
+	int						m_nLogLevel;
+	string&					m_strError;
+	zsign_progress_callback	m_pfnProgress;
+	void*					m_pProgressContext;
+	mutex					m_mutex;
+};
+
+static string OptionalString(const char* szValue)
+{
+	return (NULL != szValue) ? szValue : "";
+}
+
+static string OptionalPath(const char* szValue)
+{
+	return (NULL != szValue && 0 != *szValue) ? ZFile::GetFullPath(szValue) : "";
+}
+
+const char* zsign_version(void)
+{
+	return ZSIGN_STR(ZSIGN_VERSION);
+}
+
+zsign_identity* zsign_identity_load(const char* cert_file,
+									const char* pkey_file,
+									const char* prov_file,
+									const char* entitlements_file,
+									const char* password,
+									zsign_log_callback log_callback,
+									void* user_data)
+{
+	string strError;
+	ZJobLog log(log_callback, user_data, ZSIGN_LOG_ERROR, strError);
+	if (NULL == pkey_file || NULL == prov_file) {
+		ZLog::Error(">>> Private key and provision file are required!\n");
+		return NULL;
+	}
+
+	zsign_identity* pIdentity = new zsign_identity();
+	if (!pIdentity->asset.Init(OptionalPath(cert_file), OptionalPath(pkey_file), OptionalPath(prov_file),
+								OptionalPath(entitlements_file), OptionalString(password), false, true, false)) {
+		delete pIdentity;
+		return NULL;
+	}
+	return pIdentity;
+}
+
+zsign_identity* zsign_identity_adhoc(const char* entitlements_file)
+{
+	string strError;
+	ZJobLog log(NULL, NULL, ZSIGN_LOG_NONE, strError);
+	zsign_identity* pIdentity = new zsign_identity();
+	if (!pIdentity->asset.Init("", "", "", OptionalPath(entitlements_file), "", true, true, false)) {
+		delete pIdentity;
+		return NULL;
+	}
+	return pIdentity;
+}
+
+const char* zsign_identity_team_id(const zsign_identity* identity)
+{
+	return (NULL != identity) ? identity->asset.m_strTeamId.c_str() : "";
+}
+
+const char* zsign_identity_subject_cn(const zsign_identity* identity)
+{
+	return (NULL != identity) ? identity->asset.m_strSubjectCN.c_str() : "";
+}
+
+void zsign_identity_free(zsign_identity* identity)
+{
+	delete identity;
+}
+
+zsign_job* zsign_job_new(const zsign_identity* identity)
+{
+	if (NULL == identity) {
+		return NULL;
+	}
+
+	zsign_job* pJob = new zsign_job();
+	pJob->pIdentity = identity;
+	pJob->bWeakInject = false;
+	pJob->bInjectExtensions = false;
+	pJob->bForce = false;
+	pJob->nZipLevel = 0;
+	pJob->strTempFolder = ZFile::GetTempFolder();
+	pJob->strCacheFolder = "./.zsign_cache";
+	pJob->bEnableDocuments = false;
+	pJob->bRemoveProvision = false;
+	pJob->bRemoveExtensions = false;
+	pJob->bRemoveWatchApp = false;
+	pJob->bRemoveUISupportedDevices = false;
+	pJob->nLogLevel = ZSIGN_LOG_ERROR;
+	pJob->pfnLog = NULL;
+	pJob->pLogContext = NULL;
+	pJob->pfnProgress = NULL;
+	pJob->pProgressContext = NULL;
+	return pJob;
+}
+
+int zsign_job_set_option(zsign_job* job, int option, const char* value)
+{
+	if (NULL == job || NULL == value) {
+		return ZSIGN_ERROR_ARGUMENT;
+	}
+
+	bool bFlag = ('1' == value[0]);
+	switch (option) {
+	case ZSIGN_OPT_OUTPUT:
+		job->strOutputFile = OptionalPath(value);
+		break;
+	case ZSIGN_OPT_BUNDLE_ID:
+		job->strBundleId = value;
+		break;
+	case ZSIGN_OPT_BUNDLE_VERSION:
+		job->strBundleVersion = value;
+		break;
+	case ZSIGN_OPT_DISPLAY_NAME:
+		job->strDisplayName = value;
+		break;
+	case ZSIGN_OPT_INJECT_DYLIB:
+		job->arrDylibFiles.push_back(OptionalPath(value));
+		break;
+	case ZSIGN_OPT_REMOVE_DYLIB:
+		job->arrRemoveDylibNames.push_back(value);
+		break;
+	case ZSIGN_OPT_WEAK_INJECT:
+		job->bWeakInject = bFlag;
+		break;
+	case ZSIGN_OPT_INJECT_EXTENSIONS:
+		job->bInjectExtensions = bFlag;
+		break;
+	case ZSIGN_OPT_FORCE:
+		job->bForce = bFlag;
+		break;
+	case ZSIGN_OPT_ZIP_LEVEL:
+		job->nZipLevel = atoi(value);
+		if (job->nZipLevel < 0 || job->nZipLevel > 9) {
+			job->nZipLevel = 0;
+			return ZSIGN_ERROR_ARGUMENT;
+		}
+		break;
+	case ZSIGN_OPT_TEMP_FOLDER:
+		job->strTempFolder = OptionalPath(value);
+		break;
+	case ZSIGN_OPT_CACHE_FOLDER:
+		job->strCacheFolder = value;
+		break;
+	case ZSIGN_OPT_ICON_FILE:
+		job->strIconFile = OptionalPath(value);
+		break;
+	case ZSIGN_OPT_MIN_VERSION:
+		job->strMinVersion = value;
+		break;
+	case ZSIGN_OPT_ENABLE_DOCUMENTS:
+		job->bEnableDocuments = bFlag;
+		break;
+	case ZSIGN_OPT_REMOVE_PROVISION:
+		job->bRemoveProvision = bFlag;
+		break;
+	case ZSIGN_OPT_REMOVE_EXTENSIONS:
+		job->bRemoveExtensions = bFlag;
+		break;
+	case ZSIGN_OPT_REMOVE_WATCH_APP:
+		job->bRemoveWatchApp = bFlag;
+		break;
+	case ZSIGN_OPT_REMOVE_UISD:
+		job->bRemoveUISupportedDevices = bFlag;
+		break;
+	case ZSIGN_OPT_LOG_LEVEL:
+		// debug output also dumps blobs into ./.zsign_debug, so it isn't offered
+		job->nLogLevel = min(max(atoi(value), (int)ZSIGN_LOG_NONE), (int)ZSIGN_LOG_INFO);
+		break;
+	default:
+		return ZSIGN_ERROR_ARGUMENT;
+	}
+	return ZSIGN_OK;
+}
+
+void zsign_job_set_log_callback(zsign_job* job, zsign_log_callback callback, void* user_data)
+{
+	if (NULL != job) {
+		job->pfnLog = callback;
+		job->pLogContext = user_data;
+	}
+}
+
+void zsign_job_set_progress_callback(zsign_job* job, zsign_progress_callback callback, void* user_data)
+{
+	if (NULL != job) {
+		job->pfnProgress = callback;
+		job->pProgressContext = user_data;
+	}
+}
+
+static int SignMachO(zsign_job* job, ZSignAsset* pSignAsset, ZMachO& macho)
+{
+	ZLoadCommandEdits edits;
+	for (const string& strDylibFile : job->arrDylibFiles) {
+		edits.InjectDylib(strDylibFile, job->bWeakInject);
+	}
+	for (const string& name : job->arrRemoveDylibNames) {
+		edits.RemoveDylib((string::npos != name.find('/')) ? name : ("@executable_path/" + name));
+	}
+	if (!macho.ApplyLoadCommandEdits(edits)) {
+		return ZSIGN_ERROR_SIGN;
+	}
+
+	ZStatsScope scope("sign");
+	return macho.Sign(pSignAsset, job->bForce, job->strBundleId, "", "", "") ? ZSIGN_OK : ZSIGN_ERROR_SIGN;
+}
+
+static int SignBundle(zsign_job* job, ZSignAsset* pSignAsset, const string& strPath)
+{
+	bool bZipFile = ZFile::IsZipFile(strPath.c_str());
+	if (bZipFile && job->strOutputFile.empty()) {
+		ZLog::Error(">>> An output file is required to sign an ipa!\n");
+		return ZSIGN_ERROR_ARGUMENT;
+	}
+
+	bool bForce = job->bForce;
+	bool bEnableCache = true;
+	string strFolder = strPath;
+	if (bZipFile) {
+		bForce = true;
+		bEnableCache = false;
+		strFolder = ZFile::GetRealPathV("%s/zsign_folder_%llu_%u", job->strTempFolder.c_str(), ZUtil::GetMicroSecond(), (uint32_t)++s_uJobFolders);
+		ZStatsScope scope("extract");
+		if (!Zip::Extract(strPath.c_str(), strFolder.c_str())) {
+			ZLog::ErrorV(">>> Unzip failed! %s\n", strPath.c_str());
+			return ZSIGN_ERROR_EXTRACT;
+		}
+	}
+
+	ZBundle bundle;
+	bundle.m_bEnableDocuments = job->bEnableDocuments;
+	bundle.m_strMinVersion = job->strMinVersion;
+	bundle.m_strIconFile = job->strIconFile;
+	bundle.m_bRemoveExtensions = job->bRemoveExtensions;
+	bundle.m_bRemoveWatchApp = job->bRemoveWatchApp;
+	bundle.m_bRemoveUISupportedDevices = job->bRemoveUISupportedDevices;
+	bundle.m_bInjectExtensions = job->bInjectExtensions;
+	bundle.m_strCacheFolder = job->strCacheFolder;
+
+	ZStatsScope signScope("sign");
+	int nRet = bundle.SignFolder(pSignAsset, strFolder, job->strBundleId, job->strBundleVersion, job->strDisplayName,
+									job->arrDylibFiles, job->arrRemoveDylibNames, bForce, job->bWeakInject, bEnableCache, job->bRemoveProvision)
+				? ZSIGN_OK : ZSIGN_ERROR_SIGN;
+	signScope.Stop();
+
+	if (ZSIGN_OK == nRet && !job->strOutputFile.empty()) {
+		size_t pos = bundle.m_strAppFolder.rfind("Payload");
+		if (string::npos != pos && pos > 0) {
+			ZStatsScope scope("archive");
+			ZFile::RemoveFile(job->strOutputFile.c_str());
+			if (!Zip::Archive(bundle.m_strAppFolder.substr(0, pos - 1), job->strOutputFile, job->nZipLevel)) {
+				ZLog::ErrorV(">>> Archive failed! %s\n", job->strOutputFile.c_str());
+				nRet = ZSIGN_ERROR_ARCHIVE;
+			}
+		} else {
+			ZLog::Error(">>> Can't find payload directory!\n");
+			nRet = ZSIGN_ERROR_ARCHIVE;
+		}
+	}
+
+	if (bZipFile) {
+		ZStatsScope scope("cleanup");
+		ZFile::RemoveFolder(strFolder.c_str());
+	}
+	return nRet;
+}
+
+int zsign_job_run(zsign_job* job, const char* input_path)
+{
+	if (NULL == job) {
+		return ZSIGN_ERROR_ARGUMENT;
+	}
+
+	ZJobLog log(job->pfnLog, job->pLogContext, job->nLogLevel, job->strError, job->pfnProgress, job->pProgressContext);
+	string strPath = OptionalPath(input_path);
+	if (strPath.empty() || !ZFile::IsFileExists(strPath.c_str())) {
+		ZLog::ErrorV(">>> Invalid path! %s\n", OptionalString(input_path).c_str());
+		return ZSIGN_ERROR_INPUT;
+	}
+
+	for (const string& strDylibFile : job->arrDylibFiles) {
+		if (!ZMachO::IsMachOFile(strDylibFile)) {
+			ZLog::ErrorV(">>> Invalid dylib file! %s\n", strDylibFile.c_str());
+			return ZSIGN_ERROR_ARGUMENT;
+		}
+	}
+
+	// signing only reads the identity, apart from its locked special slot memo
+	ZSignAsset* pSignAsset = const_cast<ZSignAsset*>(&job->pIdentity->asset);
+	if (!ZFile::IsZipFile(strPath.c_str()) && !ZFile::IsFolder(strPath.c_str())) {
+		ZMachO macho;
+		if (!macho.Init(strPath.c_str())) {
+			ZLog::ErrorV(">>> Invalid mach-o file! %s\n", strPath.c_str());
+			return ZSIGN_ERROR_INPUT;
+		}
+		return SignMachO(job, pSignAsset, macho);
+	}
+	return SignBundle(job, pSignAsset, strPath);
+}
+
+int zsign_job_sign_data(zsign_job* job, const char* name, const void* data, size_t size, void** output, size_t* output_size)
+{
+	if (NULL == job || NULL == name || NULL == data || NULL == output || NULL == output_size) {
+		return ZSIGN_ERROR_ARGUMENT;
+	}
+	*output = NULL;
+	*output_size = 0;
+
+	ZJobLog log(job->pfnLog, job->pLogContext, job->nLogLevel, job->strError, job->pfnProgress, job->pProgressContext);
+	ZMachO macho;
+	if (!macho.InitData((const uint8_t*)data, size, name)) {
+		return ZSIGN_ERROR_INPUT;
+	}
+
+	ZSignAsset* pSignAsset = const_cast<ZSignAsset*>(&job->pIdentity->asset);
+	int nRet = SignMachO(job, pSignAsset, macho);
+	if (ZSIGN_OK != nRet) {
+		return nRet;
+	}
+
+	const string& strData = macho.GetData();
+	*output = malloc(strData.size());
+	if (NULL == *output) {
+		ZLog::Error(">>> Out of memory!\n");
+		return ZSIGN_ERROR_SIGN;
+	}
+	memcpy(*output, strData.data(), strData.size());
+	*output_size = strData.size();
+	return ZSIGN_OK;
+}
+
+void zsign_free(void* data)
+{
+	free(data);
+}
+
+const char* zsign_job_error(const zsign_job* job)
+{
+	return (NULL != job) ? job->strError.c_str() : "";
+}
+
+void zsign_job_free(zsign_job* job)
+{
+	delete job;
+}
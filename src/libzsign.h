@@ -0,0 +1,153 @@
+#pragma once
+
+/*
+ * libzsign: the zsign signing core as an embeddable library.
+ *
+ * An identity (certificate, private key, provisioning profile and
+ * entitlements) is loaded once and can then be shared by any number of
+ * jobs. A job signs one .ipa, app folder or Mach-O file with its own
+ * options and reports log lines and progress through callbacks instead of
+ * printing to stdout.
+ *
+ * Thread safety:
+ *   - an identity is read-only after zsign_identity_load() and may be used
+ *     by jobs on many threads at once. Free it after its last job.
+ *   - a job may only be used by one thread at a time. Different jobs may run
+ *     concurrently. A job's progress callback runs on the thread that called
+ *     zsign_job_run(); its log callback may also run on the worker threads
+ *     zsign starts for the job, but never for two lines at once.
+ *   - concurrent jobs must not sign the same folder in place or write the
+ *     same output file.
+ */
+
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#if defined(_WIN32) && defined(ZSIGN_SHARED)
+#define ZSIGN_API __declspec(dllexport)
+#elif defined(__GNUC__)
+#define ZSIGN_API __attribute__((visibility("default")))
+#else
+#define ZSIGN_API
+#endif
+
+#define ZSIGN_API_VERSION 1
+
+typedef struct zsign_identity zsign_identity;
+typedef struct zsign_job zsign_job;
+
+enum zsign_result
+{
+	ZSIGN_OK = 0,
+	ZSIGN_ERROR_ARGUMENT = -1,
+	ZSIGN_ERROR_IDENTITY = -2,
+	ZSIGN_ERROR_INPUT = -3,
+	ZSIGN_ERROR_EXTRACT = -4,
+	ZSIGN_ERROR_SIGN = -5,
+	ZSIGN_ERROR_ARCHIVE = -6,
+};
+
+enum zsign_log_level
+{
+	ZSIGN_LOG_NONE = 0,
+	ZSIGN_LOG_ERROR = 1,
+	ZSIGN_LOG_WARN = 2,
+	ZSIGN_LOG_INFO = 3,
+};
+
+/*
+ * Job options for zsign_job_set_option(). Flags take "1" or "0", options
+ * marked (repeatable) add one value per call.
+ */
+enum zsign_option
+{
+	ZSIGN_OPT_OUTPUT = 1,			/* output .ipa, required for .ipa input */
+	ZSIGN_OPT_BUNDLE_ID,			/* new CFBundleIdentifier */
+	ZSIGN_OPT_BUNDLE_VERSION,		/* new CFBundleVersion and CFBundleShortVersionString */
+	ZSIGN_OPT_DISPLAY_NAME,			/* new CFBundleDisplayName */
+	ZSIGN_OPT_INJECT_DYLIB,			/* dylib file to inject (repeatable) */
+	ZSIGN_OPT_REMOVE_DYLIB,			/* dylib name to remove (repeatable) */
+	ZSIGN_OPT_WEAK_INJECT,			/* flag: inject as LC_LOAD_WEAK_DYLIB */
+	ZSIGN_OPT_INJECT_EXTENSIONS,	/* flag: also inject into app extensions */
+	ZSIGN_OPT_FORCE,				/* flag: sign everything, ignore the cache */
+	ZSIGN_OPT_ZIP_LEVEL,			/* 0 - 9, default 0 */
+	ZSIGN_OPT_TEMP_FOLDER,			/* where .ipa input is extracted */
+	ZSIGN_OPT_CACHE_FOLDER,			/* signing cache for folder input, default ./.zsign_cache */
+	ZSIGN_OPT_ICON_FILE,			/* PNG to replace the app icons with */
+	ZSIGN_OPT_MIN_VERSION,			/* new MinimumOSVersion */
+	ZSIGN_OPT_ENABLE_DOCUMENTS,		/* flag: UISupportsDocumentBrowser and UIFileSharingEnabled */
+	ZSIGN_OPT_REMOVE_PROVISION,		/* flag: drop embedded.mobileprovision after signing */
+	ZSIGN_OPT_REMOVE_EXTENSIONS,	/* flag: remove PlugIns and Extensions */
+	ZSIGN_OPT_REMOVE_WATCH_APP,		/* flag: remove the watch app */
+	ZSIGN_OPT_REMOVE_UISD,			/* flag: remove UISupportedDevices */
+	ZSIGN_OPT_LOG_LEVEL,			/* zsign_log_level, default ZSIGN_LOG_ERROR */
+};
+
+/* One log line, including its trailing newline. */
+typedef void (*zsign_log_callback)(void* user_data, int level, const char* message);
+
+/*
+ * Begin (finished == 0) and end (finished == 1) of a pipeline step: phase
+ * is "extract", "sign", "bundle", "binary", "code_resources", "archive", ...
+ * and item the bundle or binary path inside the app, or "".
+ */
+typedef void (*zsign_progress_callback)(void* user_data, const char* phase, const char* item, int finished);
+
+ZSIGN_API const char* zsign_version(void);
+
+/*
+ * Loads a signing identity. pkey_file is a .p12 or a PEM/DER private key,
+ * cert_file is only needed with a bare private key that the provisioning
+ * profile doesn't carry a certificate for. entitlements_file overrides the
+ * profile's entitlements. Any argument but pkey_file and prov_file may be
+ * NULL. Errors are passed to log_callback when given.
+ */
+ZSIGN_API zsign_identity* zsign_identity_load(const char* cert_file,
+												const char* pkey_file,
+												const char* prov_file,
+												const char* entitlements_file,
+												const char* password,
+												zsign_log_callback log_callback,
+												void* user_data);
+
+/* An ad-hoc identity, with optional entitlements. */
+ZSIGN_API zsign_identity* zsign_identity_adhoc(const char* entitlements_file);
+
+ZSIGN_API const char* zsign_identity_team_id(const zsign_identity* identity);
+ZSIGN_API const char* zsign_identity_subject_cn(const zsign_identity* identity);
+ZSIGN_API void zsign_identity_free(zsign_identity* identity);
+
+/* The identity must stay alive until the job is freed. */
+ZSIGN_API zsign_job* zsign_job_new(const zsign_identity* identity);
+ZSIGN_API int zsign_job_set_option(zsign_job* job, int option, const char* value);
+ZSIGN_API void zsign_job_set_log_callback(zsign_job* job, zsign_log_callback callback, void* user_data);
+ZSIGN_API void zsign_job_set_progress_callback(zsign_job* job, zsign_progress_callback callback, void* user_data);
+
+/*
+ * Signs an .ipa, an app folder (in place) or a single Mach-O file (in
+ * place). Returns ZSIGN_OK or a zsign_result error, see zsign_job_error()
+ * for the message. A job can be run again, with the same or new options.
+ */
+ZSIGN_API int zsign_job_run(zsign_job* job, const char* input_path);
+
+/*
+ * Signs a Mach-O (thin or fat) held in memory, without touching the
+ * filesystem, using the job's bundle id, force and dylib options. name is
+ * the binary's file name, the identifier when there is neither a bundle id
+ * nor an embedded Info.plist. On success *output receives the signed
+ * binary, which may be larger than the input, to be released with
+ * zsign_free().
+ */
+ZSIGN_API int zsign_job_sign_data(zsign_job* job, const char* name, const void* data, size_t size, void** output, size_t* output_size);
+ZSIGN_API void zsign_free(void* data);
+
+/* The last error logged by zsign_job_run() or zsign_job_sign_data(), or "". */
+ZSIGN_API const char* zsign_job_error(const zsign_job* job);
+ZSIGN_API void zsign_job_free(zsign_job* job);
+
+#ifdef __cplusplus
+}
+#endif
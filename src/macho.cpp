@@ -4,11 +4,14 @@
 #include "openssl.h"
 #include "signing.h"
 #include "macho.h"
+#include "stats.h"
 
 ZMachO::ZMachO()
 {
 	m_pBase = NULL;
 	m_sSize = 0;
+	m_bInMemory = false;
+	m_bReadOnly = false;
 	m_bCSRealloced = false;
 }
 
@@ -29,6 +32,35 @@ bool ZMachO::InitV(const char* szPath, ...)
 	return Init(szFile);
 }
 
+bool ZMachO::InitData(const uint8_t* pData, size_t sSize, const string& strName)
+{
+	FreeArchOes();
+	m_strFile = strName;
+	m_bInMemory = true;
+	if (NULL == pData || sSize < sizeof(uint32_t)) {
+		ZLog::Error(">>> Invalid mach-o data!\n");
+		return false;
+	}
+	m_strData.assign((const char*)pData, sSize);
+	m_pBase = (uint8_t*)&m_strData[0];
+	m_sSize = m_strData.size();
+	return LoadArchOes();
+}
+
+const string& ZMachO::GetData() const
+{
+	return m_strData;
+}
+
+bool ZMachO::IsMachOFile(const string& strFile)
+{
+	ZMachO macho;
+	macho.m_strFile = strFile;
+	bool bRet = macho.OpenFile(strFile.c_str(), true);
+	macho.CloseFile();
+	return bRet;
+}
+
 bool ZMachO::Free()
 {
 	FreeArchOes();
@@ -57,12 +89,19 @@ void ZMachO::FreeArchOes()
 	m_arrArchOes.clear();
 }
 
-bool ZMachO::OpenFile(const char* szPath)
+bool ZMachO::OpenFile(const char* szPath, bool bReadOnly)
 {
 	FreeArchOes();
 
 	m_sSize = 0;
-	m_pBase = (uint8_t*)ZFile::MapFile(szPath, 0, 0, &m_sSize, false);
+	m_bInMemory = false;
+	m_bReadOnly = bReadOnly;
+	m_pBase = (uint8_t*)ZFile::MapFile(szPath, 0, 0, &m_sSize, bReadOnly);
+	return LoadArchOes();
+}
+
+bool ZMachO::LoadArchOes()
+{
 	if (NULL != m_pBase) {
 		uint32_t magic = *((uint32_t*)m_pBase);
 		if (FAT_CIGAM == magic || FAT_MAGIC == magic) {
@@ -97,6 +136,10 @@ bool ZMachO::CloseFile()
 		return false;
 	}
 
+	if (m_bInMemory) { // signed in place, nothing to write back
+		return true;
+	}
+
 	if (!ZFile::UnmapFile((void*)m_pBase, m_sSize)) {
 		ZLog::ErrorV(">>> CodeSign write(munmap) failed! Error: %p, %lu, %s\n", m_pBase, m_sSize, strerror(errno));
 		return false;
@@ -121,22 +164,41 @@ bool ZMachO::CheckSignature() const
 	);
 }
 
-bool ZMachO::Sign(ZSignAsset* pSignAsset, bool bForce, string strBundleId, string strInfoSHA1, string strInfoSHA256, const string& strCodeResourcesData)
+bool ZMachO::Verify(const string& strInfoPlist, const string& strCodeResources, string& strReason)
 {
 	if (NULL == m_pBase || m_arrArchOes.empty()) {
+		strReason = "invalid mach-o";
 		return false;
 	}
 
 	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
 		ZArchO* archo = m_arrArchOes[i];
+		if (!archo->Verify(strInfoPlist, strCodeResources, strReason)) {
+			strReason = string(archo->GetArchName()) + ": " + strReason;
+			return false;
+		}
+	}
+	return true;
+}
+
+bool ZMachO::Sign(ZSignAsset* pSignAsset, bool bForce, string strBundleId, string strInfoSHA1, string strInfoSHA256, const string& strCodeResourcesData)
+{
+	if (NULL == m_pBase || m_arrArchOes.empty()) {
+		return false;
+	}
+
+	ZStatsScope scope("binary", m_strFile);
+	if (strBundleId.empty()) {
+		jvalue jvInfo;
+		jvInfo.read_plist(m_arrArchOes[0]->m_strInfoPlist);
+		strBundleId = jvInfo["CFBundleIdentifier"].as_cstr();
 		if (strBundleId.empty()) {
-			jvalue jvInfo;
-			jvInfo.read_plist(archo->m_strInfoPlist);
-			strBundleId = jvInfo["CFBundleIdentifier"].as_cstr();
-			if (strBundleId.empty()) {
-				strBundleId = ZUtil::GetBaseName(m_strFile.c_str());
-			}
+			strBundleId = ZUtil::GetBaseName(m_strFile.c_str());
 		}
+	}
+
+	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
+		ZArchO* archo = m_arrArchOes[i];
 
 		if (strInfoSHA1.empty() || strInfoSHA256.empty()) {
 			if (archo->m_strInfoPlist.empty()) {
@@ -147,6 +209,7 @@ bool ZMachO::Sign(ZSignAsset* pSignAsset, bool bForce, string strBundleId, strin
 			}
 		}
 
+		ZStatsScope archScope("arch", m_strFile + " (" + archo->GetArchName() + ")");
 		if (!archo->Sign(pSignAsset, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesData)) {
 			if (!archo->m_bEnoughSpace && !m_bCSRealloced) {
 				m_bCSRealloced = true;
@@ -158,6 +221,7 @@ bool ZMachO::Sign(ZSignAsset* pSignAsset, bool bForce, string strBundleId, strin
 		}
 	}
 
+	ZStats::Add(ZStats::E_BINARIES_SIGNED);
 	return CloseFile();
 }
 
@@ -165,26 +229,20 @@ bool ZMachO::ReallocCodeSignSpace()
 {
 	ZLog::Warn(">>> Realloc CodeSignature space... \n");
 
-	vector<uint32_t> arrMachOesSizes;
+	vector<set<uint32_t>> arrChangedPages(m_arrArchOes.size());
+	vector<string> arrArchOes(m_arrArchOes.size());
 	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
-		string strNewArchOFile;
-		ZUtil::StringFormatV(strNewArchOFile, "%s.archo.%d", m_strFile.c_str(), i);
-		uint32_t uNewLength = m_arrArchOes[i]->ReallocCodeSignSpace(strNewArchOFile);
-		if (uNewLength <= 0) {
+		if (m_arrArchOes[i]->ReallocCodeSignSpace(arrArchOes[i]) <= 0) {
 			ZLog::Error(">>> Failed!\n");
 			return false;
 		}
-		arrMachOesSizes.push_back(uNewLength);
+		arrChangedPages[i].swap(m_arrArchOes[i]->m_setChangedPages);
 	}
 	ZLog::Warn(">>> Success!\n");
 
+	string strNewData;
 	if (1 == m_arrArchOes.size()) {
-		CloseFile();
-		ZFile::RemoveFile(m_strFile.c_str());
-		string strNewArchOFile = m_strFile + ".archo.0";
-		if (0 == rename(strNewArchOFile.c_str(), m_strFile.c_str())) {
-			return OpenFile(m_strFile.c_str());
-		}
+		strNewData.swap(arrArchOes[0]);
 	} else { //fat
 		uint32_t uAlign = 16384;
 		vector<fat_arch> arrArches;
@@ -194,7 +252,6 @@ bool ZMachO::ReallocCodeSignSpace()
 			fat_arch arch = *((fat_arch*)(m_pBase + sizeof(fat_header) + sizeof(fat_arch) * i));
 			arrArches.push_back(arch);
 		}
-		CloseFile();
 
 		if (arrArches.size() != m_arrArchOes.size()) {
 			return false;
@@ -205,7 +262,7 @@ bool ZMachO::ReallocCodeSignSpace()
 		uint32_t uOffset = uFatHeaderSize + uPadding1;
 		for (size_t i = 0; i < arrArches.size(); i++) {
 			fat_arch& arch = arrArches[i];
-			uint32_t& uMachOSize = arrMachOesSizes[i];
+			uint32_t uMachOSize = (uint32_t)arrArchOes[i].size();
 
 			arch.align = (FAT_MAGIC == fath.magic) ? 14 : BE((uint32_t)14);
 			arch.offset = (FAT_MAGIC == fath.magic) ? uOffset : BE(uOffset);
@@ -215,66 +272,81 @@ bool ZMachO::ReallocCodeSignSpace()
 			uOffset = uOffset + (uAlign - uOffset % uAlign);
 		}
 
-		string strNewFatMachOFile = m_strFile + ".fato";
-
-		string strFatHeader;
-		strFatHeader.append((const char*)&fath, sizeof(fat_header));
+		strNewData.reserve(uOffset);
+		strNewData.append((const char*)&fath, sizeof(fat_header));
 		for (size_t i = 0; i < arrArches.size(); i++) {
-			fat_arch& arch = arrArches[i];
-			strFatHeader.append((const char*)&arch, sizeof(fat_arch));
+			strNewData.append((const char*)&arrArches[i], sizeof(fat_arch));
 		}
+		strNewData.append(uPadding1, 0);
 
-		string strPadding1;
-		strPadding1.append(uPadding1, 0);
-
-		ZFile::AppendFile(strNewFatMachOFile.c_str(), strFatHeader);
-		ZFile::AppendFile(strNewFatMachOFile.c_str(), strPadding1);
-
-		for (size_t i = 0; i < arrArches.size(); i++) {
-			size_t sSize = 0;
-			string strNewArchOFile = m_strFile + ".archo." + std::to_string(i);
-			uint8_t* pData = (uint8_t*)ZFile::MapFile(strNewArchOFile.c_str(), 0, 0, &sSize, true);
-			if (NULL == pData) {
-				ZFile::RemoveFile(strNewFatMachOFile.c_str());
-				return false;
-			}
-			string strPadding;
-			strPadding.append((uAlign - sSize % uAlign), 0);
-
-			ZFile::AppendFile(strNewFatMachOFile.c_str(), (const char*)pData, sSize);
-			ZFile::AppendFile(strNewFatMachOFile.c_str(), strPadding);
-
-			ZFile::UnmapFile((void*)pData, sSize);
-			ZFile::RemoveFile(strNewArchOFile.c_str());
+		for (size_t i = 0; i < arrArchOes.size(); i++) {
+			strNewData += arrArchOes[i];
+			strNewData.append((uAlign - arrArchOes[i].size() % uAlign), 0);
+			string().swap(arrArchOes[i]);
 		}
+	}
 
-		ZFile::RemoveFile(m_strFile.c_str());
-		if (0 == rename(strNewFatMachOFile.c_str(), m_strFile.c_str())) {
-			return OpenFile(m_strFile.c_str());
+	if (m_bInMemory) {
+		FreeArchOes();
+		m_strData.swap(strNewData);
+		m_pBase = (uint8_t*)&m_strData[0];
+		m_sSize = m_strData.size();
+		if (!LoadArchOes()) {
+			return false;
+		}
+	} else {
+		CloseFile();
+		if (!ZFile::WriteFile(m_strFile.c_str(), strNewData)) {
+			ZLog::ErrorV(">>> Can't write mach-o file! %s\n", m_strFile.c_str());
+			return false;
+		}
+		if (!OpenFile(m_strFile.c_str())) {
+			return false;
 		}
 	}
 
-	return false;
+	// the slices were reloaded, keep the pages edited before the realloc
+	if (m_arrArchOes.size() == arrChangedPages.size()) {
+		for (size_t i = 0; i < m_arrArchOes.size(); i++) {
+			m_arrArchOes[i]->m_setChangedPages.insert(arrChangedPages[i].begin(), arrChangedPages[i].end());
+		}
+	}
+	return true;
 }
 
-bool ZMachO::InjectDylib(bool bWeakInject, const char* szDylibFile)
+bool ZMachO::ApplyLoadCommandEdits(const ZLoadCommandEdits& edits)
 {
-	ZLog::WarnV(">>> InjectDylib: %s %s... \n", szDylibFile, bWeakInject ? "(weak)" : "");
+	if (edits.IsEmpty()) {
+		return true;
+	}
+
+	for (const pair<string, bool>& inject : edits.m_arrInjectDylibs) {
+		ZLog::WarnV(">>> InjectDylib: %s %s... \n", inject.first.c_str(), inject.second ? "(weak)" : "");
+	}
 
-	vector<uint32_t> arrMachOesSizes;
 	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
-		if (!m_arrArchOes[i]->InjectDylib(bWeakInject, szDylibFile)) {
+		if (!m_arrArchOes[i]->ApplyLoadCommandEdits(edits)) {
 			ZLog::Error(">>> Failed!\n");
 			return false;
 		}
+		ZLog::DebugV(">>> LoadCommands: %s, %u changed pages\n", m_arrArchOes[i]->GetArchName(), (uint32_t)m_arrArchOes[i]->m_setChangedPages.size());
 	}
 	ZLog::Warn(">>> Success!\n");
 	return true;
 }
 
+bool ZMachO::InjectDylib(bool bWeakInject, const char* szDylibFile)
+{
+	ZLoadCommandEdits edits;
+	edits.InjectDylib(szDylibFile, bWeakInject);
+	return ApplyLoadCommandEdits(edits);
+}
+
 void ZMachO::RemoveDylibs(const set<string>& setDylibs)
 {
-	for (size_t i = 0; i < m_arrArchOes.size(); i++) {
-		m_arrArchOes[i]->RemoveDylibs(setDylibs);
+	ZLoadCommandEdits edits;
+	for (const string& strDylib : setDylibs) {
+		edits.RemoveDylib(strDylib);
 	}
+	ApplyLoadCommandEdits(edits);
 }
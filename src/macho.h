@@ -10,22 +10,32 @@ public:
 public:
 	bool Init(const char* szFile);
 	bool InitV(const char* szPath, ...);
+	// Works on a private copy of the data, with no filesystem access; the
+	// signed (and possibly grown) binary is then available from GetData().
+	// strName stands in for the file name, e.g. as the default identifier.
+	bool InitData(const uint8_t* pData, size_t sSize, const string& strName);
+	// Whether strFile is a valid Mach-O file, mapped read-only to parse it.
+	static bool IsMachOFile(const string& strFile);
+	const string& GetData() const;
 	bool Free();
 	void PrintInfo();
 	bool CheckSignature() const;
+	bool Verify(const string& strInfoPlist, const string& strCodeResources, string& strReason);
 	bool Sign(ZSignAsset* pSignAsset,
 				bool bForce, 
 				string strBundleId, 
 				string strInfoSHA1, 
 				string strInfoSHA256, 
 				const string& strCodeResourcesData);
+	bool ApplyLoadCommandEdits(const ZLoadCommandEdits& edits);
 	bool InjectDylib(bool bWeakInject, const char* szDylibFile);
 	void RemoveDylibs(const set<string>& setDylibs);
 
 private:
-	bool OpenFile(const char* szPath);
+	bool OpenFile(const char* szPath, bool bReadOnly = false);
 	bool CloseFile();
 
+	bool LoadArchOes();
 	bool NewArchO(uint8_t* pBase, uint32_t uLength);
 	void FreeArchOes();
 	bool ReallocCodeSignSpace();
@@ -33,6 +43,9 @@ private:
 private:
 	size_t			m_sSize;
 	string			m_strFile;
+	string			m_strData;
+	bool			m_bInMemory;
+	bool			m_bReadOnly;
 	uint8_t*		m_pBase;
 	bool			m_bCSRealloced;
 	vector<ZArchO*> m_arrArchOes;
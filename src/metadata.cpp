@@ -3,6 +3,7 @@
 #include "sha.h"
 #include "fs.h"
 #include "util.h"
+#include "archive.h"
 #include <zlib.h>
 
 static uint32_t ReadBE32(const uint8_t* p)
@@ -36,10 +37,88 @@ static uint8_t PaethPredictor(int a, int b, int c)
 	return (pb <= pc) ? (uint8_t)b : (uint8_t)c;
 }
 
+// Reverses a scanline's filter in place; pPrev is the reconstructed row
+// above, all zero for the first row.
+static bool UnfilterRow(uint8_t uFilter, uint8_t* pRow, const uint8_t* pPrev, size_t sLine)
+{
+	switch (uFilter) {
+	case 0:
+		break;
+	case 1:
+		for (size_t i = 4; i < sLine; i++) {
+			pRow[i] = (uint8_t)(pRow[i] + pRow[i - 4]);
+		}
+		break;
+	case 2:
+		for (size_t i = 0; i < sLine; i++) {
+			pRow[i] = (uint8_t)(pRow[i] + pPrev[i]);
+		}
+		break;
+	case 3:
+		for (size_t i = 0; i < 4 && i < sLine; i++) {
+			pRow[i] = (uint8_t)(pRow[i] + (pPrev[i] >> 1));
+		}
+		for (size_t i = 4; i < sLine; i++) {
+			pRow[i] = (uint8_t)(pRow[i] + ((pRow[i - 4] + pPrev[i]) >> 1));
+		}
+		break;
+	case 4:
+		for (size_t i = 0; i < 4 && i < sLine; i++) {
+			pRow[i] = (uint8_t)(pRow[i] + pPrev[i]);
+		}
+		for (size_t i = 4; i < sLine; i++) {
+			pRow[i] = (uint8_t)(pRow[i] + PaethPredictor(pRow[i - 4], pPrev[i], pPrev[i - 4]));
+		}
+		break;
+	default:
+		return false;
+	}
+	return true;
+}
+
+// (c * 255 + a / 2) / a for every alpha a and premultiplied channel c, so
+// un-premultiplying a pixel is three lookups instead of three divisions.
+struct ZUnpremultiplyTable
+{
+	uint8_t data[256 * 256];
+
+	ZUnpremultiplyTable()
+	{
+		for (uint32_t a = 0; a < 256; a++) {
+			for (uint32_t c = 0; c < 256; c++) {
+				data[(a << 8) | c] = (a > 0 && a < 255) ? (uint8_t)((c * 255 + a / 2) / a) : (uint8_t)c;
+			}
+		}
+	}
+};
+
+// BGRA premultiplied -> RGBA straight alpha, written with the Sub filter
+// (each byte minus the one a pixel before), which deflates smaller and
+// faster than unfiltered rows.
+static void ConvertCgbiRow(const uint8_t* pSrc, uint8_t* pDst, size_t sLine)
+{
+	static const ZUnpremultiplyTable s_table;
+	uint8_t r0 = 0, g0 = 0, b0 = 0, a0 = 0;
+	for (size_t i = 0; i + 4 <= sLine; i += 4) {
+		uint8_t a = pSrc[i + 3];
+		const uint8_t* pTable = s_table.data + ((uint32_t)a << 8);
+		uint8_t r = pTable[pSrc[i + 2]];
+		uint8_t g = pTable[pSrc[i + 1]];
+		uint8_t b = pTable[pSrc[i]];
+		pDst[i] = (uint8_t)(r - r0);
+		pDst[i + 1] = (uint8_t)(g - g0);
+		pDst[i + 2] = (uint8_t)(b - b0);
+		pDst[i + 3] = (uint8_t)(a - a0);
+		r0 = r; g0 = g; b0 = b; a0 = a;
+	}
+}
+
 // Xcode runs "pngcrush -iphone" on bundled PNGs, producing Apple's CgBI variant
 // (extra CgBI chunk, IDAT deflated without zlib wrapper, BGRA byte order,
 // premultiplied alpha) that standard PNG decoders reject. Convert it back to a
 // standard PNG; returns false if the data is not a CgBI PNG (use it as-is then).
+// Works one scanline at a time: IDAT chunks are inflated, un-filtered,
+// converted and deflated again as they come, so memory stays at a few rows.
 static bool DecodeCgbiPng(const string& strData, string& strPng)
 {
 	static const uint8_t magic[8] = { 0x89, 'P', 'N', 'G', 0x0d, 0x0a, 0x1a, 0x0a };
@@ -52,134 +131,152 @@ static bool DecodeCgbiPng(const string& strData, string& strPng)
 	bool bCgbi = false;
 	bool bHasIHDR = false;
 	uint8_t ihdr[13] = { 0 };
-	string strIdat;
-	for (size_t pos = 8; pos + 12 <= sSize;) {
+
+	uint32_t uHeight = 0;
+	uint32_t uRow = 0;
+	size_t sRowBytes = 0;
+	size_t sFilled = 0;
+	bool bInflating = false;
+	bool bInflated = false;
+	bool bFailed = false;
+	vector<uint8_t> arrRows;
+	vector<uint8_t> arrOutRow;
+	vector<uint8_t> arrComp(64 * 1024);
+	uint8_t* pCur = NULL;
+	uint8_t* pPrev = NULL;
+	z_stream zs;
+	z_stream ds;
+
+	// deflates the converted row, emitting an IDAT chunk whenever the buffer fills
+	auto deflateRow = [&](const uint8_t* pIn, size_t sIn, int nFlush) {
+		ds.next_in = (Bytef*)pIn;
+		ds.avail_in = (uInt)sIn;
+		while (true) {
+			int nRet = deflate(&ds, nFlush);
+			if (Z_STREAM_ERROR == nRet) {
+				return false;
+			}
+			if (0 == ds.avail_out || (Z_FINISH == nFlush && Z_STREAM_END == nRet)) {
+				size_t sComp = arrComp.size() - ds.avail_out;
+				if (sComp > 0) {
+					AppendPngChunk(strPng, "IDAT", arrComp.data(), (uint32_t)sComp);
+				}
+				ds.next_out = arrComp.data();
+				ds.avail_out = (uInt)arrComp.size();
+			}
+			if (Z_FINISH == nFlush ? (Z_STREAM_END == nRet) : (0 == ds.avail_in && 0 != ds.avail_out)) {
+				return true;
+			}
+		}
+	};
+
+	for (size_t pos = 8; pos + 12 <= sSize && !bFailed;) {
 		uint32_t uLen = ReadBE32(pData + pos);
 		const uint8_t* pType = pData + pos + 4;
 		if (uLen > sSize - pos - 12) {
-			return false;
+			bFailed = true;
+			break;
 		}
 		const uint8_t* pChunk = pData + pos + 8;
 		if (0 == memcmp(pType, "CgBI", 4)) {
 			bCgbi = true;
 		} else if (0 == memcmp(pType, "IHDR", 4)) {
 			if (13 != uLen) {
-				return false;
+				bFailed = true;
+				break;
 			}
 			memcpy(ihdr, pChunk, 13);
 			bHasIHDR = true;
 		} else if (0 == memcmp(pType, "IDAT", 4)) {
-			strIdat.append((const char*)pChunk, uLen);
-		} else if (0 == memcmp(pType, "IEND", 4)) {
-			break;
-		}
-		pos += 12 + (size_t)uLen;
-	}
-	if (!bCgbi || !bHasIHDR || strIdat.empty()) {
-		return false;
-	}
-
-	uint32_t uWidth = ReadBE32(ihdr);
-	uint32_t uHeight = ReadBE32(ihdr + 4);
-	// pngcrush -iphone only emits 8-bit RGBA non-interlaced
-	if (8 != ihdr[8] || 6 != ihdr[9] || 0 != ihdr[12]) {
-		return false;
-	}
-	if (0 == uWidth || 0 == uHeight || (uint64_t)uWidth * uHeight > 0x4000000) {
-		return false;
-	}
+			if (!bInflating) {
+				if (!bCgbi || !bHasIHDR || bInflated) {
+					bFailed = true;
+					break;
+				}
+				uint32_t uWidth = ReadBE32(ihdr);
+				uHeight = ReadBE32(ihdr + 4);
+				// pngcrush -iphone only emits 8-bit RGBA non-interlaced
+				if (8 != ihdr[8] || 6 != ihdr[9] || 0 != ihdr[12] ||
+					0 == uWidth || 0 == uHeight || (uint64_t)uWidth * uHeight > 0x4000000) {
+					bFailed = true;
+					break;
+				}
 
-	size_t sRowBytes = (size_t)uWidth * 4 + 1;
-	size_t sRawSize = sRowBytes * uHeight;
-	string strRaw;
-	strRaw.resize(sRawSize);
-	uint8_t* pRaw = (uint8_t*)&strRaw[0];
+				sRowBytes = (size_t)uWidth * 4 + 1;
+				arrRows.assign(sRowBytes * 2, 0);
+				arrOutRow.assign(sRowBytes, 1); // filter type: Sub
+				pCur = arrRows.data();
+				pPrev = pCur + sRowBytes;
 
-	// CgBI's IDAT is a raw deflate stream (no zlib header/checksum)
-	z_stream zs;
-	memset(&zs, 0, sizeof(zs));
-	if (Z_OK != inflateInit2(&zs, -15)) {
-		return false;
-	}
-	zs.next_in = (Bytef*)strIdat.data();
-	zs.avail_in = (uInt)strIdat.size();
-	zs.next_out = pRaw;
-	zs.avail_out = (uInt)sRawSize;
-	int nRet = inflate(&zs, Z_FINISH);
-	bool bDone = (Z_STREAM_END == nRet && sRawSize == zs.total_out);
-	inflateEnd(&zs);
-	if (!bDone) {
-		return false;
-	}
+				// CgBI's IDAT is a raw deflate stream (no zlib header/checksum)
+				memset(&zs, 0, sizeof(zs));
+				memset(&ds, 0, sizeof(ds));
+				if (Z_OK != inflateInit2(&zs, -15)) {
+					bFailed = true;
+					break;
+				}
+				if (Z_OK != deflateInit(&ds, Z_BEST_SPEED)) {
+					inflateEnd(&zs);
+					bFailed = true;
+					break;
+				}
+				ds.next_out = arrComp.data();
+				ds.avail_out = (uInt)arrComp.size();
+				bInflating = true;
 
-	// un-filter every scanline first; filters 2/3/4 reference the previous
-	// row, so it must still hold reconstructed (not yet swapped) bytes
-	for (uint32_t row = 0; row < uHeight; row++) {
-		uint8_t* pRow = pRaw + row * sRowBytes + 1;
-		const uint8_t* pPrev = (row > 0) ? (pRow - sRowBytes) : NULL;
-		uint8_t uFilter = pRow[-1];
-		size_t sLine = sRowBytes - 1;
-		switch (uFilter) {
-		case 0:
-			break;
-		case 1:
-			for (size_t i = 4; i < sLine; i++) {
-				pRow[i] = (uint8_t)(pRow[i] + pRow[i - 4]);
+				strPng.assign((const char*)magic, 8);
+				AppendPngChunk(strPng, "IHDR", ihdr, 13);
 			}
-			break;
-		case 2:
-			if (NULL != pPrev) {
-				for (size_t i = 0; i < sLine; i++) {
-					pRow[i] = (uint8_t)(pRow[i] + pPrev[i]);
+
+			zs.next_in = (Bytef*)pChunk;
+			zs.avail_in = uLen;
+			while (!bInflated) {
+				zs.next_out = pCur + sFilled;
+				zs.avail_out = (uInt)(sRowBytes - sFilled);
+				int nRet = inflate(&zs, Z_NO_FLUSH);
+				if (Z_OK != nRet && Z_STREAM_END != nRet && Z_BUF_ERROR != nRet) {
+					bFailed = true;
+					break;
+				}
+				sFilled = sRowBytes - zs.avail_out;
+				if (sFilled == sRowBytes) {
+					if (uRow >= uHeight || !UnfilterRow(pCur[0], pCur + 1, pPrev + 1, sRowBytes - 1)) {
+						bFailed = true;
+						break;
+					}
+					ConvertCgbiRow(pCur + 1, arrOutRow.data() + 1, sRowBytes - 1);
+					if (!deflateRow(arrOutRow.data(), sRowBytes, Z_NO_FLUSH)) {
+						bFailed = true;
+						break;
+					}
+					swap(pCur, pPrev);
+					sFilled = 0;
+					uRow++;
+				}
+				if (Z_STREAM_END == nRet) {
+					bInflated = true;
+				} else if (0 == zs.avail_in && 0 != zs.avail_out) {
+					break; // needs the next IDAT
 				}
 			}
+		} else if (0 == memcmp(pType, "IEND", 4)) {
 			break;
-		case 3:
-			for (size_t i = 0; i < sLine; i++) {
-				int a = (i >= 4) ? pRow[i - 4] : 0;
-				int b = (NULL != pPrev) ? pPrev[i] : 0;
-				pRow[i] = (uint8_t)(pRow[i] + ((a + b) >> 1));
-			}
-			break;
-		case 4:
-			for (size_t i = 0; i < sLine; i++) {
-				int a = (i >= 4) ? pRow[i - 4] : 0;
-				int b = (NULL != pPrev) ? pPrev[i] : 0;
-				int c = (i >= 4 && NULL != pPrev) ? pPrev[i - 4] : 0;
-				pRow[i] = (uint8_t)(pRow[i] + PaethPredictor(a, b, c));
-			}
-			break;
-		default:
-			return false;
 		}
-		pRow[-1] = 0;
+		pos += 12 + (size_t)uLen;
 	}
 
-	// swap BGRA -> RGBA and un-premultiply alpha
-	for (uint32_t row = 0; row < uHeight; row++) {
-		uint8_t* pRow = pRaw + row * sRowBytes + 1;
-		for (size_t i = 0; i + 4 <= sRowBytes - 1; i += 4) {
-			uint8_t b = pRow[i], a = pRow[i + 3];
-			pRow[i] = pRow[i + 2];
-			pRow[i + 2] = b;
-			if (a > 0 && a < 255) {
-				pRow[i] = (uint8_t)((pRow[i] * 255 + a / 2) / a);
-				pRow[i + 1] = (uint8_t)((pRow[i + 1] * 255 + a / 2) / a);
-				pRow[i + 2] = (uint8_t)((pRow[i + 2] * 255 + a / 2) / a);
-			}
-		}
+	if (!bInflating) {
+		return false;
 	}
 
-	uLongf uCompSize = compressBound((uLong)sRawSize);
-	string strComp;
-	strComp.resize(uCompSize);
-	if (Z_OK != compress2((Bytef*)&strComp[0], &uCompSize, pRaw, (uLong)sRawSize, Z_DEFAULT_COMPRESSION)) {
+	bool bDone = (!bFailed && bInflated && uRow == uHeight && 0 == sFilled && deflateRow(NULL, 0, Z_FINISH));
+	inflateEnd(&zs);
+	deflateEnd(&ds);
+	if (!bDone) {
+		strPng.clear();
 		return false;
 	}
 
-	strPng.assign((const char*)magic, 8);
-	AppendPngChunk(strPng, "IHDR", ihdr, 13);
-	AppendPngChunk(strPng, "IDAT", (const uint8_t*)strComp.data(), (uint32_t)uCompSize);
 	AppendPngChunk(strPng, "IEND", NULL, 0);
 	return true;
 }
@@ -245,17 +342,35 @@ static bool FindLargestIcon(const string& strAppFolder, const vector<string>& ar
 	return (nBestSize > 0);
 }
 
-bool GetMetadata(const string& strAppFolder, const string& strOutputDir, const string& strIpaFile)
+// Icons sit at the top of the app folder, named after CFBundleIconFiles
+// with size and scale suffixes; the largest file is the best one.
+static bool FindLargestZipIcon(const ZipIndex& zip, const string& strAppFolder, const vector<string>& arrIconNames, string& strBestPath)
 {
-	string strInfoPlistData;
-	string strInfoPlistPath = strAppFolder + "/Info.plist";
-	if (!ZFile::ReadFile(strInfoPlistPath.c_str(), strInfoPlistData)) {
-		return ZLog::ErrorV(">>> GetMetadata: Can't read %s\n", strInfoPlistPath.c_str());
+	uint64_t uBestSize = 0;
+	for (const string& strPath : zip.m_arrFiles) {
+		if (0 != strPath.compare(0, strAppFolder.size(), strAppFolder) ||
+			string::npos != strPath.find('/', strAppFolder.size())) {
+			continue;
+		}
+		string strBaseName = strPath.substr(strAppFolder.size());
+		for (const string& strPrefix : arrIconNames) {
+			if (0 == strncmp(strBaseName.c_str(), strPrefix.c_str(), strPrefix.size())) {
+				uint64_t uSize = zip.Find(strPath)->uSize;
+				if (uSize > uBestSize) {
+					uBestSize = uSize;
+					strBestPath = strPath;
+				}
+				break;
+			}
+		}
 	}
+	return (uBestSize > 0);
+}
 
-	jvalue jvInfo;
-	jvInfo.read_plist(strInfoPlistData);
-
+// strIconKey names the icon file: the sha1 of its path, so that one output
+// folder can hold the icons of many apps.
+static bool WriteMetadata(jvalue& jvInfo, const string& strIconKey, string& strIconData, const string& strOutputDir, const string& strIpaFile)
+{
 	string strAppName = jvInfo["CFBundleDisplayName"];
 	if (strAppName.empty()) {
 		strAppName = jvInfo["CFBundleName"].as_cstr();
@@ -268,24 +383,17 @@ bool GetMetadata(const string& strAppFolder, const string& strOutputDir, const s
 
 	string strBundleId = jvInfo["CFBundleIdentifier"];
 
-	// extract icon
+	// write icon
 	string strIconName;
-	vector<string> arrIconNames;
-	GetIconNames(jvInfo, arrIconNames);
-
-	string strBestIconPath;
-	if (!arrIconNames.empty() && FindLargestIcon(strAppFolder, arrIconNames, strBestIconPath)) {
-		string strIconData;
-		if (ZFile::ReadFile(strBestIconPath.c_str(), strIconData)) {
-			string strStandardPng;
-			if (DecodeCgbiPng(strIconData, strStandardPng)) {
-				strIconData = strStandardPng;
-			}
-			string strHash;
-			ZSHA::SHA1Text(strBestIconPath, strHash);
-			strIconName = strHash + ".png";
-			ZFile::WriteFile((strOutputDir + "/" + strIconName).c_str(), strIconData);
+	if (!strIconData.empty()) {
+		string strStandardPng;
+		if (DecodeCgbiPng(strIconData, strStandardPng)) {
+			strIconData = strStandardPng;
 		}
+		string strHash;
+		ZSHA::SHA1Text(strIconKey, strHash);
+		strIconName = strHash + ".png";
+		ZFile::WriteFile((strOutputDir + "/" + strIconName).c_str(), strIconData);
 	}
 
 	// ipa file info
@@ -314,3 +422,55 @@ bool GetMetadata(const string& strAppFolder, const string& strOutputDir, const s
 	ZLog::PrintV(">>> Metadata:\t%s\n", strMetaPath.c_str());
 	return true;
 }
+
+bool GetMetadata(const string& strAppFolder, const string& strOutputDir, const string& strIpaFile)
+{
+	string strInfoPlistData;
+	string strInfoPlistPath = strAppFolder + "/Info.plist";
+	if (!ZFile::ReadFile(strInfoPlistPath.c_str(), strInfoPlistData)) {
+		return ZLog::ErrorV(">>> GetMetadata: Can't read %s\n", strInfoPlistPath.c_str());
+	}
+
+	jvalue jvInfo;
+	jvInfo.read_plist(strInfoPlistData);
+
+	// extract icon
+	vector<string> arrIconNames;
+	GetIconNames(jvInfo, arrIconNames);
+
+	string strIconData;
+	string strBestIconPath;
+	if (!arrIconNames.empty() && FindLargestIcon(strAppFolder, arrIconNames, strBestIconPath)) {
+		ZFile::ReadFile(strBestIconPath.c_str(), strIconData);
+	}
+
+	return WriteMetadata(jvInfo, strBestIconPath, strIconData, strOutputDir, strIpaFile);
+}
+
+bool GetMetadataFromIpa(const string& strIpaFile, const string& strOutputDir)
+{
+	ZipIndex zip;
+	if (!zip.Open(strIpaFile)) {
+		return ZLog::ErrorV(">>> GetMetadata: Can't open %s\n", strIpaFile.c_str());
+	}
+
+	string strAppFolder;
+	string strInfoPlistData;
+	if (!zip.FindAppFolder(strAppFolder) || !zip.ReadFile(strAppFolder + "Info.plist", strInfoPlistData)) {
+		return ZLog::ErrorV(">>> GetMetadata: Can't find Payload/*.app/Info.plist in %s\n", strIpaFile.c_str());
+	}
+
+	jvalue jvInfo;
+	jvInfo.read_plist(strInfoPlistData);
+
+	vector<string> arrIconNames;
+	GetIconNames(jvInfo, arrIconNames);
+
+	string strIconData;
+	string strBestIconPath;
+	if (!arrIconNames.empty() && FindLargestZipIcon(zip, strAppFolder, arrIconNames, strBestIconPath)) {
+		zip.ReadFile(strBestIconPath, strIconData);
+	}
+
+	return WriteMetadata(jvInfo, strIpaFile + "/" + strBestIconPath, strIconData, strOutputDir, strIpaFile);
+}
@@ -2,3 +2,7 @@
 #include "common.h"
 
 bool GetMetadata(const string& strAppFolder, const string& strOutputDir, const string& strIpaFile);
+
+// Reads Info.plist and the app icon straight from the .ipa, without
+// extracting it.
+bool GetMetadataFromIpa(const string& strIpaFile, const string& strOutputDir);
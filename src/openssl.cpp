@@ -1,12 +1,13 @@
 #include "common.h"
 #include "base64.h"
+#include "mach-o.h"
 #include "openssl.h"
+#include "signing.h"
 #include <openssl/pem.h>
 #include <openssl/cms.h>
 #include <openssl/err.h>
 #include <openssl/provider.h>
 #include <openssl/pkcs12.h>
-#include <openssl/conf.h>
 
 const char* ZSignAsset::s_szAppleDevCACert = ""
 "-----BEGIN CERTIFICATE-----\n"
@@ -273,46 +274,26 @@ ZSignAsset::OpenSSLInit::OpenSSLInit()
 
 bool ZSignAsset::CMSError()
 {
-	ERR_print_errors_fp(stdout);
+	// through ZLog, so library callers get OpenSSL's errors in their log callback
+	ERR_print_errors_cb([](const char* str, size_t len, void* u) {
+		ZLog::Print(ZLog::E_ERROR, string(str, len).c_str());
+		return 1;
+	}, NULL);
 	return false;
 }
 
-void* ZSignAsset::GenerateASN1Type(const string& value)
+void ZSignAsset::BuildCDHashDER(const string& strCDHash256, string& strOutput)
 {
-	long errline = -1;
-	char* genstr = NULL;
-	BIO* ldapbio = BIO_new(BIO_s_mem());
-	CONF* cnf = NCONF_new(NULL);
-	ASN1_TYPE* ret = NULL;
-	string a = "asn1=SEQUENCE:A\n[A]\nC=OBJECT:sha256\nB=FORMAT:HEX,OCT:" + value + "\n";
-
-	if (NULL == ldapbio || NULL == cnf) {
-		ZLog::Error(">>> NCONF_new failed\n");
-		goto cleanup;
-	}
-	if (BIO_puts(ldapbio, a.c_str()) <= 0) {
-		ZLog::Error(">>> BIO_puts failed\n");
-		goto cleanup;
-	}
-	if (NCONF_load_bio(cnf, ldapbio, &errline) <= 0) {
-		ZLog::PrintV(">>> NCONF_load_bio failed %d\n", errline);
-		goto cleanup;
-	}
-	genstr = NCONF_get_string(cnf, "default", "asn1");
-
-	if (genstr == NULL) {
-		ZLog::Error(">>> NCONF_get_string failed\n");
-		goto cleanup;
-	}
-	ret = ASN1_generate_nconf(genstr, cnf);
-	if (NULL == ret) {
-		ZLog::Error(">>> ASN1_generate_nconf failed\n");
-	}
-
-cleanup:
-	if (ldapbio) BIO_free(ldapbio);
-	if (cnf) NCONF_free(cnf);
-	return ret;
+	static const uint8_t arrSHA256OID[] = { 0x60, 0x86, 0x48, 0x01, 0x65, 0x03, 0x04, 0x02, 0x01 };
+	uint64_t uLength = ZDER::HeaderSize(sizeof(arrSHA256OID)) + sizeof(arrSHA256OID) +
+						ZDER::HeaderSize(strCDHash256.size()) + strCDHash256.size();
+	strOutput.assign(ZDER::HeaderSize(uLength) + uLength, 0);
+	uint8_t* pOutput = (uint8_t*)&strOutput[0];
+	pOutput = ZDER::WriteHeader(pOutput, V_ASN1_SEQUENCE | V_ASN1_CONSTRUCTED, uLength);
+	pOutput = ZDER::WriteHeader(pOutput, V_ASN1_OBJECT, sizeof(arrSHA256OID));
+	pOutput = ZDER::WriteBytes(pOutput, arrSHA256OID, sizeof(arrSHA256OID));
+	pOutput = ZDER::WriteHeader(pOutput, V_ASN1_OCTET_STRING, strCDHash256.size());
+	ZDER::WriteBytes(pOutput, strCDHash256.data(), strCDHash256.size());
 }
 
 const char* ZSignAsset::WWDRIntermediatePEM(unsigned long uIssuerHash)
@@ -359,33 +340,31 @@ static bool StackContainsIssuerOf(STACK_OF(X509)* certs, X509* cert)
 	return false;
 }
 
-bool ZSignAsset::GenerateCMS(void* pscert, void* pspkey, const string& strCDHashData, const string& strCDHashesPlist, const string& strCodeDirectorySlotSHA1, const string& strAltnateCodeDirectorySlot256, string& strCMSOutput)
+// The certificates sent along with every signature: the issuer chain of
+// scert, terminated with the Apple root. Returns a STACK_OF(X509)*, or NULL.
+void* ZSignAsset::BuildCertChain(void* pscert, void* pcaCerts)
 {
-	if (!pscert || !pspkey) {
-		return CMSError();
-	}
-
 	X509* scert = (X509*)pscert;
-	EVP_PKEY* spkey = (EVP_PKEY*)pspkey;
-
 	STACK_OF(X509)* otherCerts = sk_X509_new_null();
 	if (!otherCerts) {
-		return CMSError();
+		return NULL;
 	}
 
 	// Prefer the CA chain shipped inside the input p12, but only when it actually
 	// contains the leaf's issuer; a p12 can carry an incomplete or unrelated chain
 	// (e.g. a root-only export), which must not shadow the embedded intermediates.
-	STACK_OF(X509)* caCerts = (STACK_OF(X509)*)m_caCerts;
+	STACK_OF(X509)* caCerts = (STACK_OF(X509)*)pcaCerts;
 	if (NULL != caCerts && StackContainsIssuerOf(caCerts, scert)) {
 		for (int i = 0; i < sk_X509_num(caCerts); i++) {
 			X509* cert = sk_X509_value(caCerts, i);
 			if (!X509_up_ref(cert)) {
-				return CMSError();
+				sk_X509_pop_free(otherCerts, X509_free);
+				return NULL;
 			}
 			if (!sk_X509_push(otherCerts, cert)) {
 				X509_free(cert);
-				return CMSError();
+				sk_X509_pop_free(otherCerts, X509_free);
+				return NULL;
 			}
 		}
 	} else {
@@ -394,10 +373,12 @@ bool ZSignAsset::GenerateCMS(void* pscert, void* pspkey, const string& strCDHash
 		const char* szIssuerCert = WWDRIntermediatePEM(issuerHash);
 		if (NULL == szIssuerCert) {
 			ZLog::ErrorV(">>> Unknown issuer hash 0x%08lx! No embedded WWDR intermediate matches and the p12 carries no usable CA chain.\n", issuerHash);
-			return false;
+			sk_X509_pop_free(otherCerts, X509_free);
+			return NULL;
 		}
 		if (!AppendPEMCert(otherCerts, szIssuerCert)) {
-			return CMSError();
+			sk_X509_pop_free(otherCerts, X509_free);
+			return NULL;
 		}
 	}
 
@@ -410,7 +391,8 @@ bool ZSignAsset::GenerateCMS(void* pscert, void* pspkey, const string& strCDHash
 		X509* root = (NULL != bio) ? PEM_read_bio_X509(bio, NULL, 0, NULL) : NULL;
 		BIO_free(bio);
 		if (!root) {
-			return CMSError();
+			sk_X509_pop_free(otherCerts, X509_free);
+			return NULL;
 		}
 
 		bool bIssuedChain = false;
@@ -426,99 +408,69 @@ bool ZSignAsset::GenerateCMS(void* pscert, void* pspkey, const string& strCDHash
 		if (bIssuedChain && !bPresent) {
 			if (!sk_X509_push(otherCerts, root)) {
 				X509_free(root);
-				return CMSError();
+				sk_X509_pop_free(otherCerts, X509_free);
+				return NULL;
 			}
 		} else {
 			X509_free(root);
 		}
 	}
+	return otherCerts;
+}
 
-	BIO* in = BIO_new_mem_buf(strCDHashData.c_str(), (int)strCDHashData.size());
-	if (!in) {
-		return CMSError();
-	}
-
-	int nFlags = CMS_PARTIAL | CMS_DETACHED | CMS_NOSMIMECAP | CMS_BINARY;
-	CMS_ContentInfo* cms = CMS_sign(NULL, NULL, otherCerts, NULL, nFlags);
-	if (!cms) {
-		return CMSError();
+static bool AddCMSSigner(CMS_ContentInfo* cms, X509* scert, EVP_PKEY* spkey, int nFlags, const string& strCDHashesPlist, const string& strAltnateCodeDirectorySlot256)
+{
+	// parsed once, the attributes take their own copies
+	static ASN1_OBJECT* s_objCDHashesPlist = OBJ_txt2obj("1.2.840.113635.100.9.1", 1);
+	static ASN1_OBJECT* s_objCDHashes = OBJ_txt2obj("1.2.840.113635.100.9.2", 1);
+	if (!s_objCDHashesPlist || !s_objCDHashes) {
+		return false;
 	}
 
 	CMS_SignerInfo* si = CMS_add1_signer(cms, scert, spkey, EVP_sha256(), nFlags);
 	//    CMS_add1_signer(cms, NULL, NULL, EVP_sha1(), nFlags);
 	if (!si) {
-		return CMSError();
+		return false;
 	}
 
 	// add plist
-	ASN1_OBJECT* obj = OBJ_txt2obj("1.2.840.113635.100.9.1", 1);
-	if (!obj) {
-		return CMSError();
-	}
-
-	int addHashPlist = CMS_signed_add1_attr_by_OBJ(si, obj, 0x4, strCDHashesPlist.c_str(), (int)strCDHashesPlist.size());
-
-	if (!addHashPlist) {
-		return CMSError();
+	if (!CMS_signed_add1_attr_by_OBJ(si, s_objCDHashesPlist, 0x4, strCDHashesPlist.c_str(), (int)strCDHashesPlist.size())) {
+		return false;
 	}
 
 	// add CDHashes
-	static const char hex_upper[] = "0123456789ABCDEF";
-	string sha256;
-	sha256.reserve(strAltnateCodeDirectorySlot256.size() * 2);
-	for (size_t i = 0; i < strAltnateCodeDirectorySlot256.size(); i++) {
-		uint8_t c = (uint8_t)strAltnateCodeDirectorySlot256[i];
-		sha256 += hex_upper[c >> 4];
-		sha256 += hex_upper[c & 0x0F];
-	}
-
-	ASN1_OBJECT* obj2 = OBJ_txt2obj("1.2.840.113635.100.9.2", 1);
-	if (!obj2) {
-		return CMSError();
-	}
-
-	X509_ATTRIBUTE* attr = X509_ATTRIBUTE_new();
-	if (!attr) {
-		return CMSError();
-	}
-	X509_ATTRIBUTE_set1_object(attr, obj2);
-
-	ASN1_TYPE* type_256 = (ASN1_TYPE*)GenerateASN1Type(sha256);
-	if (!type_256) {
-		return CMSError();
-	}
-	X509_ATTRIBUTE_set1_data(attr, V_ASN1_SEQUENCE,
-		ASN1_STRING_get0_data(type_256->value.asn1_string), ASN1_STRING_length(type_256->value.asn1_string));
-	int addHashSHA = CMS_signed_add1_attr(si, attr);
-	if (!addHashSHA) {
-		return CMSError();
-	}
+	string strCDHash;
+	ZSignAsset::BuildCDHashDER(strAltnateCodeDirectorySlot256, strCDHash);
+	return (0 != CMS_signed_add1_attr_by_OBJ(si, s_objCDHashes, V_ASN1_SEQUENCE, strCDHash.data(), (int)strCDHash.size()));
+}
 
-	if (!CMS_final(cms, in, NULL, nFlags)) {
+bool ZSignAsset::GenerateCMS(void* pscert, void* pspkey, void* pcerts, const string& strCDHashData, const string& strCDHashesPlist, const string& strCodeDirectorySlotSHA1, const string& strAltnateCodeDirectorySlot256, string& strCMSOutput)
+{
+	if (!pscert || !pspkey || !pcerts) {
 		return CMSError();
 	}
 
+	int nFlags = CMS_PARTIAL | CMS_DETACHED | CMS_NOSMIMECAP | CMS_BINARY;
+	CMS_ContentInfo* cms = CMS_sign(NULL, NULL, (STACK_OF(X509)*)pcerts, NULL, nFlags);
+	BIO* in = BIO_new_mem_buf(strCDHashData.c_str(), (int)strCDHashData.size());
 	BIO* out = BIO_new(BIO_s_mem());
-	if (!out) {
-		return CMSError();
-	}
-
-	//PEM_write_bio_CMS(out, cms);
-	if (!i2d_CMS_bio(out, cms)) {
-		return CMSError();
-	}
-
-	BUF_MEM* bptr = NULL;
-	BIO_get_mem_ptr(out, &bptr);
-	if (!bptr) {
-		return CMSError();
-	}
+	bool bRet = (NULL != cms && NULL != in && NULL != out &&
+				AddCMSSigner(cms, (X509*)pscert, (EVP_PKEY*)pspkey, nFlags, strCDHashesPlist, strAltnateCodeDirectorySlot256) &&
+				CMS_final(cms, in, NULL, nFlags) &&
+				i2d_CMS_bio(out, cms));
 
 	strCMSOutput.clear();
-	strCMSOutput.append(bptr->data, bptr->length);
-	ASN1_TYPE_free(type_256);
-	sk_X509_pop_free(otherCerts, X509_free); // CMS_sign holds its own references
-	return (!strCMSOutput.empty());
+	if (bRet) {
+		BUF_MEM* bptr = NULL;
+		BIO_get_mem_ptr(out, &bptr);
+		if (NULL != bptr) {
+			strCMSOutput.append(bptr->data, bptr->length);
+		}
+	}
+	CMS_ContentInfo_free(cms);
+	BIO_free(in);
+	BIO_free(out);
+	return bRet ? (!strCMSOutput.empty()) : CMSError();
 }
 
 bool ZSignAsset::GetCMSContent(const string& strCMSDataInput, string& strContentOutput)
@@ -548,6 +500,40 @@ bool ZSignAsset::GetCMSContent(const string& strCMSDataInput, string& strContent
 	return (!strContentOutput.empty());
 }
 
+bool ZSignAsset::VerifyCMS(const uint8_t* pCMSData, uint32_t uCMSLength, const string& strContent, string& strCDHashesPlist)
+{
+	strCDHashesPlist.clear();
+	BIO* in = BIO_new_mem_buf(pCMSData, (int)uCMSLength);
+	CMS_ContentInfo* cms = d2i_CMS_bio(in, NULL);
+	BIO_free(in);
+	if (!cms) {
+		ERR_clear_error();
+		return false;
+	}
+
+	// failures are reported by the caller, keep the error queue quiet
+	BIO* content = BIO_new_mem_buf(strContent.data(), (int)strContent.size());
+	bool bRet = (1 == CMS_verify(cms, NULL, NULL, content, NULL, CMS_NO_SIGNER_CERT_VERIFY | CMS_BINARY));
+	BIO_free(content);
+
+	STACK_OF(CMS_SignerInfo)* sis = CMS_get0_SignerInfos(cms);
+	if (bRet && sk_CMS_SignerInfo_num(sis) > 0) {
+		CMS_SignerInfo* si = sk_CMS_SignerInfo_value(sis, 0);
+		ASN1_OBJECT* obj = OBJ_txt2obj("1.2.840.113635.100.9.1", 1);
+		int nIndex = CMS_signed_get_attr_by_OBJ(si, obj, -1);
+		ASN1_OBJECT_free(obj);
+		X509_ATTRIBUTE* attr = (nIndex >= 0) ? CMS_signed_get_attr(si, nIndex) : NULL;
+		const ASN1_TYPE* av = (NULL != attr) ? X509_ATTRIBUTE_get0_type(attr, 0) : NULL;
+		if (NULL != av && V_ASN1_OCTET_STRING == av->type) {
+			strCDHashesPlist.append((const char*)ASN1_STRING_get0_data(av->value.octet_string), ASN1_STRING_length(av->value.octet_string));
+		}
+	}
+
+	CMS_ContentInfo_free(cms);
+	ERR_clear_error();
+	return bRet;
+}
+
 bool ZSignAsset::GetCertSubjectCN(void* pcert, string& strSubjectCN)
 {
 	if (!pcert) {
@@ -821,11 +807,28 @@ ZSignAsset::ZSignAsset()
 	m_evpPKey = NULL;
 	m_x509Cert = NULL;
 	m_caCerts = NULL;
+	m_certChain = NULL;
 	m_bAdhoc = false;
 	m_bSingleBinary = false;
 	m_bSHA256Only = false;
 }
 
+ZSignAsset::~ZSignAsset()
+{
+	if (NULL != m_evpPKey) {
+		EVP_PKEY_free((EVP_PKEY*)m_evpPKey);
+	}
+	if (NULL != m_x509Cert) {
+		X509_free((X509*)m_x509Cert);
+	}
+	if (NULL != m_caCerts) {
+		sk_X509_pop_free((STACK_OF(X509)*)m_caCerts, X509_free);
+	}
+	if (NULL != m_certChain) {
+		sk_X509_pop_free((STACK_OF(X509)*)m_certChain, X509_free);
+	}
+}
+
 bool ZSignAsset::Init(
 	const string& strCertFile,
 	const string& strPKeyFile, 
@@ -839,6 +842,9 @@ bool ZSignAsset::Init(
 	m_bAdhoc = bAdhoc;
 	m_bSHA256Only = bSHA256Only;
 	m_bSingleBinary = bSingleBinary;
+	m_mapRequirementsSlots.clear();
+	m_mapEntitlementsSlots.clear();
+	m_mapDerEntitlementsSlots.clear();
 
 	if (m_bAdhoc) {
 		if (!strEntitleFile.empty()) {
@@ -957,10 +963,60 @@ bool ZSignAsset::Init(
 
 	m_evpPKey = evpPKey;
 	m_x509Cert = x509Cert;
+
+	// every signature carries the same chain, build it once
+	m_certChain = BuildCertChain(m_x509Cert, m_caCerts);
+	if (NULL == m_certChain) {
+		ZLog::Error(">>> Can't build the certificate chain!\n");
+		return false;
+	}
 	return true;
 }
 
+void ZSignAsset::HashSpecialSlot(SpecialSlot& slot)
+{
+	if (slot.strData.empty()) {
+		slot.strSHA1.assign(20, 0);
+		slot.strSHA256.assign(32, 0);
+	} else {
+		ZSHA::SHA(slot.strData, slot.strSHA1, slot.strSHA256);
+	}
+}
+
+void ZSignAsset::GetSpecialSlots(const string& strBundleId, bool bExecute, SpecialSlot& requirements, SpecialSlot& entitlements, SpecialSlot& derEntitlements)
+{
+	lock_guard<mutex> lock(m_mtxSpecialSlots);
+
+	auto itRequirements = m_mapRequirementsSlots.find(strBundleId);
+	if (itRequirements == m_mapRequirementsSlots.end()) {
+		SpecialSlot slot;
+		ZSign::SlotBuildRequirements(strBundleId, m_strSubjectCN, slot.strData);
+		HashSpecialSlot(slot);
+		itRequirements = m_mapRequirementsSlots.insert(make_pair(strBundleId, slot)).first;
+	}
+	requirements = itRequirements->second;
+
+	auto itEntitlements = m_mapEntitlementsSlots.find(bExecute);
+	if (itEntitlements == m_mapEntitlementsSlots.end()) {
+		string strEmptyEntitlements = "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<!DOCTYPE plist PUBLIC \"-//Apple//DTD PLIST 1.0//EN\" \"http://www.apple.com/DTDs/PropertyList-1.0.dtd\">\n<plist version=\"1.0\">\n<dict/>\n</plist>\n";
+		SpecialSlot slot;
+		ZSign::SlotBuildEntitlements(bExecute ? m_strEntitleData : strEmptyEntitlements, slot.strData);
+		HashSpecialSlot(slot);
+		itEntitlements = m_mapEntitlementsSlots.insert(make_pair(bExecute, slot)).first;
+	}
+	entitlements = itEntitlements->second;
+
+	auto itDerEntitlements = m_mapDerEntitlementsSlots.find(bExecute);
+	if (itDerEntitlements == m_mapDerEntitlementsSlots.end()) {
+		SpecialSlot slot;
+		ZSign::SlotBuildDerEntitlements(bExecute ? m_strEntitleData : "", slot.strData);
+		HashSpecialSlot(slot);
+		itDerEntitlements = m_mapDerEntitlementsSlots.insert(make_pair(bExecute, slot)).first;
+	}
+	derEntitlements = itDerEntitlements->second;
+}
+
 bool ZSignAsset::GenerateCMS(const string& strCDHashData, const string& strCDHashesPlist, const string& strCodeDirectorySlotSHA1, const string& strAltnateCodeDirectorySlot256, string& strCMSOutput)
 {
-	return GenerateCMS((X509*)m_x509Cert, (EVP_PKEY*)m_evpPKey, strCDHashData, strCDHashesPlist, strCodeDirectorySlotSHA1, strAltnateCodeDirectorySlot256, strCMSOutput);
+	return GenerateCMS(m_x509Cert, m_evpPKey, m_certChain, strCDHashData, strCDHashesPlist, strCodeDirectorySlotSHA1, strAltnateCodeDirectorySlot256, strCMSOutput);
 }
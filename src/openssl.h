@@ -5,6 +5,22 @@ class ZSignAsset
 {
 public:
 	ZSignAsset();
+	~ZSignAsset();
+
+private:
+	// owns the OpenSSL key and certificates
+	ZSignAsset(const ZSignAsset&);
+	ZSignAsset& operator=(const ZSignAsset&);
+
+public:
+	// A special slot blob with its SHA-1 and SHA-256, which are all zeros
+	// for an empty blob.
+	struct SpecialSlot
+	{
+		string	strData;
+		string	strSHA1;
+		string	strSHA256;
+	};
 
 public:
 	bool Init(const string& strCertFile, 
@@ -16,6 +32,16 @@ public:
 				bool bSHA256Only,
 				bool bSingleBinary);
 
+	// The requirements, entitlements and DER entitlements slots only depend
+	// on the bundle id, this identity and whether the binary is an
+	// executable, so each distinct one is built and hashed once, and then
+	// shared by every binary and arch signed with this asset.
+	void GetSpecialSlots(const string& strBundleId,
+							bool bExecute,
+							SpecialSlot& requirements,
+							SpecialSlot& entitlements,
+							SpecialSlot& derEntitlements);
+
 	bool GenerateCMS(const string& strCDHashData, 
 						const string& strCDHashesPlist, 
 						const string& strCodeDirectorySlotSHA1, 
@@ -25,24 +51,33 @@ public:
 private:
 	bool GenerateCMS(void* pscert, 
 						void* pspkey, 
+						void* pcerts, 
 						const string& strCDHashData, 
 						const string& strCDHashesPlist, 
 						const string& strCodeDirectorySlotSHA1, 
 						const string& strAltnateCodeDirectorySlot256, 
 						string& strCMSOutput);
 
+	static void* BuildCertChain(void* pscert, void* pcaCerts);
 	bool GetCertSubjectCN(void* cert, string& strSubjectCN);
 	bool GetCertSubjectCN(const string& strCertData, string& strSubjectCN);
+	static void HashSpecialSlot(SpecialSlot& slot);
 
 public:
 	static bool		CMSError();
 	// Returns the embedded WWDR intermediate (G1-G8) whose subject name hash
 	// matches uIssuerHash, or NULL. Shared by signing and certificate check.
 	static const char*	WWDRIntermediatePEM(unsigned long uIssuerHash);
-	static void*	GenerateASN1Type(const string& value);
+	// The value of the CDHashes signed attribute (1.2.840.113635.100.9.2):
+	// SEQUENCE { OBJECT sha256, OCTET STRING strCDHash256 }
+	static void		BuildCDHashDER(const string& strCDHash256, string& strOutput);
 	static bool		GetCertInfo(void* pcert, jvalue& jvCertInfo);
 	static bool		GetCMSInfo(uint8_t* pCMSData, uint32_t uCMSLength, jvalue& jvOutput);
 	static bool		GetCMSContent(const string& strCMSDataInput, string& strContentOutput);
+	// Verifies a detached CMS signature over strContent with the signer
+	// certificate it carries (neither its chain nor revocation is checked)
+	// and returns its signed CDHashes plist attribute.
+	static bool		VerifyCMS(const uint8_t* pCMSData, uint32_t uCMSLength, const string& strContent, string& strCDHashesPlist);
 	static void		ParseCertSubject(const string& strSubject, jvalue& jvSubject);
 	static string	ASN1_TIMEtoString(const void* time);
 
@@ -60,6 +95,12 @@ private:
 	void*	m_evpPKey;
 	void*	m_x509Cert;
 	void*	m_caCerts; // STACK_OF(X509)* CA chain recovered from the input p12, if any
+	void*	m_certChain; // STACK_OF(X509)* sent with every signature, see BuildCertChain()
+
+	mutex						m_mtxSpecialSlots;
+	map<string, SpecialSlot>	m_mapRequirementsSlots;		// by bundle id
+	map<bool, SpecialSlot>		m_mapEntitlementsSlots;		// by is-execute
+	map<bool, SpecialSlot>		m_mapDerEntitlementsSlots;
 
 public:
 	static const char* s_szAppleDevCACert;
@@ -4,88 +4,149 @@
 #include "openssl.h"
 #include "signing.h"
 #include <algorithm>
-#include <openssl/sha.h>
 
-void ZSign::_DERLength(string& strBlob, uint64_t uLength)
+uint32_t ZDER::HeaderSize(uint64_t uLength)
 {
+	return (uLength < 128) ? 2 : (2 + (64 - ZUtil::builtin_clzll(uLength) + 7) / 8);
+}
+
+uint8_t* ZDER::WriteHeader(uint8_t* pOutput, uint8_t uTag, uint64_t uLength)
+{
+	*pOutput++ = uTag;
 	if (uLength < 128) {
-		strBlob.append(1, (char)uLength);
+		*pOutput++ = (uint8_t)uLength;
 	} else {
 		uint32_t sLength = (64 - ZUtil::builtin_clzll(uLength) + 7) / 8;
-		strBlob.append(1, (char)(0x80 | sLength));
+		*pOutput++ = (uint8_t)(0x80 | sLength);
 		sLength *= 8;
 		do {
-			strBlob.append(1, (char)(uLength >> (sLength -= 8)));
+			*pOutput++ = (uint8_t)(uLength >> (sLength -= 8));
 		} while (sLength != 0);
 	}
+	return pOutput;
+}
+
+uint8_t* ZDER::WriteBytes(uint8_t* pOutput, const void* pData, size_t sSize)
+{
+	if (sSize > 0) {
+		memcpy(pOutput, pData, sSize);
+	}
+	return pOutput + sSize;
+}
+
+// minimal two's complement: no leading 0x00 or 0xff byte that only
+// repeats the sign of the next one
+uint32_t ZDER::IntegerSize(int64_t nValue)
+{
+	uint32_t uSize = 8;
+	while (uSize > 1) {
+		int64_t nTop = nValue >> (uSize * 8 - 9);
+		if (0 != nTop && -1 != nTop) {
+			break;
+		}
+		uSize--;
+	}
+	return 2 + uSize;
 }
 
-string ZSign::_DER(const jvalue& data)
+uint8_t* ZDER::WriteInteger(uint8_t* pOutput, int64_t nValue)
+{
+	uint32_t uSize = IntegerSize(nValue) - 2;
+	pOutput = WriteHeader(pOutput, 0x02, uSize);
+	while (uSize > 0) {
+		*pOutput++ = (uint8_t)((uint64_t)nValue >> (--uSize * 8));
+	}
+	return pOutput;
+}
+
+uint64_t ZDER::Measure(const jvalue& data)
+{
+	m_arrLengths.clear();
+	m_arrKeys.clear();
+	return MeasureValue(data);
+}
+
+uint8_t* ZDER::Write(const jvalue& data, uint8_t* pOutput)
+{
+	m_sLengths = 0;
+	m_sKeys = 0;
+	return WriteValue(data, pOutput);
+}
+
+uint64_t ZDER::MeasureValue(const jvalue& data)
 {
-	string strOutput;
 	if (data.is_bool()) {
-		strOutput.append(1, 0x01);
-		strOutput.append(1, 1);
-		strOutput.append(1, data.as_bool() ? (char)0xff : (char)0x00);
+		return 3;
 	} else if (data.is_int()) {
-		uint64_t uVal = data.as_int64();
-		strOutput.append(1, 0x02);
-		_DERLength(strOutput, uVal);
-
-		uint32_t sLength = (64 - ZUtil::builtin_clzll(uVal) + 7) / 8;
-		sLength *= 8;
-		do {
-			strOutput.append(1, (char)(uVal >> (sLength -= 8)));
-		} while (sLength != 0);
+		return IntegerSize(data.as_int64());
 	} else if (data.is_string()) {
-		string strVal = data.as_cstr();
-		strOutput.append(1, 0x0c);
-		_DERLength(strOutput, strVal.size());
-		strOutput += strVal;
+		uint64_t uLength = strlen(data.as_cstr());
+		return HeaderSize(uLength) + uLength;
 	} else if (data.is_array()) {
-		string strArray;
+		size_t sIndex = m_arrLengths.size();
+		m_arrLengths.push_back(0);
+		uint64_t uLength = 0;
 		size_t size = data.size();
 		for (size_t i = 0; i < size; i++) {
-			strArray += _DER(data[i]);
+			uLength += MeasureValue(data[i]);
 		}
-		strOutput.append(1, 0x30);
-		_DERLength(strOutput, strArray.size());
-		strOutput += strArray;
+		m_arrLengths[sIndex] = uLength;
+		return HeaderSize(uLength) + uLength;
 	} else if (data.is_object()) {
-		vector<string> arrKeys;
-		data.get_keys(arrKeys);
-		std::sort(arrKeys.begin(), arrKeys.end());
+		size_t sIndex = m_arrLengths.size();
+		m_arrLengths.push_back(0);
+		size_t sKeys = m_arrKeys.size();
+		m_arrKeys.push_back(vector<string>());
+		data.get_keys(m_arrKeys[sKeys]);
+		std::sort(m_arrKeys[sKeys].begin(), m_arrKeys[sKeys].end());
+
+		uint64_t uLength = 0;
+		for (size_t i = 0; i < m_arrKeys[sKeys].size(); i++) {
+			const string& strKey = m_arrKeys[sKeys][i];
+			size_t sEntry = m_arrLengths.size();
+			m_arrLengths.push_back(0);
+			uint64_t uEntry = HeaderSize(strKey.size()) + strKey.size() + MeasureValue(data[strKey]);
+			m_arrLengths[sEntry] = uEntry;
+			uLength += HeaderSize(uEntry) + uEntry;
+		}
+		m_arrLengths[sIndex] = uLength;
+		return HeaderSize(uLength) + uLength;
+	}
+
+	assert(false && "Unsupported Entitlements DER Type");
+	return 0;
+}
 
-		string strDict;
+uint8_t* ZDER::WriteValue(const jvalue& data, uint8_t* pOutput)
+{
+	if (data.is_bool()) {
+		pOutput = WriteHeader(pOutput, 0x01, 1);
+		*pOutput++ = data.as_bool() ? 0xff : 0x00;
+	} else if (data.is_int()) {
+		pOutput = WriteInteger(pOutput, data.as_int64());
+	} else if (data.is_string()) {
+		const char* szVal = data.as_cstr();
+		size_t sLength = strlen(szVal);
+		pOutput = WriteHeader(pOutput, 0x0c, sLength);
+		pOutput = WriteBytes(pOutput, szVal, sLength);
+	} else if (data.is_array()) {
+		pOutput = WriteHeader(pOutput, 0x30, m_arrLengths[m_sLengths++]);
+		size_t size = data.size();
+		for (size_t i = 0; i < size; i++) {
+			pOutput = WriteValue(data[i], pOutput);
+		}
+	} else if (data.is_object()) {
+		pOutput = WriteHeader(pOutput, 0xb0, m_arrLengths[m_sLengths++]);
+		const vector<string>& arrKeys = m_arrKeys[m_sKeys++];
 		for (size_t i = 0; i < arrKeys.size(); i++) {
-			string& strKey = arrKeys[i];
-			string strVal = _DER(data[strKey]);
-
-			string strEntry;
-			strEntry.append(1, 0x0c);
-			_DERLength(strEntry, strKey.size());
-			strEntry += strKey;
-			strEntry += strVal;
-
-			strDict.append(1, 0x30);
-			_DERLength(strDict, strEntry.size());
-			strDict += strEntry;
+			const string& strKey = arrKeys[i];
+			pOutput = WriteHeader(pOutput, 0x30, m_arrLengths[m_sLengths++]);
+			pOutput = WriteHeader(pOutput, 0x0c, strKey.size());
+			pOutput = WriteBytes(pOutput, strKey.data(), strKey.size());
+			pOutput = WriteValue(data[strKey], pOutput);
 		}
-
-		strOutput.append(1, (char)0xb0);
-		_DERLength(strOutput, strDict.size());
-		strOutput += strDict;
-	} else if (data.is_double()) {
-		assert(false);
-	} else if (data.is_date()) {
-		assert(false);
-	} else if (data.is_data()) {
-		assert(false);
-	} else {
-		assert(false && "Unsupported Entitlements DER Type");
 	}
-
-	return strOutput;
+	return pOutput;
 }
 
 uint32_t ZSign::SlotParseGeneralHeader(const char* szSlotName, uint8_t* pSlotBase, CS_BlobIndex* pbi)
@@ -321,26 +382,20 @@ bool ZSign::SlotBuildDerEntitlements(const string& strEntitlements, string& strO
 	jvalue jvInfo;
 	jvInfo.read_plist(strEntitlements);
 
-	string strInnerDict = _DER(jvInfo);
-
-	string strVersion;
-	strVersion.append(1, 0x02);
-	strVersion.append(1, 0x01);
-	strVersion.append(1, 0x01);
-
-	string strBody = strVersion + strInnerDict;
-
-	string strRawEntitlementsData;
-	strRawEntitlementsData.append(1, (char)0x70);
-	_DERLength(strRawEntitlementsData, strBody.size());
-	strRawEntitlementsData += strBody;
-
+	// [APPLICATION 16] { INTEGER 1 (version), entitlements dict }
+	ZDER der;
+	uint64_t uBody = ZDER::IntegerSize(1) + der.Measure(jvInfo);
 	uint32_t uMagic = BE((uint32_t)CSMAGIC_EMBEDDED_DER_ENTITLEMENTS);
-	uint32_t uLength = BE((uint32_t)strRawEntitlementsData.size() + 8);
+	uint32_t uLength = (uint32_t)(8 + ZDER::HeaderSize(uBody) + uBody);
 
-	strOutput.append((const char*)&uMagic, sizeof(uMagic));
-	strOutput.append((const char*)&uLength, sizeof(uLength));
-	strOutput.append(strRawEntitlementsData.data(), strRawEntitlementsData.size());
+	strOutput.resize(uLength);
+	uint8_t* pOutput = (uint8_t*)&strOutput[0];
+	pOutput = ZDER::WriteBytes(pOutput, &uMagic, sizeof(uMagic));
+	uLength = BE(uLength);
+	pOutput = ZDER::WriteBytes(pOutput, &uLength, sizeof(uLength));
+	pOutput = ZDER::WriteHeader(pOutput, 0x70, uBody);
+	pOutput = ZDER::WriteInteger(pOutput, 1);
+	der.Write(jvInfo, pOutput);
 
 	return true;
 }
@@ -586,25 +641,10 @@ bool ZSign::SlotBuildCodeDirectory(bool bAlternate,
 	if (NULL != pCodeSlotsData && (uCodeSlotsDataLength == uCodeSlots * cdHeader.hashSize)) { //use exists
 		strOutput.append((const char*)pCodeSlotsData, uCodeSlotsDataLength);
 	} else {
-		uint8_t hash[32]; // large enough for both SHA1 (20) and SHA256 (32)
-		for (uint32_t i = 0; i < uPages; i++) {
-			if (1 == cdHeader.hashType) {
-				::SHA1(pCodeBase + uPageSize * i, uPageSize, hash);
-				strOutput.append((const char*)hash, 20);
-			} else {
-				::SHA256(pCodeBase + uPageSize * i, uPageSize, hash);
-				strOutput.append((const char*)hash, 32);
-			}
-		}
-		if (uRemain > 0) {
-			if (1 == cdHeader.hashType) {
-				::SHA1(pCodeBase + uPageSize * uPages, uRemain, hash);
-				strOutput.append((const char*)hash, 20);
-			} else {
-				::SHA256(pCodeBase + uPageSize * uPages, uRemain, hash);
-				strOutput.append((const char*)hash, 32);
-			}
-		}
+		// hashed straight into the output, one slot per page
+		size_t sOffset = strOutput.size();
+		strOutput.resize(sOffset + uCodeSlotsLength);
+		ZSHA::HashPages(1 != cdHeader.hashType, pCodeBase, (size_t)uPageSize * uPages + uRemain, uPageSize, (uint8_t*)&strOutput[sOffset]);
 	}
 
 	return true;
@@ -705,8 +745,7 @@ bool ZSign::SlotBuildCMSSignature(ZSignAsset* pSignAsset,
 	string strCodeDirectorySlotSHA1;   // SHA1 of primary CD (used by CMS detached content & dual-hash plist[0])
 	string strPrimaryCD_SHA256;        // SHA256 of primary CD (used in SHA256-only mode)
 	string strAltnateCD_SHA256;        // SHA256 of alternate CD (dual-hash mode only)
-	ZSHA::SHA1(strCodeDirectorySlot, strCodeDirectorySlotSHA1);
-	ZSHA::SHA256(strCodeDirectorySlot, strPrimaryCD_SHA256);
+	ZSHA::SHA(strCodeDirectorySlot, strCodeDirectorySlotSHA1, strPrimaryCD_SHA256);
 	if (bHasAlternate) {
 		ZSHA::SHA256(strAltnateCodeDirectorySlot, strAltnateCD_SHA256);
 	}
@@ -817,44 +856,251 @@ bool ZSign::SlotGetCodeSlotsData(uint8_t* pSlotBase, uint8_t*& pCodeSlots, uint3
 bool ZSign::GetCodeSignatureExistsCodeSlotsData(uint8_t* pCSBase,
 	uint8_t*& pCodeSlots1Data,
 	uint32_t& uCodeSlots1DataLength,
+	uint32_t& uCodeSlots1PageSize,
 	uint8_t*& pCodeSlots256Data,
-	uint32_t& uCodeSlots256DataLength)
+	uint32_t& uCodeSlots256DataLength,
+	uint32_t& uCodeSlots256PageSize)
 {
 	pCodeSlots1Data = NULL;
 	pCodeSlots256Data = NULL;
 	uCodeSlots1DataLength = 0;
 	uCodeSlots256DataLength = 0;
+	uCodeSlots1PageSize = 0;
+	uCodeSlots256PageSize = 0;
 	CS_SuperBlob* psb = (CS_SuperBlob*)pCSBase;
 	if (NULL == psb || CSMAGIC_EMBEDDED_SIGNATURE != LE(psb->magic)) {
 		return false;
 	}
 
+	// sorted by hash type rather than slot: a SHA-256 only signature has
+	// its SHA-256 code directory in the primary slot
 	CS_BlobIndex* pbi = (CS_BlobIndex*)(pCSBase + sizeof(CS_SuperBlob));
 	for (uint32_t i = 0; i < LE(psb->count); i++, pbi++) {
-		uint8_t* pSlotBase = pCSBase + LE(pbi->offset);
-		switch (LE(pbi->type)) {
-		case CSSLOT_CODEDIRECTORY:
-		{
-			CS_CodeDirectory cdHeader = *((CS_CodeDirectory*)pSlotBase);
-			if (LE(cdHeader.length) > 8) {
-				pCodeSlots1Data = pSlotBase + LE(cdHeader.hashOffset);
-				uCodeSlots1DataLength = LE(cdHeader.nCodeSlots) * cdHeader.hashSize;
-			}
+		uint32_t uType = LE(pbi->type);
+		if (CSSLOT_CODEDIRECTORY != uType && CSSLOT_ALTERNATE_CODEDIRECTORIES != uType) {
+			continue;
 		}
-		break;
-		case CSSLOT_ALTERNATE_CODEDIRECTORIES:
-		{
-			CS_CodeDirectory cdHeader = *((CS_CodeDirectory*)pSlotBase);
-			if (LE(cdHeader.length) > 8) {
-				pCodeSlots256Data = pSlotBase + LE(cdHeader.hashOffset);
-				uCodeSlots256DataLength = LE(cdHeader.nCodeSlots) * cdHeader.hashSize;
-			}
+
+		uint8_t* pSlotBase = pCSBase + LE(pbi->offset);
+		CS_CodeDirectory cdHeader = *((CS_CodeDirectory*)pSlotBase);
+		if (LE(cdHeader.length) <= 8) {
+			continue;
 		}
-		break;
-		default:
-			break;
+		uint32_t uPageSize = (cdHeader.pageSize > 0 && cdHeader.pageSize < 32) ? (1u << cdHeader.pageSize) : 0;
+		if (1 == cdHeader.hashType && 20 == cdHeader.hashSize) {
+			pCodeSlots1Data = pSlotBase + LE(cdHeader.hashOffset);
+			uCodeSlots1DataLength = LE(cdHeader.nCodeSlots) * cdHeader.hashSize;
+			uCodeSlots1PageSize = uPageSize;
+		} else if (2 == cdHeader.hashType && 32 == cdHeader.hashSize) {
+			pCodeSlots256Data = pSlotBase + LE(cdHeader.hashOffset);
+			uCodeSlots256DataLength = LE(cdHeader.nCodeSlots) * cdHeader.hashSize;
+			uCodeSlots256PageSize = uPageSize;
 		}
 	}
 
 	return ((NULL != pCodeSlots1Data) && (NULL != pCodeSlots256Data) && uCodeSlots1DataLength > 0 && uCodeSlots256DataLength > 0);
 }
+
+static const char* GetSpecialSlotName(uint32_t uSlot)
+{
+	switch (uSlot) {
+	case CSSLOT_INFOSLOT:
+		return "Info.plist";
+	case CSSLOT_REQUIREMENTS:
+		return "Requirements";
+	case CSSLOT_RESOURCEDIR:
+		return "CodeResources";
+	case CSSLOT_ENTITLEMENTS:
+		return "Entitlements";
+	case CSSLOT_DER_ENTITLEMENTS:
+		return "Entitlements(DER)";
+	}
+	return "Unknown";
+}
+
+static void HashSlotData(uint8_t uHashType, const uint8_t* pData, size_t sSize, uint8_t* pHash)
+{
+	ZSHA::Hash(1 != uHashType, pData, sSize, pHash);
+}
+
+bool ZSign::VerifyCodeDirectory(uint8_t* pSlotBase,
+	uint32_t uSlotLength,
+	uint8_t* pCodeBase,
+	uint32_t uCodeLength,
+	const map<uint32_t, string>& mapSpecialSlots,
+	string& strReason)
+{
+	CS_CodeDirectory cdHeader;
+	memset(&cdHeader, 0, sizeof(cdHeader));
+	if (uSlotLength < 44) {
+		strReason = "CodeDirectory is truncated";
+		return false;
+	}
+	memcpy(&cdHeader, pSlotBase, min((size_t)uSlotLength, sizeof(cdHeader)));
+
+	if (CSMAGIC_CODEDIRECTORY != LE(cdHeader.magic)) {
+		strReason = "bad CodeDirectory magic";
+		return false;
+	}
+
+	uint32_t uHashSize = cdHeader.hashSize;
+	if (!(1 == cdHeader.hashType && 20 == uHashSize) && !(2 == cdHeader.hashType && 32 == uHashSize)) {
+		ZUtil::StringFormatV(strReason, "unsupported CodeDirectory hash type %u", cdHeader.hashType);
+		return false;
+	}
+	const char* szHashName = (1 == cdHeader.hashType) ? "SHA-1" : "SHA-256";
+
+	uint32_t uCodeLimit = LE(cdHeader.codeLimit);
+	if (uCodeLimit != uCodeLength) {
+		ZUtil::StringFormatV(strReason, "code limit %u doesn't match the signature offset %u (%s)", uCodeLimit, uCodeLength, szHashName);
+		return false;
+	}
+
+	uint64_t uPageSize = (cdHeader.pageSize > 0 && cdHeader.pageSize < 32) ? (1ull << cdHeader.pageSize) : uCodeLimit;
+	uint64_t uCodeSlots = (uPageSize > 0) ? (uCodeLimit + uPageSize - 1) / uPageSize : 0;
+	uint32_t uSpecialSlots = LE(cdHeader.nSpecialSlots);
+	uint32_t uHashOffset = LE(cdHeader.hashOffset);
+	if (uCodeSlots != LE(cdHeader.nCodeSlots) ||
+		(uint64_t)uSpecialSlots * uHashSize > uHashOffset ||
+		(uint64_t)uHashOffset + uCodeSlots * uHashSize > uSlotLength) {
+		ZUtil::StringFormatV(strReason, "malformed CodeDirectory (%s)", szHashName);
+		return false;
+	}
+
+	uint8_t hash[32];
+	uint8_t* pHashes = pSlotBase + uHashOffset;
+	for (uint64_t i = 0; i < uCodeSlots; i++) {
+		uint64_t uOffset = i * uPageSize;
+		HashSlotData(cdHeader.hashType, pCodeBase + uOffset, (size_t)min(uPageSize, uCodeLimit - uOffset), hash);
+		if (0 != memcmp(hash, pHashes + i * uHashSize, uHashSize)) {
+			ZUtil::StringFormatV(strReason, "code page %llu of %llu doesn't match (%s)", i, uCodeSlots, szHashName);
+			return false;
+		}
+	}
+
+	// a special slot past nSpecialSlots is an omitted, i.e. empty, one
+	uint8_t empty[32] = { 0 };
+	for (map<uint32_t, string>::const_iterator it = mapSpecialSlots.begin(); it != mapSpecialSlots.end(); it++) {
+		if (it->second.empty()) {
+			memset(hash, 0, sizeof(hash));
+		} else {
+			HashSlotData(cdHeader.hashType, (const uint8_t*)it->second.data(), it->second.size(), hash);
+		}
+		uint8_t* pSlotHash = (it->first <= uSpecialSlots) ? (pHashes - it->first * uHashSize) : empty;
+		if (0 != memcmp(hash, pSlotHash, uHashSize)) {
+			ZUtil::StringFormatV(strReason, "%s slot doesn't match (%s)", GetSpecialSlotName(it->first), szHashName);
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool ZSign::VerifyCodeSignature(uint8_t* pCSBase,
+	uint32_t uCSLength,
+	uint8_t* pCodeBase,
+	uint32_t uCodeLength,
+	const string& strInfoPlist,
+	const string& strCodeResources,
+	string& strReason)
+{
+	CS_SuperBlob* psb = (CS_SuperBlob*)pCSBase;
+	if (NULL == psb || uCSLength < sizeof(CS_SuperBlob) || CSMAGIC_EMBEDDED_SIGNATURE != LE(psb->magic)) {
+		strReason = "not signed";
+		return false;
+	}
+
+	uint32_t uCount = LE(psb->count);
+	if (sizeof(CS_SuperBlob) + (uint64_t)uCount * sizeof(CS_BlobIndex) > uCSLength) {
+		strReason = "malformed code signature";
+		return false;
+	}
+
+	// CodeDirectories in slot order, the primary one first
+	map<uint32_t, string> mapCodeDirectories;
+	map<uint32_t, string> mapSpecialSlots;
+	mapSpecialSlots[CSSLOT_INFOSLOT] = strInfoPlist;
+	mapSpecialSlots[CSSLOT_REQUIREMENTS] = "";
+	mapSpecialSlots[CSSLOT_RESOURCEDIR] = strCodeResources;
+	mapSpecialSlots[CSSLOT_ENTITLEMENTS] = "";
+	mapSpecialSlots[CSSLOT_DER_ENTITLEMENTS] = "";
+	uint8_t* pCMSBase = NULL;
+	uint32_t uCMSLength = 0;
+
+	CS_BlobIndex* pbi = (CS_BlobIndex*)(pCSBase + sizeof(CS_SuperBlob));
+	for (uint32_t i = 0; i < uCount; i++, pbi++) {
+		uint32_t uType = LE(pbi->type);
+		uint32_t uOffset = LE(pbi->offset);
+		if ((uint64_t)uOffset + 8 > uCSLength) {
+			strReason = "malformed code signature";
+			return false;
+		}
+		uint8_t* pSlotBase = pCSBase + uOffset;
+		uint32_t uSlotLength = LE(*(((uint32_t*)pSlotBase) + 1));
+		if (uSlotLength < 8 || (uint64_t)uOffset + uSlotLength > uCSLength) {
+			strReason = "malformed code signature";
+			return false;
+		}
+
+		if (CSSLOT_CODEDIRECTORY == uType || (uType >= CSSLOT_ALTERNATE_CODEDIRECTORIES && uType < CSSLOT_ALTERNATE_CODEDIRECTORY_LIMIT)) {
+			mapCodeDirectories[uType].assign((const char*)pSlotBase, uSlotLength);
+		} else if (CSSLOT_REQUIREMENTS == uType || CSSLOT_ENTITLEMENTS == uType || CSSLOT_DER_ENTITLEMENTS == uType) {
+			mapSpecialSlots[uType].assign((const char*)pSlotBase, uSlotLength);
+		} else if (CSSLOT_SIGNATURESLOT == uType) {
+			pCMSBase = pSlotBase;
+			uCMSLength = uSlotLength;
+		}
+	}
+
+	if (mapCodeDirectories.empty()) {
+		strReason = "no CodeDirectory";
+		return false;
+	}
+
+	vector<string> arrCDHashes;
+	for (map<uint32_t, string>::iterator it = mapCodeDirectories.begin(); it != mapCodeDirectories.end(); it++) {
+		string& strCD = it->second;
+		if (!VerifyCodeDirectory((uint8_t*)&strCD[0], (uint32_t)strCD.size(), pCodeBase, uCodeLength, mapSpecialSlots, strReason)) {
+			return false;
+		}
+
+		// cdhashes are truncated to 20 bytes, whatever the hash type
+		uint8_t hash[32];
+		HashSlotData(((CS_CodeDirectory*)strCD.data())->hashType, (const uint8_t*)strCD.data(), strCD.size(), hash);
+		arrCDHashes.push_back(string((const char*)hash, 20));
+	}
+
+	const string& strPrimaryCD = mapCodeDirectories.begin()->second;
+	bool bAdhoc = (0 != (LE(((CS_CodeDirectory*)strPrimaryCD.data())->flags) & CS_SEC_CODESIGNATURE_ADHOC));
+	if (NULL == pCMSBase || uCMSLength <= 8) {
+		if (!bAdhoc) {
+			strReason = "missing CMS signature";
+			return false;
+		}
+		return true;
+	}
+
+	string strCDHashesPlist;
+	if (!ZSignAsset::VerifyCMS(pCMSBase + 8, uCMSLength - 8, strPrimaryCD, strCDHashesPlist)) {
+		strReason = "CMS signature doesn't verify against the CodeDirectory";
+		return false;
+	}
+
+	jvalue jvHashes;
+	jvHashes.read_plist(strCDHashesPlist);
+	jvalue& jvCDHashes = jvHashes["cdhashes"];
+	if (jvCDHashes.size() != arrCDHashes.size()) {
+		ZUtil::StringFormatV(strReason, "CMS signs %u CDHashes for %u CodeDirectories", (uint32_t)jvCDHashes.size(), (uint32_t)arrCDHashes.size());
+		return false;
+	}
+	for (size_t i = 0; i < arrCDHashes.size(); i++) {
+		string strCDHash;
+		jvCDHashes[i].as_data(strCDHash);
+		if (strCDHash != arrCDHashes[i]) {
+			ZUtil::StringFormatV(strReason, "CDHash %u signed by CMS doesn't match", (uint32_t)i);
+			return false;
+		}
+	}
+
+	return true;
+}
@@ -1,6 +1,36 @@
 #pragma once
 #include "openssl.h"
 
+// Two-pass DER writer. Measure() works out the content length of every
+// nested value of a plist, in the order they are written, and sorts the
+// keys of each dict once; Write() then encodes it into a buffer already
+// allocated at the final size, so nothing is copied per nesting level.
+// The static helpers write single elements, for structures whose lengths
+// are known up front.
+class ZDER
+{
+public:
+	static uint32_t HeaderSize(uint64_t uLength);
+	static uint8_t* WriteHeader(uint8_t* pOutput, uint8_t uTag, uint64_t uLength);
+	static uint8_t* WriteBytes(uint8_t* pOutput, const void* pData, size_t sSize);
+	static uint32_t IntegerSize(int64_t nValue);
+	static uint8_t* WriteInteger(uint8_t* pOutput, int64_t nValue);
+
+public:
+	uint64_t Measure(const jvalue& data); // the encoded size of data
+	uint8_t* Write(const jvalue& data, uint8_t* pOutput);
+
+private:
+	uint64_t MeasureValue(const jvalue& data);
+	uint8_t* WriteValue(const jvalue& data, uint8_t* pOutput);
+
+private:
+	vector<uint64_t>		m_arrLengths;	// array, dict and dict entry content lengths
+	vector<vector<string>>	m_arrKeys;		// sorted keys of each dict
+	size_t					m_sLengths;
+	size_t					m_sKeys;
+};
+
 class ZSign
 {
 public:
@@ -37,15 +67,34 @@ public:
 												uint32_t& uCodeSlots1Length, 
 												uint8_t*& pCodeSlots256, 
 												uint32_t& uCodeSlots256Length);
+	// uPageSize is the code page size of each code directory in bytes, 0 for
+	// a single slot over the whole code
 	static bool GetCodeSignatureExistsCodeSlotsData(uint8_t* pCSBase,
 													uint8_t*& pCodeSlots1Data,
 													uint32_t& uCodeSlots1DataLength,
+													uint32_t& uCodeSlots1PageSize,
 													uint8_t*& pCodeSlots256Data,
-													uint32_t& uCodeSlots256DataLength);
+													uint32_t& uCodeSlots256DataLength,
+													uint32_t& uCodeSlots256PageSize);
 	static uint32_t GetCodeSignatureLength(uint8_t* pCSBase);
 
-	static string _DER(const jvalue& data);
-	static void _DERLength(string& strBlob, uint64_t uLength);
+	// Checks a signature against the code it covers: the page and special
+	// slot hashes of every CodeDirectory and, unless ad-hoc, the CMS
+	// signature and its CDHashes. strInfoPlist and strCodeResources are what
+	// the Info.plist and CodeResources slots must hash, empty for none.
+	static bool VerifyCodeSignature(uint8_t* pCSBase,
+									uint32_t uCSLength,
+									uint8_t* pCodeBase,
+									uint32_t uCodeLength,
+									const string& strInfoPlist,
+									const string& strCodeResources,
+									string& strReason);
+	static bool VerifyCodeDirectory(uint8_t* pSlotBase,
+									uint32_t uSlotLength,
+									uint8_t* pCodeBase,
+									uint32_t uCodeLength,
+									const map<uint32_t, string>& mapSpecialSlots,
+									string& strReason);
 
 	static bool ParseCodeSignature(uint8_t* pCSBase);
 	static bool SlotParseEntitlements(uint8_t* pSlotBase, CS_BlobIndex* pbi);
@@ -0,0 +1,519 @@
+#include "common.h"
+#include "verify.h"
+#include "json.h"
+#include "macho.h"
+#include "stats.h"
+#include "timer.h"
+#include "archive.h"
+
+// --- source ---------------------------------------------------------
+
+// The files of an app folder or of an .ipa, by '/' separated UTF-8 path.
+// Zip entries are inflated straight from the archive.
+class ZVerifySource
+{
+public:
+	ZVerifySource();
+
+public:
+	bool OpenFolder(const string& strFolder);
+	bool OpenZip(const string& strZipFile);
+	bool HasFile(const string& strPath) const;
+	bool ReadFile(const string& strPath, string& strData);
+	bool HashFile(const string& strPath, string& strSHA1, string& strSHA256, uint32_t& uMagic);
+
+public:
+	vector<string>	m_arrFiles; // sorted
+
+private:
+	bool			m_bZip;
+	string			m_strRoot;
+	set<string>		m_setFiles;
+	ZipIndex		m_zip;
+};
+
+ZVerifySource::ZVerifySource()
+{
+	m_bZip = false;
+}
+
+bool ZVerifySource::OpenFolder(const string& strFolder)
+{
+	m_bZip = false;
+	m_strRoot = strFolder;
+	ZFile::EnumFolder(strFolder.c_str(), true, NULL, [&](bool bFolder, const string& strPath) {
+		if (!bFolder) {
+			string strFile = strPath.substr(strFolder.size() + 1);
+			ZUtil::StringReplace(strFile, "\\", "/");
+#ifdef _WIN32
+			iconv ic;
+			strFile = ic.A2U8(strFile);
+#endif
+			m_arrFiles.push_back(strFile);
+		}
+		return false;
+	});
+
+	sort(m_arrFiles.begin(), m_arrFiles.end());
+	m_setFiles.insert(m_arrFiles.begin(), m_arrFiles.end());
+	return true;
+}
+
+bool ZVerifySource::OpenZip(const string& strZipFile)
+{
+	m_bZip = true;
+	m_strRoot = strZipFile;
+	if (!m_zip.Open(strZipFile)) {
+		return false;
+	}
+
+	m_arrFiles = m_zip.m_arrFiles;
+	sort(m_arrFiles.begin(), m_arrFiles.end());
+	return true;
+}
+
+bool ZVerifySource::HasFile(const string& strPath) const
+{
+	return m_bZip ? m_zip.HasFile(strPath) : (m_setFiles.end() != m_setFiles.find(strPath));
+}
+
+bool ZVerifySource::ReadFile(const string& strPath, string& strData)
+{
+	if (!m_bZip) {
+		strData.clear();
+		string strFile = m_strRoot + "/" + strPath;
+#ifdef _WIN32
+		iconv ic;
+		strFile = ic.U82A(strFile);
+#endif
+		return ZFile::ReadFile(strFile.c_str(), strData);
+	}
+	return m_zip.ReadFile(strPath, strData);
+}
+
+bool ZVerifySource::HashFile(const string& strPath, string& strSHA1, string& strSHA256, uint32_t& uMagic)
+{
+	uMagic = 0;
+	if (!m_bZip) {
+		string strFile = m_strRoot + "/" + strPath;
+#ifdef _WIN32
+		iconv ic;
+		strFile = ic.U82A(strFile);
+#endif
+		FILE* fp = NULL;
+		_fopen64(fp, strFile.c_str(), "rb");
+		if (NULL != fp) {
+			if (sizeof(uMagic) != fread(&uMagic, 1, sizeof(uMagic), fp)) {
+				uMagic = 0;
+			}
+			fclose(fp);
+		}
+		return ZSHA::SHAFile(strFile.c_str(), strSHA1, strSHA256);
+	}
+
+	ZDualDigest digest;
+	bool bFirst = true;
+	bool bRet = m_zip.ReadEntry(strPath, [&](const uint8_t* pData, size_t sSize) {
+		if (bFirst && sSize >= sizeof(uMagic)) {
+			memcpy(&uMagic, pData, sizeof(uMagic));
+		}
+		bFirst = false;
+		digest.Update(pData, sSize);
+		return true;
+	});
+	ZStats::Add(ZStats::E_FILES_HASHED);
+	return (bRet && digest.Final(strSHA1, strSHA256));
+}
+
+// --- checks ---------------------------------------------------------
+
+struct ZVerifyBundle
+{
+	string	strFolder;
+	string	strExecutable;
+	string	strInfoPlist;
+	string	strCodeResources;
+};
+
+// One sealed file, with the hashes each bundle sealing it recorded.
+struct ZVerifySeal
+{
+	size_t	uBundle;
+	string	strSHA1;
+	string	strSHA256;
+	bool	bOptional;
+};
+
+struct ZVerifyItem
+{
+	bool				bBinary;	// a bundle executable, else a file
+	string				strPath;
+	size_t				uBundle;
+	vector<ZVerifySeal>	arrSeals;
+	bool				bPassed;
+	bool				bMissing;
+	string				strReason;
+	uint64_t			uTime;
+};
+
+static bool IsMachOMagic(uint32_t uMagic)
+{
+	return (MH_MAGIC == uMagic || MH_CIGAM == uMagic ||
+			MH_MAGIC_64 == uMagic || MH_CIGAM_64 == uMagic ||
+			FAT_MAGIC == uMagic || FAT_CIGAM == uMagic);
+}
+
+static bool IsCodeBundle(const string& strPath)
+{
+	return (ZFile::IsPathSuffix(strPath, ".app") ||
+			ZFile::IsPathSuffix(strPath, ".appex") ||
+			ZFile::IsPathSuffix(strPath, ".framework") ||
+			ZFile::IsPathSuffix(strPath, ".xctest"));
+}
+
+static bool VerifyBinary(ZVerifySource& source, const string& strPath, const string& strInfoPlist, const string& strCodeResources, string& strReason)
+{
+	ZStatsScope scope("verify_binary", strPath);
+	string strData;
+	if (!source.ReadFile(strPath, strData)) {
+		strReason = "can't read file";
+		return false;
+	}
+
+	ZMachO macho;
+	if (!macho.InitData((const uint8_t*)strData.data(), strData.size(), ZUtil::GetBaseName(strPath.c_str()))) {
+		strReason = "invalid mach-o";
+		return false;
+	}
+	return macho.Verify(strInfoPlist, strCodeResources, strReason);
+}
+
+static void VerifyItem(ZVerifySource& source, const vector<ZVerifyBundle>& arrBundles, const set<string>& setExecutables, ZVerifyItem& item)
+{
+	uint64_t uBegin = ZUtil::GetMicroSecond();
+	item.bPassed = false;
+	item.bMissing = false;
+	if (item.bBinary) {
+		const ZVerifyBundle& bundle = arrBundles[item.uBundle];
+		item.bPassed = VerifyBinary(source, item.strPath, bundle.strInfoPlist, bundle.strCodeResources, item.strReason);
+		item.uTime = ZUtil::GetMicroSecond() - uBegin;
+		return;
+	}
+
+	if (!source.HasFile(item.strPath)) {
+		item.bMissing = true;
+		item.bPassed = all_of(item.arrSeals.begin(), item.arrSeals.end(), [](const ZVerifySeal& seal) { return seal.bOptional; });
+		item.strReason = "missing";
+		item.uTime = ZUtil::GetMicroSecond() - uBegin;
+		return;
+	}
+
+	string strSHA1;
+	string strSHA256;
+	uint32_t uMagic = 0;
+	if (!source.HashFile(item.strPath, strSHA1, strSHA256, uMagic)) {
+		item.strReason = "can't read file";
+		item.uTime = ZUtil::GetMicroSecond() - uBegin;
+		return;
+	}
+
+	item.bPassed = true;
+	for (const ZVerifySeal& seal : item.arrSeals) {
+		if (seal.strSHA256.empty() ? (seal.strSHA1 != strSHA1) : (seal.strSHA256 != strSHA256)) {
+			item.bPassed = false;
+			item.strReason = "modified, doesn't match " + arrBundles[seal.uBundle].strFolder + "/_CodeSignature/CodeResources";
+			break;
+		}
+	}
+
+	// nested Mach-O files are signed on their own, like ZBundle does
+	if (item.bPassed && IsMachOMagic(uMagic) &&
+		setExecutables.end() == setExecutables.find(item.strPath) &&
+		string::npos == item.strPath.find(".dSYM/") &&
+		string::npos == item.strPath.find("_WatchKitStub")) {
+		item.bBinary = true;
+		item.bPassed = VerifyBinary(source, item.strPath, "", "", item.strReason);
+	}
+	item.uTime = ZUtil::GetMicroSecond() - uBegin;
+}
+
+// Adds the files sealed by a bundle's CodeResources, and reports the
+// unsealed ones with the rules ZBundle::GenerateCodeResources seals by.
+static bool AddBundleSeals(ZVerifySource& source, vector<ZVerifyBundle>& arrBundles, size_t uBundle, vector<ZVerifyItem>& arrItems, map<string, size_t>& mapItems, vector<string>& arrErrors)
+{
+	const ZVerifyBundle& bundle = arrBundles[uBundle];
+	jvalue jvCodeRes;
+	jvCodeRes.read_plist(bundle.strCodeResources);
+	jvalue& jvFiles = jvCodeRes["files2"];
+	if (!jvFiles.is_object()) {
+		arrErrors.push_back(bundle.strFolder + "/_CodeSignature/CodeResources: no files2 seal");
+		return false;
+	}
+
+	vector<string> arrKeys;
+	set<string> setNested; // nested code sealed by its cdhash
+	jvFiles.get_keys(arrKeys);
+	for (const string& strKey : arrKeys) {
+		jvalue& jvFile = jvFiles[strKey];
+		ZVerifySeal seal;
+		seal.uBundle = uBundle;
+		seal.bOptional = false;
+		if (jvFile.is_object()) {
+			if (jvFile.has("cdhash") || jvFile.has("symlink")) {
+				setNested.insert(strKey);
+				continue;
+			}
+			jvFile["hash"].as_data(seal.strSHA1);
+			jvFile["hash2"].as_data(seal.strSHA256);
+			seal.bOptional = jvFile["optional"].as_bool();
+		} else {
+			jvFile.as_data(seal.strSHA1);
+		}
+
+		string strPath = bundle.strFolder + "/" + strKey;
+		map<string, size_t>::iterator it = mapItems.find(strPath);
+		if (mapItems.end() == it) {
+			ZVerifyItem item;
+			item.bBinary = false;
+			item.strPath = strPath;
+			item.uBundle = uBundle;
+			item.uTime = 0;
+			arrItems.push_back(item);
+			it = mapItems.insert(make_pair(strPath, arrItems.size() - 1)).first;
+		}
+		arrItems[it->second].arrSeals.push_back(seal);
+	}
+
+	bool bRet = true;
+	string strPrefix = bundle.strFolder + "/";
+	vector<string>::const_iterator itFile = lower_bound(source.m_arrFiles.begin(), source.m_arrFiles.end(), strPrefix);
+	for (; itFile != source.m_arrFiles.end() && 0 == itFile->compare(0, strPrefix.size(), strPrefix); itFile++) {
+		string strKey = itFile->substr(strPrefix.size());
+		if ("_CodeSignature/CodeResources" == strKey || bundle.strExecutable == *itFile ||
+			"Info.plist" == strKey || "PkgInfo" == strKey ||
+			ZFile::IsPathSuffix(strKey, ".DS_Store") ||
+			ZFile::IsPathSuffix(strKey, ".lproj/locversion.plist") ||
+			jvFiles.has(strKey)) {
+			continue;
+		}
+
+		bool bNested = false;
+		for (const string& strNested : setNested) {
+			if (0 == strKey.compare(0, strNested.size(), strNested) && (strKey.size() == strNested.size() || '/' == strKey[strNested.size()])) {
+				bNested = true;
+				break;
+			}
+		}
+		if (!bNested) {
+			arrErrors.push_back(*itFile + ": not sealed by " + bundle.strFolder + "/_CodeSignature/CodeResources");
+			bRet = false;
+		}
+	}
+	return bRet;
+}
+
+static int VerifyMachOFile(const string& strPath)
+{
+	ZTimer timer;
+	ZLog::PrintV(">>> Verify:\t%s\n", strPath.c_str());
+
+	string strData;
+	if (!ZFile::ReadFile(strPath.c_str(), strData)) {
+		ZLog::ErrorV(">>> Cannot read file: %s\n", strPath.c_str());
+		return -1;
+	}
+
+	string strReason;
+	ZMachO macho;
+	if (!macho.InitData((const uint8_t*)strData.data(), strData.size(), ZUtil::GetBaseName(strPath.c_str()))) {
+		ZLog::ErrorV(">>> Invalid mach-o file! %s\n", strPath.c_str());
+		return -1;
+	}
+
+	// a bundle executable seals its bundle's Info.plist and CodeResources
+	jvalue jvInfo;
+	string strInfoPlist;
+	string strCodeResources;
+	string strFolder = strPath;
+	ZFile::PathRemoveFileSpec(strFolder);
+	ZFile::ReadFileV(strInfoPlist, "%s/Info.plist", strFolder.c_str());
+	jvInfo.read_plist(strInfoPlist);
+	if (jvInfo["CFBundleExecutable"].as_string() == ZUtil::GetBaseName(strPath.c_str())) {
+		ZFile::ReadFileV(strCodeResources, "%s/_CodeSignature/CodeResources", strFolder.c_str());
+	} else {
+		strInfoPlist.clear();
+	}
+
+	bool bRet = macho.Verify(strInfoPlist, strCodeResources, strReason);
+	if (!bRet) {
+		ZLog::ErrorV(">>> FAIL\t%s: %s\n", ZUtil::GetBaseName(strPath.c_str()), strReason.c_str());
+	}
+	timer.PrintResult(bRet, ">>> Verify %s!", bRet ? "OK" : "Failed");
+	return bRet ? 0 : 1;
+}
+
+// --- main entry -----------------------------------------------------
+
+int VerifySignature(const string& strPath)
+{
+	bool bZipFile = ZFile::IsZipFile(strPath.c_str());
+	if (!bZipFile && !ZFile::IsFolder(strPath.c_str())) {
+		return VerifyMachOFile(strPath);
+	}
+
+	ZTimer gtimer;
+	ZTimer atimer;
+	ZLog::PrintV(">>> Verify:\t%s\n", strPath.c_str());
+
+	ZVerifySource source;
+	ZStatsScope indexScope("verify_index");
+	if (bZipFile ? !source.OpenZip(strPath) : !source.OpenFolder(strPath)) {
+		ZLog::ErrorV(">>> Cannot read %s!\n", strPath.c_str());
+		return -1;
+	}
+	indexScope.Stop();
+	atimer.Print(">>> Indexed:\t%u files", (uint32_t)source.m_arrFiles.size());
+
+	// code bundles, the ones ZBundle signs, deepest first
+	ZStatsScope sealScope("verify_seal");
+	set<string> setFolders;
+	for (const string& strFile : source.m_arrFiles) {
+		if (0 == strFile.compare(0, 9, "__MACOSX/") || string::npos != strFile.find(".dSYM/")) {
+			continue;
+		}
+		for (size_t pos = strFile.find('/'); string::npos != pos; pos = strFile.find('/', pos + 1)) {
+			string strFolder = strFile.substr(0, pos);
+			if (IsCodeBundle(strFolder) && source.HasFile(strFolder + "/Info.plist")) {
+				setFolders.insert(strFolder);
+			}
+		}
+	}
+
+	vector<string> arrErrors;
+	vector<ZVerifyBundle> arrBundles;
+	vector<ZVerifyItem> arrItems;
+	map<string, size_t> mapItems;
+	set<string> setExecutables;
+	for (const string& strFolder : setFolders) {
+		ZVerifyBundle bundle;
+		bundle.strFolder = strFolder;
+		if (!source.ReadFile(strFolder + "/Info.plist", bundle.strInfoPlist)) {
+			arrErrors.push_back(strFolder + ": can't read Info.plist");
+			continue;
+		}
+		jvalue jvInfo;
+		jvInfo.read_plist(bundle.strInfoPlist);
+		string strBundleId = jvInfo["CFBundleIdentifier"];
+		string strBundleExe = jvInfo["CFBundleExecutable"];
+		if (strBundleId.empty() || strBundleExe.empty()) {
+			continue;
+		}
+		bundle.strExecutable = strFolder + "/" + strBundleExe;
+		setExecutables.insert(bundle.strExecutable);
+
+		if (!source.ReadFile(strFolder + "/_CodeSignature/CodeResources", bundle.strCodeResources)) {
+			arrErrors.push_back(strFolder + ": missing _CodeSignature/CodeResources");
+			continue;
+		}
+		arrBundles.push_back(bundle);
+	}
+
+	for (size_t i = 0; i < arrBundles.size(); i++) {
+		ZVerifyItem item;
+		item.bBinary = true;
+		item.strPath = arrBundles[i].strExecutable;
+		item.uBundle = i;
+		item.uTime = 0;
+		arrItems.push_back(item);
+	}
+	for (size_t i = 0; i < arrBundles.size(); i++) {
+		AddBundleSeals(source, arrBundles, i, arrItems, mapItems, arrErrors);
+	}
+
+	// files outside of any bundle only have their own signature, if any
+	for (const string& strFile : source.m_arrFiles) {
+		bool bSealed = (mapItems.end() != mapItems.find(strFile)) || (setExecutables.end() != setExecutables.find(strFile));
+		for (set<string>::iterator it = setFolders.begin(); !bSealed && it != setFolders.end(); it++) {
+			bSealed = (0 == strFile.compare(0, it->size() + 1, *it + "/"));
+		}
+		if (!bSealed) {
+			ZVerifyItem item;
+			item.bBinary = false;
+			item.strPath = strFile;
+			item.uBundle = 0;
+			item.uTime = 0;
+			arrItems.push_back(item);
+		}
+	}
+	sealScope.Stop();
+
+	if (arrBundles.empty() && arrErrors.empty()) {
+		ZLog::ErrorV(">>> Can't find any signed bundle in %s!\n", strPath.c_str());
+		return -1;
+	}
+	atimer.Print(">>> Sealed:\t%u bundles, %u files", (uint32_t)arrBundles.size(), (uint32_t)(arrItems.size() - arrBundles.size()));
+
+	// binaries first, they take the longest
+	ZStatsScope checkScope("verify_check");
+	atomic<size_t> uNext(0);
+	ZLog::ThreadCallback logCallback = ZLog::GetThreadCallback();
+	auto worker = [&]() {
+		ZLog::SetThreadCallback(logCallback);
+		for (size_t i = uNext++; i < arrItems.size(); i = uNext++) {
+			VerifyItem(source, arrBundles, setExecutables, arrItems[i]);
+		}
+	};
+
+	unsigned int nThreads = thread::hardware_concurrency();
+	nThreads = (nThreads > 8) ? 8 : nThreads;
+	vector<thread> arrThreads;
+	for (unsigned int i = 1; i < nThreads; i++) {
+		try {
+			arrThreads.push_back(thread(worker));
+		} catch (...) {
+			break;
+		}
+	}
+	worker();
+	for (thread& t : arrThreads) {
+		t.join();
+	}
+	checkScope.Stop();
+
+	uint32_t uBinariesPassed = 0;
+	uint32_t uBinariesFailed = 0;
+	uint32_t uFilesPassed = 0;
+	uint32_t uFilesFailed = 0;
+	uint32_t uFilesOptional = 0;
+	for (const ZVerifyItem& item : arrItems) {
+		if (item.bBinary) {
+			if (item.bPassed) {
+				uBinariesPassed++;
+				ZLog::PrintV(">>> OK\t\t%s (%.03fs)\n", item.strPath.c_str(), item.uTime / 1000000.0);
+			} else {
+				uBinariesFailed++;
+				ZLog::ErrorV(">>> FAIL\t%s: %s\n", item.strPath.c_str(), item.strReason.c_str());
+			}
+		} else if (item.bPassed) {
+			if (item.bMissing) {
+				uFilesOptional++;
+			} else {
+				uFilesPassed++;
+			}
+			ZLog::DebugV(">>> OK\t\t%s%s\n", item.strPath.c_str(), item.bMissing ? " (optional, missing)" : "");
+		} else {
+			uFilesFailed++;
+			ZLog::ErrorV(">>> FAIL\t%s: %s\n", item.strPath.c_str(), item.strReason.c_str());
+		}
+	}
+	for (const string& strError : arrErrors) {
+		ZLog::ErrorV(">>> FAIL\t%s\n", strError.c_str());
+	}
+
+	bool bRet = (0 == uBinariesFailed && 0 == uFilesFailed && arrErrors.empty());
+	ZLog::PrintV(">>> Binaries:\t%u passed, %u failed\n", uBinariesPassed, uBinariesFailed);
+	ZLog::PrintV(">>> Files:\t%u passed, %u failed, %u optional missing\n", uFilesPassed, uFilesFailed, uFilesOptional);
+	atimer.Print(">>> Checked:\t%u threads", (uint32_t)(arrThreads.size() + 1));
+	gtimer.PrintResult(bRet, ">>> Verify %s!", bRet ? "OK" : "Failed");
+	return bRet ? 0 : 1;
+}
@@ -0,0 +1,9 @@
+#pragma once
+#include "common.h"
+
+// Verify the signature of an .ipa, app folder or Mach-O file: the code and
+// special slot hashes of every binary, the CMS signature against the
+// CDHashes, and every bundle's CodeResources against its files. An .ipa is
+// read in place, without extracting it.
+// Returns: 0 = valid, 1 = invalid, -1 = error
+int VerifySignature(const string& strPath);
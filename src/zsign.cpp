@@ -8,6 +8,8 @@
 #include "archive.h"
 #include "metadata.h"
 #include "certcheck.h"
+#include "verify.h"
+#include "stats.h"
 
 #ifdef _WIN32
 #include "common_win32.h"
@@ -22,6 +24,20 @@
 #define ZSIGN_STR(x) ZSIGN_STR_(x)
 #define ZSIGN_VERSION_STR ZSIGN_STR(ZSIGN_VERSION)
 
+// long-only options
+enum
+{
+	OPT_CACHE_DIR = 0x100,
+	OPT_CACHE_STATS,
+	OPT_STATS,
+	OPT_TRACE,
+	OPT_VERIFY,
+	OPT_OCSP_MAX_AGE,
+	OPT_OCSP_TIMEOUT,
+	OPT_OUTPUT_FOLDER,
+	OPT_OVERLAY,
+};
+
 const struct option options[] = {
 	{"debug", no_argument, NULL, 'd'},
 	{"force", no_argument, NULL, 'f'},
@@ -55,6 +71,15 @@ const struct option options[] = {
 	{"rm_watch", no_argument, NULL, 'W'},
 	{"rm_uisd", no_argument, NULL, 'U'},
 	{"inject_extensions", no_argument, NULL, 'P'},
+	{"cache_dir", required_argument, NULL, OPT_CACHE_DIR},
+	{"cache_stats", no_argument, NULL, OPT_CACHE_STATS},
+	{"stats", required_argument, NULL, OPT_STATS},
+	{"trace", required_argument, NULL, OPT_TRACE},
+	{"verify", no_argument, NULL, OPT_VERIFY},
+	{"ocsp_max_age", required_argument, NULL, OPT_OCSP_MAX_AGE},
+	{"ocsp_timeout", required_argument, NULL, OPT_OCSP_TIMEOUT},
+	{"output_folder", required_argument, NULL, OPT_OUTPUT_FOLDER},
+	{"overlay", no_argument, NULL, OPT_OVERLAY},
 	{"help", no_argument, NULL, 'h'},
 	{}
 };
@@ -143,9 +168,9 @@ int usage()
 	ZLog::Print("-t, --temp_folder\tPath to temporary folder for intermediate files.\n");
 	ZLog::Print("-2, --sha256_only\t(Deprecated, now the default.) Kept for backward compatibility.\n");
 	ZLog::Print("-L, --legacy_sha1\tEmit a dual SHA1+SHA256 CodeDirectory for iOS <= 10 compatibility.\n");
-	ZLog::Print("-C, --check\t\tCheck certificate validity and OCSP revocation status.\n");
+	ZLog::Print("-C, --check\t\tCheck certificate validity and OCSP revocation status. Takes several files at once.\n");
 	ZLog::Print("-q, --quiet\t\tQuiet operation.\n");
-	ZLog::Print("-x, --metadata\t\tExtract metadata and icon to the specified directory.\n");
+	ZLog::Print("-x, --metadata\t\tExtract metadata and icon to the specified directory. Without -k, -m or -a, only that is read from the ipa.\n");
 	ZLog::Print("-R, --rm_provision\tRemove mobileprovision file after signing.\n");
 	ZLog::Print("-S, --enable_docs\tEnable UISupportsDocumentBrowser and UIFileSharingEnabled.\n");
 	ZLog::Print("-M, --min_version\tSet MinimumOSVersion in Info.plist.\n");
@@ -153,6 +178,15 @@ int usage()
 	ZLog::Print("-W, --rm_watch\t\tRemove watch app from the bundle.\n");
 	ZLog::Print("-U, --rm_uisd\t\tRemove UISupportedDevices from Info.plist.\n");
 	ZLog::Print("-P, --inject_extensions\tAlso inject -l dylibs into app extensions (PlugIns/Extensions).\n");
+	ZLog::Print("    --cache_dir\t\tFolder for the signing cache. (default: ./.zsign_cache)\n");
+	ZLog::Print("    --cache_stats\tPrint a report of the signing cache folder.\n");
+	ZLog::Print("    --stats\t\tWrite per-phase timings and I/O counters of this job to a JSON file.\n");
+	ZLog::Print("    --trace		Write a Chrome trace-event JSON file of the signing pipeline.\n");
+	ZLog::Print("    --verify\t\tVerify the signatures and sealed resources of an ipa, folder or mach-o file.\n");
+	ZLog::Print("    --ocsp_max_age	Seconds a cached OCSP response is used for, within its nextUpdate. 0 disables the cache. (default: 86400)\n");
+	ZLog::Print("    --ocsp_timeout	Seconds all OCSP lookups of -C may take together. (default: 10)\n");
+	ZLog::Print("    --output_folder\tSign a copy-on-write clone of the input folder, or keep the extracted ipa, at this new path.\n");
+	ZLog::Print("    --overlay\t\tSign a folder through links to it, without copying or modifying it. Needs -o or --output_folder.\n");
 	ZLog::Print("-v, --version\t\tShows version.\n");
 	ZLog::Print("-h, --help\t\tShows help (this message).\n");
 
@@ -194,6 +228,15 @@ int main(int argc, char* argv[])
 	vector<string> arrRemoveDylibNames;
 	string strMetadataDir;
 	string strTempFolder = ZFile::GetTempFolder();
+	string strCacheFolder = "./.zsign_cache";
+	bool bCacheStats = false;
+	string strStatsFile;
+	string strTraceFile;
+	bool bVerify = false;
+	uint32_t uOCSPMaxAge = 86400;
+	uint32_t uOCSPTimeout = 10;
+	string strOutputFolder;
+	bool bOverlay = false;
 
 	int opt = 0;
 	int argslot = -1;
@@ -295,6 +338,33 @@ int main(int argc, char* argv[])
 		case 'P':
 			bInjectExtensions = true;
 			break;
+		case OPT_CACHE_DIR:
+			strCacheFolder = optarg;
+			break;
+		case OPT_CACHE_STATS:
+			bCacheStats = true;
+			break;
+		case OPT_STATS:
+			strStatsFile = ZFile::GetFullPath(optarg);
+			break;
+		case OPT_TRACE:
+			strTraceFile = ZFile::GetFullPath(optarg);
+			break;
+		case OPT_VERIFY:
+			bVerify = true;
+			break;
+		case OPT_OCSP_MAX_AGE:
+			uOCSPMaxAge = (uint32_t)atoi(optarg);
+			break;
+		case OPT_OCSP_TIMEOUT:
+			uOCSPTimeout = (uint32_t)atoi(optarg);
+			break;
+		case OPT_OUTPUT_FOLDER:
+			strOutputFolder = ZFile::GetFullPath(optarg);
+			break;
+		case OPT_OVERLAY:
+			bOverlay = true;
+			break;
 		case 'v': {
 			printf("version: %s\n", ZSIGN_VERSION_STR);
 			return 0;
@@ -306,7 +376,18 @@ int main(int argc, char* argv[])
 			break;
 		}
 
-		ZLog::DebugV(">>> Option:\t-%c, %s\n", opt, optarg ? optarg : "");
+		if (opt < OPT_CACHE_DIR) {
+			ZLog::DebugV(">>> Option:\t-%c, %s\n", opt, optarg ? optarg : "");
+		} else {
+			ZLog::DebugV(">>> Option:\t--%s, %s\n", options[argslot].name, optarg ? optarg : "");
+		}
+	}
+
+	if (bCacheStats) {
+		ZSignCache::PrintStats(strCacheFolder);
+		if (optind >= argc) {
+			return 0;
+		}
 	}
 
 	if (optind >= argc) {
@@ -334,8 +415,7 @@ int main(int argc, char* argv[])
 			ZLog::ErrorV(">>> Dylib file not found! %s\n", strDylibFile.c_str());
 			return -1;
 		}
-		ZMachO dylibMachO;
-		if (!dylibMachO.Init(strDylibFile.c_str())) {
+		if (!ZMachO::IsMachOFile(strDylibFile)) {
 			ZLog::ErrorV(">>> Invalid dylib file! Not a valid Mach-O format. %s\n", strDylibFile.c_str());
 			return -1;
 		}
@@ -357,11 +437,51 @@ int main(int argc, char* argv[])
 		}
 	}
 
+	SetOCSPOptions(strCacheFolder, uOCSPMaxAge, uOCSPTimeout);
 	if (bCheckSignature && strPKeyFile.empty() && strProvFile.empty()) {
-		return CheckCertificate(strPath, strPassword);
+		vector<string> arrCheckFiles;
+		for (int i = optind; i < argc; i++) {
+			arrCheckFiles.push_back(ZFile::GetFullPath(argv[i]));
+		}
+		return CheckCertificates(arrCheckFiles, strPassword);
+	}
+
+	if (!strStatsFile.empty()) {
+		ZStats::Enable();
+	}
+
+	if (!strTraceFile.empty()) {
+		ZStats::EnableTrace();
+	}
+
+	auto finish = [&](bool bSuccess) {
+		if (!strStatsFile.empty()) {
+			ZStats::WriteFile(strStatsFile, strPath, bSuccess);
+		}
+		if (!strTraceFile.empty()) {
+			ZStats::WriteTraceFile(strTraceFile);
+		}
+		return bSuccess ? 0 : -1;
+	};
+
+	if (bVerify) {
+		ZStatsScope scope("verify");
+		int nRet = VerifySignature(strPath);
+		scope.Stop();
+		finish(0 == nRet);
+		return nRet;
 	}
 
 	bool bZipFile = ZFile::IsZipFile(strPath.c_str());
+	if (bZipFile && !strMetadataDir.empty() && !bAdhoc && strPKeyFile.empty() && strProvFile.empty()) { // metadata only
+		ZStatsScope scope("metadata");
+		ZFile::CreateFolder(strMetadataDir.c_str());
+		bool bRet = GetMetadataFromIpa(strPath, strMetadataDir);
+		scope.Stop();
+		atimer.PrintResult(bRet, ">>> Metadata %s!", bRet ? "OK" : "Failed");
+		return finish(bRet);
+	}
+
 	if (!bZipFile && !ZFile::IsFolder(strPath.c_str())) { // macho file
 		ZMachO* macho = new ZMachO();
 		if (!macho->Init(strPath.c_str())) {
@@ -379,24 +499,19 @@ int main(int argc, char* argv[])
 			return -1;
 		}
 
-		if (!arrDylibFiles.empty()) {
-			for (const string& dyLibFile : arrDylibFiles) {
-				if (!macho->InjectDylib(bWeakInject, dyLibFile.c_str())) {
-					return -1;
-				}
-			}
+		ZLoadCommandEdits edits;
+		for (const string& dyLibFile : arrDylibFiles) {
+			edits.InjectDylib(dyLibFile, bWeakInject);
 		}
-
-		if (!arrRemoveDylibNames.empty()) {
-			set<string> setDylibs;
-			for (const string& name : arrRemoveDylibNames) {
-				if (name.find('/') != string::npos) {
-					setDylibs.insert(name);
-				} else {
-					setDylibs.insert("@executable_path/" + name);
-				}
+		for (const string& name : arrRemoveDylibNames) {
+			if (name.find('/') != string::npos) {
+				edits.RemoveDylib(name);
+			} else {
+				edits.RemoveDylib("@executable_path/" + name);
 			}
-			macho->RemoveDylibs(setDylibs);
+		}
+		if (!macho->ApplyLoadCommandEdits(edits)) {
+			return -1;
 		}
 
 		atimer.Reset();
@@ -404,9 +519,11 @@ int main(int argc, char* argv[])
 		string strInfoSHA1;
 		string strInfoSHA256;
 		string strCodeResourcesData;
+		ZStatsScope scope("sign");
 		bool bRet = macho->Sign(&zsa, bForce, strBundleId, strInfoSHA1, strInfoSHA256, strCodeResourcesData);
+		scope.Stop();
 		atimer.PrintResult(bRet, ">>> Signed %s!", bRet ? "OK" : "Failed");
-		return bRet ? 0 : -1;
+		return finish(bRet);
 	}
 
 	bool bTempOutputFile = false;
@@ -414,12 +531,37 @@ int main(int argc, char* argv[])
 		if (bInstall) {
 			bTempOutputFile = true;
 			strOutputFile = ZFile::GetRealPathV("%s/zsign_temp_%llu.ipa", strTempFolder.c_str(), ZUtil::GetMicroSecond());
-		} else if (bZipFile) {
+		} else if (bZipFile && strOutputFolder.empty()) {
 			ZLog::ErrorV(">>> Use -o option to specify the output file.\n");
 			return -1;
 		}
 	}
 
+	if (bOverlay && bZipFile) {
+		ZLog::ErrorV(">>> --overlay needs a folder input, an ipa is always extracted to a copy.\n");
+		return -1;
+	}
+	if (bOverlay && strOutputFolder.empty() && strOutputFile.empty()) {
+		ZLog::ErrorV(">>> Use -o or --output_folder option with --overlay.\n");
+		return -1;
+	}
+
+	if (!strOutputFolder.empty()) {
+		if (ZFile::IsFileExists(strOutputFolder.c_str())) {
+			ZLog::ErrorV(">>> Output folder already exists! %s\n", strOutputFolder.c_str());
+			return -1;
+		}
+#ifdef _WIN32
+		string strInputPrefix = strPath + "\\";
+#else
+		string strInputPrefix = strPath + "/";
+#endif
+		if (0 == strOutputFolder.compare(0, strInputPrefix.size(), strInputPrefix)) {
+			ZLog::ErrorV(">>> Output folder can't be inside the input folder! %s\n", strOutputFolder.c_str());
+			return -1;
+		}
+	}
+
 	//init
 	ZSignAsset zsa;
 	if (!zsa.Init(strCertFile, strPKeyFile, strProvFile, strEntitleFile, strPassword, bAdhoc, bSHA256Only, false)) {
@@ -430,17 +572,48 @@ int main(int argc, char* argv[])
 	bool bTempFolder = false;
 	bool bEnableCache = true;
 	string strFolder = strPath;
+	string strTempWorkFolder;
 	if (bZipFile) {
 		bForce = true;
-		bTempFolder = true;
+		bTempFolder = strOutputFolder.empty();
 		bEnableCache = false;
-		strFolder = ZFile::GetRealPathV("%s/zsign_folder_%llu", strTempFolder.c_str(), atimer.Reset());
+		strFolder = bTempFolder ? ZFile::GetRealPathV("%s/zsign_folder_%llu", strTempFolder.c_str(), atimer.Reset()) : strOutputFolder;
 		ZLog::PrintV(">>> Unzip:\t%s (%s) -> %s ... \n", strPath.c_str(), ZFile::GetFileSizeString(strPath.c_str()).c_str(), strFolder.c_str());
+		ZStatsScope scope("extract");
 		if (!Zip::Extract(strPath.c_str(), strFolder.c_str())) {
 			ZLog::ErrorV(">>> Unzip failed!\n");
-			return -1;
+			scope.Stop();
+			return finish(false);
 		}
 		atimer.PrintResult(true, ">>> Unzip OK!");
+	} else if (!strOutputFolder.empty() || bOverlay) {
+		// the copy has new inodes and a new path, nothing in the cache applies to it
+		bForce = true;
+		bEnableCache = false;
+		strFolder = strOutputFolder;
+		if (strFolder.empty()) { // overlay only for the output ipa, laid out the way the archiver expects
+			bTempFolder = true;
+			strTempWorkFolder = ZFile::GetRealPathV("%s/zsign_overlay_%llu", strTempFolder.c_str(), atimer.Reset());
+			string strName = ZUtil::GetBaseName(strPath.c_str());
+			strFolder = strTempWorkFolder + "/Payload";
+			if ("Payload" != strName) {
+				strFolder += "/" + strName;
+			}
+		}
+		atimer.Reset();
+		const char* szMode = bOverlay ? "Overlay" : "Clone";
+		ZLog::PrintV(">>> %s:\t%s -> %s ... \n", szMode, strPath.c_str(), strFolder.c_str());
+		ZStatsScope scope(bOverlay ? "overlay" : "clone");
+		if (bOverlay ? !ZFile::CreateOverlay(strPath.c_str(), strFolder.c_str()) : !ZFile::CloneFolder(strPath.c_str(), strFolder.c_str())) {
+			ZLog::ErrorV(">>> %s failed!\n", szMode);
+			scope.Stop();
+			if (bTempFolder) {
+				ZFile::RemoveFolder(strTempWorkFolder.c_str());
+			}
+			return finish(false);
+		}
+		strFolder = ZFile::GetFullPath(strFolder.c_str());
+		atimer.PrintResult(true, ">>> %s OK!", szMode);
 	}
 
 	//sign
@@ -453,12 +626,14 @@ int main(int argc, char* argv[])
 	bundle.m_bRemoveWatchApp = bRemoveWatchApp;
 	bundle.m_bRemoveUISupportedDevices = bRemoveUISupportedDevices;
 	bundle.m_bInjectExtensions = bInjectExtensions;
+	bundle.m_strCacheFolder = strCacheFolder;
 
 	bool bRet;
+	ZStatsScope signScope("sign");
 	if (arrProvFiles.size() > 1) {
 		list<ZSignAsset> zsaList;
 		for (const string& provFile : arrProvFiles) {
-			zsaList.push_back(ZSignAsset());
+			zsaList.emplace_back();
 			if (!zsaList.back().Init(strCertFile, strPKeyFile, provFile, strEntitleFile, strPassword, bAdhoc, bSHA256Only, false)) {
 				ZLog::ErrorV(">>> Failed to init provision: %s\n", provFile.c_str());
 				zsaList.pop_back();
@@ -468,10 +643,12 @@ int main(int argc, char* argv[])
 	} else {
 		bRet = bundle.SignFolder(&zsa, strFolder, strBundleId, strBundleVersion, strDisplayName, arrDylibFiles, arrRemoveDylibNames, bForce, bWeakInject, bEnableCache, bRemoveProvision);
 	}
+	signScope.Stop();
 	atimer.PrintResult(bRet, ">>> Signed %s!", bRet ? "OK" : "Failed");
 
 	// Post-sign certificate check
 	if (bRet && bCheckSignature && !bundle.m_strAppFolder.empty()) {
+		ZStatsScope scope("check");
 		CheckSignedBinary(bundle.m_strAppFolder);
 	}
 
@@ -482,12 +659,15 @@ int main(int argc, char* argv[])
 			atimer.Reset();
 			ZLog::PrintV(">>> Archiving: \t%s ... \n", strOutputFile.c_str());
 			string strBaseFolder = bundle.m_strAppFolder.substr(0, pos - 1);
+			ZStatsScope scope("archive");
 			if (!Zip::Archive(strBaseFolder.c_str(), strOutputFile.c_str(), uZipLevel)) {
 				ZLog::Error(">>> Archive failed!\n");
 				bRet = false;
 			} else {
+				scope.Stop();
 				atimer.PrintResult(true, ">>> Archive OK! (%s)", ZFile::GetFileSizeString(strOutputFile.c_str()).c_str());
 				if (bRet && !strMetadataDir.empty()) {
+					ZStatsScope metaScope("metadata");
 					ZFile::CreateFolder(strMetadataDir.c_str());
 					GetMetadata(bundle.m_strAppFolder, strMetadataDir, strOutputFile);
 				}
@@ -500,18 +680,25 @@ int main(int argc, char* argv[])
 
 	//install
 	if (bRet && bInstall) {
+		ZStatsScope scope("install");
 		bRet = InstallSignedIpa(strOutputFile);
 	}
 
 	//clean
+	ZStatsScope scope("cleanup");
+	if (bOverlay) {
+		ZFile::CloseOverlay(strFolder.c_str());
+	}
+
 	if (bTempFolder) {
-		ZFile::RemoveFolder(strFolder.c_str());
+		ZFile::RemoveFolder(strTempWorkFolder.empty() ? strFolder.c_str() : strTempWorkFolder.c_str());
 	}
 
 	if (bTempOutputFile) {
 		ZFile::RemoveFile(strOutputFile.c_str());
 	}
+	scope.Stop();
 
 	gtimer.Print(">>> Done.");
-	return bRet ? 0 : -1;
+	return finish(bRet);
 }
@@ -0,0 +1,90 @@
+/*
+ * Runs two libzsign jobs at once with one shared identity, each on its own
+ * thread with its own log callback. Every line is printed with the name of
+ * the job it was delivered to; test.sh then checks the outputs with
+ * zsign --verify.
+ *
+ *	jobs <p12> <mobileprovision> <password> <input1> <output1> <input2> <output2>
+ */
+
+#include "libzsign.h"
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+struct job_ctx
+{
+	const zsign_identity*	identity;
+	const char*				input;
+	const char*				output;
+	const char*				name;
+	pthread_t				thread;
+	int						lines;
+	int						result;
+	char					error[1024];
+};
+
+static void on_log(void* user_data, int level, const char* message)
+{
+	struct job_ctx* ctx = (struct job_ctx*)user_data;
+	ctx->lines++;
+	printf("[%s:%d] %s", ctx->name, level, message);
+}
+
+static void* run_job(void* arg)
+{
+	struct job_ctx* ctx = (struct job_ctx*)arg;
+	zsign_job* job = zsign_job_new(ctx->identity);
+	if (NULL == job) {
+		ctx->result = ZSIGN_ERROR_ARGUMENT;
+		return NULL;
+	}
+	zsign_job_set_log_callback(job, on_log, ctx);
+	zsign_job_set_option(job, ZSIGN_OPT_LOG_LEVEL, "3");
+	zsign_job_set_option(job, ZSIGN_OPT_FORCE, "1");
+	if (NULL != ctx->output) {
+		zsign_job_set_option(job, ZSIGN_OPT_OUTPUT, ctx->output);
+	}
+	ctx->result = zsign_job_run(job, ctx->input);
+	snprintf(ctx->error, sizeof(ctx->error), "%s", zsign_job_error(job));
+	zsign_job_free(job);
+	return NULL;
+}
+
+int main(int argc, char* argv[])
+{
+	if (argc < 8) {
+		fprintf(stderr, "usage: %s <p12> <mobileprovision> <password> <input1> <output1> <input2> <output2>\n", argv[0]);
+		return 2;
+	}
+
+	zsign_identity* identity = zsign_identity_load(NULL, argv[1], argv[2], NULL, argv[3], NULL, NULL);
+	if (NULL == identity) {
+		fprintf(stderr, ">>> Can't load the identity!\n");
+		return 1;
+	}
+
+	struct job_ctx jobs[2];
+	memset(jobs, 0, sizeof(jobs));
+	for (int i = 0; i < 2; i++) {
+		jobs[i].identity = identity;
+		jobs[i].input = argv[4 + i * 2];
+		jobs[i].output = (0 != *argv[5 + i * 2]) ? argv[5 + i * 2] : NULL;
+		jobs[i].name = (0 == i) ? "job1" : "job2";
+		pthread_create(&jobs[i].thread, NULL, run_job, &jobs[i]);
+	}
+
+	int ret = 0;
+	for (int i = 0; i < 2; i++) {
+		pthread_join(jobs[i].thread, NULL);
+		if (ZSIGN_OK != jobs[i].result) {
+			fprintf(stderr, ">>> %s failed (%d): %s\n", jobs[i].name, jobs[i].result, jobs[i].error);
+			ret = 1;
+		} else if (0 == jobs[i].lines) {
+			fprintf(stderr, ">>> %s logged nothing!\n", jobs[i].name);
+			ret = 1;
+		}
+	}
+	zsign_identity_free(identity);
+	return ret;
+}
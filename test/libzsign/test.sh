@@ -0,0 +1,38 @@
+#!/bin/bash
+
+# Signs two packages at once through libzsign (jobs.c) and checks both
+# results with zsign --verify. Build the library first with `make lib`.
+
+PACKAGES="../ipa"
+PRIVATE_KEY="../assets/test.p12"
+MOBILE_PROVISION="../assets/test.mobileprovision"
+PASSWORD="${PASSWORD:-}"
+ZSIGN="../../bin/zsign"
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+
+cc -O2 -I../../src -c jobs.c -o "$WORK/jobs.o" || exit 1
+c++ "$WORK/jobs.o" ../../bin/libzsign.a $(pkg-config --libs openssl) -lz -pthread -o "$WORK/jobs" || exit 1
+
+FILES=("$PACKAGES"/*.ipa)
+if [ ! -e "${FILES[0]}" ]; then
+    echo "no packages in $PACKAGES"
+    exit 1
+fi
+# with a single package both jobs sign their own copy of it
+[ -e "${FILES[1]}" ] || FILES[1]="${FILES[0]}"
+
+echo -n "${FILES[0]} + ${FILES[1]}: "
+
+"$WORK/jobs" $PRIVATE_KEY $MOBILE_PROVISION "$PASSWORD" \
+    "${FILES[0]}" "$WORK/out1.ipa" "${FILES[1]}" "$WORK/out2.ipa" >"$WORK/jobs.log" 2>&1 &&
+    $ZSIGN --verify "$WORK/out1.ipa" &>/dev/null &&
+    $ZSIGN --verify "$WORK/out2.ipa" &>/dev/null
+
+if [ $? -eq 0 ]; then
+    echo -e "\033[32mOK.\033[0m"
+else
+    echo -e "\033[31m!!!FAILED!!!\033[0m"
+    cat "$WORK/jobs.log"
+    exit 1
+fi
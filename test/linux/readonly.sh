@@ -0,0 +1,48 @@
+#!/bin/bash
+
+# Signs a read-only copy of each package as a non-root user, once into a
+# clone (--output_folder) and once through an overlay (--overlay -o), and
+# checks both results with --verify. Run as root, zsign runs as nobody.
+
+PACKAGES="../ipa"
+PRIVATE_KEY="../assets/test.p12"
+MOBILE_PROVISION="../assets/test.mobileprovision"
+PASSWORD="${PASSWORD:-}"
+WORK="$(mktemp -d)"
+trap 'rm -rf "$WORK"' EXIT
+
+RUN=""
+if [ "$(id -u)" -eq 0 ]; then
+    RUN="runuser -u nobody --"
+fi
+
+cp ../../bin/zsign $PRIVATE_KEY $MOBILE_PROVISION "$WORK/"
+chmod 777 "$WORK"
+chmod a+r "$WORK"/*
+KEY="$WORK/$(basename $PRIVATE_KEY)"
+PROV="$WORK/$(basename $MOBILE_PROVISION)"
+
+FAILED=0
+for file in "$PACKAGES"/*.ipa; do
+    [ -e "$file" ] || continue
+
+    echo -n "$file: "
+
+    rm -rf "$WORK/in" "$WORK/clone" "$WORK/out.ipa"
+    mkdir "$WORK/in" && unzip -q "$file" -d "$WORK/in"
+    chmod -R a+rX,a-w "$WORK/in"
+
+    $RUN "$WORK/zsign" -q -k "$KEY" -p "$PASSWORD" -m "$PROV" --output_folder "$WORK/clone" "$WORK/in/Payload" &>/dev/null &&
+        $RUN "$WORK/zsign" --verify "$WORK/clone" &>/dev/null &&
+        $RUN "$WORK/zsign" -q -k "$KEY" -p "$PASSWORD" -m "$PROV" --overlay -o "$WORK/out.ipa" "$WORK/in/Payload" &>/dev/null &&
+        $RUN "$WORK/zsign" --verify "$WORK/out.ipa" &>/dev/null
+
+    if [ $? -eq 0 ]; then
+        echo -e "\033[32mOK.\033[0m"
+    else
+        echo -e "\033[31m!!!FAILED!!!\033[0m"
+        FAILED=1
+    fi
+    chmod -R u+w "$WORK/in"
+done
+exit $FAILED